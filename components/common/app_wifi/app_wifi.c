@@ -231,37 +231,76 @@ esp_err_t app_wifi_start(TickType_t ticks_to_wait)
     return ESP_OK;
 }
 
+// 解析 "22:33:4D:06:43:ED" 或 "22-33-4D-06-43-ED"，跳过前导空格和引号
+static bool parse_target_mac(const char *str, uint8_t mac[6])
+{
+    while (*str == ' ' || *str == '"')
+        str++;
+    int n = sscanf(str, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+                   &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]);
+    if (n != 6)
+    {
+        n = sscanf(str, "%hhx-%hhx-%hhx-%hhx-%hhx-%hhx",
+                   &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]);
+    }
+    return n == 6;
+}
+
 esp_err_t targetmac_endpoint_handler(uint32_t session_id, const uint8_t *inbuf, ssize_t inlen, uint8_t **outbuf, ssize_t *outlen, void *priv_data)
 {
     ESP_LOGI(TAG, "targetMAC endpoint handler called, inlen=%d", (int)inlen);
     esp_err_t nvs_result = ESP_OK;
+    bool bridge = false;
 
     if (inbuf && inlen > 0)
     {
         ESP_LOGI(TAG, "targetMAC received: %.*s", (int)inlen, (const char *)inbuf);
         // 解析 JSON 格式 { "target_mac": "22:33:4D:06:43:ED" }
-        const char *key = "target_mac";
+        // 或多台电脑（网桥模式）{ "target_macs": ["22:33:4D:06:43:ED", "22:33:4D:06:43:EE"] }
         const char *json = (const char *)inbuf;
-        char *mac_ptr = strstr(json, key);
+        static uint8_t macs[APP_WIFI_MAX_TARGETS][6];
+        int count = 0;
         bool valid = false;
-        uint8_t mac[6];
-        if (mac_ptr)
+        const char *list = strstr(json, "\"target_macs\"");
+        if (list)
         {
-            mac_ptr = strchr(mac_ptr, ':');
+            list = strchr(list, '[');
+            valid = (list != NULL);
+            while (valid && count < APP_WIFI_MAX_TARGETS)
+            {
+                const char *item = strchr(list + 1, '"');
+                const char *end = strchr(list + 1, ']');
+                if (!item || (end && end < item))
+                    break;
+                valid = parse_target_mac(item, macs[count]);
+                count++;
+                list = strchr(item + 1, '"');
+                valid = valid && (list != NULL);
+            }
+            if (valid && count == APP_WIFI_MAX_TARGETS)
+            {
+                // 超出上限的列表整体拒绝，不悄悄丢掉多出来的电脑
+                const char *item = strchr(list + 1, '"');
+                const char *end = strchr(list + 1, ']');
+                if (item && (!end || item < end))
+                {
+                    ESP_LOGE(TAG, "Too many target MACs, at most %d", APP_WIFI_MAX_TARGETS);
+                    valid = false;
+                }
+            }
+            valid = valid && count > 0;
+        }
+        else
+        {
+            char *mac_ptr = strstr(json, "target_mac");
             if (mac_ptr)
             {
-                mac_ptr++;
-                while (*mac_ptr == ' ' || *mac_ptr == '"')
-                    mac_ptr++;
-                // 支持 : 或 - 分割
-                int n = sscanf(mac_ptr, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
-                               &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]);
-                if (n != 6)
+                mac_ptr = strchr(mac_ptr, ':');
+                if (mac_ptr)
                 {
-                    n = sscanf(mac_ptr, "%hhx-%hhx-%hhx-%hhx-%hhx-%hhx",
-                               &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]);
+                    valid = parse_target_mac(mac_ptr + 1, macs[0]);
+                    count = 1;
                 }
-                valid = (n == 6);
             }
         }
         if (valid)
@@ -270,13 +309,19 @@ esp_err_t targetmac_endpoint_handler(uint32_t session_id, const uint8_t *inbuf,
             nvs_result = nvs_open("prov", NVS_READWRITE, &nvs_handle);
             if (nvs_result == ESP_OK)
             {
-                nvs_result = nvs_set_blob(nvs_handle, "targetMAC", mac, 6);
+                // targetMAC 保留第一台，兼容旧固件
+                nvs_result = nvs_set_blob(nvs_handle, "targetMAC", macs[0], 6);
+                if (nvs_result == ESP_OK)
+                {
+                    nvs_result = nvs_set_blob(nvs_handle, "targetMACs", macs, count * 6);
+                }
                 if (nvs_result == ESP_OK)
                 {
                     nvs_result = nvs_commit(nvs_handle);
                 }
                 nvs_close(nvs_handle);
             }
+            bridge = count > 1;
         }
         else
         {
@@ -292,7 +337,7 @@ esp_err_t targetmac_endpoint_handler(uint32_t session_id, const uint8_t *inbuf,
         get_setup_code(setup_code);
         /**
          * 此处
-         * categoryId HAP_CID_SWITCH
+         * categoryId HAP_CID_SWITCH，多台电脑时为 HAP_CID_BRIDGE
          * flag 固定0
          * password get_setup_code
          * reserved 保留字段 固定0
@@ -305,7 +350,7 @@ esp_err_t targetmac_endpoint_handler(uint32_t session_id, const uint8_t *inbuf,
         //   setupId: "7G9X",
         // }
         snprintf(resp_buf, sizeof(resp_buf), "{\"categoryId\":%d,\"password\":\"%s\",\"setupId\":\"%s\"}",
-                 HAP_CID_SWITCH, setup_code, "7G9X");
+                 bridge ? HAP_CID_BRIDGE : HAP_CID_SWITCH, setup_code, "7G9X");
     }
     else
     {
@@ -6,6 +6,9 @@ extern "C"
 {
 #endif
 
+/* 配网时可写入的目标电脑 MAC 数量上限（NVS prov/targetMACs） */
+#define APP_WIFI_MAX_TARGETS 64
+
   void app_wifi_init(void);
   void get_setup_code(char out_str[9]);
   esp_err_t app_wifi_start(TickType_t ticks_to_wait);
@@ -333,7 +333,8 @@ typedef struct {
   uint8_t task_priority;
   /** Maximum characteristics to which event notifications can be sent
    * simultaneously. Default value is enough for standalone accessories. Change
-   * may be required only for bridges.
+   * may be required only for bridges. Pending notifications beyond this are
+   * not dropped, but sent in subsequent messages.
    */
   uint8_t max_event_notif_chars;
   /** Indicates what paramaters will be made unique by the HAP Core */
@@ -1098,6 +1099,21 @@ int hap_char_update_val(hap_char_t *hc, hap_val_t *val);
  */
 const hap_val_t *hap_char_get_val(hap_char_t *hc);
 
+/**
+ * @brief Set the minimum interval between event notifications of a characteristic
+ *
+ * Useful for characteristics of sensors that may change very frequently.
+ * Updates received within this interval after a notification are coalesced,
+ * and only the latest value is reported once the interval elapses.
+ *
+ * @param[in] hc HAP characteristic object handle
+ * @param[in] interval_ms Minimum interval in milliseconds. 0 (default) disables rate limiting.
+ *
+ * @return 0 on success
+ * @return other on error
+ */
+int hap_char_set_min_notif_interval(hap_char_t *hc, uint32_t interval_ms);
+
 /** Authorization Data received in a write reqest
  */
 typedef struct {
@@ -1173,6 +1189,44 @@ typedef struct {
 typedef int (*hap_serv_write_t)(hap_write_data_t write_data[], int count,
                                 void *serv_priv, void *write_priv);
 
+/** Deferred Write Function Prototype
+ *
+ * A function with this prototype does the actual work for a characteristic
+ * write deferred using hap_write_defer(). It runs on the HAP write executor
+ * task, and so, can block without holding up the HomeKit server.
+ *
+ * @param[in] write Copy of the write data. The value and the authorization
+ * data remain valid only till the function returns.
+ * @param[in] priv The private data passed to hap_write_defer()
+ *
+ * @return Status of the write, from \ref hap_status_t
+ */
+typedef hap_status_t (*hap_write_work_t)(hap_write_data_t *write, void *priv);
+
+/**
+ * @brief Defer a characteristic write
+ *
+ * Can be called only from a service write callback (\ref hap_serv_write_t), for
+ * one of the entries in its write_data array, when completing the write may take
+ * long (like network or flash operations). The work is then run on the HAP write
+ * executor task, and the response to the controller is sent once all the
+ * deferred writes of the request are done. Writes still pending after
+ * CONFIG_HAP_DEFERRED_WRITE_TIMEOUT milliseconds are reported with
+ * HAP_STATUS_TIMEOUT.
+ *
+ * Any status set by the write callback for a deferred write is ignored. If the
+ * characteristic needs a write response, the work should update the value using
+ * hap_char_update_val().
+ *
+ * @param[in] write The entry in the write_data array to be deferred
+ * @param[in] work The function that does the actual work
+ * @param[in] priv Private data passed to the work function
+ *
+ * @return HAP_SUCCESS on success. The status will be reported as per the return value of work.
+ * @return HAP_FAIL on error. The write callback must then report the status itself.
+ */
+int hap_write_defer(hap_write_data_t *write, hap_write_work_t work, void *priv);
+
 /** Service Read Function Prototype
  *
  * A function with this prototype must be registered with the HAP framework to
@@ -22,6 +22,7 @@
  *
  */
 #include <string.h>
+#include <inttypes.h>
 #include <esp_wifi.h>
 #include <hap_platform_memory.h>
 #include <esp_hap_acc.h>
@@ -33,6 +34,7 @@
 #include <esp_hap_database.h>
 #include <esp_hap_keystore.h>
 #include <esp_hap_main.h>
+#include <esp_hap_ip_services.h>
 
 /* Primary Accessory Pointer */
 static __hap_acc_t *primary_acc;
@@ -414,8 +416,13 @@ void hap_add_bridged_accessory(hap_acc_t *ha, int aid)
     }
 
     hap_add_acc_to_list(primary_acc, _ha);
+    hap_acc_index_invalidate();
+    hap_acc_db_cache_invalidate();
     if (!hap_priv.cfg.disable_config_num_update) {
         hap_update_config_number();
+    } else {
+        /* Else, the index gets rebuilt on the config number update */
+        hap_http_rebuild_acc_index();
     }
 }
 
@@ -426,8 +433,12 @@ void hap_remove_bridged_accessory(hap_acc_t *ha)
     } else {
         if (ha) {
             hap_remove_acc_from_list(primary_acc, (__hap_acc_t *)ha);
+            hap_acc_index_invalidate();
+            hap_acc_db_cache_invalidate();
             if (!hap_priv.cfg.disable_config_num_update) {
                 hap_update_config_number();
+            } else {
+                hap_http_rebuild_acc_index();
             }
         }
 
@@ -476,12 +487,146 @@ void hap_delete_all_accessories(void)
         ha = next;
     }
 }
+/* Flat (aid, iid) index over all the accessories and characteristics.
+ *
+ * It is an open addressing hash table with linear probing, sized to keep the load
+ * factor under 0.5. An entry with iid 0 maps an aid to the accessory itself,
+ * since valid instance ids start from 1. The index is built in hap_start().
+ * Adding or removing a bridged accessory invalidates it right away, in which case
+ * the lookups fall back to walking the lists, and rebuilds it from the HTTP server
+ * task, which does all the lookups, on the config number update (or right away, if
+ * those are disabled). While the index is valid, a miss in it is final.
+ *
+ * As with the attribute database cache, hap_acc_index_invalidate() just bumps the
+ * generation number, so that an invalidation while a build is in progress is not
+ * lost. Such a build is dropped, and the rebuild queued along with the invalidation
+ * takes over.
+ */
+typedef struct {
+    uint32_t aid;
+    uint32_t iid;
+    void *obj;      /* hap_acc_t * if iid is 0, else hap_char_t * */
+} hap_acc_index_entry_t;
+
+static hap_acc_index_entry_t *hap_acc_index;
+static uint32_t hap_acc_index_mask;
+/* Generation the index was built for. 0 if there is none */
+static uint32_t hap_acc_index_built_gen;
+/* Starts from 1, since a built generation of 0 means there is no index */
+static volatile uint32_t hap_acc_index_gen = 1;
+
+static bool hap_acc_index_valid(void)
+{
+    return hap_acc_index && (hap_acc_index_built_gen == hap_acc_index_gen);
+}
+
+static uint32_t hap_acc_index_hash(uint32_t aid, uint32_t iid)
+{
+    uint32_t h = (aid * 0x9E3779B1) ^ iid;
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    return h;
+}
+
+static void hap_acc_index_insert(hap_acc_index_entry_t *index, uint32_t mask,
+        uint32_t aid, uint32_t iid, void *obj)
+{
+    uint32_t i = hap_acc_index_hash(aid, iid) & mask;
+    while (index[i].obj) {
+        i = (i + 1) & mask;
+    }
+    index[i].aid = aid;
+    index[i].iid = iid;
+    index[i].obj = obj;
+}
+
+/* Returns false if the index is not valid and the lists have to be walked instead.
+ * Else, obj is set to the object found, or NULL if there is none.
+ */
+static bool hap_acc_index_lookup(uint32_t aid, uint32_t iid, void **obj)
+{
+    if (!hap_acc_index_valid()) {
+        return false;
+    }
+    hap_acc_index_entry_t *index = hap_acc_index;
+    uint32_t i = hap_acc_index_hash(aid, iid) & hap_acc_index_mask;
+    *obj = NULL;
+    while (index[i].obj) {
+        if ((index[i].aid == aid) && (index[i].iid == iid)) {
+            *obj = index[i].obj;
+            break;
+        }
+        i = (i + 1) & hap_acc_index_mask;
+    }
+    return true;
+}
+
+int hap_acc_index_build(void)
+{
+    uint32_t gen = hap_acc_index_gen;
+    hap_acc_t *ha;
+    hap_serv_t *hs;
+    hap_char_t *hc;
+    uint32_t count = 0;
+    for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
+        count++;
+        for (hs = hap_acc_get_first_serv(ha); hs; hs = hap_serv_get_next(hs)) {
+            for (hc = hap_serv_get_first_char(hs); hc; hc = hap_char_get_next(hc)) {
+                count++;
+            }
+        }
+    }
+    uint32_t size = 16;
+    while (size < (count * 2)) {
+        size <<= 1;
+    }
+    hap_acc_index_entry_t *index = hap_platform_memory_calloc(size, sizeof(hap_acc_index_entry_t));
+    if (!index) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to allocate accessory index");
+        hap_acc_index_invalidate();
+        return HAP_FAIL;
+    }
+    for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
+        uint32_t aid = ((__hap_acc_t *)ha)->aid;
+        hap_acc_index_insert(index, size - 1, aid, 0, ha);
+        for (hs = hap_acc_get_first_serv(ha); hs; hs = hap_serv_get_next(hs)) {
+            for (hc = hap_serv_get_first_char(hs); hc; hc = hap_char_get_next(hc)) {
+                hap_acc_index_insert(index, size - 1, aid, ((__hap_char_t *)hc)->iid, hc);
+            }
+        }
+    }
+    if (gen != hap_acc_index_gen) {
+        /* The accessories changed under us */
+        hap_platform_memory_free(index);
+        return HAP_FAIL;
+    }
+    hap_acc_index_built_gen = 0;
+    hap_acc_index_entry_t *old_index = hap_acc_index;
+    hap_acc_index = index;
+    hap_acc_index_mask = size - 1;
+    hap_acc_index_built_gen = gen;
+    if (old_index) {
+        hap_platform_memory_free(old_index);
+    }
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Accessory index built with %"PRIu32" entries", count);
+    return HAP_SUCCESS;
+}
+
+void hap_acc_index_invalidate(void)
+{
+    hap_acc_index_gen++;
+}
+
 /**
  * @brief get target accessory by AID
  */
 hap_acc_t *hap_acc_get_by_aid(int32_t aid)
 {
 	hap_acc_t *ha;
+    if (hap_acc_index_lookup(aid, 0, (void **)&ha)) {
+        return ha;
+    }
 	for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
         if (((__hap_acc_t *)ha)->aid == aid) {
             return ha;
@@ -489,3 +634,19 @@ hap_acc_t *hap_acc_get_by_aid(int32_t aid)
     }
     return NULL;
 }
+
+/**
+ * @brief get target characteristic by AID and IID
+ */
+hap_char_t *hap_get_char_by_aid_iid(int32_t aid, int32_t iid)
+{
+    /* IID 0 is never valid for a characteristic */
+    if (iid == 0) {
+        return NULL;
+    }
+    hap_char_t *hc;
+    if (hap_acc_index_lookup(aid, iid, (void **)&hc)) {
+        return hc;
+    }
+    return hap_acc_get_char_by_iid(hap_acc_get_by_aid(aid), iid);
+}
@@ -0,0 +1,537 @@
+ /*
+  * ESPRESSIF MIT License
+  *
+  * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+  *
+  * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+  * it is free of charge, to any person obtaining a copy of this software and associated
+  * documentation files (the "Software"), to deal in the Software without restriction, including
+  * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+  * to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all copies or
+  * substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+  * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+  * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+  * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+  *
+  */
+#include <string.h>
+#include <json_generator.h>
+#include <hap_platform_memory.h>
+#include <esp_mfi_debug.h>
+#include <esp_mfi_base64.h>
+#include <esp_hap_acc.h>
+#include <esp_hap_serv.h>
+#include <esp_hap_char.h>
+#include <esp_hap_ip_services.h>
+#include <esp_hap_http_stream.h>
+#include <esp_hap_acc_db.h>
+
+int hap_add_char_val_json(hap_char_format_t format, char *key,
+		hap_val_t *val, json_gen_str_t *jptr)
+{
+	switch (format) {
+		case HAP_CHAR_FORMAT_BOOL : {
+			json_gen_obj_set_bool(jptr, key, val->b);
+			break;
+		}
+		case HAP_CHAR_FORMAT_UINT8:
+		case HAP_CHAR_FORMAT_UINT16:
+		case HAP_CHAR_FORMAT_UINT32:
+		case HAP_CHAR_FORMAT_INT: {
+			json_gen_obj_set_int(jptr, key, val->i);
+			break;
+		}
+		case HAP_CHAR_FORMAT_FLOAT : {
+			json_gen_obj_set_float(jptr, key, val->f);
+			break;
+		}
+		case HAP_CHAR_FORMAT_STRING : {
+            if (val->s) {
+			    json_gen_obj_set_string(jptr, key, val->s);
+            } else {
+                json_gen_obj_set_null(jptr, key);
+            }
+			break;
+		}
+        case HAP_CHAR_FORMAT_DATA:
+        case HAP_CHAR_FORMAT_TLV8: {
+            if (val->d.buf) {
+                json_gen_obj_start_long_string(jptr, key, NULL);
+                uint8_t *buf = val->d.buf;
+                uint32_t buflen = val->d.buflen;
+                char tmp[100];
+                while (buflen) {
+                    int tmp_len = sizeof(tmp);
+                    if (buflen > 60) {
+                        esp_mfi_base64_encode((char *)buf, 60, tmp, tmp_len, &tmp_len);
+                        buflen -= 60;
+                        buf += 60;
+                    } else {
+                        esp_mfi_base64_encode((char *)buf, buflen, tmp, tmp_len, &tmp_len);
+                        buflen -= buflen;
+                    }
+                    tmp[tmp_len] = 0;
+                    json_gen_add_to_long_string(jptr, tmp);
+                }
+                json_gen_end_long_string(jptr);
+            } else {
+                json_gen_obj_set_null(jptr, key);
+            }
+            break;
+        }
+		default :
+			break;
+	}
+	return HAP_SUCCESS;
+}
+
+static int hap_add_char_format_json(__hap_char_t *hc, json_gen_str_t *jptr)
+{
+	switch (hc->format) {
+		case HAP_CHAR_FORMAT_UINT8:
+			return json_gen_obj_set_string(jptr, "format", "uint8");
+		case HAP_CHAR_FORMAT_UINT16:
+			return json_gen_obj_set_string(jptr, "format", "uint16");
+		case HAP_CHAR_FORMAT_UINT32:
+			return json_gen_obj_set_string(jptr, "format", "uint32");
+		case HAP_CHAR_FORMAT_INT:
+			return json_gen_obj_set_string(jptr, "format", "int");
+		case HAP_CHAR_FORMAT_BOOL:
+			return json_gen_obj_set_string(jptr, "format", "bool");
+		case HAP_CHAR_FORMAT_STRING:
+			return json_gen_obj_set_string(jptr, "format", "string");
+		case HAP_CHAR_FORMAT_FLOAT:
+			return json_gen_obj_set_string(jptr, "format", "float");
+		case HAP_CHAR_FORMAT_DATA:
+			return json_gen_obj_set_string(jptr, "format", "data");
+		case HAP_CHAR_FORMAT_TLV8:
+			return json_gen_obj_set_string(jptr, "format", "tlv8");
+		default:
+			break;
+	}
+	return HAP_SUCCESS;
+}
+
+int hap_add_char_type(__hap_char_t *hc, json_gen_str_t *jptr)
+{
+	return json_gen_obj_set_string(jptr, "type", (char *)hc->type_uuid);
+}
+
+int hap_add_char_meta(__hap_char_t *hc, json_gen_str_t *jptr)
+{
+	hap_add_char_format_json(hc, jptr);
+
+	if (hc->constraint_flags & HAP_CHAR_MIN_FLAG)
+		hap_add_char_val_json(hc->format, "minValue", &hc->min, jptr);
+	if (hc->constraint_flags & HAP_CHAR_MAX_FLAG)
+		hap_add_char_val_json(hc->format, "maxValue", &hc->max, jptr);
+	if (hc->constraint_flags & HAP_CHAR_STEP_FLAG)
+		hap_add_char_val_json(hc->format, "minStep", &hc->step, jptr);
+
+	/* maxLen and maxDataLen are constraints for "string" and "data" format
+	 * of characteristics, respectively. However, the constraints themselves
+	 * are integers. So, we pass the format as HAP_CHAR_FORMAT_INT
+	 */
+	if (hc->constraint_flags & HAP_CHAR_MAXLEN_FLAG)
+		hap_add_char_val_json(HAP_CHAR_FORMAT_INT, "maxLen", &hc->max, jptr);
+	if (hc->constraint_flags & HAP_CHAR_MAXDATALEN_FLAG)
+		hap_add_char_val_json(HAP_CHAR_FORMAT_INT, "maxDataLen", &hc->max, jptr);
+
+	if (hc->description)
+		json_gen_obj_set_string(jptr, "description", hc->description);
+	if (hc->unit)
+		json_gen_obj_set_string(jptr, "unit", hc->unit);
+
+	return HAP_SUCCESS;
+}
+
+int hap_add_char_perms(__hap_char_t *hc, json_gen_str_t *jptr)
+{
+	json_gen_push_array(jptr, "perms");
+	if (hc->permission & HAP_CHAR_PERM_PR)
+		json_gen_arr_set_string(jptr, "pr");
+	if (hc->permission & HAP_CHAR_PERM_PW)
+		json_gen_arr_set_string(jptr, "pw");
+	if (hc->permission & HAP_CHAR_PERM_EV)
+		json_gen_arr_set_string(jptr, "ev");
+	if (hc->permission & HAP_CHAR_PERM_AA)
+		json_gen_arr_set_string(jptr, "aa");
+	if (hc->permission & HAP_CHAR_PERM_TW)
+		json_gen_arr_set_string(jptr, "tw");
+	if (hc->permission & HAP_CHAR_PERM_HD)
+		json_gen_arr_set_string(jptr, "hd");
+	if (hc->permission & HAP_CHAR_PERM_WR)
+		json_gen_arr_set_string(jptr, "wr");
+	json_gen_pop_array(jptr);
+	return HAP_SUCCESS;
+}
+
+int hap_add_char_ev(__hap_char_t *hc, json_gen_str_t *jptr, uint8_t session_index)
+{
+    if (hap_char_is_ctrl_subscribed((hap_char_t *)hc, session_index)) {
+        return json_gen_obj_set_bool(jptr, "ev", true);
+    } else {
+	    return json_gen_obj_set_bool(jptr, "ev", false);
+    }
+}
+
+static int hap_add_char_valid_vals(__hap_char_t *hc, json_gen_str_t *jptr)
+{
+    if (hc->valid_vals) {
+        json_gen_push_array(jptr, "valid-values");
+        int i;
+        for (i = 0; i < hc->valid_vals_cnt; i++) {
+            json_gen_arr_set_int(jptr, hc->valid_vals[i]);
+        }
+        json_gen_pop_array(jptr);
+    }
+    if (hc->valid_vals_range) {
+        json_gen_push_array(jptr, "valid-values-range");
+        json_gen_arr_set_int(jptr, hc->valid_vals_range[0]);
+        json_gen_arr_set_int(jptr, hc->valid_vals_range[1]);
+        json_gen_pop_array(jptr);
+    }
+    return HAP_SUCCESS;
+}
+
+/* Emits the value of a characteristic for the attribute database. Before that,
+ * if the Update API has not been called from the service read routine, the owner
+ * controller value is reset. Else, the controller will miss the next notification.
+ */
+static int hap_add_char_db_val(__hap_char_t *hc, json_gen_str_t *jptr)
+{
+    if (!hc->update_called)   {
+        hc->owner_ctrl = 0;
+    }
+    hc->update_called = false;
+
+	if (hc->permission & HAP_CHAR_PERM_PR) {
+        if (hc->permission & HAP_CHAR_PERM_SPECIAL_READ) {
+            json_gen_obj_set_null(jptr, "value");
+        } else if (hc->permission & HAP_CHAR_PERM_WR) {
+            /* TODO: Check what to do for bool/int/float types of control
+             * characteristics with "Write Response" permission.
+             * Ideally, a NULL should have been acceptable as it is independent
+             * of actual datatype, but HAT does not accept it for Wi-Fi
+             * configuration.
+             */
+            json_gen_obj_set_string(jptr, "value", "");
+        } else {
+            hap_add_char_val_json(hc->format, "value", &hc->val, jptr);
+        }
+	}
+	return HAP_SUCCESS;
+}
+
+/* Reads all the readable characteristics of a service in one go, before they are
+ * added to the attribute database
+ */
+static int hap_serv_db_read(__hap_serv_t *hs, int session_index)
+{
+    int char_cnt = 0;
+	hap_char_t *hc;
+    for (hc = hap_serv_get_first_char((hap_serv_t *)hs); hc; hc = hap_char_get_next(hc)) {
+        if (((__hap_char_t *)hc)->permission & HAP_CHAR_PERM_PR) {
+            char_cnt++;
+        }
+    }
+    if (!char_cnt) {
+        return HAP_SUCCESS;
+    }
+    hap_read_data_t *read_arr = hap_platform_memory_calloc(char_cnt, sizeof(hap_read_data_t));
+    if (!read_arr) {
+        return HAP_FAIL;
+    }
+
+    hap_status_t *status_codes = hap_platform_memory_calloc(char_cnt, sizeof(hap_status_t));
+    if (!status_codes) {
+        hap_platform_memory_free(read_arr);
+        return HAP_FAIL;
+    }
+
+    /* Create an array of characteristics to read, and then read them in one go */
+    char_cnt = 0;
+    for (hc = hap_serv_get_first_char((hap_serv_t *)hs); hc; hc = hap_char_get_next(hc)) {
+        if (((__hap_char_t *)hc)->permission & HAP_CHAR_PERM_PR) {
+            hap_char_set_owner_ctrl(hc, session_index);
+            ((__hap_char_t *)hc)->update_called = false;
+            read_arr[char_cnt].hc = hc;
+            status_codes[char_cnt] = HAP_STATUS_SUCCESS;
+            read_arr[char_cnt].status = &status_codes[char_cnt];
+            char_cnt++;
+        }
+    }
+
+    hs->bulk_read(&read_arr[0], char_cnt, hs->priv, NULL);
+    hap_platform_memory_free(read_arr);
+    hap_platform_memory_free(status_codes);
+    return HAP_SUCCESS;
+}
+
+/* The attribute database is generated by a single set of routines, either inline
+ * for a given controller, or as a template for the cache below. Everything that
+ * depends on the current values or on the controller goes through a "slot". Inline,
+ * a slot is filled in right away. For the template, only its offset is recorded.
+ */
+typedef enum {
+    HAP_ACC_DB_SLOT_SERV_READ,  /* Bulk read of the service. Emits nothing */
+    HAP_ACC_DB_SLOT_CHAR_VAL,   /* Owner reset and "value" of the characteristic */
+    HAP_ACC_DB_SLOT_CHAR_EV,    /* "ev" of the characteristic for the controller */
+} hap_acc_db_slot_type_t;
+
+typedef struct {
+    uint32_t offset;    /* Offset in the template at which the slot is filled in */
+    uint32_t type;      /* hap_acc_db_slot_type_t */
+    void *obj;          /* __hap_serv_t * for HAP_ACC_DB_SLOT_SERV_READ, else __hap_char_t * */
+} hap_acc_db_slot_t;
+
+typedef struct {
+    bool tmpl;                  /* Generating the template, rather than inline */
+    int session_index;          /* Controller for which slots are filled in inline */
+    hap_acc_db_slot_t *slots;   /* Slots recorded for the template. NULL to just count them */
+    uint32_t slot_cnt;
+} hap_acc_db_gen_ctx_t;
+
+static void hap_acc_db_fill_slot(uint32_t type, void *obj, json_gen_str_t *jptr, int session_index)
+{
+    switch (type) {
+        case HAP_ACC_DB_SLOT_SERV_READ:
+            hap_serv_db_read((__hap_serv_t *)obj, session_index);
+            break;
+        case HAP_ACC_DB_SLOT_CHAR_VAL:
+            hap_add_char_db_val((__hap_char_t *)obj, jptr);
+            break;
+        case HAP_ACC_DB_SLOT_CHAR_EV:
+            hap_add_char_ev((__hap_char_t *)obj, jptr, session_index);
+            break;
+        default:
+            break;
+    }
+}
+
+static void hap_acc_db_slot(hap_acc_db_gen_ctx_t *ctx, json_gen_str_t *jptr, uint32_t type, void *obj)
+{
+    if (!ctx->tmpl) {
+        hap_acc_db_fill_slot(type, obj, jptr, ctx->session_index);
+        return;
+    }
+    if (ctx->slots) {
+        ctx->slots[ctx->slot_cnt].offset = jptr->total_len;
+        ctx->slots[ctx->slot_cnt].type = type;
+        ctx->slots[ctx->slot_cnt].obj = obj;
+    }
+    ctx->slot_cnt++;
+}
+
+static int hap_prepare_char_db(__hap_char_t *hc, json_gen_str_t *jptr, hap_acc_db_gen_ctx_t *ctx)
+{
+	json_gen_start_object(jptr);
+
+	json_gen_obj_set_int(jptr, "iid", hc->iid);
+	hap_acc_db_slot(ctx, jptr, HAP_ACC_DB_SLOT_CHAR_VAL, hc);
+	hap_add_char_type(hc, jptr);
+	hap_add_char_perms(hc, jptr);
+	hap_acc_db_slot(ctx, jptr, HAP_ACC_DB_SLOT_CHAR_EV, hc);
+	hap_add_char_meta(hc, jptr);
+    hap_add_char_valid_vals(hc, jptr);
+
+	json_gen_end_object(jptr);
+
+	return HAP_SUCCESS;
+}
+
+static int hap_prepare_serv_db(__hap_serv_t *hs, json_gen_str_t *jptr, hap_acc_db_gen_ctx_t *ctx)
+{
+	json_gen_start_object(jptr);
+	json_gen_obj_set_int(jptr, "iid", hs->iid);
+	json_gen_obj_set_string(jptr, "type", hs->type_uuid);
+	if (hs->hidden)
+		json_gen_obj_set_bool(jptr, "hidden", "true");
+	if (hs->primary)
+		json_gen_obj_set_bool(jptr, "primary", "true");
+    if (hs->linked_servs) {
+        hap_linked_serv_t *linked = hs->linked_servs;
+        json_gen_push_array(jptr, "linked");
+        while (linked) {
+            json_gen_arr_set_int(jptr, ((__hap_serv_t *)linked->hs)->iid);
+            linked = linked->next;
+        }
+        json_gen_pop_array(jptr);
+    }
+
+    hap_acc_db_slot(ctx, jptr, HAP_ACC_DB_SLOT_SERV_READ, hs);
+	json_gen_push_array(jptr, "characteristics");
+	hap_char_t *hc;
+    for (hc = hap_serv_get_first_char((hap_serv_t *)hs); hc; hc = hap_char_get_next(hc)) {
+		hap_prepare_char_db((__hap_char_t *)hc, jptr, ctx);
+	}
+
+	json_gen_pop_array(jptr);
+	json_gen_end_object(jptr);
+	return HAP_SUCCESS;
+}
+
+static int hap_prepare_acc_db(__hap_acc_t *ha, json_gen_str_t *jptr, hap_acc_db_gen_ctx_t *ctx)
+{
+	json_gen_start_object(jptr);
+	json_gen_obj_set_int(jptr, "aid", ha->aid);
+	json_gen_push_array(jptr, "services");
+	hap_serv_t *hs;
+	for (hs = hap_acc_get_first_serv((hap_acc_t *)ha); hs; hs = hap_serv_get_next(hs)) {
+		hap_prepare_serv_db((__hap_serv_t *)hs, jptr, ctx);
+	}
+	json_gen_pop_array(jptr);
+	json_gen_end_object(jptr);
+	return HAP_SUCCESS;
+}
+
+static void hap_prepare_db(json_gen_str_t *jptr, hap_acc_db_gen_ctx_t *ctx)
+{
+	json_gen_start_object(jptr);
+	json_gen_push_array(jptr, "accessories");
+	hap_acc_t *ha;
+	for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
+		hap_prepare_acc_db((__hap_acc_t *)ha, jptr, ctx);
+	}
+	json_gen_pop_array(jptr);
+	json_gen_end_object(jptr);
+}
+
+void hap_prepare_json_database(hap_http_stream_t *s, int session_index)
+{
+    hap_acc_db_gen_ctx_t ctx = {
+        .session_index = session_index,
+    };
+	json_gen_str_t jstr;
+	hap_http_stream_json_start(s, &jstr);
+	hap_prepare_db(&jstr, &ctx);
+	hap_http_stream_json_end(s, &jstr);
+}
+
+/* Cached attribute database.
+ *
+ * Everything other than the slots changes only along with the config number, so it
+ * is serialized just once into a template, which GET /accessories then streams out,
+ * filling in the slots. The cache is built lazily on the HTTP server task, which
+ * is the only one that reads or frees it. hap_acc_db_cache_invalidate() can be
+ * called from anywhere. It just bumps the generation number, so that an
+ * invalidation while a build is in progress is not lost.
+ */
+typedef struct {
+    char *tmpl;
+    uint32_t tmpl_len;
+    hap_acc_db_slot_t *slots;
+    uint32_t slot_cnt;
+    uint32_t gen;
+} hap_acc_db_cache_t;
+
+static hap_acc_db_cache_t hap_acc_db_cache;
+/* Starts from 1, since a cache generation of 0 means it was never built */
+static volatile uint32_t hap_acc_db_cache_gen = 1;
+
+void hap_acc_db_cache_invalidate()
+{
+    hap_acc_db_cache_gen++;
+}
+
+static int hap_acc_db_cache_build()
+{
+    uint32_t gen = hap_acc_db_cache_gen;
+    hap_acc_db_gen_ctx_t ctx = {
+        .tmpl = true,
+    };
+    json_gen_str_t jstr;
+
+    /* A first pass without any buffer just finds the template length and slot count */
+    json_gen_str_start(&jstr, NULL, 0, NULL, NULL);
+    hap_prepare_db(&jstr, &ctx);
+    uint32_t tmpl_len = json_gen_str_end(&jstr) - 1;
+
+    char *tmpl = hap_platform_memory_malloc(tmpl_len + 1);
+    hap_acc_db_slot_t *slots = hap_platform_memory_calloc(ctx.slot_cnt, sizeof(hap_acc_db_slot_t));
+    if (!tmpl || !slots) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to allocate accessory database cache");
+        hap_platform_memory_free(tmpl);
+        hap_platform_memory_free(slots);
+        return HAP_FAIL;
+    }
+    uint32_t slot_cnt = ctx.slot_cnt;
+    ctx.slots = slots;
+    ctx.slot_cnt = 0;
+    json_gen_str_start(&jstr, tmpl, tmpl_len + 1, NULL, NULL);
+    hap_prepare_db(&jstr, &ctx);
+    json_gen_str_end(&jstr);
+    if ((ctx.slot_cnt != slot_cnt) || (gen != hap_acc_db_cache_gen)) {
+        /* The database changed under us. Will be retried on the next request */
+        hap_platform_memory_free(tmpl);
+        hap_platform_memory_free(slots);
+        return HAP_FAIL;
+    }
+
+    hap_platform_memory_free(hap_acc_db_cache.tmpl);
+    hap_platform_memory_free(hap_acc_db_cache.slots);
+    hap_acc_db_cache.tmpl = tmpl;
+    hap_acc_db_cache.tmpl_len = tmpl_len;
+    hap_acc_db_cache.slots = slots;
+    hap_acc_db_cache.slot_cnt = slot_cnt;
+    hap_acc_db_cache.gen = gen;
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Accessory database cached: %u bytes, %u slots",
+            (unsigned)tmpl_len, (unsigned)slot_cnt);
+    return HAP_SUCCESS;
+}
+
+/* A filled in slot goes out through a generator of its own. A slot always follows
+ * some other member of the same object, so whatever it emits needs a leading comma.
+ */
+typedef struct {
+    hap_http_stream_t *s;
+    bool empty;         /* Nothing emitted yet */
+} hap_acc_db_slot_out_t;
+
+static void hap_acc_db_slot_flush(char *data, void *priv)
+{
+    hap_acc_db_slot_out_t *out = (hap_acc_db_slot_out_t *)priv;
+    int len = strlen(data);
+    if (len && out->empty) {
+        hap_http_stream_add(out->s, ",", 1);
+        out->empty = false;
+    }
+    hap_http_stream_add(out->s, data, len);
+}
+
+/* Streams the cached attribute database, filling in the slots for the given
+ * controller. The cache is (re)built first, if required.
+ */
+int hap_acc_db_cache_send(hap_http_stream_t *s, int session_index)
+{
+    hap_acc_db_cache_t *cache = &hap_acc_db_cache;
+    if ((cache->gen != hap_acc_db_cache_gen) && (hap_acc_db_cache_build() != HAP_SUCCESS)) {
+        return HAP_FAIL;
+    }
+    uint32_t offset = 0;
+    uint32_t i;
+    for (i = 0; i < cache->slot_cnt; i++) {
+        hap_acc_db_slot_t *slot = &cache->slots[i];
+        hap_http_stream_add(s, cache->tmpl + offset, slot->offset - offset);
+        offset = slot->offset;
+
+        hap_acc_db_slot_out_t out = {
+            .s = s,
+            .empty = true,
+        };
+        char buf[64];
+        json_gen_str_t jstr;
+        json_gen_str_start(&jstr, buf, sizeof(buf), hap_acc_db_slot_flush, &out);
+        hap_acc_db_fill_slot(slot->type, slot->obj, &jstr, session_index);
+        json_gen_str_end(&jstr);
+    }
+    hap_http_stream_add(s, cache->tmpl + offset, cache->tmpl_len - offset);
+    return HAP_SUCCESS;
+}
@@ -24,6 +24,8 @@
 
 #include <hap_platform_memory.h>
 #include <math.h>
+#include <freertos/FreeRTOS.h>
+#include <esp_timer.h>
 #include <string.h>
 #include "esp_mfi_debug.h"
 
@@ -33,7 +35,17 @@
 #include <esp_hap_ip_services.h>
 #include <esp_hap_database.h>
 
-static QueueHandle_t hap_event_queue;
+/* Characteristics with notifications pending are kept in an intrusive list
+ * (linked through next_pending) so that queuing is O(1), repeated updates of
+ * the same characteristic are coalesced, and nothing is ever dropped. The value
+ * itself is picked up when the notification is actually sent.
+ */
+static hap_char_t *hap_pending_head;
+static hap_char_t *hap_pending_tail;
+static portMUX_TYPE hap_pending_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool hap_pending_enabled;
+/* Timer to retrigger notifications that were held back due to rate limiting */
+static esp_timer_handle_t hap_notif_timer;
 
 /**
  * @brief get characteristics's value
@@ -67,53 +79,160 @@ static double esp_mfi_fmod(double a, double b)
     return fmod(a, b);
 }
 
+static void hap_notif_timer_cb(void *arg)
+{
+    hap_send_event(HAP_INTERNAL_EVENT_TRIGGER_NOTIF);
+}
+
 int hap_event_queue_init()
 {
-    hap_event_queue = xQueueCreate( hap_priv.cfg.max_event_notif_chars,
-                    sizeof(hap_char_t *) );
-    if (hap_event_queue) {
-        return HAP_SUCCESS;
-    } else {
-        return HAP_FAIL;
+    if (!hap_notif_timer) {
+        esp_timer_create_args_t timer_args = {
+            .callback = hap_notif_timer_cb,
+            .name = "hap_notif",
+        };
+        if (esp_timer_create(&timer_args, &hap_notif_timer) != ESP_OK) {
+            return HAP_FAIL;
+        }
     }
+    hap_pending_enabled = true;
+    return HAP_SUCCESS;
 }
 
 int hap_event_queue_deinit()
 {
-    if (hap_event_queue) {
-        vQueueDelete(hap_event_queue);
-        hap_event_queue = NULL;
+    portENTER_CRITICAL_SAFE(&hap_pending_lock);
+    hap_pending_enabled = false;
+    while (hap_pending_head) {
+        __hap_char_t *_hc = (__hap_char_t *)hap_pending_head;
+        hap_pending_head = _hc->next_pending;
+        _hc->next_pending = NULL;
+        _hc->notif_pending = false;
+    }
+    hap_pending_tail = NULL;
+    portEXIT_CRITICAL_SAFE(&hap_pending_lock);
+    if (hap_notif_timer) {
+        esp_timer_stop(hap_notif_timer);
+        esp_timer_delete(hap_notif_timer);
+        hap_notif_timer = NULL;
     }
     return HAP_SUCCESS;
 }
 
-hap_char_t * hap_get_pending_notif_char()
+/* Must be called with hap_pending_lock held */
+static void hap_pending_unlink(hap_char_t *prev, hap_char_t *hc)
 {
-    hap_char_t *hc;
-    if (xQueueReceive(hap_event_queue, &hc, 0) != pdTRUE) {
-        return NULL;
+    __hap_char_t *_hc = (__hap_char_t *)hc;
+    if (prev) {
+        ((__hap_char_t *)prev)->next_pending = _hc->next_pending;
+    } else {
+        hap_pending_head = _hc->next_pending;
+    }
+    if (hap_pending_tail == hc) {
+        hap_pending_tail = prev;
+    }
+    _hc->next_pending = NULL;
+    _hc->notif_pending = false;
+}
+
+int hap_get_pending_notif_chars(hap_char_t **char_arr, int max_chars)
+{
+    int64_t now = esp_timer_get_time() / 1000; /* Current time in msec */
+    int64_t wait_ms = -1;
+    bool more_pending = false;
+    int num_chars = 0;
+
+    portENTER_CRITICAL_SAFE(&hap_pending_lock);
+    hap_char_t *prev = NULL;
+    hap_char_t *hc = hap_pending_head;
+    while (hc) {
+        __hap_char_t *_hc = (__hap_char_t *)hc;
+        hap_char_t *next = _hc->next_pending;
+        if (_hc->min_notif_interval_ms &&
+                ((now - _hc->last_notif_time) < _hc->min_notif_interval_ms)) {
+            /* Rate limited. Leave it in the list and find out how long to wait */
+            int64_t remaining = _hc->min_notif_interval_ms - (now - _hc->last_notif_time);
+            if ((wait_ms < 0) || (remaining < wait_ms)) {
+                wait_ms = remaining;
+            }
+            prev = hc;
+        } else if (num_chars < max_chars) {
+            hap_pending_unlink(prev, hc);
+            _hc->last_notif_time = now;
+            char_arr[num_chars++] = hc;
+        } else {
+            more_pending = true;
+            break;
+        }
+        hc = next;
+    }
+    portEXIT_CRITICAL_SAFE(&hap_pending_lock);
+
+    if (more_pending) {
+        /* Batch is full. Trigger one more round for the remaining ones */
+        hap_send_event(HAP_INTERNAL_EVENT_TRIGGER_NOTIF);
+    } else if ((wait_ms >= 0) && hap_notif_timer) {
+        esp_timer_stop(hap_notif_timer);
+        esp_timer_start_once(hap_notif_timer, wait_ms * 1000);
+    }
+    return num_chars;
+}
+
+static void hap_remove_pending_notif(hap_char_t *hc)
+{
+    portENTER_CRITICAL_SAFE(&hap_pending_lock);
+    if (((__hap_char_t *)hc)->notif_pending) {
+        hap_char_t *prev = NULL;
+        hap_char_t *tmp = hap_pending_head;
+        while (tmp && (tmp != hc)) {
+            prev = tmp;
+            tmp = ((__hap_char_t *)tmp)->next_pending;
+        }
+        if (tmp) {
+            hap_pending_unlink(prev, hc);
+        }
     }
-    return hc;
+    portEXIT_CRITICAL_SAFE(&hap_pending_lock);
 }
 
 static int hap_queue_event(hap_char_t *hc)
 {
-    int ret;
-    if (!hap_event_queue) {
+    __hap_char_t *_hc = (__hap_char_t *)hc;
+    bool queued = false;
+    portENTER_CRITICAL_SAFE(&hap_pending_lock);
+    if (!hap_pending_enabled) {
+        portEXIT_CRITICAL_SAFE(&hap_pending_lock);
         return HAP_FAIL;
     }
-    if (xPortInIsrContext() == pdTRUE) {
-        ret = xQueueSendFromISR(hap_event_queue, &hc, NULL);
-    } else {
-        ret = xQueueSend(hap_event_queue, &hc, 0);
+    /* If the characteristic is already pending, the latest value will anyways
+     * get reported when the notification is sent.
+     */
+    if (!_hc->notif_pending) {
+        _hc->notif_pending = true;
+        _hc->next_pending = NULL;
+        if (hap_pending_tail) {
+            ((__hap_char_t *)hap_pending_tail)->next_pending = hc;
+        } else {
+            hap_pending_head = hc;
+        }
+        hap_pending_tail = hc;
+        queued = true;
     }
-    if (ret == pdTRUE) {
+    portEXIT_CRITICAL_SAFE(&hap_pending_lock);
+    if (queued) {
         hap_send_event(HAP_INTERNAL_EVENT_TRIGGER_NOTIF);
-        return HAP_SUCCESS;
     }
-    return HAP_FAIL;
+    return HAP_SUCCESS;
 }
 
+int hap_char_set_min_notif_interval(hap_char_t *hc, uint32_t interval_ms)
+{
+    if (!hc) {
+        return HAP_FAIL;
+    }
+    ((__hap_char_t *)hc)->min_notif_interval_ms = interval_ms;
+    return HAP_SUCCESS;
+}
 
 /**
  * @brief check if characteristics value is at the range
@@ -453,6 +572,7 @@ void hap_char_delete(hap_char_t *hc)
 {
     ESP_MFI_ASSERT(hc);
     __hap_char_t *_hc = (__hap_char_t *)hc;
+    hap_remove_pending_notif(hc);
     if (_hc->format == HAP_CHAR_FORMAT_STRING) {
         if (_hc->val.s) {
             hap_platform_memory_free(_hc->val.s);
@@ -581,9 +701,45 @@ void hap_disable_all_char_notif(int index)
         for (hs = hap_acc_get_first_serv(ha); hs; hs = hap_serv_get_next(hs)) {
             for (hc = hap_serv_get_first_char(hs); hc; hc = hap_char_get_next(hc)) {
                 reset_bit(((__hap_char_t *)hc)->ev_ctrls, index);
+                reset_bit(((__hap_char_t *)hc)->held_ctrls, index);
+            }
+        }
+    }
+}
+
+void hap_char_hold_notif(hap_char_t *hc, int index)
+{
+	__hap_char_t *_hc = (__hap_char_t *)hc;
+	set_bit(_hc->held_ctrls, index);
+}
+
+/* Picks up, and releases, up to max_chars of the characteristics whose notification
+ * is held back for the controller. Like hap_disable_all_char_notif(), this just loops
+ * through all the characteristic objects, since it is needed only once a deferred
+ * write response has gone out.
+ */
+int hap_get_held_notif_chars(int index, hap_char_t **char_arr, int max_chars)
+{
+    int num_chars = 0;
+    hap_acc_t *ha;
+    hap_serv_t *hs;
+    hap_char_t *hc;
+    for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
+        for (hs = hap_acc_get_first_serv(ha); hs; hs = hap_serv_get_next(hs)) {
+            for (hc = hap_serv_get_first_char(hs); hc; hc = hap_char_get_next(hc)) {
+                __hap_char_t *_hc = (__hap_char_t *)hc;
+                if (!(_hc->held_ctrls & (1 << index))) {
+                    continue;
+                }
+                if (num_chars == max_chars) {
+                    return num_chars;
+                }
+                reset_bit(_hc->held_ctrls, index);
+                char_arr[num_chars++] = hc;
             }
         }
     }
+    return num_chars;
 }
 
 void hap_char_add_valid_vals(hap_char_t *hc, const uint8_t *valid_vals, size_t valid_val_cnt)
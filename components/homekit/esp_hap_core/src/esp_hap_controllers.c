@@ -31,9 +31,89 @@
 #include <esp_hap_controllers.h>
 #include <esp_hap_keystore.h>
 #include <esp_hap_pair_setup.h>
+#include <esp_hap_ed25519.h>
+
+#include <freertos/FreeRTOS.h>
 
 #define HAP_KEYSTORE_NAMESPACE_CTRL "hap_ctrl"
 
+/* In-RAM directory of the paired controllers, so that Pair Verify and Pair Resume
+ * find a controller with a hash lookup rather than a strcmp() of every slot, and
+ * verify its signature without decoding its public key again.
+ * The buckets hold slot indices (open addressing, linear probing) and are simply
+ * rebuilt whenever a controller is added or removed, which is rare.
+ */
+#define HAP_CTRL_DIR_BUCKETS    (2 * HAP_MAX_CONTROLLERS)
+#define HAP_CTRL_DIR_EMPTY      -1
+
+typedef struct {
+    int8_t bucket[HAP_CTRL_DIR_BUCKETS];
+    uint32_t hash[HAP_MAX_CONTROLLERS];
+    hap_ed25519_pk_t ltpk[HAP_MAX_CONTROLLERS];
+} hap_ctrl_dir_t;
+
+static hap_ctrl_dir_t hap_ctrl_dir;
+/* Lookups happen on the crypto executor as well as the httpd task */
+static portMUX_TYPE hap_ctrl_dir_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* FNV-1a */
+static uint32_t hap_ctrl_id_hash(const char *id)
+{
+    uint32_t h = 2166136261u;
+    int i;
+    for (i = 0; i < HAP_CTRL_ID_LEN && id[i]; i++) {
+        h ^= (uint8_t)id[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Must be called with hap_ctrl_dir_lock held */
+static void hap_ctrl_dir_rehash(void)
+{
+    int i, j;
+    memset(hap_ctrl_dir.bucket, HAP_CTRL_DIR_EMPTY, sizeof(hap_ctrl_dir.bucket));
+    for (i = 0; i < HAP_MAX_CONTROLLERS; i++) {
+        if (!hap_priv.controllers[i].valid)
+            continue;
+        j = hap_ctrl_dir.hash[i] % HAP_CTRL_DIR_BUCKETS;
+        while (hap_ctrl_dir.bucket[j] != HAP_CTRL_DIR_EMPTY)
+            j = (j + 1) % HAP_CTRL_DIR_BUCKETS;
+        hap_ctrl_dir.bucket[j] = i;
+    }
+}
+
+static void hap_ctrl_dir_update(hap_ctrl_data_t *ctrl_data)
+{
+    int slot = ctrl_data - hap_priv.controllers;
+    /* Decode the key outside the critical section, it takes a while */
+    hap_ed25519_pk_t ltpk;
+    if (!ctrl_data->valid || hap_ed25519_pk_load(&ltpk, ctrl_data->info.ltpk) != HAP_SUCCESS) {
+        /* Not expected for a saved controller. hap_controller_verify() fails for it,
+         * just as crypto_sign_ed25519_verify_detached() would have.
+         */
+        hap_ed25519_pk_clear(&ltpk);
+    }
+    uint32_t hash = hap_ctrl_id_hash(ctrl_data->info.id);
+    portENTER_CRITICAL_SAFE(&hap_ctrl_dir_lock);
+    hap_ctrl_dir.hash[slot] = hash;
+    memcpy(&hap_ctrl_dir.ltpk[slot], &ltpk, sizeof(ltpk));
+    hap_ctrl_dir_rehash();
+    portEXIT_CRITICAL_SAFE(&hap_ctrl_dir_lock);
+}
+
+/* Clears the controller as well, under the lock, so that a snapshot never has half of it */
+static void hap_ctrl_dir_remove(hap_ctrl_data_t *ctrl_data)
+{
+    int slot = ctrl_data - hap_priv.controllers;
+    portENTER_CRITICAL_SAFE(&hap_ctrl_dir_lock);
+    memset(ctrl_data, 0, sizeof(hap_ctrl_data_t));
+    hap_ctrl_dir.hash[slot] = 0;
+    hap_ed25519_pk_clear(&hap_ctrl_dir.ltpk[slot]);
+    hap_ctrl_dir_rehash();
+    portEXIT_CRITICAL_SAFE(&hap_ctrl_dir_lock);
+}
+
 int hap_controllers_init()
 {
 	memset(hap_priv.controllers, 0, sizeof(hap_priv.controllers));
@@ -50,9 +130,13 @@ int hap_controllers_init()
                 hap_priv.controllers[i].index = i;
                 hap_priv.controllers[i].valid = true;
                 acc_paired = true;
+                hap_ctrl_dir_update(&hap_priv.controllers[i]);
             }
         }
     }
+    portENTER_CRITICAL_SAFE(&hap_ctrl_dir_lock);
+    hap_ctrl_dir_rehash();
+    portEXIT_CRITICAL_SAFE(&hap_ctrl_dir_lock);
     if (acc_paired) {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Accessory is Paired with atleast one controller");
     } else {
@@ -117,6 +201,7 @@ int hap_controller_save(hap_ctrl_data_t *ctrl_data)
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to store controller %d", ctrl_data->index);
         return HAP_FAIL;
     }
+    hap_ctrl_dir_update(ctrl_data);
     hap_report_event(HAP_EVENT_CTRL_PAIRED, ctrl_data->info.id, sizeof(ctrl_data->info.id));
     return HAP_SUCCESS;
 }
@@ -130,19 +215,68 @@ void hap_controller_remove(hap_ctrl_data_t *ctrl_data)
     char id[HAP_CTRL_ID_LEN];
     strncpy(id, ctrl_data->info.id, sizeof(id));
     hap_keystore_delete(HAP_KEYSTORE_NAMESPACE_CTRL, index_str);
-    memset(ctrl_data, 0, sizeof(hap_ctrl_data_t));
+    hap_ctrl_dir_remove(ctrl_data);
     hap_report_event(HAP_EVENT_CTRL_UNPAIRED, id, sizeof(id));
 }
 
+/* Must be called with hap_ctrl_dir_lock held */
+static int hap_ctrl_dir_find(const char *ctrl_id)
+{
+    uint32_t hash = hap_ctrl_id_hash(ctrl_id);
+    int i, j, slot;
+    for (i = 0, j = hash % HAP_CTRL_DIR_BUCKETS; i < HAP_CTRL_DIR_BUCKETS;
+            i++, j = (j + 1) % HAP_CTRL_DIR_BUCKETS) {
+        slot = hap_ctrl_dir.bucket[j];
+        if (slot == HAP_CTRL_DIR_EMPTY)
+            break;
+        /* Hashes can collide, so confirm the ID as well */
+        if (hap_ctrl_dir.hash[slot] == hash && hap_priv.controllers[slot].valid
+                && !strncmp(hap_priv.controllers[slot].info.id, ctrl_id, HAP_CTRL_ID_LEN)) {
+            return slot;
+        }
+    }
+    return HAP_CTRL_DIR_EMPTY;
+}
+
 hap_ctrl_data_t *hap_get_controller(char *ctrl_id)
 {
-	int i;
-	for (i = 0; i < HAP_MAX_CONTROLLERS; i++) {
-		if (hap_priv.controllers[i].valid
-				&& (!strcmp(hap_priv.controllers[i].info.id, ctrl_id)))
-			return &hap_priv.controllers[i];
-	}
-	return NULL;
+    portENTER_CRITICAL_SAFE(&hap_ctrl_dir_lock);
+    int slot = hap_ctrl_dir_find(ctrl_id);
+    portEXIT_CRITICAL_SAFE(&hap_ctrl_dir_lock);
+    return slot == HAP_CTRL_DIR_EMPTY ? NULL : &hap_priv.controllers[slot];
+}
+
+int hap_get_controller_snapshot(const char *ctrl_id, hap_ctrl_snapshot_t *snap)
+{
+    portENTER_CRITICAL_SAFE(&hap_ctrl_dir_lock);
+    int slot = hap_ctrl_dir_find(ctrl_id);
+    if (slot != HAP_CTRL_DIR_EMPTY) {
+        snap->ctrl = &hap_priv.controllers[slot];
+        memcpy(snap->id, snap->ctrl->info.id, HAP_CTRL_ID_LEN);
+        memcpy(snap->ltpk, snap->ctrl->info.ltpk, ED_KEY_LEN);
+    }
+    portEXIT_CRITICAL_SAFE(&hap_ctrl_dir_lock);
+    return slot == HAP_CTRL_DIR_EMPTY ? HAP_FAIL : HAP_SUCCESS;
+}
+
+int hap_controller_verify(const hap_ctrl_snapshot_t *ctrl, const uint8_t *sig,
+        const uint8_t *msg, size_t msg_len)
+{
+    int slot = ctrl->ctrl - hap_priv.controllers;
+    hap_ed25519_pk_t ltpk;
+    portENTER_CRITICAL_SAFE(&hap_ctrl_dir_lock);
+    memcpy(&ltpk, &hap_ctrl_dir.ltpk[slot], sizeof(ltpk));
+    portEXIT_CRITICAL_SAFE(&hap_ctrl_dir_lock);
+    /* The slot may have been reused since the snapshot, so never verify against any
+     * other key than the snapshot's.
+     */
+    if (!ltpk.valid || memcmp(ltpk.bytes, ctrl->ltpk, ED_KEY_LEN)) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Controller key not cached, decoding it now");
+        if (hap_ed25519_pk_load(&ltpk, ctrl->ltpk) != HAP_SUCCESS) {
+            return HAP_FAIL;
+        }
+    }
+    return hap_ed25519_verify(&ltpk, sig, msg, msg_len);
 }
 
 void hap_erase_controller_info()
@@ -0,0 +1,214 @@
+ /*
+  * ESPRESSIF MIT License
+  *
+  * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+  *
+  * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+  * it is free of charge, to any person obtaining a copy of this software and associated
+  * documentation files (the "Software"), to deal in the Software without restriction, including
+  * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+  * to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all copies or
+  * substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+  * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+  * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+  * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+  *
+  */
+#include <string.h>
+#include <stdbool.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <esp_timer.h>
+#include <hap.h>
+#include <hap_platform_memory.h>
+#include <esp_mfi_debug.h>
+#include <esp_hap_crypto_exec.h>
+
+/* Below the HTTP server task, so that it keeps serving other controllers
+ * while a handshake is being processed.
+ */
+#define HAP_CRYPTO_EXEC_TASK_PRIORITY   (tskIDLE_PRIORITY + 4)
+
+static const char *hap_crypto_stage_names[HAP_CRYPTO_STAGE_MAX] = {
+    [HAP_CRYPTO_STAGE_SETUP_M1] = "Pair Setup M1->M2",
+    [HAP_CRYPTO_STAGE_SETUP_M3] = "Pair Setup M3->M4",
+    [HAP_CRYPTO_STAGE_SETUP_M5] = "Pair Setup M5->M6",
+    [HAP_CRYPTO_STAGE_VERIFY_M1] = "Pair Verify M1->M2",
+    [HAP_CRYPTO_STAGE_VERIFY_M3] = "Pair Verify M3->M4",
+};
+
+typedef struct {
+    uint32_t count;
+    uint32_t last_ms;
+    uint32_t max_ms;
+    uint64_t total_ms;
+    uint32_t max_wait_ms;
+} hap_crypto_stage_data_t;
+
+static QueueHandle_t hap_crypto_exec_queue;
+/* Jobs are submitted and completed from the HTTP server task, but can be abandoned
+ * by the executor task.
+ */
+static portMUX_TYPE hap_crypto_exec_lock = portMUX_INITIALIZER_UNLOCKED;
+static int hap_crypto_exec_in_flight;
+/* Only updated from the HTTP server task */
+static hap_crypto_stage_data_t hap_crypto_stage_data[HAP_CRYPTO_STAGE_MAX];
+
+bool hap_crypto_exec_enabled(void)
+{
+    return CONFIG_HAP_MAX_CONCURRENT_HANDSHAKES > 0;
+}
+
+bool hap_crypto_exec_full(void)
+{
+    portENTER_CRITICAL_SAFE(&hap_crypto_exec_lock);
+    bool full = hap_crypto_exec_in_flight >= CONFIG_HAP_MAX_CONCURRENT_HANDSHAKES;
+    portEXIT_CRITICAL_SAFE(&hap_crypto_exec_lock);
+    return full;
+}
+
+hap_crypto_job_t *hap_crypto_job_create(int fd, int bufsize)
+{
+    hap_crypto_job_t *job = hap_platform_memory_calloc(1, sizeof(hap_crypto_job_t) + bufsize);
+    if (!job) {
+        return NULL;
+    }
+    job->fd = fd;
+    job->bufsize = bufsize;
+    job->stage = HAP_CRYPTO_STAGE_MAX;
+    job->received_us = esp_timer_get_time();
+    return job;
+}
+
+static void hap_crypto_exec_task(void *param)
+{
+    hap_crypto_job_t *job;
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HAP Crypto Executor Started");
+    while (1) {
+        if (xQueueReceive(hap_crypto_exec_queue, &job, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        job->started_us = esp_timer_get_time();
+        job->ret = job->process(&job->ctx, job->buf, job->inlen, job->bufsize, &job->outlen);
+        job->done_cb(job);
+    }
+}
+
+/* Started on the first handshake rather than at hap_start(), like the write executor */
+static int hap_crypto_exec_start(void)
+{
+    if (hap_crypto_exec_queue) {
+        return HAP_SUCCESS;
+    }
+    hap_crypto_exec_queue = xQueueCreate(CONFIG_HAP_MAX_CONCURRENT_HANDSHAKES, sizeof(hap_crypto_job_t *));
+    if (!hap_crypto_exec_queue) {
+        return HAP_FAIL;
+    }
+    /* The handshakes used to run in the HTTP server task, so they get the same stack */
+    if (xTaskCreate(hap_crypto_exec_task, "hap-crypto-exec", CONFIG_HAP_HTTP_STACK_SIZE,
+                NULL, HAP_CRYPTO_EXEC_TASK_PRIORITY, NULL) != pdPASS) {
+        vQueueDelete(hap_crypto_exec_queue);
+        hap_crypto_exec_queue = NULL;
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
+int hap_crypto_exec_submit(hap_crypto_job_t *job, void (*done_cb)(hap_crypto_job_t *job))
+{
+    if (hap_crypto_exec_start() != HAP_SUCCESS) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to start the crypto executor");
+        return HAP_FAIL;
+    }
+    /* The slot is taken before the job is queued, since the executor may abandon it
+     * as soon as it is.
+     */
+    portENTER_CRITICAL_SAFE(&hap_crypto_exec_lock);
+    int in_flight = hap_crypto_exec_in_flight;
+    bool full = in_flight >= CONFIG_HAP_MAX_CONCURRENT_HANDSHAKES;
+    if (!full) {
+        hap_crypto_exec_in_flight++;
+    }
+    portEXIT_CRITICAL_SAFE(&hap_crypto_exec_lock);
+    if (full) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Too many handshakes in progress (%d)", in_flight);
+        return HAP_FAIL;
+    }
+    job->done_cb = done_cb;
+    if (xQueueSend(hap_crypto_exec_queue, &job, 0) != pdTRUE) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Crypto executor queue full");
+        portENTER_CRITICAL_SAFE(&hap_crypto_exec_lock);
+        hap_crypto_exec_in_flight--;
+        portEXIT_CRITICAL_SAFE(&hap_crypto_exec_lock);
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
+void hap_crypto_exec_complete(hap_crypto_job_t *job)
+{
+    if (!job) {
+        return;
+    }
+    portENTER_CRITICAL_SAFE(&hap_crypto_exec_lock);
+    hap_crypto_exec_in_flight--;
+    portEXIT_CRITICAL_SAFE(&hap_crypto_exec_lock);
+    if (job->stage < HAP_CRYPTO_STAGE_MAX) {
+        hap_crypto_stage_data_t *data = &hap_crypto_stage_data[job->stage];
+        int64_t now = esp_timer_get_time();
+        uint32_t total_ms = (now - job->received_us) / 1000;
+        uint32_t wait_ms = job->started_us ? (job->started_us - job->received_us) / 1000 : 0;
+        data->count++;
+        data->last_ms = total_ms;
+        data->total_ms += total_ms;
+        if (total_ms > data->max_ms) {
+            data->max_ms = total_ms;
+        }
+        if (wait_ms > data->max_wait_ms) {
+            data->max_wait_ms = wait_ms;
+        }
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "%s: %u ms (%u ms queued)",
+                hap_crypto_stage_names[job->stage], (unsigned)total_ms, (unsigned)wait_ms);
+    }
+    hap_platform_memory_free(job);
+}
+
+bool hap_crypto_exec_abandon(hap_crypto_job_t *job)
+{
+    portENTER_CRITICAL_SAFE(&hap_crypto_exec_lock);
+    hap_crypto_exec_in_flight--;
+    job->abandoned = true;
+    bool attached = job->attached;
+    portEXIT_CRITICAL_SAFE(&hap_crypto_exec_lock);
+    return attached;
+}
+
+bool hap_crypto_exec_detach(hap_crypto_job_t *job)
+{
+    portENTER_CRITICAL_SAFE(&hap_crypto_exec_lock);
+    job->attached = false;
+    bool abandoned = job->abandoned;
+    portEXIT_CRITICAL_SAFE(&hap_crypto_exec_lock);
+    return abandoned;
+}
+
+void hap_crypto_exec_get_stats(hap_crypto_stage_t stage, hap_crypto_stage_stats_t *stats)
+{
+    if (!stats || (stage >= HAP_CRYPTO_STAGE_MAX)) {
+        return;
+    }
+    hap_crypto_stage_data_t *data = &hap_crypto_stage_data[stage];
+    stats->count = data->count;
+    stats->last_ms = data->last_ms;
+    stats->max_ms = data->max_ms;
+    stats->avg_ms = data->count ? (uint32_t)(data->total_ms / data->count) : 0;
+    stats->max_wait_ms = data->max_wait_ms;
+}
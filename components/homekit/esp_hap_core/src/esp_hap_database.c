@@ -24,6 +24,7 @@
 
 #include <stdio.h>
 #include <sodium/crypto_sign_ed25519.h>
+#include <sodium/utils.h>
 #include <string.h>
 #include <hap_platform_memory.h>
 
@@ -36,6 +37,7 @@
 #include <esp_hap_database.h>
 #include <esp_hap_controllers.h>
 #include <esp_hap_pair_setup.h>
+#include <esp_hap_ip_services.h>
 
 #include <esp_mfi_base64.h>
 
@@ -97,6 +99,7 @@ void hap_increment_and_save_config_num()
         hap_priv.config_num = 1;
     }
     hap_save_config_number();
+    hap_acc_db_cache_invalidate();
 }
 
 
@@ -281,6 +284,9 @@ int hap_database_init(void)
         hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_LTSKA, hap_priv.ltska, sizeof(hap_priv.ltska));
         hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_LTPKA, hap_priv.ltpka, sizeof(hap_priv.ltpka));
     }
+    /* Pair Setup M6 and Pair Verify M2 sign with this */
+    memcpy(hap_priv.ltska_sk, hap_priv.ltska, ED_KEY_LEN);
+    memcpy(hap_priv.ltska_sk + ED_KEY_LEN, hap_priv.ltpka, ED_KEY_LEN);
 
     memcpy(hap_priv.raw_acc_id, id, sizeof(hap_priv.raw_acc_id));
 	snprintf(hap_priv.acc_id, sizeof(hap_priv.acc_id), "%02X:%02X:%02X:%02X:%02X:%02X",
@@ -306,9 +312,17 @@ int hap_get_next_aid(char *id)
     return hap_priv.cur_aid;
 }
 
+/* Wipe the in-RAM copies of the accessory's long term secret key */
+void hap_wipe_accessory_keys()
+{
+    sodium_memzero(hap_priv.ltska, sizeof(hap_priv.ltska));
+    sodium_memzero(hap_priv.ltska_sk, sizeof(hap_priv.ltska_sk));
+}
+
 void hap_erase_accessory_info()
 {
     hap_keystore_delete_namespace(HAP_KEYSTORE_NAMESPACE_HAPMAIN);
+    hap_wipe_accessory_keys();
 }
 
 void hap_configure_unique_param(hap_unique_param_t param)
@@ -0,0 +1,93 @@
+ /*
+  * ESPRESSIF MIT License
+  *
+  * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+  *
+  * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+  * it is free of charge, to any person obtaining a copy of this software and associated
+  * documentation files (the "Software"), to deal in the Software without restriction, including
+  * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+  * to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all copies or
+  * substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+  * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+  * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+  * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+  *
+  */
+
+/* Ed25519 verification against a public key that has been decoded beforehand.
+ * This follows crypto_sign/ed25519/ref10/open.c from libsodium, minus the per call
+ * key decoding, and so needs libsodium's private ref10 header.
+ */
+#include <string.h>
+#include <hap.h>
+#include <esp_hap_ed25519.h>
+
+#include <sodium/crypto_hash_sha512.h>
+#include <sodium/crypto_verify_32.h>
+#include <sodium/utils.h>
+#include <private/ed25519_ref10.h>
+
+_Static_assert(sizeof(((hap_ed25519_pk_t *)0)->point) >= sizeof(ge25519_p3),
+        "hap_ed25519_pk_t cannot hold a ge25519_p3");
+
+int hap_ed25519_pk_load(hap_ed25519_pk_t *pk, const uint8_t *bytes)
+{
+    ge25519_p3 A;
+
+    pk->valid = false;
+    if (ge25519_is_canonical(bytes) == 0 ||
+            ge25519_has_small_order(bytes) != 0) {
+        return HAP_FAIL;
+    }
+    if (ge25519_frombytes_negate_vartime(&A, bytes) != 0) {
+        return HAP_FAIL;
+    }
+    memcpy(pk->point, &A, sizeof(A));
+    memcpy(pk->bytes, bytes, HAP_ED25519_PK_LEN);
+    pk->valid = true;
+    return HAP_SUCCESS;
+}
+
+void hap_ed25519_pk_clear(hap_ed25519_pk_t *pk)
+{
+    sodium_memzero(pk, sizeof(hap_ed25519_pk_t));
+}
+
+int hap_ed25519_verify(const hap_ed25519_pk_t *pk, const uint8_t *sig,
+        const uint8_t *msg, size_t msg_len)
+{
+    crypto_hash_sha512_state hs;
+    unsigned char h[64];
+    unsigned char rcheck[32];
+    ge25519_p2 R;
+
+    if (!pk->valid) {
+        return HAP_FAIL;
+    }
+    if (sc25519_is_canonical(sig + 32) == 0 ||
+            ge25519_has_small_order(sig) != 0) {
+        return HAP_FAIL;
+    }
+    crypto_hash_sha512_init(&hs);
+    crypto_hash_sha512_update(&hs, sig, 32);
+    crypto_hash_sha512_update(&hs, pk->bytes, HAP_ED25519_PK_LEN);
+    crypto_hash_sha512_update(&hs, msg, msg_len);
+    crypto_hash_sha512_final(&hs, h);
+    sc25519_reduce(h);
+
+    ge25519_double_scalarmult_vartime(&R, h, (const ge25519_p3 *)pk->point, sig + 32);
+    ge25519_tobytes(rcheck, &R);
+
+    if (crypto_verify_32(rcheck, sig) != 0) {
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
@@ -0,0 +1,207 @@
+ /*
+  * ESPRESSIF MIT License
+  *
+  * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+  *
+  * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+  * it is free of charge, to any person obtaining a copy of this software and associated
+  * documentation files (the "Software"), to deal in the Software without restriction, including
+  * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+  * to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all copies or
+  * substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+  * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+  * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+  * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+  *
+  */
+#include <string.h>
+#include <stdbool.h>
+#include <hap.h>
+#include <esp_mfi_debug.h>
+#include <esp_hap_hkdf.h>
+#ifdef CONFIG_HAP_HKDF_USE_LIBSODIUM
+#include <sodium/crypto_auth_hmacsha512.h>
+#include <sodium/utils.h>
+#else
+#include <hkdf-sha.h>
+#endif
+
+#define HAP_HKDF_HASH_LEN   64
+
+static const char *hap_hkdf_salts[HAP_HKDF_SALT_MAX] = {
+    [HAP_HKDF_SALT_CONTROL] = "Control-Salt",
+    [HAP_HKDF_SALT_PAIR_VERIFY_ENCRYPT] = "Pair-Verify-Encrypt-Salt",
+    [HAP_HKDF_SALT_RESUME_SESSION_ID] = "Pair-Verify-ResumeSessionID-Salt",
+    [HAP_HKDF_SALT_PAIR_SETUP_ENCRYPT] = "Pair-Setup-Encrypt-Salt",
+    [HAP_HKDF_SALT_PAIR_SETUP_CTRL_SIGN] = "Pair-Setup-Controller-Sign-Salt",
+    [HAP_HKDF_SALT_PAIR_SETUP_ACC_SIGN] = "Pair-Setup-Accessory-Sign-Salt",
+};
+
+#ifdef CONFIG_HAP_HKDF_USE_LIBSODIUM
+/* The HMAC state of libsodium already holds the inner and outer pad states */
+typedef crypto_auth_hmacsha512_state hap_hmac_ctx_t;
+
+static void hap_hmac_init(hap_hmac_ctx_t *ctx, const uint8_t *key, int key_len)
+{
+    crypto_auth_hmacsha512_init(ctx, key, key_len);
+}
+
+static void hap_hmac_update(hap_hmac_ctx_t *ctx, const uint8_t *data, int len)
+{
+    crypto_auth_hmacsha512_update(ctx, data, len);
+}
+
+static void hap_hmac_final(hap_hmac_ctx_t *ctx, uint8_t out[HAP_HKDF_HASH_LEN])
+{
+    crypto_auth_hmacsha512_final(ctx, out);
+}
+
+static void hap_hkdf_wipe(void *buf, size_t len)
+{
+    sodium_memzero(buf, len);
+}
+#else
+/* SHA-512 states after absorbing the key XORed with ipad and opad respectively */
+typedef struct {
+    SHA512Context inner;
+    SHA512Context outer;
+} hap_hmac_ctx_t;
+
+static void hap_hkdf_wipe(void *buf, size_t len)
+{
+    volatile uint8_t *p = buf;
+    while (len--) {
+        *p++ = 0;
+    }
+}
+
+static void hap_hmac_init(hap_hmac_ctx_t *ctx, const uint8_t *key, int key_len)
+{
+    uint8_t pad[SHA512_Message_Block_Size];
+    uint8_t key_hash[SHA512HashSize];
+    int i;
+
+    /* Keys longer than a block are replaced by their hash, as per RFC 2104 */
+    if (key_len > SHA512_Message_Block_Size) {
+        SHA512Reset(&ctx->inner);
+        SHA512Input(&ctx->inner, key, key_len);
+        SHA512Result(&ctx->inner, key_hash);
+        key = key_hash;
+        key_len = sizeof(key_hash);
+    }
+    memset(pad, 0x36, sizeof(pad));
+    for (i = 0; i < key_len; i++) {
+        pad[i] ^= key[i];
+    }
+    SHA512Reset(&ctx->inner);
+    SHA512Input(&ctx->inner, pad, sizeof(pad));
+
+    memset(pad, 0x5c, sizeof(pad));
+    for (i = 0; i < key_len; i++) {
+        pad[i] ^= key[i];
+    }
+    SHA512Reset(&ctx->outer);
+    SHA512Input(&ctx->outer, pad, sizeof(pad));
+
+    hap_hkdf_wipe(pad, sizeof(pad));
+    hap_hkdf_wipe(key_hash, sizeof(key_hash));
+}
+
+static void hap_hmac_update(hap_hmac_ctx_t *ctx, const uint8_t *data, int len)
+{
+    SHA512Input(&ctx->inner, data, len);
+}
+
+static void hap_hmac_final(hap_hmac_ctx_t *ctx, uint8_t out[HAP_HKDF_HASH_LEN])
+{
+    uint8_t inner_hash[SHA512HashSize];
+    SHA512Result(&ctx->inner, inner_hash);
+    SHA512Input(&ctx->outer, inner_hash, sizeof(inner_hash));
+    SHA512Result(&ctx->outer, out);
+    hap_hkdf_wipe(inner_hash, sizeof(inner_hash));
+}
+#endif /* CONFIG_HAP_HKDF_USE_LIBSODIUM */
+
+/* HMAC contexts keyed with each of the salts. Read only once initialised. */
+static hap_hmac_ctx_t hap_hkdf_salt_ctx[HAP_HKDF_SALT_MAX];
+static bool hap_hkdf_ready;
+
+int hap_hkdf_init(void)
+{
+    int i;
+    if (hap_hkdf_ready) {
+        return HAP_SUCCESS;
+    }
+    for (i = 0; i < HAP_HKDF_SALT_MAX; i++) {
+        hap_hmac_init(&hap_hkdf_salt_ctx[i], (const uint8_t *)hap_hkdf_salts[i],
+                strlen(hap_hkdf_salts[i]));
+    }
+    hap_hkdf_ready = true;
+    return HAP_SUCCESS;
+}
+
+/* HKDF-Expand, as per RFC 5869, with HMAC already keyed with the PRK */
+static void hap_hkdf_expand(const hap_hmac_ctx_t *prk_ctx, const char *info,
+        uint8_t *okm, int okm_len)
+{
+    uint8_t t[HAP_HKDF_HASH_LEN];
+    int t_len = 0;
+    uint8_t counter = 1;
+    int len;
+    hap_hmac_ctx_t ctx;
+
+    while (okm_len > 0) {
+        ctx = *prk_ctx;
+        hap_hmac_update(&ctx, t, t_len);
+        hap_hmac_update(&ctx, (const uint8_t *)info, strlen(info));
+        hap_hmac_update(&ctx, &counter, 1);
+        hap_hmac_final(&ctx, t);
+        len = okm_len < HAP_HKDF_HASH_LEN ? okm_len : HAP_HKDF_HASH_LEN;
+        memcpy(okm, t, len);
+        okm += len;
+        okm_len -= len;
+        t_len = HAP_HKDF_HASH_LEN;
+        counter++;
+    }
+    hap_hkdf_wipe(t, sizeof(t));
+    hap_hkdf_wipe(&ctx, sizeof(ctx));
+}
+
+int hap_hkdf2(hap_hkdf_salt_t salt, const uint8_t *ikm, int ikm_len,
+        const char *info1, uint8_t *okm1, int okm1_len,
+        const char *info2, uint8_t *okm2, int okm2_len)
+{
+    if (!hap_hkdf_ready || (salt >= HAP_HKDF_SALT_MAX) || !ikm || !info1 || !okm1 ||
+            (okm1_len > 255 * HAP_HKDF_HASH_LEN) || (okm2_len > 255 * HAP_HKDF_HASH_LEN)) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Invalid HKDF parameters");
+        return HAP_FAIL;
+    }
+    uint8_t prk[HAP_HKDF_HASH_LEN];
+    hap_hmac_ctx_t ctx = hap_hkdf_salt_ctx[salt];
+
+    /* HKDF-Extract: PRK = HMAC(salt, IKM) */
+    hap_hmac_update(&ctx, ikm, ikm_len);
+    hap_hmac_final(&ctx, prk);
+
+    hap_hmac_init(&ctx, prk, sizeof(prk));
+    hap_hkdf_expand(&ctx, info1, okm1, okm1_len);
+    if (info2 && okm2) {
+        hap_hkdf_expand(&ctx, info2, okm2, okm2_len);
+    }
+    hap_hkdf_wipe(prk, sizeof(prk));
+    hap_hkdf_wipe(&ctx, sizeof(ctx));
+    return HAP_SUCCESS;
+}
+
+int hap_hkdf(hap_hkdf_salt_t salt, const uint8_t *ikm, int ikm_len,
+        const char *info, uint8_t *okm, int okm_len)
+{
+    return hap_hkdf2(salt, ikm, ikm_len, info, okm, okm_len, NULL, NULL, 0);
+}
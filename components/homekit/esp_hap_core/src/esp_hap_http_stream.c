@@ -0,0 +1,178 @@
+ /*
+  * ESPRESSIF MIT License
+  *
+  * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+  *
+  * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+  * it is free of charge, to any person obtaining a copy of this software and associated
+  * documentation files (the "Software"), to deal in the Software without restriction, including
+  * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+  * to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all copies or
+  * substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+  * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+  * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+  * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+  *
+  */
+#include <stdio.h>
+#include <string.h>
+#include <hap.h>
+#include <esp_mfi_debug.h>
+#include <esp_hap_database.h>
+#include <esp_hap_network_io.h>
+#include <esp_hap_http_stream.h>
+
+/* Streaming output for large responses.
+ *
+ * The body goes out with chunked encoding, and every chunk is written straight into
+ * the plaintext area of the session's next encrypted frame (hap_httpd_tx_get_buf()).
+ * A chunk never exceeds a frame, so its header has a fixed width. The space for it is
+ * reserved up front and the length is filled in once the chunk is complete. The
+ * "\r\n" ending a full chunk starts the next frame, so that in the steady state every
+ * frame carries exactly one full chunk.
+ *
+ * A JSON generator writes into the staging buffer of the stream, and whatever it
+ * flushes is copied into the chunk. The session must have been corked, which
+ * hap_http_tx_combined_handler() takes care of.
+ */
+#define HAP_HTTP_CHUNK_HDR_LEN  5   /* 3 hex digits for the length, and "\r\n" */
+
+static bool hap_http_stream_debug;
+
+#ifdef ESP_MFI_DEBUG_ENABLE
+#define HAP_HTTP_STREAM_PRINT(fmt, ...)                 \
+    if (hap_http_stream_debug) {                        \
+        printf("\e[1;35m" fmt "\e[0m", ##__VA_ARGS__);  \
+    }
+#else /* ESP_MFI_DEBUG_ENABLE */
+#define HAP_HTTP_STREAM_PRINT(fmt, ...)
+#endif /* ESP_MFI_DEBUG_ENABLE */
+
+void hap_http_stream_debug_enable(bool enable)
+{
+    hap_http_stream_debug = enable;
+}
+
+int hap_http_stream_init(hap_http_stream_t *s, int fd, const char *status)
+{
+    memset(s, 0, sizeof(hap_http_stream_t));
+    s->fd = fd;
+    s->status = status;
+    uint8_t *buf;
+    if (hap_httpd_tx_get_buf(s->fd, 0, &buf) < 0) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Session not corked. Cannot stream response");
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
+static int hap_http_stream_open_chunk(hap_http_stream_t *s)
+{
+    uint8_t *buf;
+    int len = hap_httpd_tx_get_buf(s->fd, HAP_HTTP_CHUNK_HDR_LEN + 1, &buf);
+    if (len < 0) {
+        s->err = true;
+        return HAP_FAIL;
+    }
+    s->buf = (char *)buf + HAP_HTTP_CHUNK_HDR_LEN;
+    s->buf_size = len - HAP_HTTP_CHUNK_HDR_LEN;
+    s->len = 0;
+    return HAP_SUCCESS;
+}
+
+static int hap_http_stream_start(hap_http_stream_t *s)
+{
+    if (s->started) {
+        return s->err ? HAP_FAIL : HAP_SUCCESS;
+    }
+    s->started = true;
+    char hdr[128];
+    snprintf(hdr, sizeof(hdr), "HTTP/1.1 %s\r\n"
+            "Content-Type: application/hap+json\r\n"
+            "Transfer-Encoding: chunked\r\n\r\n", s->status);
+    if (hap_httpd_send(hap_priv.server, s->fd, hdr, strlen(hdr), 0) < 0) {
+        s->err = true;
+        return HAP_FAIL;
+    }
+    return hap_http_stream_open_chunk(s);
+}
+
+static int hap_http_stream_close_chunk(hap_http_stream_t *s)
+{
+    /* An empty chunk would mean the end of the body */
+    if (s->err || !s->len) {
+        return s->err ? HAP_FAIL : HAP_SUCCESS;
+    }
+    static const char hex[] = "0123456789abcdef";
+    char *hdr = s->buf - HAP_HTTP_CHUNK_HDR_LEN;
+    hdr[0] = hex[(s->len >> 8) & 0xf];
+    hdr[1] = hex[(s->len >> 4) & 0xf];
+    hdr[2] = hex[s->len & 0xf];
+    hdr[3] = '\r';
+    hdr[4] = '\n';
+    /* The frame may get encrypted in place right away, so print it first */
+    HAP_HTTP_STREAM_PRINT("%.*s", s->len, s->buf);
+    if ((hap_httpd_tx_put_buf(s->fd, HAP_HTTP_CHUNK_HDR_LEN + s->len) != HAP_SUCCESS) ||
+            (hap_httpd_send(hap_priv.server, s->fd, "\r\n", strlen("\r\n"), 0) < 0)) {
+        s->err = true;
+        s->len = 0;
+        return HAP_FAIL;
+    }
+    return hap_http_stream_open_chunk(s);
+}
+
+void hap_http_stream_add(hap_http_stream_t *s, const char *data, int len)
+{
+    if (hap_http_stream_start(s) != HAP_SUCCESS) {
+        return;
+    }
+    while (len && !s->err) {
+        int copy_len = s->buf_size - s->len;
+        if (copy_len > len) {
+            copy_len = len;
+        }
+        memcpy(s->buf + s->len, data, copy_len);
+        s->len += copy_len;
+        data += copy_len;
+        len -= copy_len;
+        if (s->len == s->buf_size) {
+            hap_http_stream_close_chunk(s);
+        }
+    }
+}
+
+static void hap_http_stream_json_flush(char *data, void *priv)
+{
+    hap_http_stream_add((hap_http_stream_t *)priv, data, strlen(data));
+}
+
+void hap_http_stream_json_start(hap_http_stream_t *s, json_gen_str_t *jstr)
+{
+    json_gen_str_start(jstr, s->json_buf, sizeof(s->json_buf), hap_http_stream_json_flush, s);
+}
+
+void hap_http_stream_json_end(hap_http_stream_t *s, json_gen_str_t *jstr)
+{
+    json_gen_str_end(jstr);
+}
+
+int hap_http_stream_end(hap_http_stream_t *s)
+{
+    hap_http_stream_start(s);
+    if (hap_http_stream_close_chunk(s) != HAP_SUCCESS) {
+        return HAP_FAIL;
+    }
+    /* The last chunk */
+    if (hap_httpd_send(hap_priv.server, s->fd, "0\r\n\r\n", strlen("0\r\n\r\n"), 0) < 0) {
+        return HAP_FAIL;
+    }
+    HAP_HTTP_STREAM_PRINT("\n");
+    return HAP_SUCCESS;
+}
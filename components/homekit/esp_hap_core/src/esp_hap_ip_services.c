@@ -47,6 +47,11 @@
 #include <hap_platform_httpd.h>
 #include <hap_platform_os.h>
 #include <esp_hap_ip_services.h>
+#include <esp_hap_req_arena.h>
+#include <esp_hap_write_exec.h>
+#include <esp_hap_crypto_exec.h>
+#include <esp_hap_http_stream.h>
+#include <esp_hap_acc_db.h>
 
 #ifdef ESP_MFI_DEBUG_ENABLE
 #define ESP_MFI_DEBUG_PLAIN(fmt, ...)   \
@@ -83,6 +88,271 @@ int hap_httpd_get_data(httpd_req_t *req, char *buffer, int len)
     return read_len;
 }
 
+/* Runs the actual handler (passed as user_ctx) with write combining enabled on
+ * the session, so that the complete response goes out in as few encrypted frames
+ * and send calls as possible. Whatever the handler allocated from the request
+ * arena is released once it returns.
+ */
+static int hap_http_tx_combined_handler(httpd_req_t *req)
+{
+    int (*handler)(httpd_req_t *req) = req->user_ctx;
+    int fd = httpd_req_to_sockfd(req);
+    hap_httpd_tx_cork(fd);
+    int ret = handler(req);
+    hap_req_arena_reset();
+    hap_httpd_rx_request_done(fd);
+    if (hap_httpd_tx_flush(fd) != HAP_SUCCESS) {
+        return HAP_FAIL;
+    }
+    return ret;
+}
+
+static void hap_http_pair_verified_sock_setup(int fd)
+{
+    struct timeval timeout;
+    timeout.tv_sec = hap_priv.cfg.recv_timeout;
+    timeout.tv_usec = 0;
+    if (setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout,
+                sizeof(timeout)) < 0) {
+         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "setsockopt on pair verified socket failed for SO_RCVTIMEO");
+    }
+
+    timeout.tv_sec = hap_priv.cfg.send_timeout;
+    timeout.tv_usec = 0;
+    if (setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout,
+                sizeof(timeout)) < 0) {
+         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "setsockopt on pair verified socket failed for SO_SNDTIMEO");
+    }
+#ifdef CONFIG_HAP_SESSION_KEEP_ALIVE_ENABLE
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Enabling Keep-Alive on Pair Verify Session");
+    const int yes = 1; /* enable sending keepalive probes for socket */
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes)) < 0 ) {
+         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "setsockopt on pair verified socket failed for SO_KEEPALIVE");
+    }
+
+    const int idle = 180; /* 180 sec idle before start sending probes */
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0) {
+         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "setsockopt on pair verified socket failed for TCP_KEEPIDLE");
+    }
+
+    const int interval = 30; /* 30 sec between probes */
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) < 0) {
+         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "setsockopt on pair verified socket failed for TCP_KEEPINTVL");
+    }
+
+    const int maxpkt = 4; /* Drop connection after 4 probes without response */
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &maxpkt, sizeof(maxpkt)) < 0) {
+         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "setsockopt on pair verified socket failed for TCP_KEEPCNT");
+    }
+#endif
+}
+
+/* Pair Setup and Pair Verify requests are processed by the crypto executor, so that
+ * the HTTP server task can serve other controllers meanwhile. Till the response is sent,
+ * the session context of the socket is the job itself.
+ */
+/* Frees the context of a job whose socket is gone */
+static void hap_http_pair_job_ctx_free(hap_crypto_job_t *job)
+{
+    void *ctx = job->ctx;
+    if (ctx && (hap_pair_verify_get_state(ctx) == STATE_VERIFIED)) {
+        hap_free_session(ctx);
+    } else if (job->process == hap_pair_setup_process) {
+        hap_pair_setup_ctx_clean(ctx);
+    } else {
+        hap_pair_verify_context_deinit(ctx);
+    }
+}
+
+static void hap_http_pair_job_detach(void *arg)
+{
+    hap_crypto_job_t *job = (hap_crypto_job_t *)arg;
+    /* The socket got closed. The job gets freed once it is back from the executor,
+     * or right away if it came back, but could not be handed over to this task.
+     */
+    if (hap_crypto_exec_detach(job)) {
+        hap_http_pair_job_ctx_free(job);
+        hap_platform_memory_free(job);
+    }
+}
+
+static hap_crypto_stage_t hap_http_pair_stage(bool setup, uint8_t state)
+{
+    switch (state) {
+        case STATE_M1:
+            return setup ? HAP_CRYPTO_STAGE_SETUP_M1 : HAP_CRYPTO_STAGE_VERIFY_M1;
+        case STATE_M3:
+            return setup ? HAP_CRYPTO_STAGE_SETUP_M3 : HAP_CRYPTO_STAGE_VERIFY_M3;
+        case STATE_M5:
+            return setup ? HAP_CRYPTO_STAGE_SETUP_M5 : HAP_CRYPTO_STAGE_MAX;
+        default:
+            return HAP_CRYPTO_STAGE_MAX;
+    }
+}
+
+static void hap_http_pair_send_resp(int fd, uint8_t *buf, int len)
+{
+    char hdr[100];
+    snprintf(hdr, sizeof(hdr), "HTTP/1.1 %s\r\n"
+            "Content-Type: application/pairing+tlv8\r\n"
+            "Content-Length: %d\r\n\r\n", HTTPD_200, len);
+    if ((httpd_socket_send(hap_priv.server, fd, hdr, strlen(hdr), 0) < 0) ||
+            (httpd_socket_send(hap_priv.server, fd, (char *)buf, len, 0) < 0)) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to send pairing response on socket fd: %d", fd);
+    }
+}
+
+static void hap_http_pair_setup_finish(hap_crypto_job_t *job)
+{
+    int fd = job->fd;
+    void *ctx = job->ctx;
+    hap_http_pair_send_resp(fd, job->buf, job->outlen);
+    if (job->ret != HAP_SUCCESS) {
+        hap_pair_setup_ctx_clean(ctx);
+        ctx = NULL;
+    } else if (ctx && (hap_pair_verify_get_state(ctx) == STATE_VERIFIED)) {
+        /* Software Token Authentication, as in hap_http_pair_setup_handler() */
+        ((hap_secure_session_t *)ctx)->conn_identifier = fd;
+        httpd_sess_set_ctx(hap_priv.server, fd, ctx, hap_free_session);
+        httpd_sess_set_send_override(hap_priv.server, fd, hap_httpd_send);
+        httpd_sess_set_recv_override(hap_priv.server, fd, hap_httpd_recv);
+        return;
+    }
+    httpd_sess_set_ctx(hap_priv.server, fd, ctx, ctx ? hap_pair_setup_ctx_clean : NULL);
+}
+
+static void hap_http_pair_verify_finish(hap_crypto_job_t *job)
+{
+    int fd = job->fd;
+    void *ctx = job->ctx;
+    hap_http_pair_send_resp(fd, job->buf, job->outlen);
+    if (job->ret != HAP_SUCCESS) {
+        hap_pair_verify_context_deinit(ctx);
+        ctx = NULL;
+    } else if (hap_pair_verify_get_state(ctx) == STATE_VERIFIED) {
+        ((hap_secure_session_t *)ctx)->conn_identifier = fd;
+        hap_http_pair_verified_sock_setup(fd);
+        hap_add_secure_session(ctx);
+        httpd_sess_set_ctx(hap_priv.server, fd, ctx, hap_free_session);
+        httpd_sess_set_send_override(hap_priv.server, fd, hap_httpd_send);
+        httpd_sess_set_recv_override(hap_priv.server, fd, hap_httpd_recv);
+        return;
+    }
+    httpd_sess_set_ctx(hap_priv.server, fd, ctx, ctx ? hap_pair_verify_context_deinit : NULL);
+}
+
+static void hap_http_pair_job_finish(hap_crypto_job_t *job)
+{
+    if (job->process == hap_pair_setup_process) {
+        hap_http_pair_setup_finish(job);
+    } else {
+        hap_http_pair_verify_finish(job);
+    }
+}
+
+static void hap_http_pair_job_done(void *arg)
+{
+    hap_crypto_job_t *job = (hap_crypto_job_t *)arg;
+    if (job->attached) {
+        hap_http_pair_job_finish(job);
+    } else {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Socket fd: %d closed during the handshake", job->fd);
+        hap_http_pair_job_ctx_free(job);
+    }
+    hap_crypto_exec_complete(job);
+}
+
+#define HAP_HTTP_PAIR_QUEUE_RETRIES     5
+
+/* Called from the crypto executor task */
+static void hap_http_pair_job_done_cb(hap_crypto_job_t *job)
+{
+    int i;
+    for (i = 0; i < HAP_HTTP_PAIR_QUEUE_RETRIES; i++) {
+        if (httpd_queue_work(hap_priv.server, hap_http_pair_job_done, job) == ESP_OK) {
+            return;
+        }
+        vTaskDelay(10 / hap_platform_os_get_msec_per_tick());
+    }
+    int fd = job->fd;
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to complete handshake on socket fd: %d", fd);
+    /* Give up on the handshake, so that it does not keep an executor slot */
+    if (hap_crypto_exec_abandon(job)) {
+        /* The socket still refers to the job, which gets freed once the socket is closed */
+        httpd_sess_trigger_close(hap_priv.server, fd);
+    } else {
+        hap_http_pair_job_ctx_free(job);
+        hap_platform_memory_free(job);
+    }
+}
+
+static void hap_http_pair_send_busy(httpd_req_t *req, uint8_t *buf, int bufsize, uint8_t state)
+{
+    int outlen;
+    hap_prepare_error_tlv(state + 1, kTLVError_Busy, buf, bufsize, &outlen);
+    httpd_resp_set_type(req, "application/pairing+tlv8");
+    httpd_resp_send(req, (char *)buf, outlen);
+}
+
+/* Hands the request over to the crypto executor. Returns HAP_SUCCESS if the request was
+ * taken care of, or HAP_FAIL if the caller should process it inline, in which case the
+ * request body has not been read.
+ */
+static int hap_http_pair_defer(httpd_req_t *req, int bufsize,
+        int (*process)(void **ctx, uint8_t *buf, int inlen, int bufsize, int *outlen))
+{
+    bool setup = (process == hap_pair_setup_process);
+    void *ctx = hap_platform_httpd_get_sess_ctx(req);
+    /* Requests on an already verified session are encrypted, and so, have to be
+     * handled in line with the other requests on it.
+     */
+    if (!hap_crypto_exec_enabled() ||
+            ((req->free_ctx != hap_http_pair_job_detach) && ctx &&
+             (hap_pair_verify_get_state(ctx) == STATE_VERIFIED))) {
+        return HAP_FAIL;
+    }
+    int fd = httpd_req_to_sockfd(req);
+    hap_crypto_job_t *job = hap_crypto_job_create(fd, bufsize);
+    if (!job) {
+        return HAP_FAIL;
+    }
+    job->inlen = httpd_req_recv(req, (char *)job->buf, bufsize);
+    uint8_t state = 0;
+    get_value_from_tlv(job->buf, job->inlen, kTLVType_State, &state, sizeof(state));
+    if ((req->free_ctx == hap_http_pair_job_detach) || hap_crypto_exec_full()) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Socket fd: %d; Handshake rejected as busy", fd);
+        hap_http_pair_send_busy(req, job->buf, bufsize, state);
+        hap_platform_memory_free(job);
+        return HAP_SUCCESS;
+    }
+    if (!ctx) {
+        int ret;
+        if (setup) {
+            ret = hap_pair_setup_context_init(fd, &ctx, job->buf, bufsize, &job->outlen);
+        } else {
+            ret = hap_pair_verify_context_init(&ctx, job->buf, bufsize, &job->outlen);
+        }
+        if (ret != HAP_SUCCESS) {
+            httpd_resp_set_type(req, "application/pairing+tlv8");
+            httpd_resp_send(req, (char *)job->buf, job->outlen);
+            hap_platform_memory_free(job);
+            return HAP_SUCCESS;
+        }
+    }
+    job->ctx = ctx;
+    job->process = process;
+    job->stage = hap_http_pair_stage(setup, state);
+    job->attached = true;
+    hap_platform_httpd_set_sess_ctx(req, job, hap_http_pair_job_detach, true);
+    if (hap_crypto_exec_submit(job, hap_http_pair_job_done_cb) != HAP_SUCCESS) {
+        /* The executor could not be started. Better slow than never */
+        job->ret = process(&job->ctx, job->buf, job->inlen, bufsize, &job->outlen);
+        hap_http_pair_job_finish(job);
+        hap_platform_memory_free(job);
+    }
+    return HAP_SUCCESS;
+}
+
 static int hap_http_pair_setup_handler(httpd_req_t *req)
 {
 	uint8_t buf[1200];
@@ -90,6 +360,9 @@ static int hap_http_pair_setup_handler(httpd_req_t *req)
 	void *ctx = (hap_secure_session_t *)hap_platform_httpd_get_sess_ctx(req);
     int fd = httpd_req_to_sockfd(req);
     ESP_MFI_DEBUG_PLAIN("Socket fd: %d; HTTP Request %s %s\n", httpd_req_to_sockfd(req), hap_platform_httpd_get_req_method(req), hap_platform_httpd_get_req_uri(req));
+    if (hap_http_pair_defer(req, sizeof(buf), hap_pair_setup_process) == HAP_SUCCESS) {
+        return HAP_SUCCESS;
+    }
 	if (!ctx) {
 		if (hap_pair_setup_context_init(fd, &ctx, buf, sizeof(buf), &outlen) == HAP_SUCCESS) {
             hap_platform_httpd_set_sess_ctx(req, ctx, hap_pair_setup_ctx_clean, true);
@@ -142,9 +415,13 @@ static int hap_http_pair_verify_handler(httpd_req_t *req)
 	int ret, outlen;
 	void *ctx = hap_platform_httpd_get_sess_ctx(req);
     ESP_MFI_DEBUG_PLAIN("Socket fd: %d; HTTP Request %s %s\n", httpd_req_to_sockfd(req), hap_platform_httpd_get_req_method(req), hap_platform_httpd_get_req_uri(req));
+    if (hap_http_pair_defer(req, sizeof(buf), hap_pair_verify_process) == HAP_SUCCESS) {
+        return HAP_SUCCESS;
+    }
 	if (!ctx) {
 		if (hap_pair_verify_context_init(&ctx, buf, sizeof(buf), &outlen) == HAP_SUCCESS) {
-            hap_platform_httpd_set_sess_ctx(req, ctx, NULL, true);
+            /* The context holds the shared secret, so it gets wiped, not just freed */
+            hap_platform_httpd_set_sess_ctx(req, ctx, hap_pair_verify_context_deinit, true);
 		}
 	}
 	int data_len = httpd_req_recv(req, (char *)buf, sizeof(buf));
@@ -159,42 +436,8 @@ static int hap_http_pair_verify_handler(httpd_req_t *req)
             int fd = httpd_req_to_sockfd(req);
 			((hap_secure_session_t *)ctx)->conn_identifier = fd;
 
-            struct timeval timeout;
-            timeout.tv_sec = hap_priv.cfg.recv_timeout;
-            timeout.tv_usec = 0;
-            if (setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout,
-                        sizeof(timeout)) < 0) {
-                 ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "setsockopt on pair verified socket failed for SO_RCVTIMEO");
-            }
-
-            timeout.tv_sec = hap_priv.cfg.send_timeout;
-            timeout.tv_usec = 0;
-            if (setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout,
-                        sizeof(timeout)) < 0) {
-                 ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "setsockopt on pair verified socket failed for SO_SNDTIMEO");
-            }
-#ifdef CONFIG_HAP_SESSION_KEEP_ALIVE_ENABLE
-            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Enabling Keep-Alive on Pair Verify Session");
-            const int yes = 1; /* enable sending keepalive probes for socket */
-            if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes)) < 0 ) {
-                 ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "setsockopt on pair verified socket failed for SO_KEEPALIVE");
-            }
-
-            const int idle = 180; /* 180 sec idle before start sending probes */
-            if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0) {
-                 ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "setsockopt on pair verified socket failed for TCP_KEEPIDLE");
-            }
-
-            const int interval = 30; /* 30 sec between probes */
-            if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) < 0) {
-                 ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "setsockopt on pair verified socket failed for TCP_KEEPINTVL");
-            }
-
-            const int maxpkt = 4; /* Drop connection after 4 probes without response */
-            if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &maxpkt, sizeof(maxpkt)) < 0) {
-                 ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "setsockopt on pair verified socket failed for TCP_KEEPCNT");
-            }
-#endif
+            hap_http_pair_verified_sock_setup(fd);
+            hap_add_secure_session(ctx);
             hap_platform_httpd_set_sess_ctx(req, ctx, hap_free_session, true);
             httpd_sess_set_send_override(hap_priv.server, fd, hap_httpd_send);
             httpd_sess_set_recv_override(hap_priv.server, fd, hap_httpd_recv);
@@ -204,7 +447,7 @@ static int hap_http_pair_verify_handler(httpd_req_t *req)
             if (req->free_ctx) {
                 req->free_ctx(req->sess_ctx);
             } else {
-                free(req->sess_ctx);
+                hap_pair_verify_context_deinit(req->sess_ctx);
             }
         }
         hap_platform_httpd_set_sess_ctx(req, NULL, NULL, true);
@@ -218,377 +461,404 @@ static struct httpd_uri hap_pair_verify = {
     .handler = hap_http_pair_verify_handler,
 };
 
-static int hap_add_char_val_json(hap_char_format_t format, char *key,
-		hap_val_t *val, json_gen_str_t *jptr)
+static int hap_http_get_accessories(httpd_req_t *req)
 {
-	switch (format) {
-		case HAP_CHAR_FORMAT_BOOL : {
-			json_gen_obj_set_bool(jptr, key, val->b);
-			break;
-		}
-		case HAP_CHAR_FORMAT_UINT8:
-		case HAP_CHAR_FORMAT_UINT16:
-		case HAP_CHAR_FORMAT_UINT32:
-		case HAP_CHAR_FORMAT_INT: {
-			json_gen_obj_set_int(jptr, key, val->i);
-			break;
-		}
-		case HAP_CHAR_FORMAT_FLOAT : {
-			json_gen_obj_set_float(jptr, key, val->f);
-			break;
-		}
-		case HAP_CHAR_FORMAT_STRING : {
-            if (val->s) {
-			    json_gen_obj_set_string(jptr, key, val->s);
-            } else {
-                json_gen_obj_set_null(jptr, key);
-            }
-			break;
-		}
-        case HAP_CHAR_FORMAT_DATA:
-        case HAP_CHAR_FORMAT_TLV8: {
-            if (val->d.buf) {
-                json_gen_obj_start_long_string(jptr, key, NULL);
-                uint8_t *buf = val->d.buf;
-                uint32_t buflen = val->d.buflen;
-                char tmp[100];
-                while (buflen) {
-                    int tmp_len = sizeof(tmp);
-                    if (buflen > 60) {
-                        esp_mfi_base64_encode((char *)buf, 60, tmp, tmp_len, &tmp_len);
-                        buflen -= 60;
-                        buf += 60;
-                    } else {
-                        esp_mfi_base64_encode((char *)buf, buflen, tmp, tmp_len, &tmp_len);
-                        buflen -= buflen;
-                    }
-                    tmp[tmp_len] = 0;
-                    json_gen_add_to_long_string(jptr, tmp);
-                }
-                json_gen_end_long_string(jptr);
-            } else {
-                json_gen_obj_set_null(jptr, key);
-            }
-            break;
-        }
-		default :
-			break;
-	}
+    ESP_MFI_DEBUG_PLAIN("Socket fd: %d; HTTP Request %s %s\n", httpd_req_to_sockfd(req), hap_platform_httpd_get_req_method(req), hap_platform_httpd_get_req_uri(req));
+    hap_secure_session_t *session = (hap_secure_session_t *)hap_platform_httpd_get_sess_ctx(req);
+    if (!hap_is_req_secure(session)) {
+        return hap_http_session_not_authorized(req);
+    }
+    hap_http_stream_t s;
+    if (hap_http_stream_init(&s, httpd_req_to_sockfd(req), HTTPD_200) != HAP_SUCCESS) {
+        return HAP_FAIL;
+    }
+    ESP_MFI_DEBUG_PLAIN("Generating HTTP Response\n");
+    /* Streaming with chunked encoding since the response can be large, especially for
+     * bridges. If the cache cannot be used, the complete database is generated afresh.
+     */
+    int session_index = hap_get_ctrl_session_index(session);
+    if (hap_acc_db_cache_send(&s, session_index) != HAP_SUCCESS) {
+        hap_prepare_json_database(&s, session_index);
+    }
+    hap_http_stream_end(&s);
+
+    hap_report_event(HAP_EVENT_GET_ACC_COMPLETED, NULL, 0);
 	return HAP_SUCCESS;
 }
+static struct httpd_uri hap_accessories = {
+	.uri = "/accessories",
+    .method = HTTP_GET,
+    .handler = hap_http_tx_combined_handler,
+    .user_ctx = hap_http_get_accessories,
+};
 
-static int hap_add_char_format_json(__hap_char_t *hc, json_gen_str_t *jptr)
+static void hap_set_char_report_status(bool *include_status, json_gen_str_t *jstr,
+		int aid, int iid, int status)
 {
-	switch (hc->format) {
-		case HAP_CHAR_FORMAT_UINT8:
-			return json_gen_obj_set_string(jptr, "format", "uint8");
-		case HAP_CHAR_FORMAT_UINT16:
-			return json_gen_obj_set_string(jptr, "format", "uint16");
-		case HAP_CHAR_FORMAT_UINT32:
-			return json_gen_obj_set_string(jptr, "format", "uint32");
-		case HAP_CHAR_FORMAT_INT:
-			return json_gen_obj_set_string(jptr, "format", "int");
-		case HAP_CHAR_FORMAT_BOOL:
-			return json_gen_obj_set_string(jptr, "format", "bool");
-		case HAP_CHAR_FORMAT_STRING:
-			return json_gen_obj_set_string(jptr, "format", "string");
-		case HAP_CHAR_FORMAT_FLOAT:
-			return json_gen_obj_set_string(jptr, "format", "float");
-		case HAP_CHAR_FORMAT_DATA:
-			return json_gen_obj_set_string(jptr, "format", "data");
-		case HAP_CHAR_FORMAT_TLV8:
-			return json_gen_obj_set_string(jptr, "format", "tlv8");
-		default:
-			break;
+	if (!*include_status) {
+		json_gen_start_object(jstr);
+		json_gen_push_array(jstr, "characteristics");
+		*include_status = true;
 	}
-	return HAP_SUCCESS;
+	json_gen_start_object(jstr);
+	json_gen_obj_set_int(jstr, "aid", aid);
+	json_gen_obj_set_int(jstr, "iid", iid);
+	json_gen_obj_set_int(jstr, "status", status);
+	json_gen_end_object(jstr);
 }
 
-static int hap_add_char_type(__hap_char_t *hc, json_gen_str_t *jptr)
+/* Outcome of a characteristic in a write request. The response reports these in the
+ * request order.
+ */
+typedef struct {
+    int aid;
+    int iid;
+    __hap_char_t *hc;       /* Set only for the writes passed on to the service */
+    bool write_response;
+    bool pending;           /* Deferred write not done yet */
+    hap_status_t status;
+} hap_set_char_res_t;
+
+static void hap_set_char_record_status(hap_set_char_res_t *res_arr, int *res_cnt,
+		int aid, int iid, int status)
 {
-	return json_gen_obj_set_string(jptr, "type", (char *)hc->type_uuid);
+	res_arr[*res_cnt].aid = aid;
+	res_arr[*res_cnt].iid = iid;
+	res_arr[*res_cnt].status = status;
+	(*res_cnt)++;
 }
 
-static int hap_add_char_meta(__hap_char_t *hc, json_gen_str_t *jptr)
+/* Sends 204 if there is nothing to report, else 207 with the status of each
+ * characteristic. The session must have been corked.
+ */
+static void hap_http_send_set_char_resp(int fd, hap_set_char_res_t *res_arr, int res_cnt,
+        bool report)
 {
-	hap_add_char_format_json(hc, jptr);
-
-	if (hc->constraint_flags & HAP_CHAR_MIN_FLAG)
-		hap_add_char_val_json(hc->format, "minValue", &hc->min, jptr);
-	if (hc->constraint_flags & HAP_CHAR_MAX_FLAG)
-		hap_add_char_val_json(hc->format, "maxValue", &hc->max, jptr);
-	if (hc->constraint_flags & HAP_CHAR_STEP_FLAG)
-		hap_add_char_val_json(hc->format, "minStep", &hc->step, jptr);
-
-	/* maxLen and maxDataLen are constraints for "string" and "data" format
-	 * of characteristics, respectively. However, the constraints themselves
-	 * are integers. So, we pass the format as HAP_CHAR_FORMAT_INT
-	 */
-	if (hc->constraint_flags & HAP_CHAR_MAXLEN_FLAG)
-		hap_add_char_val_json(HAP_CHAR_FORMAT_INT, "maxLen", &hc->max, jptr);
-	if (hc->constraint_flags & HAP_CHAR_MAXDATALEN_FLAG)
-		hap_add_char_val_json(HAP_CHAR_FORMAT_INT, "maxDataLen", &hc->max, jptr);
+    if (!report) {
+        char buf[48];
+        snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\n\r\n", HTTPD_204);
+        hap_httpd_send(hap_priv.server, fd, buf, strlen(buf), 0);
+        return;
+    }
+    hap_http_stream_t s;
+    if (hap_http_stream_init(&s, fd, HTTPD_207) != HAP_SUCCESS) {
+        return;
+    }
+    if (res_cnt) {
+        json_gen_str_t jstr;
+        hap_http_stream_json_start(&s, &jstr);
+        json_gen_start_object(&jstr);
+        json_gen_push_array(&jstr, "characteristics");
+        int i;
+        for (i = 0; i < res_cnt; i++) {
+            json_gen_start_object(&jstr);
+            json_gen_obj_set_int(&jstr, "aid", res_arr[i].aid);
+            json_gen_obj_set_int(&jstr, "iid", res_arr[i].iid);
+            json_gen_obj_set_int(&jstr, "status", res_arr[i].status);
+            if (res_arr[i].write_response && (res_arr[i].status == HAP_STATUS_SUCCESS)) {
+                hap_add_char_val_json(res_arr[i].hc->format, "value", &res_arr[i].hc->val, &jstr);
+            }
+            json_gen_end_object(&jstr);
+        }
+        json_gen_pop_array(&jstr);
+        json_gen_end_object(&jstr);
+        hap_http_stream_json_end(&s, &jstr);
+    }
+    hap_http_stream_end(&s);
+}
 
-	if (hc->description)
-		json_gen_obj_set_string(jptr, "description", hc->description);
-	if (hc->unit)
-		json_gen_obj_set_string(jptr, "unit", hc->unit);
+#define HAP_NOTIF_JSON_SIZE     1024
 
-	return HAP_SUCCESS;
+/* Serializes the notification for the characteristics in char_arr, or for just the
+ * ones set in map, if given
+ */
+static void hap_prepare_notif_json(char *notif_json, int size, hap_char_t **char_arr,
+        int num_chars, uint32_t *map)
+{
+    int j;
+    json_gen_str_t jstr;
+    json_gen_str_start(&jstr, notif_json, size, NULL, NULL);
+    json_gen_start_object(&jstr);
+    json_gen_push_array(&jstr, "characteristics");
+    for (j = 0; j < num_chars; j++) {
+        if (map && !(map[j / 32] & (1U << (j % 32))))
+            continue;
+        hap_char_t *hc = char_arr[j];
+        __hap_char_t *_hc = ( __hap_char_t *)hc;
+        json_gen_start_object(&jstr);
+        hap_acc_t *ha = hap_serv_get_parent(hap_char_get_parent(hc));
+        int aid = ((__hap_acc_t *)ha)->aid;
+        json_gen_obj_set_int(&jstr, "aid", aid);
+        json_gen_obj_set_int(&jstr, "iid", _hc->iid);
+        hap_add_char_val_json(_hc->format, "value", &_hc->val, &jstr);
+        json_gen_end_object(&jstr);
+    }
+    json_gen_pop_array(&jstr);
+    json_gen_end_object(&jstr);
+    json_gen_str_end(&jstr);
 }
 
-static int hap_add_char_perms(__hap_char_t *hc, json_gen_str_t *jptr)
+static void hap_send_notif_frame(int fd, const char *notif_json)
 {
-	json_gen_push_array(jptr, "perms");
-	if (hc->permission & HAP_CHAR_PERM_PR)
-		json_gen_arr_set_string(jptr, "pr");
-	if (hc->permission & HAP_CHAR_PERM_PW)
-		json_gen_arr_set_string(jptr, "pw");
-	if (hc->permission & HAP_CHAR_PERM_EV)
-		json_gen_arr_set_string(jptr, "ev");
-	if (hc->permission & HAP_CHAR_PERM_AA)
-		json_gen_arr_set_string(jptr, "aa");
-	if (hc->permission & HAP_CHAR_PERM_TW)
-		json_gen_arr_set_string(jptr, "tw");
-	if (hc->permission & HAP_CHAR_PERM_HD)
-		json_gen_arr_set_string(jptr, "hd");
-	if (hc->permission & HAP_CHAR_PERM_WR)
-		json_gen_arr_set_string(jptr, "wr");
-	json_gen_pop_array(jptr);
-	return HAP_SUCCESS;
+    char buf[250];
+#define HTTPD_HDR_STR      "EVENT/1.0 200 OK\r\n"                   \
+		"Content-Type: application/hap+json\r\n"           \
+		"Content-Length: %d\r\n"
+    snprintf(buf, sizeof(buf), HTTPD_HDR_STR, strlen(notif_json));
+    /* Combine the headers and the body into a single encrypted frame */
+    hap_httpd_tx_cork(fd);
+    hap_httpd_send(hap_priv.server, fd, buf, strlen(buf), 0);
+    /* Space for sending additional headers based on set_header */
+    hap_httpd_send(hap_priv.server, fd, "\r\n", strlen("\r\n"), 0);
+    hap_httpd_send(hap_priv.server, fd, notif_json, strlen(notif_json), 0);
+    hap_httpd_tx_flush(fd);
+    httpd_sess_update_lru_counter(hap_priv.server, fd);
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Notification Sent");
+    ESP_MFI_DEBUG_PLAIN("Socket fd: %d; Event message: %s\n", fd, notif_json);
 }
 
-static int hap_add_char_ev(__hap_char_t *hc, json_gen_str_t *jptr, uint8_t session_index)
+/* Sends the notifications held back for a controller while its write response was
+ * deferred. The values sent are the current ones.
+ */
+static void hap_send_held_notif(int index)
 {
-    if (hap_char_is_ctrl_subscribed((hap_char_t *)hc, session_index)) {
-        return json_gen_obj_set_bool(jptr, "ev", true);
-    } else {
-	    return json_gen_obj_set_bool(jptr, "ev", false);
+    int num_char = hap_priv.cfg.max_event_notif_chars;
+    hap_char_t **char_arr = hap_platform_memory_calloc(num_char, sizeof(hap_char_t *));
+    if (!char_arr) {
+        return;
+    }
+    char notif_json[HAP_NOTIF_JSON_SIZE];
+    int num_held;
+    while ((num_held = hap_get_held_notif_chars(index, char_arr, num_char)) > 0) {
+        /* Notifications may have been disabled meanwhile */
+        int i, num_notif_chars = 0;
+        for (i = 0; i < num_held; i++) {
+            if (hap_char_is_ctrl_subscribed(char_arr[i], index)) {
+                char_arr[num_notif_chars++] = char_arr[i];
+            }
+        }
+        if (num_notif_chars) {
+            hap_prepare_notif_json(notif_json, sizeof(notif_json), char_arr, num_notif_chars, NULL);
+            hap_send_notif_frame(hap_priv.sessions[index]->conn_identifier, notif_json);
+        }
     }
+    hap_platform_memory_free(char_arr);
 }
 
-static int hap_add_char_valid_vals(__hap_char_t *hc, json_gen_str_t *jptr)
+/* Write request whose response is held back till its deferred writes are done.
+ * Only accessed from the HTTP server task.
+ */
+typedef struct hap_set_char_defer {
+    struct hap_set_char_defer *next;
+    uint32_t id;
+    int fd;
+    hap_secure_session_t *session;
+    esp_timer_handle_t timer;
+    int pending;
+    bool report;
+    int res_cnt;
+    hap_set_char_res_t res_arr[];
+} hap_set_char_defer_t;
+
+static hap_set_char_defer_t *hap_set_char_defers;
+static uint32_t hap_set_char_defer_id;
+
+static hap_set_char_defer_t *hap_set_char_defer_find(uint32_t id)
 {
-    if (hc->valid_vals) {
-        json_gen_push_array(jptr, "valid-values");
-        int i;
-        for (i = 0; i < hc->valid_vals_cnt; i++) {
-            json_gen_arr_set_int(jptr, hc->valid_vals[i]);
+    hap_set_char_defer_t *defer;
+    for (defer = hap_set_char_defers; defer; defer = defer->next) {
+        if (defer->id == id) {
+            return defer;
         }
-        json_gen_pop_array(jptr);
-    }
-    if (hc->valid_vals_range) {
-        json_gen_push_array(jptr, "valid-values-range");
-        json_gen_arr_set_int(jptr, hc->valid_vals_range[0]);
-        json_gen_arr_set_int(jptr, hc->valid_vals_range[1]);
-        json_gen_pop_array(jptr);
     }
-    return HAP_SUCCESS;
+    return NULL;
 }
 
-static int hap_prepare_char_db(__hap_char_t *hc, json_gen_str_t *jptr, int session_index)
+/* Checks if the session is waiting for a deferred write response */
+static bool hap_set_char_defer_pending(hap_secure_session_t *session)
 {
-	json_gen_start_object(jptr);
-
-	json_gen_obj_set_int(jptr, "iid", hc->iid);
-
-    /* If the Update API has not been called from the service read routine,
-     * reset the owner controller value.
-     * Else, the controller will  miss the next notification.
-     */
-    if (!hc->update_called)   {
-        hc->owner_ctrl = 0;
-    }
-    hc->update_called = false;
-
-	if (hc->permission & HAP_CHAR_PERM_PR) {
-        if (hc->permission & HAP_CHAR_PERM_SPECIAL_READ) {
-            json_gen_obj_set_null(jptr, "value");
-        } else if (hc->permission & HAP_CHAR_PERM_WR) {
-            /* TODO: Check what to do for bool/int/float types of control
-             * characteristics with "Write Response" permission.
-             * Ideally, a NULL should have been acceptable as it is independent
-             * of actual datatype, but HAT does not accept it for Wi-Fi
-             * configuration.
-             */
-            json_gen_obj_set_string(jptr, "value", "");
-        } else {
-            hap_add_char_val_json(hc->format, "value", &hc->val, jptr);
+    hap_set_char_defer_t *defer;
+    for (defer = hap_set_char_defers; defer; defer = defer->next) {
+        if (defer->session == session) {
+            return true;
         }
-	}
-	hap_add_char_type(hc, jptr);
-	hap_add_char_perms(hc, jptr);
-	hap_add_char_ev(hc, jptr, session_index);
-	hap_add_char_meta(hc, jptr);
-    hap_add_char_valid_vals(hc, jptr);
-
-	json_gen_end_object(jptr);
-
-	return HAP_SUCCESS;
+    }
+    return false;
 }
 
-static int hap_prepare_serv_db(__hap_serv_t *hs, json_gen_str_t *jptr, int session_index)
+/* Sends the response once nothing is pending, followed by the notifications held
+ * back for the controller meanwhile
+ */
+static void hap_set_char_defer_check(hap_set_char_defer_t *defer)
 {
-	json_gen_start_object(jptr);
-	json_gen_obj_set_int(jptr, "iid", hs->iid);
-	json_gen_obj_set_string(jptr, "type", hs->type_uuid);
-	if (hs->hidden)
-		json_gen_obj_set_bool(jptr, "hidden", "true");
-	if (hs->primary)
-		json_gen_obj_set_bool(jptr, "primary", "true");
-    if (hs->linked_servs) {
-        hap_linked_serv_t *linked = hs->linked_servs;
-        json_gen_push_array(jptr, "linked");
-        while (linked) {
-            json_gen_arr_set_int(jptr, ((__hap_serv_t *)linked->hs)->iid);
-            linked = linked->next;
-        }
-        json_gen_pop_array(jptr);
+    if (defer->pending) {
+        return;
     }
-
-	json_gen_push_array(jptr, "characteristics");
-    int char_cnt = 0;
-	hap_char_t *hc;
-    for (hc = hap_serv_get_first_char((hap_serv_t *)hs); hc; hc = hap_char_get_next(hc)) {
-        if (((__hap_char_t *)hc)->permission & HAP_CHAR_PERM_PR) {
-            char_cnt++;
-        }
+    esp_timer_stop(defer->timer);
+    esp_timer_delete(defer->timer);
+    hap_set_char_defer_t **prev = &hap_set_char_defers;
+    while (*prev != defer) {
+        prev = &(*prev)->next;
     }
-    if (char_cnt) {
-        hap_read_data_t *read_arr = hap_platform_memory_calloc(char_cnt, sizeof(hap_read_data_t));
-        if (!read_arr) {
-            return HAP_FAIL;
-        }
-
-        hap_status_t *status_codes = hap_platform_memory_calloc(char_cnt, sizeof(hap_status_t));
-        if (!status_codes) {
-            hap_platform_memory_free(read_arr);
-            return HAP_FAIL;
-        }
-
-        /* Create an array of characteristics to read, and then read them in one go */
-        char_cnt = 0;
-        for (hc = hap_serv_get_first_char((hap_serv_t *)hs); hc; hc = hap_char_get_next(hc)) {
-            if (((__hap_char_t *)hc)->permission & HAP_CHAR_PERM_PR) {
-                hap_char_set_owner_ctrl(hc, session_index);
-                ((__hap_char_t *)hc)->update_called = false;
-                read_arr[char_cnt].hc = hc;
-                status_codes[char_cnt] = HAP_STATUS_SUCCESS;
-                read_arr[char_cnt].status = &status_codes[char_cnt];
-                char_cnt++;
+    *prev = defer->next;
+    /* The controller may have disconnected meanwhile */
+    if ((httpd_sess_get_ctx(hap_priv.server, defer->fd) == defer->session) &&
+            (defer->session->state == STATE_VERIFIED)) {
+        ESP_MFI_DEBUG_PLAIN("Socket fd: %d; Deferred write response\n", defer->fd);
+        hap_httpd_tx_cork(defer->fd);
+        hap_http_send_set_char_resp(defer->fd, defer->res_arr, defer->res_cnt, defer->report);
+        hap_httpd_tx_flush(defer->fd);
+        httpd_sess_update_lru_counter(hap_priv.server, defer->fd);
+        int i;
+        for (i = 0; !hap_set_char_defer_pending(defer->session) && (i < HAP_MAX_SESSIONS); i++) {
+            if (hap_priv.sessions[i] == defer->session) {
+                hap_send_held_notif(i);
+                break;
             }
         }
-
-        hs->bulk_read(&read_arr[0], char_cnt, hs->priv, NULL);
-        hap_platform_memory_free(read_arr);
-        hap_platform_memory_free(status_codes);
+    } else {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Session gone. Dropping deferred write response");
     }
-    for (hc = hap_serv_get_first_char((hap_serv_t *)hs); hc; hc = hap_char_get_next(hc)) {
-		hap_prepare_char_db((__hap_char_t *)hc, jptr, session_index);
-	}
-
-	json_gen_pop_array(jptr);
-	json_gen_end_object(jptr);
-	return HAP_SUCCESS;
-}
-
-static int hap_prepare_acc_db(__hap_acc_t *ha, json_gen_str_t *jptr, int session_index)
-{
-	json_gen_start_object(jptr);
-	json_gen_obj_set_int(jptr, "aid", ha->aid);
-	json_gen_push_array(jptr, "services");
-	hap_serv_t *hs;
-	for (hs = hap_acc_get_first_serv((hap_acc_t *)ha); hs; hs = hap_serv_get_next(hs)) {
-		hap_prepare_serv_db((__hap_serv_t *)hs, jptr, session_index);
-	}
-	json_gen_pop_array(jptr);
-	json_gen_end_object(jptr);
-	return HAP_SUCCESS;
+    hap_platform_memory_free(defer);
+    hap_report_event(HAP_EVENT_SET_CHAR_COMPLETED, NULL, 0);
 }
 
-static int hap_prepare_json_database(char *buf, int bufsize, json_gen_flush_cb_t flush_cb, httpd_req_t *req)
+static void hap_set_char_defer_done(void *arg)
 {
-    if (!req) {
-        return HAP_FAIL;
-    }
-    hap_secure_session_t *session = (hap_secure_session_t *)hap_platform_httpd_get_sess_ctx(req);
-    if (!session) {
-        return HAP_FAIL;
+    hap_write_job_t *job = (hap_write_job_t *)arg;
+    /* The request may already have timed out */
+    hap_set_char_defer_t *defer = hap_set_char_defer_find(job->id);
+    if (defer && defer->res_arr[job->index].pending) {
+        hap_set_char_res_t *res = &defer->res_arr[job->index];
+        res->pending = false;
+        res->status = job->status;
+        if ((res->status != HAP_STATUS_SUCCESS) || res->write_response) {
+            defer->report = true;
+        }
+        defer->pending--;
+        hap_set_char_defer_check(defer);
     }
-	json_gen_str_t jstr;
-	json_gen_str_start(&jstr, buf, bufsize, flush_cb, req);
-	json_gen_start_object(&jstr);
-	json_gen_push_array(&jstr, "accessories");
-	hap_acc_t *ha;
-	for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
-		hap_prepare_acc_db((__hap_acc_t *)ha, &jstr, hap_get_ctrl_session_index(session));
-	}
-	json_gen_pop_array(&jstr);
-	json_gen_end_object(&jstr);
-	json_gen_str_end(&jstr);
-	return HAP_SUCCESS;
+    hap_write_job_free(job);
 }
 
-static void hap_http_json_flush_chunk(char *data, void *priv)
+#define HAP_SET_CHAR_DEFER_QUEUE_RETRIES    5
+
+/* Called from the write executor task, which can afford to wait for the server */
+static void hap_set_char_defer_done_cb(hap_write_job_t *job)
 {
-    ESP_MFI_DEBUG_PLAIN("%s", data);
-	httpd_resp_send_chunk((httpd_req_t *)priv, data, strlen(data));
+    int i;
+    for (i = 0; i < HAP_SET_CHAR_DEFER_QUEUE_RETRIES; i++) {
+        if (httpd_queue_work(hap_priv.server, hap_set_char_defer_done, job) == ESP_OK) {
+            return;
+        }
+        vTaskDelay(10 / hap_platform_os_get_msec_per_tick());
+    }
+    /* The timeout will send the response, reporting this write as timed out */
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Failed to queue deferred write completion");
+    hap_write_job_free(job);
 }
 
-static int hap_http_get_accessories(httpd_req_t *req)
+static void hap_set_char_defer_expire(void *arg)
 {
-	char buf[1000];
-    ESP_MFI_DEBUG_PLAIN("Socket fd: %d; HTTP Request %s %s\n", httpd_req_to_sockfd(req), hap_platform_httpd_get_req_method(req), hap_platform_httpd_get_req_uri(req));
-    hap_secure_session_t *session = (hap_secure_session_t *)hap_platform_httpd_get_sess_ctx(req);
-    if (!hap_is_req_secure(session)) {
-        return hap_http_session_not_authorized(req);
+    hap_set_char_defer_t *defer = hap_set_char_defer_find((uint32_t)(uintptr_t)arg);
+    if (!defer) {
+        return;
     }
-	httpd_resp_set_type(req, "application/hap+json");
-    ESP_MFI_DEBUG_PLAIN("Generating HTTP Response\n");
-    /* Using chunked encoding since the response can be large, especially for bridges */
-	hap_prepare_json_database(buf, sizeof(buf), hap_http_json_flush_chunk, req);
-    /* This indicates the last chunk */
-    httpd_resp_send_chunk(req, NULL, 0);
-    ESP_MFI_DEBUG_PLAIN("\n");
-
-    hap_report_event(HAP_EVENT_GET_ACC_COMPLETED, NULL, 0);
-	return HAP_SUCCESS;
+    int i;
+    for (i = 0; i < defer->res_cnt; i++) {
+        if (defer->res_arr[i].pending) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Deferred write timed out for aid=%d iid=%d",
+                    defer->res_arr[i].aid, defer->res_arr[i].iid);
+            defer->res_arr[i].pending = false;
+            defer->res_arr[i].status = HAP_STATUS_TIMEOUT;
+        }
+    }
+    defer->report = true;
+    defer->pending = 0;
+    hap_set_char_defer_check(defer);
 }
-static struct httpd_uri hap_accessories = {
-	.uri = "/accessories",
-    .method = HTTP_GET,
-    .handler = hap_http_get_accessories,
-};
 
-static void hap_set_char_report_status(bool *include_status, json_gen_str_t *jstr,
-		int aid, int iid, int status)
+/* Called from the esp_timer task. The timer is periodic and is deleted only once the
+ * response has been sent, so if queuing the expiry fails, it is retried on the next
+ * period instead of leaving the request pending forever.
+ */
+static void hap_set_char_defer_timeout_cb(void *arg)
 {
-	if (!*include_status) {
-		json_gen_start_object(jstr);
-		json_gen_push_array(jstr, "characteristics");
-		*include_status = true;
-	}
-	json_gen_start_object(jstr);
-	json_gen_obj_set_int(jstr, "aid", aid);
-	json_gen_obj_set_int(jstr, "iid", iid);
-	json_gen_obj_set_int(jstr, "status", status);
-	json_gen_end_object(jstr);
+    if (httpd_queue_work(hap_priv.server, hap_set_char_defer_expire, arg) != ESP_OK) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Failed to queue deferred write expiry. Will retry");
+    }
 }
 
-static void hap_set_char_report_write_response(bool *include_status, json_gen_str_t *jstr,
-        int aid, int iid, __hap_char_t *hc)
+/* Holds back the response of a write request and hands the deferred writes over to the
+ * executor. Returns HAP_SUCCESS if the response was deferred. Else, the deferred writes
+ * have been reported as failed in res_arr, and the response must be sent right away.
+ */
+static int hap_set_char_defer(int fd, hap_secure_session_t *session, hap_set_char_res_t *res_arr,
+        int res_cnt, bool report, hap_write_job_t *jobs)
 {
-    if (!*include_status) {
-        json_gen_start_object(jstr);
-        json_gen_push_array(jstr, "characteristics");
-        *include_status = true;
-    }
-    json_gen_start_object(jstr);
-    json_gen_obj_set_int(jstr, "aid", aid);
-    json_gen_obj_set_int(jstr, "iid", iid);
-    json_gen_obj_set_int(jstr, "status", 0);
-    hap_add_char_val_json(hc->format, "value", &hc->val, jstr);
-    json_gen_end_object(jstr);
+    hap_write_job_t *job, *next;
+    hap_set_char_defer_t *defer = hap_platform_memory_calloc(1,
+            sizeof(hap_set_char_defer_t) + res_cnt * sizeof(hap_set_char_res_t));
+    if (defer) {
+        defer->id = ++hap_set_char_defer_id;
+        esp_timer_create_args_t timer_args = {
+            .callback = hap_set_char_defer_timeout_cb,
+            .arg = (void *)(uintptr_t)defer->id,
+            .name = "hap_write_timeout",
+        };
+        if (esp_timer_create(&timer_args, &defer->timer) != ESP_OK) {
+            hap_platform_memory_free(defer);
+            defer = NULL;
+        }
+    }
+    for (job = jobs; job; job = next) {
+        next = job->next;
+        int i;
+        for (i = 0; (i < res_cnt) && (&res_arr[i].status != job->req_status); i++);
+        if (i == res_cnt) {
+            hap_write_job_free(job);
+            continue;
+        }
+        if (!defer) {
+            res_arr[i].status = HAP_STATUS_OO_RES;
+            hap_write_job_free(job);
+            continue;
+        }
+        job->id = defer->id;
+        job->index = i;
+        res_arr[i].pending = true;
+        if (hap_write_exec_submit(job, hap_set_char_defer_done_cb) != HAP_SUCCESS) {
+            res_arr[i].pending = false;
+            res_arr[i].status = HAP_STATUS_OO_RES;
+            hap_write_job_free(job);
+            continue;
+        }
+        defer->pending++;
+    }
+    if (!defer) {
+        return HAP_FAIL;
+    }
+    if (!defer->pending) {
+        esp_timer_delete(defer->timer);
+        hap_platform_memory_free(defer);
+        return HAP_FAIL;
+    }
+    int i;
+    for (i = 0; i < res_cnt; i++) {
+        if (!res_arr[i].pending && (res_arr[i].status != HAP_STATUS_SUCCESS)) {
+            report = true;
+        }
+    }
+    defer->fd = fd;
+    defer->session = session;
+    defer->report = report;
+    defer->res_cnt = res_cnt;
+    memcpy(defer->res_arr, res_arr, res_cnt * sizeof(hap_set_char_res_t));
+    defer->next = hap_set_char_defers;
+    hap_set_char_defers = defer;
+    esp_timer_start_periodic(defer->timer, CONFIG_HAP_DEFERRED_WRITE_TIMEOUT * 1000ULL);
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Response deferred for %d write(s)", defer->pending);
+    return HAP_SUCCESS;
 }
 
 static void remove_escape_char(char *data, uint32_t *buf_len)
@@ -605,11 +875,43 @@ static void remove_escape_char(char *data, uint32_t *buf_len)
     }
 }
 
-static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_size,
-		httpd_req_t *req)
+/* Returns a copy of the write array, stably grouped by service, so that each service
+ * gets a single write callback even if the controller interleaved writes to different
+ * services. The status pointers are copied as is, so they still point to the statuses
+ * of the original entries, which are used (in request order) for the response.
+ * If the copy cannot be allocated, the original array is returned.
+ */
+static hap_write_data_t *hap_http_group_writes_by_serv(hap_write_data_t *write_arr, int cnt)
 {
-	int cnt = 0, char_cnt = 0, i;
-	bool include_status = false;
+    hap_write_data_t *grouped = hap_req_arena_calloc(cnt, sizeof(hap_write_data_t));
+    bool *placed = hap_req_arena_calloc(cnt, sizeof(bool));
+    if (!grouped || !placed) {
+        return write_arr;
+    }
+    int i, j, n = 0;
+    for (i = 0; i < cnt; i++) {
+        if (placed[i]) {
+            continue;
+        }
+        hap_serv_t *hs = hap_char_get_parent(write_arr[i].hc);
+        for (j = i; j < cnt; j++) {
+            if (!placed[j] && (hap_char_get_parent(write_arr[j].hc) == hs)) {
+                grouped[n++] = write_arr[j];
+                placed[j] = true;
+            }
+        }
+    }
+    return grouped;
+}
+
+/* Handles the writes and sends the response, unless it had to be deferred, which is
+ * indicated by the deferred flag.
+ */
+static int hap_http_handle_set_char(jparse_ctx_t *jctx, httpd_req_t *req, bool *deferred)
+{
+	int cnt = 0, char_cnt = 0, res_cnt = 0, i;
+	bool report = false;
+    int fd = httpd_req_to_sockfd(req);
     uint64_t pid;
     bool valid_tw = false;
     bool req_tw = false;
@@ -643,17 +945,19 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
     session->pid = 0;
     session->ttl = 0;
 
+    *deferred = false;
+    /* Even an empty response is sent if the request cannot be handled */
+    report = true;
+    hap_set_char_res_t *res_arr = NULL;
 	json_obj_get_array(jctx, "characteristics", &cnt);
 	if (cnt <= 0)
-		return HAP_FAIL;
-
-    hap_write_data_t *write_arr = hap_platform_memory_calloc(cnt, sizeof(hap_write_data_t));
-	hap_status_t *status_arr = hap_platform_memory_calloc(cnt, sizeof(hap_status_t));
-	if (!write_arr || !status_arr)
 		goto set_char_end;
 
-	json_gen_str_t jstr;
-	json_gen_str_start(&jstr, outbuf, buf_size, hap_http_json_flush_chunk, req);
+    hap_write_data_t *write_arr = hap_req_arena_calloc(cnt, sizeof(hap_write_data_t));
+	res_arr = hap_req_arena_calloc(cnt, sizeof(hap_set_char_res_t));
+	if (!write_arr || !res_arr)
+		goto set_char_end;
+    report = false;
     /* Dummy get, so that the loop can start by leaving the previous
      * object and getting newer one
      */
@@ -669,10 +973,9 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
 		json_arr_get_object(jctx, i);
 		json_obj_get_int(jctx, "aid", &aid);
 		json_obj_get_int(jctx, "iid", &iid);
-		hap_acc_t *ha = hap_acc_get_by_aid(aid);
-		__hap_char_t *hc = (__hap_char_t *)hap_acc_get_char_by_iid(ha, iid);
-		if (!ha || !hc) {
-			hap_set_char_report_status(&include_status, &jstr,
+		__hap_char_t *hc = (__hap_char_t *)hap_get_char_by_aid_iid(aid, iid);
+		if (!hc) {
+			hap_set_char_record_status(res_arr, &res_cnt,
 					aid, iid, HAP_STATUS_RES_ABSENT);
 			continue;
 		}
@@ -690,7 +993,7 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
                 ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Events %s for aid=%d iid=%d",
                         ev ? "Enabled" : "Disabled", aid, iid);
             } else {
-				hap_set_char_report_status(&include_status, &jstr,
+				hap_set_char_record_status(res_arr, &res_cnt,
 						aid, iid, HAP_STATUS_NO_NOTIF);
 			}
 			continue;
@@ -700,7 +1003,7 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
          * one was not a valid timed write, report error.
          */
         if (req_tw == true && valid_tw == false) {
-            hap_set_char_report_status(&include_status, &jstr,
+            hap_set_char_record_status(res_arr, &res_cnt,
                     aid, iid, HAP_STATUS_VAL_INVALID);
             continue;
         }
@@ -710,7 +1013,7 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
          */
         if (hc->permission & HAP_CHAR_PERM_TW) {
             if (valid_tw == false) {
-                hap_set_char_report_status(&include_status, &jstr,
+                hap_set_char_record_status(res_arr, &res_cnt,
                         aid, iid, HAP_STATUS_VAL_INVALID);
                 continue;
             }
@@ -718,7 +1021,7 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
 
         /* Check if the characteristic has write permission */
 		if (!(hc->permission & HAP_CHAR_PERM_PW)) {
-			hap_set_char_report_status(&include_status, &jstr,
+			hap_set_char_record_status(res_arr, &res_cnt,
 					aid, iid, HAP_STATUS_WR_ON_RDONLY);
 			continue;
 		}
@@ -729,7 +1032,7 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
         if (hc->permission & HAP_CHAR_PERM_AA) {
             int tmp_len;
             if (json_obj_get_strlen(jctx, "authData", &tmp_len) != HAP_SUCCESS) {
-			hap_set_char_report_status(&include_status, &jstr,
+			hap_set_char_record_status(res_arr, &res_cnt,
 					aid, iid, HAP_STATUS_INSUFFICIENT_AUTH);
 			continue;
             }
@@ -738,7 +1041,7 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
          * this write request. Return an error.
          */
 		if (!((__hap_serv_t *)(hap_char_get_parent((hap_char_t *)hc)))->write_cb) {
-			hap_set_char_report_status(&include_status, &jstr,
+			hap_set_char_record_status(res_arr, &res_cnt,
 					aid, iid, HAP_STATUS_VAL_INVALID);
 			continue;
 		}
@@ -776,9 +1079,9 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
 				if (json_ret == HAP_SUCCESS) {
                     /* Increment string length, for NULL termination byte */
                     str_len++;
-                    val.s = hap_platform_memory_calloc(str_len, 1);
+                    val.s = hap_req_arena_calloc(str_len, 1);
                     if (!val.s) {
-                        hap_set_char_report_status(&include_status, &jstr,
+                        hap_set_char_record_status(res_arr, &res_cnt,
                                 aid, iid, HAP_STATUS_OO_RES);
                         continue;
                     }
@@ -791,9 +1094,9 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
 				int str_len = 0;
 				json_ret = json_obj_get_strlen(jctx, "value", &str_len);
 				if (json_ret == HAP_SUCCESS) {
-					val.d.buf = hap_platform_memory_calloc(1, str_len + 1);
+					val.d.buf = hap_req_arena_calloc(1, str_len + 1);
                     if (!val.d.buf) {
-                        hap_set_char_report_status(&include_status, &jstr,
+                        hap_set_char_record_status(res_arr, &res_cnt,
                                 aid, iid, HAP_STATUS_OO_RES);
                         continue;
                     }
@@ -802,8 +1105,8 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
                     remove_escape_char((char *)val.d.buf, &val.d.buflen);
                     if (esp_mfi_base64_decode((const char *)val.d.buf, strlen((char *)val.d.buf),
                                 (char *)val.d.buf, val.d.buflen, (int *)&val.d.buflen) != 0) {
-                        hap_platform_memory_free(val.d.buf);
-                        hap_set_char_report_status(&include_status, &jstr,
+                        hap_req_arena_free(val.d.buf);
+                        hap_set_char_record_status(res_arr, &res_cnt,
                                 aid, iid, HAP_STATUS_VAL_INVALID);
                         continue;
                     }
@@ -814,20 +1117,25 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
 				json_ret = HAP_FAIL;
 		}
 		if (json_ret != HAP_SUCCESS) {
-			hap_set_char_report_status(&include_status, &jstr,
+			hap_set_char_record_status(res_arr, &res_cnt,
 					aid, iid, HAP_STATUS_VAL_INVALID);
 			continue;
 		}
 
         /* Check if the value is within constraints */
         if (hap_char_check_val_constraints(hc, &val) != HAP_SUCCESS) {
-			hap_set_char_report_status(&include_status, &jstr,
+			hap_set_char_record_status(res_arr, &res_cnt,
 					aid, iid, HAP_STATUS_VAL_INVALID);
 			continue;
         }
 
         if (json_obj_get_strlen(jctx, "authData", &auth_data.len) == HAP_SUCCESS) {
-            auth_data.data = hap_platform_memory_calloc(1, auth_data.len + 1);
+            auth_data.data = hap_req_arena_calloc(1, auth_data.len + 1);
+            if (!auth_data.data) {
+                hap_set_char_record_status(res_arr, &res_cnt,
+                        aid, iid, HAP_STATUS_OO_RES);
+                continue;
+            }
             json_obj_get_string(jctx, "authData", (char *)auth_data.data, auth_data.len + 1);
             esp_mfi_base64_decode((const char *)auth_data.data, auth_data.len, (char *)auth_data.data, auth_data.len + 1, &auth_data.len);
         }
@@ -849,39 +1157,47 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
         write_arr[char_cnt].auth_data = auth_data;
         write_arr[char_cnt].remote = remote;
         write_arr[char_cnt].write_response = response;
-        write_arr[char_cnt].status = &status_arr[char_cnt];
+        write_arr[char_cnt].status = &res_arr[res_cnt].status;
 		char_cnt++;
+        res_arr[res_cnt].aid = aid;
+        res_arr[res_cnt].iid = iid;
+        res_arr[res_cnt].hc = hc;
+        res_arr[res_cnt].write_response = response;
+        res_cnt++;
 	}
+	/* Anything other than the writes must be an error, to be reported */
+	if (res_cnt != char_cnt)
+		report = true;
 	if (!char_cnt)
 		goto set_char_end;
 
-	/* The logic here is to loop through all the saved characteristic
-	 * pointers, and invoke a single write callback for all consecutive
+	/* The logic here is to group the saved characteristic pointers by service,
+	 * loop through them, and invoke a single write callback for all the
 	 * characteristics of the same service.
 	 * The write callback will be invoked if the service changes or
 	 * if the last characteristic in the array is reached
 	 */
+	hap_write_data_t *dispatch_arr = hap_http_group_writes_by_serv(write_arr, char_cnt);
 	int hs_index = 0;
-	bool write_err = false;
-    bool write_response = false;
-	__hap_serv_t *hs = (__hap_serv_t *)hap_char_get_parent(write_arr[0].hc);
+	__hap_serv_t *hs = (__hap_serv_t *)hap_char_get_parent(dispatch_arr[0].hc);
 	/* The counter here will go till char_cnt instead of char_cnt - 1.
 	 * When i == char_cnt, it will mean that all elements in the array
 	 * have been looped through.
 	 * So, last iteration will invoke the write callback for the last
 	 * set of characteritics.
 	 */
+    hap_write_exec_begin();
 	for (i = 0; i <= char_cnt; i++) {
         /* Explicitly checking for i < char_cnt because this loop runs till
          * char_cnt (because of logic mentioned above) which is actually
-         * outside the write_arr.
+         * outside the dispatch_arr.
          */
         if (i < char_cnt) {
-            if (write_arr[i].write_response) {
-                write_response = true;
+            if (dispatch_arr[i].write_response) {
+                report = true;
             }
         }
-		if ((i < char_cnt) && ((hap_serv_t *)hs == hap_char_get_parent(write_arr[i].hc)))
+		if ((i < char_cnt) && ((hap_serv_t *)hs == hap_char_get_parent(dispatch_arr[i].hc)))
 			continue;
 		else {
 			/* Passing the pointers to the first elements of the array
@@ -889,65 +1205,42 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
 			 * Number of elements of the array are indicated by
 			 * i - hs_index
 			 */
-			if (hs->write_cb(&write_arr[hs_index], i - hs_index,
+			if (hs->write_cb(&dispatch_arr[hs_index], i - hs_index,
 					hs->priv, hap_platform_httpd_get_sess_ctx(req)) != HAP_SUCCESS)
-				write_err = true;
+				report = true;
 			if (i < char_cnt) {
-				hs = (__hap_serv_t *)hap_char_get_parent(write_arr[i].hc);
+				hs = (__hap_serv_t *)hap_char_get_parent(dispatch_arr[i].hc);
 				hs_index = i;
 			}
 		}
 	}
-	if (write_err || include_status || write_response) {
-		for (i = 0; i < char_cnt; i++) {
-            /* TODO: The code to get aid looks complex. Simplify */
-            if (write_arr[i].write_response && (*write_arr[i].status == HAP_STATUS_SUCCESS)) {
-                hap_set_char_report_write_response(&include_status, &jstr,
-                        ((__hap_acc_t *)hap_serv_get_parent(hap_char_get_parent(write_arr[i].hc)))->aid,
-                        ((__hap_char_t *)(write_arr[i].hc))->iid, (__hap_char_t *)(write_arr[i].hc));
-                continue;
-            }
-            hap_set_char_report_status(&include_status, &jstr,
-                    ((__hap_acc_t *)hap_serv_get_parent(hap_char_get_parent(write_arr[i].hc)))->aid,
-                    ((__hap_char_t *)(write_arr[i].hc))->iid, *write_arr[i].status);
-		}
-	}
+    /* Writes deferred by the callbacks are completed by the executor, and the response
+     * goes out only after that.
+     */
+    hap_write_job_t *jobs = hap_write_exec_end();
+    if (jobs) {
+        if (hap_set_char_defer(fd, session, res_arr, res_cnt, report, jobs) == HAP_SUCCESS) {
+            *deferred = true;
+            return HAP_SUCCESS;
+        }
+        report = true;
+    }
+    for (i = 0; i < res_cnt; i++) {
+        if (res_arr[i].status != HAP_STATUS_SUCCESS)
+            report = true;
+    }
 
-	int ret = HAP_SUCCESS;
 set_char_end:
-	if (include_status) {
-		json_gen_pop_array(&jstr);
-		json_gen_end_object(&jstr);
-		json_gen_str_end(&jstr);
-		ret = HAP_FAIL;
-	}
-
-	if (write_arr) {
-		for (i = 0; i < char_cnt; i++) {
-			if (((__hap_char_t *)write_arr[i].hc)->format == HAP_CHAR_FORMAT_STRING) {
-				if (write_arr[i].val.s) {
-                    hap_platform_memory_free(write_arr[i].val.s);
-                }
-			} else if ((((__hap_char_t *)write_arr[i].hc)->format == HAP_CHAR_FORMAT_DATA) ||
-                    (((__hap_char_t *)write_arr[i].hc)->format == HAP_CHAR_FORMAT_TLV8)) {
-                    hap_platform_memory_free(write_arr[i].val.d.buf);
-            }
-            if (write_arr[i].auth_data.data) {
-                hap_platform_memory_free(write_arr[i].auth_data.data);
-            }
-		}
-	}
-	if (write_arr)
-		hap_platform_memory_free(write_arr);
-	if (status_arr)
-		hap_platform_memory_free(status_arr);
-	return ret;
+    hap_http_send_set_char_resp(fd, res_arr, res_cnt, report);
+	/* The arrays and the values are in the request arena, and so, get released
+	 * along with it.
+	 */
+	return report ? HAP_FAIL : HAP_SUCCESS;
 }
 
 static int hap_http_put_characteristics(httpd_req_t *req)
 {
     char stack_inbuf[512] = {0};
-    char outbuf[512] = {0};
     char *heap_inbuf = NULL;
     char *inbuf = stack_inbuf;
 
@@ -995,25 +1288,11 @@ static int hap_http_put_characteristics(httpd_req_t *req)
 		return httpd_resp_send(req, NULL, 0);
 	}
 
-	httpd_resp_set_type(req, "application/hap+json");
-	/* Setting response type to indicate error.
-	 * This will be actually sent out only if there is some error
-	 * to be reported while handling the characteristic writes.
-	 * Else, the response type will be set to 204
+	/* The response is 204 if all the writes succeeded, else 207 with the status of
+	 * each characteristic.
 	 */
-	httpd_resp_set_status(req, HTTPD_207);
-	if (hap_http_handle_set_char(&jctx, outbuf, sizeof(outbuf), req) == HAP_SUCCESS)
-	{
-		snprintf(outbuf, sizeof(outbuf), "HTTP/1.1 %s\r\n\r\n", HTTPD_204);
-		httpd_send(req, outbuf, strlen(outbuf));
-	} else {
-        /* If a failure was encountered, it would mean that a response has been generated,
-         * which will be chunk encoded. So, sending the last chunk here and also printing
-         * a new line to end the prints of the error string.
-         */
-        httpd_resp_send_chunk(req, NULL, 0);
-        ESP_MFI_DEBUG_PLAIN("\n");
-    }
+	bool deferred = false;
+	hap_http_handle_set_char(&jctx, req, &deferred);
     json_parse_end(&jctx);
 
     if (heap_inbuf) {
@@ -1021,7 +1300,10 @@ static int hap_http_put_characteristics(httpd_req_t *req)
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Freed allocated buffer for PUT");
     }
 
-    hap_report_event(HAP_EVENT_SET_CHAR_COMPLETED, NULL, 0);
+    /* For a deferred response, the event is reported once it is sent */
+    if (!deferred) {
+        hap_report_event(HAP_EVENT_SET_CHAR_COMPLETED, NULL, 0);
+    }
     return HAP_SUCCESS;
 }
 
@@ -1048,10 +1330,15 @@ static int hap_http_get_characteristics(httpd_req_t *req)
     if (!hap_is_req_secure(session)) {
         return hap_http_session_not_authorized(req);
     }
+    /* Assume a Multi-Status response till all the values have been read */
+    hap_http_stream_t stream;
+    if (hap_http_stream_init(&stream, httpd_req_to_sockfd(req), HTTPD_207) != HAP_SUCCESS) {
+        return HAP_FAIL;
+    }
     const char *uri = hap_platform_httpd_get_req_uri(req);
-    /* Allocate on heap, if URI is longer */
+    /* Allocate from the request arena, if URI is longer */
     if (strlen(uri) > sizeof(stack_val_buf)) {
-        heap_val_buf = hap_platform_memory_calloc(strlen(uri) + 1, 1); /* Allocating an extra byte for NULL termination */
+        heap_val_buf = hap_req_arena_calloc(strlen(uri) + 1, 1); /* Allocating an extra byte for NULL termination */
         if (!heap_val_buf) {
             ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to read URL");
             httpd_resp_set_status(req, HTTPD_500);
@@ -1062,7 +1349,7 @@ static int hap_http_get_characteristics(httpd_req_t *req)
         val = heap_val_buf;
     }
     size_t url_query_str_len = httpd_req_get_url_query_len(req);
-    char * url_query_str = hap_platform_memory_calloc(1, url_query_str_len + 1);
+    char * url_query_str = hap_req_arena_calloc(1, url_query_str_len + 1);
     if (!url_query_str) {
 		httpd_resp_set_status(req, HTTPD_400);
 		httpd_resp_set_type(req, "application/hap+json");
@@ -1111,7 +1398,7 @@ static int hap_http_get_characteristics(httpd_req_t *req)
 	 * So, it is better to maintain a list of characteristics pointers,
 	 * read all the values, and only then create the response
 	 */
-	hap_read_data_t *read_arr = hap_platform_memory_calloc(char_cnt, sizeof(hap_read_data_t));
+	hap_read_data_t *read_arr = hap_req_arena_calloc(char_cnt, sizeof(hap_read_data_t));
     if (!read_arr) {
 		httpd_resp_set_status(req, HTTPD_500);
 		httpd_resp_set_type(req, "application/hap+json");
@@ -1119,9 +1406,8 @@ static int hap_http_get_characteristics(httpd_req_t *req)
 		httpd_resp_send(req, outbuf, strlen(outbuf));
         goto get_char_return;
     }
-    hap_status_t *status_codes = hap_platform_memory_calloc(char_cnt, sizeof(hap_status_t));
+    hap_status_t *status_codes = hap_req_arena_calloc(char_cnt, sizeof(hap_status_t));
     if (!status_codes) {
-        hap_platform_memory_free(read_arr);
 		httpd_resp_set_status(req, HTTPD_500);
 		httpd_resp_set_type(req, "application/hap+json");
 		snprintf(outbuf, sizeof(outbuf),"{\"status\":-70407}");
@@ -1130,12 +1416,13 @@ static int hap_http_get_characteristics(httpd_req_t *req)
     }
 
     ESP_MFI_DEBUG_PLAIN("Generating HTTP Response\n");
-	/* Generate the JSON response */
+	/* Generate the JSON response. Nothing goes out till the staging buffer of the
+	 * stream is full. Before the response status is final, only the status entries
+	 * below can fill it, and those mean a 207 anyway.
+	 */
 	bool include_status = 0;
-	httpd_resp_set_status(req, HTTPD_207);
-	httpd_resp_set_type(req, "application/hap+json");
 	json_gen_str_t jstr;
-	json_gen_str_start(&jstr, outbuf, sizeof(outbuf), hap_http_json_flush_chunk, req);
+	hap_http_stream_json_start(&stream, &jstr);
 
 	/* Get the ids once again. Not checking for success since that
 	 * would be redundant
@@ -1153,7 +1440,7 @@ static int hap_http_get_characteristics(httpd_req_t *req)
 		p = strsep(&val_ptr, ",");
 		iid = atoi(p);
 		p = strsep(&val_ptr, ".");
-		hap_char_t *hc = hap_acc_get_char_by_iid(hap_acc_get_by_aid(aid), iid);
+		hap_char_t *hc = hap_get_char_by_aid_iid(aid, iid);
 		if (!hc) {
 			hap_set_char_report_status(&include_status, &jstr,
 					aid, iid, HAP_STATUS_RES_ABSENT);
@@ -1214,7 +1501,7 @@ static int hap_http_get_characteristics(httpd_req_t *req)
              * were no errors.
              * So, set response type to 200 OK
              */
-            httpd_resp_set_status(req, HTTPD_200);
+            stream.status = HTTPD_200;
         }
         json_gen_start_object(&jstr);
         json_gen_push_array(&jstr, "characteristics");
@@ -1266,36 +1553,24 @@ static int hap_http_get_characteristics(httpd_req_t *req)
 get_char_end:
 	json_gen_pop_array(&jstr);
 	json_gen_end_object(&jstr);
-	json_gen_str_end(&jstr);
-
-	hap_platform_memory_free(read_arr);
-    hap_platform_memory_free(status_codes);
-
-    /* This indicates the last chunk */
-    httpd_resp_send_chunk(req, NULL, 0);
-    ESP_MFI_DEBUG_PLAIN("\n");
+	hap_http_stream_json_end(&stream, &jstr);
+    hap_http_stream_end(&stream);
 get_char_return:
-    if (heap_val_buf) {
-        hap_platform_memory_free(heap_val_buf);
-        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Freed allocated buffer for GET");
-    }
-
-    if (url_query_str) {
-        hap_platform_memory_free(url_query_str);
-    }
-
+    /* All the buffers are in the request arena, which gets reset by the caller */
     hap_report_event(HAP_EVENT_GET_CHAR_COMPLETED, NULL, 0);
 	return HAP_SUCCESS;
 }
 static struct httpd_uri hap_characteristics_get = {
 	.uri = "/characteristics",
     .method = HTTP_GET,
-    .handler = hap_http_get_characteristics,
+    .handler = hap_http_tx_combined_handler,
+    .user_ctx = hap_http_get_characteristics,
 };
 static struct httpd_uri hap_characteristics_put = {
 	.uri = "/characteristics",
     .method = HTTP_PUT,
-    .handler = hap_http_put_characteristics,
+    .handler = hap_http_tx_combined_handler,
+    .user_ctx = hap_http_put_characteristics,
 };
 
 static int hap_http_pairings_handler(httpd_req_t *req)
@@ -1319,7 +1594,8 @@ static int hap_http_pairings_handler(httpd_req_t *req)
 static struct httpd_uri hap_pairings = {
 	.uri = "/pairings",
     .method = HTTP_POST,
-    .handler = hap_http_pairings_handler,
+    .handler = hap_http_tx_combined_handler,
+    .user_ctx = hap_http_pairings_handler,
 };
 
 static int hap_http_post_identify(httpd_req_t *req)
@@ -1390,7 +1666,8 @@ static int hap_http_put_prepare(httpd_req_t *req)
 static struct httpd_uri hap_prepare = {
 	.uri = "/prepare",
     .method = HTTP_PUT,
-    .handler = hap_http_put_prepare,
+    .handler = hap_http_tx_combined_handler,
+    .user_ctx = hap_http_put_prepare,
 };
 
 static void hap_send_notification(void *arg)
@@ -1404,83 +1681,89 @@ static void hap_send_notification(void *arg)
     }
 
     int i, num_notif_chars;
-    for (i = 0; i < num_char; i++) {
-        hc = hap_get_pending_notif_char();
-        if (hc) {
-            char_arr[i] = hc;
-        } else {
-            break;
-        }
-    }
+    num_notif_chars = hap_get_pending_notif_chars(char_arr, num_char);
     /* If no characteristic notifications are pending, free char_arr and exit */ 
-    if (i == 0) {
+    if (num_notif_chars == 0) {
 	hap_platform_memory_free(char_arr); 
         return;
     }
-    num_notif_chars = i;
-	hap_secure_session_t *session;
+    /* Work out the characteristics to be reported to each session, as a bitmap of
+     * indices into char_arr. Sessions with identical bitmaps form a group, for which
+     * the notification is serialized just once.
+     */
+    int num_words = (num_notif_chars + 31) / 32;
+    uint32_t *notif_map = hap_platform_memory_calloc(HAP_MAX_SESSIONS * num_words, sizeof(uint32_t));
+    if (!notif_map) {
+        hap_platform_memory_free(char_arr);
+        return;
+    }
     /* Flag to indicate if any controller was connected */
     bool ctrl_connected = false;
-	char buf[250];
-	for (i = 0; i < HAP_MAX_SESSIONS; i++) {
-		session = hap_priv.sessions[i];
-		if (!session)
-			continue;
+    bool notif_to_send = false;
+    int j;
+    for (i = 0; i < HAP_MAX_SESSIONS; i++) {
+        if (!hap_priv.sessions[i])
+            continue;
         ctrl_connected = true;
-		int fd = session->conn_identifier;
-#define HTTPD_HDR_STR      "EVENT/1.0 200 OK\r\n"                   \
-		"Content-Type: application/hap+json\r\n"           \
-		"Content-Length: %d\r\n"
-		char notif_json[1024];
-		json_gen_str_t jstr;
-		json_gen_str_start(&jstr, notif_json, sizeof(notif_json), NULL, NULL);
-		json_gen_start_object(&jstr);
-		json_gen_push_array(&jstr, "characteristics");
-
-        int j;
-        bool notif_to_send = false;
+        uint32_t *map = &notif_map[i * num_words];
+        bool hold = hap_set_char_defer_pending(hap_priv.sessions[i]);
         for (j = 0; j < num_notif_chars; j++) {
             hc = char_arr[j];
-            __hap_char_t *_hc = ( __hap_char_t *)hc;
             /* If the controller is the owner, dont send notification to it */
             if (hap_char_is_ctrl_owner(hc, i)) {
                 /* Since there can be only one owner, which we are anyways skipping,
                  * we can reset owner value to 0
                  */
-                _hc->owner_ctrl = 0;
+                ((__hap_char_t *)hc)->owner_ctrl = 0;
                 continue;
             }
             if (!hap_char_is_ctrl_subscribed(hc, i))
                 continue;
-
-            json_gen_start_object(&jstr);
-            hap_acc_t *ha = hap_serv_get_parent(hap_char_get_parent(hc));
-            int aid = ((__hap_acc_t *)ha)->aid;
-            json_gen_obj_set_int(&jstr, "aid", aid);
-            json_gen_obj_set_int(&jstr, "iid", _hc->iid);
-            hap_add_char_val_json(_hc->format, "value", &_hc->val, &jstr);
-            json_gen_end_object(&jstr);
+            /* An EVENT cannot go out ahead of a deferred write response on the
+             * same connection. It is sent once the response is.
+             */
+            if (hold) {
+                hap_char_hold_notif(hc, i);
+                continue;
+            }
+            map[j / 32] |= (1U << (j % 32));
             notif_to_send = true;
         }
-        if (!notif_to_send) {
+    }
+    /* Sessions to which the notification has already been sent */
+    uint16_t sent_sessions = 0;
+    char notif_json[HAP_NOTIF_JSON_SIZE];
+    for (i = 0; notif_to_send && (i < HAP_MAX_SESSIONS); i++) {
+        uint32_t *map = &notif_map[i * num_words];
+        if (!hap_priv.sessions[i] || (sent_sessions & (1 << i)))
+            continue;
+        bool empty = true;
+        for (j = 0; j < num_words; j++) {
+            if (map[j]) {
+                empty = false;
+                break;
+            }
+        }
+        if (empty) {
             /* No notification required for this controller. Just continue */
             continue;
         }
+        hap_prepare_notif_json(notif_json, sizeof(notif_json), char_arr, num_notif_chars, map);
 
-        json_gen_pop_array(&jstr);
-		json_gen_end_object(&jstr);
-		json_gen_str_end(&jstr);
-
-		snprintf(buf, sizeof(buf), HTTPD_HDR_STR,
-				strlen(notif_json));
-		hap_httpd_send(hap_priv.server, fd, buf, strlen(buf), 0);
-		/* Space for sending additional headers based on set_header */
-		hap_httpd_send(hap_priv.server, fd, "\r\n", strlen("\r\n"), 0);
-		hap_httpd_send(hap_priv.server, fd, notif_json, strlen(notif_json), 0);
-        httpd_sess_update_lru_counter(hap_priv.server, fd);
-		ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Notification Sent");
-        ESP_MFI_DEBUG_PLAIN("Socket fd: %d; Event message: %s\n", fd, notif_json);
+        /* Send the same message to all the sessions in this group. Only the
+         * encryption is per session.
+         */
+        int k;
+        for (k = i; k < HAP_MAX_SESSIONS; k++) {
+            if (!hap_priv.sessions[k] || (sent_sessions & (1 << k)))
+                continue;
+            if ((k != i) && memcmp(&notif_map[k * num_words], map, num_words * sizeof(uint32_t)))
+                continue;
+            sent_sessions |= (1 << k);
+            hap_send_notif_frame(hap_priv.sessions[k]->conn_identifier, notif_json);
+        }
 	}
+    hap_platform_memory_free(notif_map);
     /* If no controller was connected and no disconnected event was sent,
      * reannaounce mDNS. That will increment state number as required
      * by HAP Spec R15.
@@ -1495,11 +1778,13 @@ static void hap_send_notification(void *arg)
 void hap_http_debug_enable()
 {
     http_debug = true;
+    hap_http_stream_debug_enable(true);
 }
 
 void hap_http_debug_disable()
 {
     http_debug = false;
+    hap_http_stream_debug_enable(false);
 }
 
 void hap_http_send_notif()
@@ -1507,6 +1792,26 @@ void hap_http_send_notif()
 	httpd_queue_work(hap_priv.server, hap_send_notification, NULL);
 }
 
+static void hap_rebuild_acc_index(void *arg)
+{
+    hap_acc_index_build();
+}
+
+void hap_http_rebuild_acc_index()
+{
+    /* Without a server, hap_start() is yet to build the index */
+    if (!hap_priv.server) {
+        return;
+    }
+    /* Rebuilding from the HTTP Server task, since all the lookups happen there and the
+     * old index gets freed. If that fails, the index just stays invalid and the lookups
+     * keep walking the lists.
+     */
+    if (httpd_queue_work(hap_priv.server, hap_rebuild_acc_index, NULL) != ESP_OK) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Failed to queue accessory index rebuild");
+    }
+}
+
 static bool hap_http_registered;
 int hap_register_http_handlers()
 {
@@ -0,0 +1,139 @@
+ /*
+  * ESPRESSIF MIT License
+  *
+  * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+  *
+  * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+  * it is free of charge, to any person obtaining a copy of this software and associated
+  * documentation files (the "Software"), to deal in the Software without restriction, including
+  * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+  * to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all copies or
+  * substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+  * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+  * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+  * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+  *
+  */
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <sodium/crypto_scalarmult_curve25519.h>
+#include <sodium/utils.h>
+#include <esp_mfi_debug.h>
+#include <esp_mfi_rand.h>
+#include <hap.h>
+#include <hap_platform_os.h>
+#include <esp_hap_keypair_pool.h>
+
+#define HAP_KEYPAIR_POOL_TASK_STACK     3072
+/* Just above idle, so that the pool gets refilled only when nothing else needs the CPU */
+#define HAP_KEYPAIR_POOL_TASK_PRIORITY  (tskIDLE_PRIORITY + 1)
+
+/* A zero sized array is not valid C, so keep one slot even if the pool is disabled */
+#define HAP_KEYPAIR_POOL_SLOTS  (CONFIG_HAP_KEYPAIR_POOL_SIZE ? CONFIG_HAP_KEYPAIR_POOL_SIZE : 1)
+
+/* The pool is a plain array rather than a queue, so that a slot is wiped as soon as
+ * its key pair is taken, instead of the secret key lingering in the queue storage.
+ * The refill task waits for a notification from hap_keypair_pool_get() while it is full.
+ * The lock guards the array, the count and the stats.
+ */
+static hap_curve_keypair_t hap_keypair_pool[HAP_KEYPAIR_POOL_SLOTS];
+static int hap_keypair_pool_count;
+static TaskHandle_t hap_keypair_pool_task_handle;
+static hap_keypair_pool_stats_t hap_keypair_pool_stats;
+static portMUX_TYPE hap_keypair_pool_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static int hap_curve_keypair_generate(hap_curve_keypair_t *kp)
+{
+    esp_mfi_get_random(kp->sk, CURVE_KEY_LEN);
+    /* This particular value of basepoint is required to generate the public key
+     * from secret key
+     */
+    uint8_t basepoint[32] = {9};
+    if (crypto_scalarmult_curve25519(kp->pk, kp->sk, basepoint) == -1) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Curve25519 Error");
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
+static void hap_keypair_pool_task(void *arg)
+{
+    hap_curve_keypair_t kp;
+    while (1) {
+        portENTER_CRITICAL_SAFE(&hap_keypair_pool_lock);
+        bool full = (hap_keypair_pool_count == CONFIG_HAP_KEYPAIR_POOL_SIZE);
+        portEXIT_CRITICAL_SAFE(&hap_keypair_pool_lock);
+        if (full) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        if (hap_curve_keypair_generate(&kp) == HAP_SUCCESS) {
+            portENTER_CRITICAL_SAFE(&hap_keypair_pool_lock);
+            hap_keypair_pool[hap_keypair_pool_count++] = kp;
+            hap_keypair_pool_stats.generated++;
+            portEXIT_CRITICAL_SAFE(&hap_keypair_pool_lock);
+        }
+        sodium_memzero(&kp, sizeof(kp));
+        vTaskDelay(CONFIG_HAP_KEYPAIR_POOL_REFILL_INTERVAL / hap_platform_os_get_msec_per_tick());
+    }
+}
+
+int hap_keypair_pool_start(void)
+{
+    if ((CONFIG_HAP_KEYPAIR_POOL_SIZE == 0) || hap_keypair_pool_task_handle) {
+        return HAP_SUCCESS;
+    }
+    if (xTaskCreate(hap_keypair_pool_task, "hap-keypair-pool", HAP_KEYPAIR_POOL_TASK_STACK,
+                NULL, HAP_KEYPAIR_POOL_TASK_PRIORITY, &hap_keypair_pool_task_handle) != pdPASS) {
+        hap_keypair_pool_task_handle = NULL;
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
+int hap_keypair_pool_get(hap_curve_keypair_t *kp)
+{
+    uint32_t misses;
+    portENTER_CRITICAL_SAFE(&hap_keypair_pool_lock);
+    bool hit = (hap_keypair_pool_count > 0);
+    if (hit) {
+        hap_curve_keypair_t *slot = &hap_keypair_pool[--hap_keypair_pool_count];
+        *kp = *slot;
+        sodium_memzero(slot, sizeof(*slot));
+        hap_keypair_pool_stats.hits++;
+    } else {
+        hap_keypair_pool_stats.misses++;
+    }
+    misses = hap_keypair_pool_stats.misses;
+    portEXIT_CRITICAL_SAFE(&hap_keypair_pool_lock);
+
+    if (hit) {
+        /* The pool was possibly full, in which case the refill task is waiting for this */
+        xTaskNotifyGive(hap_keypair_pool_task_handle);
+        return HAP_SUCCESS;
+    }
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Key pair pool empty. Generating one (misses: %"PRIu32")",
+            misses);
+    return hap_curve_keypair_generate(kp);
+}
+
+void hap_keypair_pool_get_stats(hap_keypair_pool_stats_t *stats)
+{
+    if (!stats) {
+        return;
+    }
+    portENTER_CRITICAL_SAFE(&hap_keypair_pool_lock);
+    *stats = hap_keypair_pool_stats;
+    stats->available = hap_keypair_pool_count;
+    portEXIT_CRITICAL_SAFE(&hap_keypair_pool_lock);
+}
@@ -40,6 +40,9 @@
 #include <esp_hap_wac.h>
 #include <esp_hap_bct_priv.h>
 #include <esp_hap_pair_verify.h>
+#include <esp_hap_pair_setup.h>
+#include <esp_hap_keypair_pool.h>
+#include <esp_hap_hkdf.h>
 #include <hap_platform_os.h>
 
 static QueueHandle_t xQueue;
@@ -59,6 +62,7 @@ static void hap_nw_configured_sm(hap_internal_event_t event, hap_state_t *state)
             hap_mdns_announce(false);
             break;
         case HAP_INTERNAL_EVENT_CONFIG_NUM_UPDATED:
+            hap_http_rebuild_acc_index();
             hap_increment_and_save_config_num();
             hap_mdns_announce(false);
             break;
@@ -102,6 +106,7 @@ static void hap_common_sm(hap_internal_event_t event)
             hap_close_all_sessions();
             hap_mdns_deannounce();
             hap_keystore_erase_all_data();
+            hap_wipe_accessory_keys();
             reboot_reason = HAP_REBOOT_REASON_RESET_TO_FACTORY;
             break;
         case HAP_INTERNAL_EVENT_RESET_HOMEKIT_DATA:
@@ -277,6 +282,12 @@ int hap_init(hap_transport_t method)
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HAP Database Init failed");
         return ret;
     }
+
+    ret = hap_hkdf_init();
+    if (ret != HAP_SUCCESS) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HAP HKDF Init failed");
+        return ret;
+    }
     ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HAP Initialization succeeded. Version : %s", hap_get_version());
 
     return ret;
@@ -356,6 +367,11 @@ int hap_start(void)
          return ret;
     }
 
+    /* Without the index, the lookups just walk the lists till the next rebuild */
+    if (hap_acc_index_build() != HAP_SUCCESS) {
+         ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Accessory index build failed");
+    }
+
     ret = hap_httpd_start();
     if (ret != HAP_SUCCESS) {
          ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HTTPD START Failed [%d]", ret);
@@ -379,11 +395,20 @@ int hap_start(void)
         return ret;
     }
 
+    ret = hap_pair_setup_prepare();
+    if (ret != HAP_SUCCESS) {
+        return ret;
+    }
+
     ret = hap_ip_services_start();
     if (ret != 0) {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HAP IP Services Start Failed [%d]", ret);
         return ret;
     }
+    /* Pair Verify works even without the pool, just slower */
+    if (hap_keypair_pool_start() != HAP_SUCCESS) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Failed to start the key pair pool");
+    }
     ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HAP Started");
     hap_started = true;
     return HAP_SUCCESS;
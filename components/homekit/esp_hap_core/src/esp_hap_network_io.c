@@ -23,35 +23,26 @@
  */
 #include <stdint.h>
 #include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
 #include <sys/socket.h>
 
 #include <sodium/crypto_aead_chacha20poly1305.h>
 #include <byte_convert.h>
+#include <hap_platform_memory.h>
 
 #include <esp_mfi_debug.h>
 #include <hap.h>
 #include <esp_hap_database.h>
 #include <esp_hap_pair_common.h>
 #include <esp_hap_pair_verify.h>
+#include <esp_hap_network_io.h>
 
-#define HAP_MAX_NW_FRAME_SIZE	1024 /* As per HAP Specifications */
-#define AUTH_TAG_LEN            16
-typedef struct {
-	uint8_t pkt_size[2];
-	uint8_t data[HAP_MAX_NW_FRAME_SIZE];
-	/* The Poly auth tag buffer will get used only if the data length is
-	 * greater than HAP_MAX_NW_FRAME_SIZE - 16.
-	 * Else, the auth tag would be included in the data buffer itself
-	 */
-	uint8_t poly_auth_tag[AUTH_TAG_LEN];
-} hap_encrypt_frame_t;
-
-typedef struct {
-	uint16_t pkt_size;
-	uint16_t bytes_read;
-	uint8_t data[HAP_MAX_NW_FRAME_SIZE + AUTH_TAG_LEN];
-	hap_secure_session_t *session;
-} hap_decrypt_frame_t;
+/* Receive frames are owned per session, so that interleaved reads from
+ * multiple controllers do not reset each other's partially consumed frames.
+ * A frame with a NULL session is free.
+ */
+static hap_decrypt_frame_t hap_decrypt_frame_pool[HAP_MAX_SESSIONS];
 
 typedef int (*hap_decrypt_read_fn_t) (uint8_t *buf, int buf_size, void *context);
 static int min(int val1, int val2)
@@ -105,6 +96,18 @@ static int hap_session_error(hap_secure_session_t *session)
 	return HAP_FAIL;
 }
 
+static int hap_read_full(hap_decrypt_read_fn_t read_fn, void *context, uint8_t *buf, int len)
+{
+	while (len) {
+		int num_bytes = read_fn(buf, len, context);
+		if (num_bytes <= 0)
+			return HAP_FAIL;
+		buf += num_bytes;
+		len -= num_bytes;
+	}
+	return HAP_SUCCESS;
+}
+
 int hap_decrypt_data(hap_decrypt_frame_t *frame, hap_secure_session_t *session,
 	void *buf, int buf_size, hap_decrypt_read_fn_t read_fn, void *context)
 {
@@ -115,61 +118,341 @@ int hap_decrypt_data(hap_decrypt_frame_t *frame, hap_secure_session_t *session,
 		frame->session = session;
 	}
 	if ((frame->pkt_size - frame->bytes_read) == 0) {
-		if (read_fn(frame->data, 2, context) < 2)
+		uint8_t len_buf[2];
+		if (hap_read_full(read_fn, context, len_buf, sizeof(len_buf)) != HAP_SUCCESS)
 			return hap_session_error(session);
 
-		frame->pkt_size = get_u16_le(frame->data);
+		uint16_t pkt_size = get_u16_le(len_buf);
+		if (pkt_size > HAP_MAX_NW_FRAME_SIZE) {
+			ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Invalid frame size %u", pkt_size);
+			return hap_session_error(session);
+		}
+		frame->pkt_size = 0;
 		frame->bytes_read = 0;
-		uint16_t bytes_to_read = frame->pkt_size + AUTH_TAG_LEN; /* +AUTH_TAG_LEN as the receivedd packet will also have the auth Tag */
-		while (bytes_to_read) {
-			int num_bytes = read_fn(&frame->data[frame->bytes_read],
-					bytes_to_read, context);
-			if (num_bytes <= 0)
+		frame->stats.frames++;
+		frame->stats.wire_bytes += 2 + pkt_size + AUTH_TAG_LEN;
+
+		/* If the caller can take the whole frame, read and decrypt it right there.
+		 * The authTag goes along if there is room for it, else to the staging buffer.
+		 * Otherwise, the frame is staged and handed out over multiple calls.
+		 */
+		uint8_t *data = frame->data;
+		uint8_t *tag = &frame->data[pkt_size];
+		if (buf_size >= pkt_size) {
+			data = buf;
+			tag = (buf_size >= pkt_size + AUTH_TAG_LEN) ? data + pkt_size : frame->data;
+		}
+		if (tag == data + pkt_size) {
+			if (hap_read_full(read_fn, context, data, pkt_size + AUTH_TAG_LEN) != HAP_SUCCESS)
 				return hap_session_error(session);
-			bytes_to_read -= num_bytes;
-			frame->bytes_read += num_bytes;
+		} else if ((hap_read_full(read_fn, context, data, pkt_size) != HAP_SUCCESS) ||
+				(hap_read_full(read_fn, context, tag, AUTH_TAG_LEN) != HAP_SUCCESS)) {
+			return hap_session_error(session);
 		}
-		frame->bytes_read -= AUTH_TAG_LEN; /* -AUTH_TAG_LEN to get only the data length */
 		uint8_t aad[2];
         int ret;
-		put_u16_le(aad, frame->pkt_size); /* Packet size is the AAD for AEAD */
+		put_u16_le(aad, pkt_size); /* Packet size is the AAD for AEAD */
         uint8_t newnonce[12];
         memset(newnonce, 0, sizeof newnonce);
         memcpy(newnonce+4, session->decrypt_nonce, 8);
-        ret = crypto_aead_chacha20poly1305_ietf_decrypt_detached(frame->data, NULL, frame->data, frame->pkt_size,
-                    &frame->data[frame->bytes_read], aad, 2, newnonce, session->decrypt_key);
-        if (ret != 0) { 
+        ret = crypto_aead_chacha20poly1305_ietf_decrypt_detached(data, NULL, data, pkt_size,
+                    tag, aad, 2, newnonce, session->decrypt_key);
+        if (ret != 0) {
 			ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "AEAD decryption failure");
 			return hap_session_error(session);
 		}
-		frame->bytes_read = 0;
 		/* Increment nonce after every frame */
 		int64_t int_nonce = get_u64_le(session->decrypt_nonce);
 		int_nonce++;
 		put_u64_le(session->decrypt_nonce, int_nonce);
+		if (data == buf) {
+			frame->stats.direct_frames++;
+			return pkt_size;
+		}
+		frame->pkt_size = pkt_size;
 	}
 	int bytes = min(frame->pkt_size - frame->bytes_read, buf_size);
 	memcpy(buf, &frame->data[frame->bytes_read], bytes);
 	frame->bytes_read += bytes;
+	frame->stats.copies++;
+	frame->stats.copied_bytes += bytes;
 	return bytes;
 }
 
+static hap_decrypt_frame_t *hap_decrypt_frame_get(hap_secure_session_t *session)
+{
+	if (session->rx_frame)
+		return session->rx_frame;
+	hap_decrypt_frame_t *frame = NULL;
+	int i;
+	for (i = 0; i < HAP_MAX_SESSIONS; i++) {
+		if (hap_decrypt_frame_pool[i].session == NULL) {
+			frame = &hap_decrypt_frame_pool[i];
+			break;
+		}
+	}
+	/* The pool is sized for the maximum number of active sessions, but a
+	 * session is not guaranteed a slot in hap_priv.sessions. Fall back to
+	 * the heap rather than failing the read.
+	 */
+	if (!frame) {
+		frame = hap_platform_memory_calloc(1, sizeof(hap_decrypt_frame_t));
+		if (!frame) {
+			ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to allocate decrypt frame");
+			return NULL;
+		}
+	}
+	frame->pkt_size = 0;
+	frame->bytes_read = 0;
+	frame->session = session;
+	session->rx_frame = frame;
+	return frame;
+}
+
+static hap_rx_stats_t hap_rx_last_stats;
+
+void hap_httpd_rx_request_done(int sockfd)
+{
+	hap_secure_session_t *session = httpd_sess_get_ctx(hap_priv.server, sockfd);
+	if (!session || !session->rx_frame)
+		return;
+	hap_decrypt_frame_t *frame = session->rx_frame;
+	hap_rx_last_stats = frame->stats;
+#ifdef CONFIG_HAP_LOG_REQUEST_STATS
+	ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Socket fd: %d; Received %"PRIu32" frame(s), %"PRIu32" decrypted in place, %"PRIu32" copies (%"PRIu32" bytes)",
+			sockfd, frame->stats.frames, frame->stats.direct_frames,
+			frame->stats.copies, frame->stats.copied_bytes);
+#endif /* CONFIG_HAP_LOG_REQUEST_STATS */
+	memset(&frame->stats, 0, sizeof(frame->stats));
+}
+
+void hap_httpd_rx_get_last_stats(hap_rx_stats_t *stats)
+{
+	if (stats)
+		*stats = hap_rx_last_stats;
+}
+
+void hap_decrypt_frame_release(hap_secure_session_t *session)
+{
+	if (!session || !session->rx_frame)
+		return;
+	hap_decrypt_frame_t *frame = session->rx_frame;
+	session->rx_frame = NULL;
+	/* Clearing the frame also wipes any plaintext left in it and, for pool
+	 * frames, marks the slot as free.
+	 */
+	memset(frame, 0, sizeof(hap_decrypt_frame_t));
+	if ((frame < hap_decrypt_frame_pool) ||
+			(frame >= hap_decrypt_frame_pool + HAP_MAX_SESSIONS))
+		hap_platform_memory_free(frame);
+}
+
+/* Write combining for the encrypted send path.
+ *
+ * All sends on HAP sessions happen from the HTTP server task, and a corked
+ * response is always flushed before the handler (or queued work) returns.
+ * Hence, a single staging area is enough for all sessions. Plaintext is
+ * accumulated directly in the data area of the next frame, the frame is
+ * sealed in place once it is full, and sealed frames go out with a single
+ * sendmsg() once all the slots are used up or on flush.
+ */
+typedef struct {
+	int sockfd;	/* -1 if no session is corked */
+	int flags;
+	hap_secure_session_t *session;
+	uint8_t num_sealed;
+	uint16_t cur_len;	/* Plaintext length in frames[num_sealed] */
+	uint16_t frame_len[CONFIG_HAP_TX_COMBINE_FRAMES];
+	hap_tx_stats_t stats;
+	hap_encrypt_frame_t frames[CONFIG_HAP_TX_COMBINE_FRAMES];
+} hap_tx_ctx_t;
+
+static hap_tx_ctx_t hap_tx_ctx = {
+	.sockfd = -1,
+};
+static hap_tx_stats_t hap_tx_last_stats;
+
+static void hap_tx_reset(hap_tx_ctx_t *tx)
+{
+	tx->sockfd = -1;
+	tx->session = NULL;
+	tx->num_sealed = 0;
+	tx->cur_len = 0;
+}
+
+static void hap_tx_seal(hap_tx_ctx_t *tx)
+{
+	hap_encrypt_frame_t *frame = &tx->frames[tx->num_sealed];
+	/* The plaintext is already in place. Encryption happens in place and the
+	 * authTag lands right after the data.
+	 */
+	hap_encrypt_data(frame, tx->session, frame->data, tx->cur_len);
+	tx->frame_len[tx->num_sealed] = tx->cur_len;
+	tx->stats.frames++;
+	tx->stats.wire_bytes += 2 + tx->cur_len + AUTH_TAG_LEN;
+	tx->num_sealed++;
+	tx->cur_len = 0;
+}
+
+static int hap_tx_send_sealed(hap_tx_ctx_t *tx)
+{
+	struct iovec iov[CONFIG_HAP_TX_COMBINE_FRAMES];
+	int i;
+	for (i = 0; i < tx->num_sealed; i++) {
+		iov[i].iov_base = &tx->frames[i];
+		iov[i].iov_len = 2 + tx->frame_len[i] + AUTH_TAG_LEN;
+	}
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = tx->num_sealed,
+	};
+	tx->num_sealed = 0;
+	while (msg.msg_iovlen) {
+		int ret = sendmsg(tx->sockfd, &msg, tx->flags);
+		if (ret <= 0) {
+			ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to send encrypted frames");
+			return HAP_FAIL;
+		}
+		tx->stats.send_calls++;
+		/* Skip over whatever got sent, in case of a partial write */
+		while (ret > 0) {
+			if ((size_t)ret >= msg.msg_iov->iov_len) {
+				ret -= msg.msg_iov->iov_len;
+				msg.msg_iov++;
+				msg.msg_iovlen--;
+			} else {
+				msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + ret;
+				msg.msg_iov->iov_len -= ret;
+				ret = 0;
+			}
+		}
+	}
+	return HAP_SUCCESS;
+}
+
+/* Seal the current frame and send out all sealed frames, if no slot is left */
+static int hap_tx_seal_frame(hap_tx_ctx_t *tx)
+{
+	hap_tx_seal(tx);
+	if (tx->num_sealed == CONFIG_HAP_TX_COMBINE_FRAMES)
+		return hap_tx_send_sealed(tx);
+	return HAP_SUCCESS;
+}
+
+static int hap_tx_append(hap_tx_ctx_t *tx, const uint8_t *buf, int buf_len)
+{
+	while (buf_len) {
+		int len = min(buf_len, HAP_MAX_NW_FRAME_SIZE - tx->cur_len);
+		memcpy(&tx->frames[tx->num_sealed].data[tx->cur_len], buf, len);
+		tx->cur_len += len;
+		tx->stats.payload_bytes += len;
+		buf += len;
+		buf_len -= len;
+		if (tx->cur_len == HAP_MAX_NW_FRAME_SIZE) {
+			if (hap_tx_seal_frame(tx) != HAP_SUCCESS)
+				return HAP_FAIL;
+		}
+	}
+	return HAP_SUCCESS;
+}
+
+int hap_httpd_tx_get_buf(int sockfd, int min_len, uint8_t **buf)
+{
+	hap_tx_ctx_t *tx = &hap_tx_ctx;
+	if ((tx->sockfd != sockfd) || (min_len > HAP_MAX_NW_FRAME_SIZE))
+		return HAP_FAIL;
+	/* Not enough room left. Seal the frame partially filled */
+	if ((HAP_MAX_NW_FRAME_SIZE - tx->cur_len) < min_len) {
+		if (hap_tx_seal_frame(tx) != HAP_SUCCESS)
+			return HAP_FAIL;
+	}
+	*buf = &tx->frames[tx->num_sealed].data[tx->cur_len];
+	return HAP_MAX_NW_FRAME_SIZE - tx->cur_len;
+}
+
+int hap_httpd_tx_put_buf(int sockfd, int len)
+{
+	hap_tx_ctx_t *tx = &hap_tx_ctx;
+	if ((tx->sockfd != sockfd) || (len > (HAP_MAX_NW_FRAME_SIZE - tx->cur_len)))
+		return HAP_FAIL;
+	tx->cur_len += len;
+	tx->stats.payload_bytes += len;
+	if (tx->cur_len == HAP_MAX_NW_FRAME_SIZE) {
+		if (hap_tx_seal_frame(tx) != HAP_SUCCESS)
+			return HAP_FAIL;
+	}
+	return HAP_SUCCESS;
+}
+
+int hap_httpd_tx_cork(int sockfd)
+{
+	hap_tx_ctx_t *tx = &hap_tx_ctx;
+	if (tx->sockfd == sockfd)
+		return HAP_SUCCESS;
+	hap_secure_session_t *session = httpd_sess_get_ctx(hap_priv.server, sockfd);
+	if (!session || (session->state != STATE_VERIFIED))
+		return HAP_FAIL;
+	/* Some other session is still corked. Push out its data first */
+	if (tx->sockfd >= 0)
+		hap_httpd_tx_flush(tx->sockfd);
+	tx->sockfd = sockfd;
+	tx->flags = 0;
+	tx->session = session;
+	memset(&tx->stats, 0, sizeof(tx->stats));
+	return HAP_SUCCESS;
+}
+
+int hap_httpd_tx_flush(int sockfd)
+{
+	hap_tx_ctx_t *tx = &hap_tx_ctx;
+	if (tx->sockfd != sockfd)
+		return HAP_SUCCESS;
+	int ret = HAP_SUCCESS;
+	/* The session may have been freed or invalidated since it was corked */
+	if ((httpd_sess_get_ctx(hap_priv.server, sockfd) != tx->session) ||
+			(tx->session->state != STATE_VERIFIED)) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Session gone. Dropping %"PRIu32" bytes",
+				tx->stats.payload_bytes);
+		ret = HAP_FAIL;
+	} else {
+		if (tx->cur_len)
+			hap_tx_seal(tx);
+		if (tx->num_sealed)
+			ret = hap_tx_send_sealed(tx);
+	}
+	hap_tx_last_stats = tx->stats;
+#ifdef CONFIG_HAP_LOG_REQUEST_STATS
+	ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Socket fd: %d; Sent %"PRIu32" bytes in %"PRIu32" frame(s), %"PRIu32" send call(s)",
+			sockfd, tx->stats.payload_bytes, tx->stats.frames, tx->stats.send_calls);
+#endif /* CONFIG_HAP_LOG_REQUEST_STATS */
+	hap_tx_reset(tx);
+	return ret;
+}
+
+void hap_httpd_tx_get_last_stats(hap_tx_stats_t *stats)
+{
+	if (stats)
+		*stats = hap_tx_last_stats;
+}
+
 int hap_httpd_send(httpd_handle_t hd, int sockfd, const char *buf, unsigned buf_len, int flags)
 {
 	hap_secure_session_t *session = httpd_sess_get_ctx(hap_priv.server, sockfd);
 	if (session && (session->state == STATE_VERIFIED)) {
-		uint8_t *buf_ptr = (uint8_t *)buf;
-		int tmp_buf_len = buf_len;
-		while (tmp_buf_len) {
-			hap_encrypt_frame_t encrypt_frame;
-			memset(&encrypt_frame, 0, sizeof(encrypt_frame));
-			int len = min(tmp_buf_len, HAP_MAX_NW_FRAME_SIZE);
-			int send_len = hap_encrypt_data(&encrypt_frame, session, buf_ptr, len);
-			if (send(sockfd, (uint8_t *)&encrypt_frame, send_len, flags) <= 0)
-				return HAP_FAIL;
-			tmp_buf_len -= len;
-			buf_ptr += len;
+		hap_tx_ctx_t *tx = &hap_tx_ctx;
+		/* If the session is not corked, cork it just for this buffer, so that
+		 * a large buffer still goes out with a single sendmsg()
+		 */
+		bool corked = (tx->sockfd == sockfd);
+		if (!corked && (hap_httpd_tx_cork(sockfd) != HAP_SUCCESS))
+			return HAP_FAIL;
+		tx->flags = flags;
+		if (hap_tx_append(tx, (const uint8_t *)buf, buf_len) != HAP_SUCCESS) {
+			hap_tx_reset(tx);
+			return HAP_FAIL;
 		}
+		if (!corked && (hap_httpd_tx_flush(sockfd) != HAP_SUCCESS))
+			return HAP_FAIL;
 		/* Return the total length at the end since this API expects so
 		 */
 		return buf_len;
@@ -179,11 +462,15 @@ int hap_httpd_send(httpd_handle_t hd, int sockfd, const char *buf, unsigned buf_
 
 int hap_httpd_recv(httpd_handle_t hd, int sockfd, char *buf, unsigned buf_len, int flags)
 {
-	static hap_decrypt_frame_t decrypt_frame;
 	hap_secure_session_t *session = httpd_sess_get_ctx(hap_priv.server, sockfd);
 	if (session) {
 		if (session->state == STATE_VERIFIED) {
-			return hap_decrypt_data(&decrypt_frame, session, buf, buf_len,
+			hap_decrypt_frame_t *decrypt_frame = hap_decrypt_frame_get(session);
+			if (!decrypt_frame) {
+				errno = ENOMEM;
+				return HAP_FAIL;
+			}
+			return hap_decrypt_data(decrypt_frame, session, buf, buf_len,
 					hap_httpd_raw_recv, &sockfd);
 		} else {
 			/* If the session state is invalid, we return an error.
@@ -27,6 +27,7 @@
 #include <inttypes.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/timers.h>
+#include <freertos/task.h>
 #include <mu_srp.h>
 #include <sodium/crypto_aead_chacha20poly1305.h>
 #include <hkdf-sha.h>
@@ -38,6 +39,7 @@
 #include <esp_hap_pair_common.h>
 #include <esp_hap_pair_setup.h>
 #include <esp_hap_pair_verify.h>
+#include <esp_hap_hkdf.h>
 #include <esp_hap_database.h>
 #include <esp_hap_main.h>
 #include <esp_hap_acc.h>
@@ -46,11 +48,8 @@
 /* Maximum attempts allowed for Pair Setup, as per HAP Specifications */
 #define HAP_PAIR_SETUP_MAX_ATTEMPTS	100
 
-#define PAIR_SETUP_ENCRYPT_SALT		"Pair-Setup-Encrypt-Salt"
 #define PAIR_SETUP_ENCRYPT_INFO		"Pair-Setup-Encrypt-Info"
-#define PAIR_SETUP_CTRL_SIGN_SALT	"Pair-Setup-Controller-Sign-Salt"
 #define PAIR_SETUP_CTRL_SIGN_INFO	"Pair-Setup-Controller-Sign-Info"
-#define PAIR_SETUP_ACC_SIGN_SALT	"Pair-Setup-Accessory-Sign-Salt"
 #define PAIR_SETUP_ACC_SIGN_INFO	"Pair-Setup-Accessory-Sign-Info"
 
 #define PS_CTX_INIT	1
@@ -90,11 +89,122 @@ void hap_stop_pairing_mode_timer(void)
     }
 }
 
+#ifdef CONFIG_HAP_SRP_SPECULATIVE_B
+#define HAP_SRP_SPEC_TASK_STACK     4096
+/* Just above idle, so that this never delays anything the user can see */
+#define HAP_SRP_SPEC_TASK_PRIORITY  (tskIDLE_PRIORITY + 1)
+
+/* g^b is by far the costliest part of M2 and does not depend on the controller.
+ * While the accessory is unpaired, a one-shot task computes it for the next
+ * attempt on a spare SRP handle, which M1 then takes over.
+ */
+static mu_srp_handle_t hap_srp_spec_hd;
+static bool hap_srp_spec_ready;
+static bool hap_srp_spec_running;
+static portMUX_TYPE hap_srp_spec_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void hap_srp_spec_task(void *arg)
+{
+    mu_srp_handle_t hd = {0};
+    bool ok = (mu_srp_init(&hd, MU_NG_3072) == 0) && (mu_srp_precompute_b(&hd) == 0);
+
+    portENTER_CRITICAL_SAFE(&hap_srp_spec_lock);
+    if (ok) {
+        hap_srp_spec_hd = hd;
+        hap_srp_spec_ready = true;
+    }
+    hap_srp_spec_running = false;
+    portEXIT_CRITICAL_SAFE(&hap_srp_spec_lock);
+
+    if (!ok) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Failed to precompute SRP public key");
+        mu_srp_free(&hd);
+    }
+    vTaskDelete(NULL);
+}
+
+static void hap_srp_spec_start(void)
+{
+    if (is_accessory_paired()) {
+        return;
+    }
+    portENTER_CRITICAL_SAFE(&hap_srp_spec_lock);
+    bool start = !hap_srp_spec_ready && !hap_srp_spec_running;
+    if (start) {
+        hap_srp_spec_running = true;
+    }
+    portEXIT_CRITICAL_SAFE(&hap_srp_spec_lock);
+    if (!start) {
+        return;
+    }
+    if (xTaskCreate(hap_srp_spec_task, "hap-srp-spec", HAP_SRP_SPEC_TASK_STACK,
+                NULL, HAP_SRP_SPEC_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Failed to start SRP precompute task");
+        portENTER_CRITICAL_SAFE(&hap_srp_spec_lock);
+        hap_srp_spec_running = false;
+        portEXIT_CRITICAL_SAFE(&hap_srp_spec_lock);
+    }
+}
+
+/* Moves the precomputed handle, if any, into hd and starts computing the next one */
+static void hap_srp_spec_take(mu_srp_handle_t *hd)
+{
+    portENTER_CRITICAL_SAFE(&hap_srp_spec_lock);
+    bool ready = hap_srp_spec_ready;
+    if (ready) {
+        *hd = hap_srp_spec_hd;
+        memset(&hap_srp_spec_hd, 0, sizeof(hap_srp_spec_hd));
+        hap_srp_spec_ready = false;
+    }
+    portEXIT_CRITICAL_SAFE(&hap_srp_spec_lock);
+    if (!ready) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "No precomputed SRP public key. Generating one");
+        mu_srp_init(hd, MU_NG_3072);
+    }
+    hap_srp_spec_start();
+}
+
+/* Once paired, pair setup is not allowed anymore, so there is no point holding on to it */
+static void hap_srp_spec_discard(void)
+{
+    mu_srp_handle_t hd = {0};
+    portENTER_CRITICAL_SAFE(&hap_srp_spec_lock);
+    if (hap_srp_spec_ready) {
+        hd = hap_srp_spec_hd;
+        memset(&hap_srp_spec_hd, 0, sizeof(hap_srp_spec_hd));
+        hap_srp_spec_ready = false;
+    }
+    portEXIT_CRITICAL_SAFE(&hap_srp_spec_lock);
+    mu_srp_free(&hd);
+}
+#else
+static inline void hap_srp_spec_start(void) {}
+static inline void hap_srp_spec_discard(void) {}
+static inline void hap_srp_spec_take(mu_srp_handle_t *hd)
+{
+    mu_srp_init(hd, MU_NG_3072);
+}
+#endif /* CONFIG_HAP_SRP_SPECULATIVE_B */
+
+int hap_pair_setup_prepare(void)
+{
+    /* Build the SRP group constants here, before any pair setup or precompute
+     * task can race to do it.
+     */
+    if (mu_srp_group_init(MU_NG_3072) < 0) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "SRP-6a Group Init Failed");
+        return HAP_FAIL;
+    }
+    hap_srp_spec_start();
+    return HAP_SUCCESS;
+}
+
 void hap_pair_setup_re_enable(void)
 {
 	ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "######## Re-enabling Pair Setup ########");
     hap_mdns_announce(false);
     hap_start_pairing_mode_timer();
+    hap_srp_spec_start();
 }
 
 static int hap_pair_setup_process_srp_start(pair_setup_ctx_t *ps_ctx, uint8_t *buf, int inlen,
@@ -167,7 +277,7 @@ static int hap_pair_setup_process_srp_start(pair_setup_ctx_t *ps_ctx, uint8_t *b
 	char *bytes_B;
 
 	/* Create SRP Salt and Verifier for the provided pairing PIN */
-    mu_srp_init(&ps_ctx->srp_hd, MU_NG_3072);
+    hap_srp_spec_take(&ps_ctx->srp_hd);
 
     /* If a setup code is explicitly set, use it */
     if (hap_priv.setup_code) {
@@ -260,10 +370,12 @@ static int hap_pair_setup_process_srp_verify(pair_setup_ctx_t *ps_ctx, uint8_t *
     }
     int acc_proof_length = SHA512HashSize;
 
-	hkdf(SHA512, (uint8_t *) PAIR_SETUP_ENCRYPT_SALT, strlen(PAIR_SETUP_ENCRYPT_SALT),
-			(uint8_t *)ps_ctx->shared_secret, ps_ctx->secret_len,
-			(uint8_t *) PAIR_SETUP_ENCRYPT_INFO, strlen(PAIR_SETUP_ENCRYPT_INFO),
-			ps_ctx->session_key, sizeof(ps_ctx->session_key));
+	if (hap_hkdf(HAP_HKDF_SALT_PAIR_SETUP_ENCRYPT, (uint8_t *)ps_ctx->shared_secret, ps_ctx->secret_len,
+			PAIR_SETUP_ENCRYPT_INFO, ps_ctx->session_key, sizeof(ps_ctx->session_key)) != HAP_SUCCESS) {
+		hap_prepare_error_tlv(STATE_M4, kTLVError_Unknown, buf, bufsize, outlen);
+        hap_report_event(HAP_EVENT_PAIRING_ABORTED, NULL, 0);
+		return HAP_FAIL;
+	}
 
 	/* Construct the response M4 */
 	hap_tlv_data_t tlv_data;
@@ -324,7 +436,6 @@ static int hap_pair_setup_process_exchange(pair_setup_ctx_t *ps_ctx, uint8_t *bu
 	hex_dbg_with_name("subtlv", edata, edata_len);
 	int ctrl_id_len;
 	unsigned char ed_sign[64];
-    unsigned long long ed_sign_len;
 	if (((ctrl_id_len = get_value_from_tlv(edata, edata_len, kTLVType_Identifier,
 					ps_ctx->ctrl->info.id, sizeof(ps_ctx->ctrl->info.id))) < 0) ||
 			(get_value_from_tlv(edata, edata_len, kTLVType_PublicKey,
@@ -342,11 +453,11 @@ static int hap_pair_setup_process_exchange(pair_setup_ctx_t *ps_ctx, uint8_t *bu
 
 	/* Derive iOSDeviceX from SRP shared secret using HKDF-SHA512 */
 	uint8_t ios_device_x[32];
-	hkdf(SHA512, (unsigned char *) PAIR_SETUP_CTRL_SIGN_SALT,
-			strlen(PAIR_SETUP_CTRL_SIGN_SALT), (uint8_t *)ps_ctx->shared_secret, ps_ctx->secret_len,
-			(unsigned char *) PAIR_SETUP_CTRL_SIGN_INFO,
-			strlen(PAIR_SETUP_CTRL_SIGN_INFO),
-			ios_device_x, sizeof(ios_device_x));
+	if (hap_hkdf(HAP_HKDF_SALT_PAIR_SETUP_CTRL_SIGN, (uint8_t *)ps_ctx->shared_secret, ps_ctx->secret_len,
+			PAIR_SETUP_CTRL_SIGN_INFO, ios_device_x, sizeof(ios_device_x)) != HAP_SUCCESS) {
+		hap_prepare_error_tlv(STATE_M6, kTLVError_Unknown, buf, bufsize, outlen);
+		return HAP_FAIL;
+	}
 	/* Construct iOSDeviceInfo by concatenating
 	 * iOSDeviceX
 	 * iOSDevicePairingID (ctrl_id)
@@ -374,11 +485,11 @@ static int hap_pair_setup_process_exchange(pair_setup_ctx_t *ps_ctx, uint8_t *bu
 
 	/* Derive AccessoryX from the SRP shared secret using HKDF-SHA512 */
 	uint8_t acc_x[32];
-	hkdf(SHA512, (unsigned char *) PAIR_SETUP_ACC_SIGN_SALT,
-			strlen(PAIR_SETUP_ACC_SIGN_SALT), (uint8_t *)ps_ctx->shared_secret, ps_ctx->secret_len,
-			(unsigned char *) PAIR_SETUP_ACC_SIGN_INFO,
-			strlen(PAIR_SETUP_ACC_SIGN_INFO),
-			acc_x, sizeof(acc_x));
+	if (hap_hkdf(HAP_HKDF_SALT_PAIR_SETUP_ACC_SIGN, (uint8_t *)ps_ctx->shared_secret, ps_ctx->secret_len,
+			PAIR_SETUP_ACC_SIGN_INFO, acc_x, sizeof(acc_x)) != HAP_SUCCESS) {
+		hap_prepare_error_tlv(STATE_M6, kTLVError_Unknown, buf, bufsize, outlen);
+		return HAP_FAIL;
+	}
 	/* Construct AccessoryInfo by concatenating
 	 * AccessoryX
 	 * AccessoryPairingID (acc_id)
@@ -395,7 +506,7 @@ static int hap_pair_setup_process_exchange(pair_setup_ctx_t *ps_ctx, uint8_t *bu
 
 	/* Generate AccessorySignature by signing AccessoryInfo with AccessoryLTSK
 	 */
-    crypto_sign_ed25519_detached(ed_sign, &ed_sign_len, acc_info, acc_info_len, hap_priv.ltska);
+    crypto_sign_ed25519_detached(ed_sign, NULL, acc_info, acc_info_len, hap_priv.ltska_sk);
 	hex_dbg_with_name("acc_sign", ed_sign, sizeof(ed_sign));
 
 	/* Create subTLV with:
@@ -446,6 +557,7 @@ static int hap_pair_setup_process_exchange(pair_setup_ctx_t *ps_ctx, uint8_t *bu
     hap_send_event(HAP_INTERNAL_EVENT_ACC_PAIRED);
     /* Stop the pairing mode timer, since pairing is already done */
     hap_stop_pairing_mode_timer();
+    hap_srp_spec_discard();
 	return HAP_SUCCESS;
 }
 static uint8_t hap_pair_setup_get_received_state(uint8_t *buf, int inlen)
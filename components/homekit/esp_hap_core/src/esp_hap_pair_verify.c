@@ -28,24 +28,34 @@
 #include <sodium/crypto_sign_ed25519.h>
 #include <hkdf-sha.h>
 #include <sodium/crypto_aead_chacha20poly1305.h>
+#include <sodium/utils.h>
 #include <esp_http_server.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
 #include <hap_platform_memory.h>
 
 #include <esp_hap_main.h>
 #include <esp_hap_pair_common.h>
 #include <esp_hap_database.h>
 #include <esp_hap_char.h>
+#include <esp_hap_network_io.h>
+#include <esp_hap_keypair_pool.h>
+#include <esp_hap_hkdf.h>
 #include <hexdump.h>
 #include <esp_mfi_debug.h>
 #include <esp_mfi_rand.h>
 
-#define PAIR_VERIFY_ENCRYPT_SALT	"Pair-Verify-Encrypt-Salt"
 #define PAIR_VERIFY_ENCRYPT_INFO	"Pair-Verify-Encrypt-Info"
 #define PV_NONCE1 			"PV-Msg02"
 #define PV_NONCE2 			"PV-Msg03"
-#define CONTROL_SALT			"Control-Salt"
 #define CONTROL_READ_INFO		"Control-Read-Encryption-Key"
 #define CONTROL_WRITE_INFO		"Control-Write-Encryption-Key"
+#define RESUME_SESSION_ID_INFO		"Pair-Verify-ResumeSessionID-Info"
+#define PAIR_RESUME_REQUEST_INFO	"Pair-Resume-Request-Info"
+#define PAIR_RESUME_RESPONSE_INFO	"Pair-Resume-Response-Info"
+#define PAIR_RESUME_SHARED_SECRET_INFO	"Pair-Resume-Shared-Secret-Info"
+#define PR_NONCE1			"PR-Msg01"
+#define PR_NONCE2			"PR-Msg02"
 
 typedef struct {
 	/* It is important that "state" should be the first element of the structure.
@@ -65,6 +75,125 @@ typedef struct {
 	hap_secure_session_t *session;
 } pair_verify_ctx_t;
 
+/* Sessions that a controller can resume with Pair Resume, without the Curve25519 and
+ * Ed25519 operations of a full Pair Verify. An entry is replaced by the new session on
+ * every resume, and the least recently used one is evicted when the cache is full.
+ * Pair Verify runs on the crypto executor while controllers get removed from the HTTP
+ * server task, so entries are only copied in and out under hap_resume_cache_lock.
+ */
+typedef struct {
+	uint8_t session_id[SESSION_ID_LEN];
+	uint8_t shared_secret[CURVE_KEY_LEN];
+	char ctrl_id[HAP_CTRL_ID_LEN];
+	uint8_t ctrl_ltpk[ED_KEY_LEN];
+	int64_t last_used;	/* In msec. 0 for an empty entry */
+} hap_resume_entry_t;
+
+static hap_resume_entry_t hap_resume_cache[CONFIG_HAP_PAIR_RESUME_CACHE_SIZE];
+static portMUX_TYPE hap_resume_cache_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static int64_t hap_resume_get_time_ms()
+{
+	return esp_timer_get_time() / 1000;
+}
+
+static bool hap_resume_entry_expired(hap_resume_entry_t *entry, int64_t now)
+{
+	return (now - entry->last_used) > (CONFIG_HAP_PAIR_RESUME_TIMEOUT * 1000LL);
+}
+
+/* Must be called with hap_resume_cache_lock held */
+static hap_resume_entry_t *hap_resume_cache_lookup(uint8_t *session_id, int64_t now)
+{
+	int i;
+	for (i = 0; i < CONFIG_HAP_PAIR_RESUME_CACHE_SIZE; i++) {
+		hap_resume_entry_t *entry = &hap_resume_cache[i];
+		if (!entry->last_used || memcmp(entry->session_id, session_id, SESSION_ID_LEN))
+			continue;
+		if (hap_resume_entry_expired(entry, now)) {
+			memset(entry, 0, sizeof(hap_resume_entry_t));
+			return NULL;
+		}
+		return entry;
+	}
+	return NULL;
+}
+
+/* Returns an empty or expired entry if available, else the least recently used one.
+ * Must be called with hap_resume_cache_lock held.
+ */
+static hap_resume_entry_t *hap_resume_cache_get_free(int64_t now)
+{
+	hap_resume_entry_t *lru = &hap_resume_cache[0];
+	int i;
+	for (i = 0; i < CONFIG_HAP_PAIR_RESUME_CACHE_SIZE; i++) {
+		hap_resume_entry_t *entry = &hap_resume_cache[i];
+		if (!entry->last_used || hap_resume_entry_expired(entry, now))
+			return entry;
+		if (entry->last_used < lru->last_used)
+			lru = entry;
+	}
+	return lru;
+}
+
+/* Copies the entry for session_id into found. The copy holds the shared secret,
+ * so the caller has to wipe it once done.
+ */
+static bool hap_resume_cache_find(uint8_t *session_id, hap_resume_entry_t *found)
+{
+	int64_t now = hap_resume_get_time_ms();
+	bool ret = false;
+	portENTER_CRITICAL_SAFE(&hap_resume_cache_lock);
+	hap_resume_entry_t *entry = hap_resume_cache_lookup(session_id, now);
+	if (entry) {
+		memcpy(found, entry, sizeof(hap_resume_entry_t));
+		ret = true;
+	}
+	portEXIT_CRITICAL_SAFE(&hap_resume_cache_lock);
+	return ret;
+}
+
+/* Saves a resumable session, in place of old_session_id if that is still cached
+ * (NULL for a full Pair Verify), or else in a free entry.
+ */
+static void hap_resume_cache_save(uint8_t *old_session_id, uint8_t *session_id,
+		uint8_t *shared_secret, const hap_ctrl_snapshot_t *ctrl)
+{
+	int64_t now = hap_resume_get_time_ms();
+	portENTER_CRITICAL_SAFE(&hap_resume_cache_lock);
+	hap_resume_entry_t *entry = old_session_id ?
+		hap_resume_cache_lookup(old_session_id, now) : NULL;
+	if (!entry)
+		entry = hap_resume_cache_get_free(now);
+	memcpy(entry->session_id, session_id, SESSION_ID_LEN);
+	memcpy(entry->shared_secret, shared_secret, CURVE_KEY_LEN);
+	memcpy(entry->ctrl_id, ctrl->id, HAP_CTRL_ID_LEN);
+	memcpy(entry->ctrl_ltpk, ctrl->ltpk, ED_KEY_LEN);
+	entry->last_used = now;
+	portEXIT_CRITICAL_SAFE(&hap_resume_cache_lock);
+}
+
+static void hap_resume_cache_forget(uint8_t *session_id)
+{
+	portENTER_CRITICAL_SAFE(&hap_resume_cache_lock);
+	hap_resume_entry_t *entry = hap_resume_cache_lookup(session_id, hap_resume_get_time_ms());
+	if (entry)
+		memset(entry, 0, sizeof(hap_resume_entry_t));
+	portEXIT_CRITICAL_SAFE(&hap_resume_cache_lock);
+}
+
+static void hap_resume_cache_forget_ctrl(const char *ctrl_id)
+{
+	int i;
+	portENTER_CRITICAL_SAFE(&hap_resume_cache_lock);
+	for (i = 0; i < CONFIG_HAP_PAIR_RESUME_CACHE_SIZE; i++) {
+		if (hap_resume_cache[i].last_used &&
+				!strncmp(hap_resume_cache[i].ctrl_id, ctrl_id, HAP_CTRL_ID_LEN))
+			memset(&hap_resume_cache[i], 0, sizeof(hap_resume_entry_t));
+	}
+	portEXIT_CRITICAL_SAFE(&hap_resume_cache_lock);
+}
+
 void hap_close_session(hap_secure_session_t *session)
 {
     if (!session)
@@ -85,6 +214,8 @@ void hap_close_sessions_of_ctrl(hap_ctrl_data_t *ctrl)
 {
 	if (!ctrl)
 		return;
+	/* The controller is being removed, so it should not be able to resume either */
+	hap_resume_cache_forget_ctrl(ctrl->info.id);
 	int i;
 	for (i = 0; i < HAP_MAX_SESSIONS; i++) {
         if (!hap_priv.sessions[i])
@@ -120,7 +251,7 @@ void hap_close_all_sessions()
 	}
 }
 
-static void hap_add_secure_session(hap_secure_session_t *session)
+void hap_add_secure_session(hap_secure_session_t *session)
 {
 	int i;
 	for (i = 0; i < HAP_MAX_SESSIONS; i++) {
@@ -156,9 +287,159 @@ void hap_free_session(void *session)
 			break;
 		}
 	}
+	hap_decrypt_frame_release(session);
 	hap_platform_memory_free(session);
 }
 
+/* Creates the secure session for the shared secret in pv_ctx, once the controller
+ * has been verified.
+ */
+static int hap_pair_verify_create_session(pair_verify_ctx_t *pv_ctx, hap_ctrl_data_t *ctrl)
+{
+	/* Allocate memory for the secure session information */
+	hap_secure_session_t *session = hap_platform_memory_calloc(sizeof(hap_secure_session_t), 1);
+	if (!session) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Memory allocation failed");
+		return HAP_FAIL;
+	}
+
+	/* Generate the Encryption and Decryption Keys.
+	 * Since, read and write are from the controller's point of view,
+	 * encryption key uses READ_INFO and decryption key uses WRITE_INFO
+	 *
+	 * Also, set the nonce to zero
+	 */
+	if (hap_hkdf2(HAP_HKDF_SALT_CONTROL, pv_ctx->shared_secret, sizeof(pv_ctx->shared_secret),
+			CONTROL_READ_INFO, session->encrypt_key, sizeof(session->encrypt_key),
+			CONTROL_WRITE_INFO, session->decrypt_key, sizeof(session->decrypt_key)) != HAP_SUCCESS) {
+		hap_platform_memory_free(session);
+		return HAP_FAIL;
+	}
+
+	session->state = STATE_VERIFIED;
+	pv_ctx->state = STATE_VERIFIED;
+
+	memset(session->encrypt_nonce, 0, sizeof(session->encrypt_nonce));
+	memset(session->decrypt_nonce, 0, sizeof(session->decrypt_nonce));
+	session->ctrl = ctrl;
+
+	/* The session gets added to the database by the caller, along with its socket */
+	pv_ctx->session = session;
+	return HAP_SUCCESS;
+}
+
+/* Resumes the session in entry, which is a copy of the cached one */
+static int hap_pair_resume_entry_process(pair_verify_ctx_t *pv_ctx, hap_resume_entry_t *entry,
+		uint8_t *buf, uint8_t *auth_tag, int bufsize, int *outlen)
+{
+	uint8_t *session_id = entry->session_id;
+	/* The controller may have been removed, or paired again, meanwhile */
+	hap_ctrl_snapshot_t ctrl;
+	if ((hap_get_controller_snapshot(entry->ctrl_id, &ctrl) != HAP_SUCCESS) ||
+			memcmp(ctrl.ltpk, entry->ctrl_ltpk, ED_KEY_LEN)) {
+		hap_resume_cache_forget(session_id);
+		return HAP_FAIL;
+	}
+
+	/* The keys are derived using the controller's public key and the session ID
+	 * as the salt.
+	 */
+	uint8_t salt[CURVE_KEY_LEN + SESSION_ID_LEN];
+	memcpy(salt, pv_ctx->ctrl_curve_pk, CURVE_KEY_LEN);
+	memcpy(salt + CURVE_KEY_LEN, session_id, SESSION_ID_LEN);
+	uint8_t key[ENCRYPT_KEY_LEN];
+	if (hkdf(SHA512, salt, sizeof(salt), entry->shared_secret, sizeof(entry->shared_secret),
+				(unsigned char *) PAIR_RESUME_REQUEST_INFO, strlen(PAIR_RESUME_REQUEST_INFO),
+				key, sizeof(key)) != shaSuccess) {
+		return HAP_FAIL;
+	}
+	/* The messages have no data, just the authTag */
+	uint8_t empty[1];
+	uint8_t newnonce[12];
+	memset(newnonce, 0, sizeof newnonce);
+	memcpy(newnonce+4, PR_NONCE1, 8);
+	if (crypto_aead_chacha20poly1305_ietf_decrypt_detached(NULL, NULL, empty, 0, auth_tag,
+				NULL, 0, newnonce, key) != 0) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Pair Resume authentication failed");
+		return HAP_FAIL;
+	}
+
+	/* The resumed session gets a new ID, and its own shared secret */
+	uint8_t new_session_id[SESSION_ID_LEN];
+	esp_mfi_get_random(new_session_id, sizeof(new_session_id));
+	memcpy(salt + CURVE_KEY_LEN, new_session_id, SESSION_ID_LEN);
+	if (hkdf(SHA512, salt, sizeof(salt), entry->shared_secret, sizeof(entry->shared_secret),
+				(unsigned char *) PAIR_RESUME_RESPONSE_INFO, strlen(PAIR_RESUME_RESPONSE_INFO),
+				key, sizeof(key)) != shaSuccess) {
+		return HAP_FAIL;
+	}
+	unsigned long long mlen = POLY_AUTHTAG_LEN;
+	memcpy(newnonce+4, PR_NONCE2, 8);
+	crypto_aead_chacha20poly1305_ietf_encrypt_detached(empty, auth_tag, &mlen, empty, 0,
+			NULL, 0, NULL, newnonce, key);
+	if (hkdf(SHA512, salt, sizeof(salt), entry->shared_secret, sizeof(entry->shared_secret),
+				(unsigned char *) PAIR_RESUME_SHARED_SECRET_INFO,
+				strlen(PAIR_RESUME_SHARED_SECRET_INFO),
+				pv_ctx->shared_secret, sizeof(pv_ctx->shared_secret)) != shaSuccess) {
+		return HAP_FAIL;
+	}
+
+	/* Construct the response M2 */
+	/* State, Method, SessionID and authTag, each with a type and length byte */
+	uint8_t m2[4 * 2 + 1 + 1 + SESSION_ID_LEN + POLY_AUTHTAG_LEN];
+	hap_tlv_data_t tlv_data;
+	tlv_data.bufptr = m2;
+	tlv_data.bufsize = sizeof(m2);
+	tlv_data.curlen = 0;
+	uint8_t state = STATE_M2;
+	uint8_t method = HAP_METHOD_PAIR_RESUME;
+	if ((add_tlv(&tlv_data, kTLVType_State, 1, &state) < 0) ||
+			(add_tlv(&tlv_data, kTLVType_Method, 1, &method) < 0) ||
+			(add_tlv(&tlv_data, kTLVType_SessionID, SESSION_ID_LEN, new_session_id) < 0) ||
+			(add_tlv(&tlv_data, kTLVType_EncryptedData, POLY_AUTHTAG_LEN, auth_tag) < 0) ||
+			(tlv_data.curlen > bufsize)) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "TLV creation failed");
+		return HAP_FAIL;
+	}
+	if (hap_pair_verify_create_session(pv_ctx, ctrl.ctrl) != HAP_SUCCESS) {
+		return HAP_FAIL;
+	}
+	hap_resume_cache_save(session_id, new_session_id, pv_ctx->shared_secret, &ctrl);
+	memcpy(buf, m2, tlv_data.curlen);
+	*outlen = tlv_data.curlen;
+	ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Pair Resume Successful for %s", ctrl.id);
+	return HAP_SUCCESS;
+}
+
+/* Pair Resume M1 carries a fresh Curve25519 public key of the controller (already in
+ * pv_ctx), the ID of an earlier session and an authTag proving that the controller knows
+ * the shared secret of that session. If everything checks out, the new session is derived
+ * from the earlier shared secret, using just HKDF and AEAD operations, and M2 is the
+ * last message. On a failure, buf is left untouched, so that the caller can continue
+ * with a full Pair Verify for the same public key.
+ */
+static int hap_pair_resume_process(pair_verify_ctx_t *pv_ctx, uint8_t *buf, int inlen,
+		int bufsize, int *outlen)
+{
+	uint8_t session_id[SESSION_ID_LEN];
+	uint8_t auth_tag[POLY_AUTHTAG_LEN];
+	if ((get_value_from_tlv(buf, inlen, kTLVType_SessionID, session_id,
+					sizeof(session_id)) != sizeof(session_id)) ||
+			(get_value_from_tlv(buf, inlen, kTLVType_EncryptedData, auth_tag,
+					sizeof(auth_tag)) != sizeof(auth_tag))) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Invalid Pair Resume TLVs");
+		return HAP_FAIL;
+	}
+	hap_resume_entry_t entry;
+	if (!hap_resume_cache_find(session_id, &entry)) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Session not resumable");
+		return HAP_FAIL;
+	}
+	int ret = hap_pair_resume_entry_process(pv_ctx, &entry, buf, auth_tag, bufsize, outlen);
+	sodium_memzero(&entry, sizeof(entry));
+	return ret;
+}
+
 static int hap_pair_verify_process_start(pair_verify_ctx_t *pv_ctx, uint8_t *buf, int inlen,
 		int bufsize, int *outlen)
 {
@@ -185,21 +466,29 @@ static int hap_pair_verify_process_start(pair_verify_ctx_t *pv_ctx, uint8_t *buf
 	ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Pair Verify M1 Received");
 	hex_dbg_with_name("ctrl curve pk", pv_ctx->ctrl_curve_pk, 32);
 
-	/* Generate a new Curve25519 Key Pair */
-	uint8_t acc_curve_sk[CURVE_KEY_LEN];
-	esp_mfi_get_random(acc_curve_sk, CURVE_KEY_LEN);
-	/* This particular value of basepoint is required to generate the public key
-	 * from secret key
+	uint8_t method = HAP_METHOD_PAIR_VERIFY;
+	get_value_from_tlv(buf, inlen, kTLVType_Method, &method, sizeof(method));
+	if (method == HAP_METHOD_PAIR_RESUME) {
+		if (hap_pair_resume_process(pv_ctx, buf, inlen, bufsize, outlen) == HAP_SUCCESS)
+			return HAP_SUCCESS;
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Falling back to Pair Verify");
+	}
+
+	/* Get a new Curve25519 Key Pair. It is usually generated in the background
+	 * already, leaving just the shared secret computation for here.
 	 */
-	uint8_t basepoint[32] = {9};
-    if (crypto_scalarmult_curve25519(pv_ctx->acc_curve_pk, acc_curve_sk, basepoint) == -1) {
-        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Curve25519 Error");
+	hap_curve_keypair_t acc_curve_kp;
+	if (hap_keypair_pool_get(&acc_curve_kp) != HAP_SUCCESS) {
 		hap_prepare_error_tlv(STATE_M2, kTLVError_Unknown, buf, bufsize, outlen);
 		return HAP_FAIL;
-    }
-	hex_dbg_with_name("acc curve sk", acc_curve_sk, 32);
+	}
+	memcpy(pv_ctx->acc_curve_pk, acc_curve_kp.pk, CURVE_KEY_LEN);
+	hex_dbg_with_name("acc curve sk", acc_curve_kp.sk, 32);
 	hex_dbg_with_name("acc curve pk", pv_ctx->acc_curve_pk, 32);
-    if (crypto_scalarmult_curve25519(pv_ctx->shared_secret, acc_curve_sk, pv_ctx->ctrl_curve_pk) == -1) {
+	int ret = crypto_scalarmult_curve25519(pv_ctx->shared_secret, acc_curve_kp.sk,
+			pv_ctx->ctrl_curve_pk);
+	memset(&acc_curve_kp, 0, sizeof(acc_curve_kp));
+    if (ret == -1) {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Curve25519 Error");
 		hap_prepare_error_tlv(STATE_M2, kTLVError_Unknown, buf, bufsize, outlen);
 		return HAP_FAIL;
@@ -227,8 +516,7 @@ static int hap_pair_verify_process_start(pair_verify_ctx_t *pv_ctx, uint8_t *buf
 	 * with its Long Term Secret Key AccessoryLTSK
 	 */
 	unsigned char ed_sign[64];
-    unsigned long long ed_sign_len;
-    crypto_sign_ed25519_detached(ed_sign, &ed_sign_len, acc_info, acc_info_len, hap_priv.ltska);
+    crypto_sign_ed25519_detached(ed_sign, NULL, acc_info, acc_info_len, hap_priv.ltska_sk);
 	hex_dbg_with_name("sign", ed_sign, 64);
 
 	/* Construct a subTLV with
@@ -248,12 +536,12 @@ static int hap_pair_verify_process_start(pair_verify_ctx_t *pv_ctx, uint8_t *buf
 	/* Derive Symmetric Session encryption key SessionKey from the curve
 	 * shared secret using HKDF-SHA-512
 	 */
-	hkdf(SHA512, (unsigned char *) PAIR_VERIFY_ENCRYPT_SALT,
-			strlen(PAIR_VERIFY_ENCRYPT_SALT),
+	if (hap_hkdf(HAP_HKDF_SALT_PAIR_VERIFY_ENCRYPT,
 			pv_ctx->shared_secret, sizeof(pv_ctx->shared_secret),
-			(unsigned char *) PAIR_VERIFY_ENCRYPT_INFO,
-			strlen(PAIR_VERIFY_ENCRYPT_INFO),
-			pv_ctx->hkdf_key, sizeof(pv_ctx->hkdf_key));
+			PAIR_VERIFY_ENCRYPT_INFO, pv_ctx->hkdf_key, sizeof(pv_ctx->hkdf_key)) != HAP_SUCCESS) {
+		hap_prepare_error_tlv(STATE_M2, kTLVError_Unknown, buf, bufsize, outlen);
+		return HAP_FAIL;
+	}
 	/* Encrypt the sub TLV to get encryptedData and an authTag using
 	 * Chacha20-Poly1305 AEAD Algorithm
 	 */
@@ -345,8 +633,8 @@ static int hap_pair_verify_process_finish(pair_verify_ctx_t *pv_ctx, uint8_t *bu
 	/* Check if the controller is present in the database i.e. check
 	 * if the controller was paired with the accessory
 	 */
-	hap_ctrl_data_t *ctrl = hap_get_controller(ctrl_id);
-	if (!ctrl) {
+	hap_ctrl_snapshot_t ctrl;
+	if (hap_get_controller_snapshot(ctrl_id, &ctrl) != HAP_SUCCESS) {
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "No ctrl details found");
 		hap_prepare_error_tlv(STATE_M4, kTLVError_Authentication, buf, bufsize, outlen);
 		return HAP_FAIL;
@@ -368,19 +656,23 @@ static int hap_pair_verify_process_finish(pair_verify_ctx_t *pv_ctx, uint8_t *bu
 	ios_dev_info_len += CURVE_KEY_LEN;
 
 	/* Validate the signature with the received iOSDeviceSignature */
-    if (crypto_sign_ed25519_verify_detached(ed_sign, ios_dev_info, ios_dev_info_len, ctrl->info.ltpk) != 0) {
+    if (hap_controller_verify(&ctrl, ed_sign, ios_dev_info, ios_dev_info_len) != HAP_SUCCESS) {
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Signature mismatch");
 		hap_prepare_error_tlv(STATE_M4, kTLVError_Authentication, buf, bufsize, outlen);
 		return HAP_FAIL;
 	}
 
-	/* Allocate memory for the secure session information */
-	hap_secure_session_t *session = hap_platform_memory_calloc(sizeof(hap_secure_session_t), 1);
-	if (!session) {
+	/* The ID with which the session can be resumed is derived from the shared secret,
+	 * the same way as the controller does.
+	 */
+	uint8_t session_id[SESSION_ID_LEN];
+	if (hap_hkdf(HAP_HKDF_SALT_RESUME_SESSION_ID,
+				pv_ctx->shared_secret, sizeof(pv_ctx->shared_secret),
+				RESUME_SESSION_ID_INFO, session_id, sizeof(session_id)) != HAP_SUCCESS) {
 		hap_prepare_error_tlv(STATE_M4, kTLVError_Unknown, buf, bufsize, outlen);
-		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Memory allocation failed");
 		return HAP_FAIL;
 	}
+
 	/* Construct the response M4 */
 	hap_tlv_data_t tlv_data;
 	tlv_data.bufptr = buf;
@@ -389,51 +681,44 @@ static int hap_pair_verify_process_finish(pair_verify_ctx_t *pv_ctx, uint8_t *bu
 	state = STATE_M4;
 	if (add_tlv(&tlv_data, kTLVType_State, 1, &state) < 0) {
 		hap_prepare_error_tlv(STATE_M4, kTLVError_Unknown, buf, bufsize, outlen);
-		hap_platform_memory_free(session);
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "TLV creation failed");
 		return HAP_FAIL;
 	}
+	if (hap_pair_verify_create_session(pv_ctx, ctrl.ctrl) != HAP_SUCCESS) {
+		hap_prepare_error_tlv(STATE_M4, kTLVError_Unknown, buf, bufsize, outlen);
+		return HAP_FAIL;
+	}
 	*outlen = tlv_data.curlen;
 
-	/* Generate the Encryption and Decryption Keys.
-	 * Since, read and write are from the controller's point of view,
-	 * encryption key uses READ_INFO and decryption key uses WRITE_INFO
-	 *
-	 * Also, set the nonce to zero
-	 */
-	hkdf(SHA512, (unsigned char *) CONTROL_SALT, strlen(CONTROL_SALT),
-			pv_ctx->shared_secret, sizeof(pv_ctx->shared_secret),
-			(unsigned char *) CONTROL_READ_INFO, strlen(CONTROL_READ_INFO),
-			session->encrypt_key, sizeof(session->encrypt_key));
-
-	hkdf(SHA512, (unsigned char *) CONTROL_SALT, strlen(CONTROL_SALT),
-			pv_ctx->shared_secret, sizeof(pv_ctx->shared_secret),
-			(unsigned char *) CONTROL_WRITE_INFO, strlen(CONTROL_WRITE_INFO),
-			session->decrypt_key, sizeof(session->decrypt_key));
-
-	session->state = STATE_VERIFIED;
-	pv_ctx->state = STATE_VERIFIED;
-
-	memset(session->encrypt_nonce, 0, sizeof(session->encrypt_nonce));
-	memset(session->decrypt_nonce, 0, sizeof(session->decrypt_nonce));
-	session->ctrl = ctrl;
-
-	pv_ctx->session = session;
-
-	/* Add the session information to database */
-	hap_add_secure_session(session);
+	/* Make the session resumable */
+	hap_resume_cache_save(NULL, session_id, pv_ctx->shared_secret, &ctrl);
 	ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Pair Verify Successful for %s", ctrl_id);
 	return HAP_SUCCESS;
 }
 
+/* The context holds the shared secret, and the keys derived from it */
+static void hap_pair_verify_ctx_free(pair_verify_ctx_t *pv_ctx)
+{
+	sodium_memzero(pv_ctx->shared_secret, sizeof(pv_ctx->shared_secret));
+	sodium_memzero(pv_ctx->hkdf_key, sizeof(pv_ctx->hkdf_key));
+	hap_platform_memory_free(pv_ctx);
+}
+
 int hap_pair_verify_process(void **ctx, uint8_t *buf, int inlen, int bufsize, int *outlen)
 {
 	pair_verify_ctx_t *pv_ctx = (pair_verify_ctx_t *)(*ctx);
 	if (pv_ctx) {
-		if (pv_ctx->state == STATE_M0)
-			return hap_pair_verify_process_start(pv_ctx, buf, inlen,
+		if (pv_ctx->state == STATE_M0) {
+			int ret = hap_pair_verify_process_start(pv_ctx, buf, inlen,
 					bufsize, outlen);
-		else if (pv_ctx->state == STATE_M2) {
+			/* A successful Pair Resume completes with M2 itself */
+			if ((ret == HAP_SUCCESS) && (pv_ctx->state == STATE_VERIFIED)) {
+				hap_secure_session_t *session = pv_ctx->session;
+				hap_pair_verify_ctx_free(pv_ctx);
+				*ctx = session;
+			}
+			return ret;
+		} else if (pv_ctx->state == STATE_M2) {
 			int ret = hap_pair_verify_process_finish(pv_ctx, buf, inlen,
 					bufsize, outlen);
 			/* Successful finish means that the pair verify was successful.
@@ -442,7 +727,7 @@ int hap_pair_verify_process(void **ctx, uint8_t *buf, int inlen, int bufsize, in
 			 */
 			if (ret == HAP_SUCCESS) {
 				hap_secure_session_t *session = pv_ctx->session;
-				hap_platform_memory_free(pv_ctx);
+				hap_pair_verify_ctx_free(pv_ctx);
 				*ctx = session;
 			}
 			return ret;
@@ -472,7 +757,7 @@ int hap_pair_verify_context_init(void **ctx, uint8_t *buf, int bufsize, int *out
 void hap_pair_verify_context_deinit(void *pv_ctx)
 {
     if (pv_ctx) {
-        hap_platform_memory_free(pv_ctx);
+        hap_pair_verify_ctx_free(pv_ctx);
     }
 }
 
@@ -0,0 +1,118 @@
+ /*
+  * ESPRESSIF MIT License
+  *
+  * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+  *
+  * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+  * it is free of charge, to any person obtaining a copy of this software and associated
+  * documentation files (the "Software"), to deal in the Software without restriction, including
+  * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+  * to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all copies or
+  * substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+  * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+  * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+  * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+  *
+  */
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <hap_platform_memory.h>
+#include <esp_mfi_debug.h>
+#include <esp_hap_req_arena.h>
+
+/* Request scoped bump allocator.
+ *
+ * HTTP handlers make many small, short lived allocations per request. All of them
+ * run on the HTTP server task, one request at a time, so a single static arena is
+ * enough. Allocations just bump an offset, and everything is released at once by
+ * hap_req_arena_reset() at the end of the handler. Once the arena is used up,
+ * allocations fall back to the heap. Such blocks are chained together, so that the
+ * reset can free them.
+ */
+#define HAP_REQ_ARENA_ALIGN     8
+
+typedef struct hap_req_arena_heap_blk {
+    struct hap_req_arena_heap_blk *next;
+    /* Keeps the data after the header aligned */
+    uint64_t data[];
+} hap_req_arena_heap_blk_t;
+
+static struct {
+    uint32_t offset;
+    uint32_t last_offset;   /* Offset of the last allocation, for hap_req_arena_free() */
+    hap_req_arena_heap_blk_t *heap_blks;
+    hap_req_arena_stats_t stats;
+    uint64_t buf[(CONFIG_HAP_REQ_ARENA_SIZE + 7) / 8];
+} hap_req_arena;
+static hap_req_arena_stats_t hap_req_arena_last_stats;
+
+void *hap_req_arena_calloc(size_t count, size_t size)
+{
+    if (size && (count > (SIZE_MAX / size))) {
+        return NULL;
+    }
+    size_t len = (count * size + HAP_REQ_ARENA_ALIGN - 1) & ~(HAP_REQ_ARENA_ALIGN - 1);
+    hap_req_arena.stats.allocs++;
+    if (len <= (sizeof(hap_req_arena.buf) - hap_req_arena.offset)) {
+        uint8_t *ptr = (uint8_t *)hap_req_arena.buf + hap_req_arena.offset;
+        hap_req_arena.last_offset = hap_req_arena.offset;
+        hap_req_arena.offset += len;
+        if (hap_req_arena.offset > hap_req_arena.stats.peak_bytes) {
+            hap_req_arena.stats.peak_bytes = hap_req_arena.offset;
+        }
+        memset(ptr, 0, len);
+        return ptr;
+    }
+    hap_req_arena_heap_blk_t *blk = hap_platform_memory_calloc(1, sizeof(hap_req_arena_heap_blk_t) + len);
+    if (!blk) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to allocate %u bytes for request", (unsigned)len);
+        return NULL;
+    }
+    blk->next = hap_req_arena.heap_blks;
+    hap_req_arena.heap_blks = blk;
+    hap_req_arena.stats.heap_bytes += len;
+    return blk->data;
+}
+
+void hap_req_arena_free(void *ptr)
+{
+    uint8_t *last = (uint8_t *)hap_req_arena.buf + hap_req_arena.last_offset;
+    if (ptr && (ptr == last) && (hap_req_arena.last_offset < hap_req_arena.offset)) {
+        hap_req_arena.offset = hap_req_arena.last_offset;
+    }
+}
+
+void hap_req_arena_reset(void)
+{
+    while (hap_req_arena.heap_blks) {
+        hap_req_arena_heap_blk_t *next = hap_req_arena.heap_blks->next;
+        hap_platform_memory_free(hap_req_arena.heap_blks);
+        hap_req_arena.heap_blks = next;
+    }
+#ifdef CONFIG_HAP_LOG_REQUEST_STATS
+    if (hap_req_arena.stats.allocs) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Request arena: %"PRIu32" allocations, peak %"PRIu32"/%u bytes, %"PRIu32" bytes from heap",
+                hap_req_arena.stats.allocs, hap_req_arena.stats.peak_bytes,
+                (unsigned)sizeof(hap_req_arena.buf), hap_req_arena.stats.heap_bytes);
+    }
+#endif /* CONFIG_HAP_LOG_REQUEST_STATS */
+    hap_req_arena_last_stats = hap_req_arena.stats;
+    memset(&hap_req_arena.stats, 0, sizeof(hap_req_arena.stats));
+    hap_req_arena.offset = 0;
+    hap_req_arena.last_offset = 0;
+}
+
+void hap_req_arena_get_last_stats(hap_req_arena_stats_t *stats)
+{
+    if (stats) {
+        *stats = hap_req_arena_last_stats;
+    }
+}
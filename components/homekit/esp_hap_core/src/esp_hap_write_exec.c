@@ -0,0 +1,204 @@
+ /*
+  * ESPRESSIF MIT License
+  *
+  * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+  *
+  * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+  * it is free of charge, to any person obtaining a copy of this software and associated
+  * documentation files (the "Software"), to deal in the Software without restriction, including
+  * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+  * to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all copies or
+  * substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+  * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+  * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+  * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+  *
+  */
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <hap.h>
+#include <hap_platform_memory.h>
+#include <esp_mfi_debug.h>
+#include <esp_hap_char.h>
+#include <esp_hap_database.h>
+#include <esp_hap_write_exec.h>
+
+#define HAP_WRITE_EXEC_QUEUE_LEN    8
+
+static QueueHandle_t hap_write_exec_queue;
+/* The write callbacks are invoked only from the HTTP server task, and so, the staging
+ * needs no locking.
+ */
+static bool hap_write_exec_accepting;
+static hap_write_job_t *hap_write_exec_staged;
+
+void hap_write_job_free(hap_write_job_t *job)
+{
+    if (!job) {
+        return;
+    }
+    switch (((__hap_char_t *)job->write.hc)->format) {
+        case HAP_CHAR_FORMAT_STRING:
+            /* Allocated with strdup() */
+            free(job->write.val.s);
+            break;
+        case HAP_CHAR_FORMAT_DATA:
+        case HAP_CHAR_FORMAT_TLV8:
+            if (job->write.val.d.buf) {
+                hap_platform_memory_free(job->write.val.d.buf);
+            }
+            break;
+        default:
+            break;
+    }
+    if (job->write.auth_data.data) {
+        hap_platform_memory_free(job->write.auth_data.data);
+    }
+    hap_platform_memory_free(job);
+}
+
+/* The write data in the request is released once the HTTP handler returns, so the
+ * job takes a copy of whatever the work may need.
+ */
+static hap_write_job_t *hap_write_job_create(hap_write_data_t *write)
+{
+    hap_write_job_t *job = hap_platform_memory_calloc(1, sizeof(hap_write_job_t));
+    if (!job) {
+        return NULL;
+    }
+    job->write = *write;
+    job->write.status = &job->status;
+    job->write.auth_data.data = NULL;
+    /* val is a union, so only the pointer formats may have their value cleared */
+    switch (((__hap_char_t *)write->hc)->format) {
+        case HAP_CHAR_FORMAT_STRING:
+            job->write.val.s = NULL;
+            if (write->val.s) {
+                job->write.val.s = strdup(write->val.s);
+                if (!job->write.val.s) {
+                    goto job_create_err;
+                }
+            }
+            break;
+        case HAP_CHAR_FORMAT_DATA:
+        case HAP_CHAR_FORMAT_TLV8:
+            job->write.val.d.buf = NULL;
+            if (write->val.d.buf) {
+                /* One extra byte, so that the value stays NULL terminated if it was */
+                job->write.val.d.buf = hap_platform_memory_calloc(1, write->val.d.buflen + 1);
+                if (!job->write.val.d.buf) {
+                    goto job_create_err;
+                }
+                memcpy(job->write.val.d.buf, write->val.d.buf, write->val.d.buflen);
+            }
+            break;
+        default:
+            break;
+    }
+    if (write->auth_data.data) {
+        job->write.auth_data.data = hap_platform_memory_calloc(1, write->auth_data.len + 1);
+        if (!job->write.auth_data.data) {
+            goto job_create_err;
+        }
+        memcpy(job->write.auth_data.data, write->auth_data.data, write->auth_data.len);
+    }
+    job->req_status = write->status;
+    return job;
+job_create_err:
+    hap_write_job_free(job);
+    return NULL;
+}
+
+int hap_write_defer(hap_write_data_t *write, hap_write_work_t work, void *priv)
+{
+    if (!hap_write_exec_accepting) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Writes can be deferred only from a write callback");
+        return HAP_FAIL;
+    }
+    if (!write || !write->hc || !write->status || !work) {
+        return HAP_FAIL;
+    }
+    hap_write_job_t *job = hap_write_job_create(write);
+    if (!job) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to allocate deferred write");
+        return HAP_FAIL;
+    }
+    job->work = work;
+    job->priv = priv;
+    job->next = hap_write_exec_staged;
+    hap_write_exec_staged = job;
+    return HAP_SUCCESS;
+}
+
+void hap_write_exec_begin(void)
+{
+    hap_write_exec_staged = NULL;
+    hap_write_exec_accepting = true;
+}
+
+hap_write_job_t *hap_write_exec_end(void)
+{
+    hap_write_job_t *jobs = hap_write_exec_staged;
+    hap_write_exec_staged = NULL;
+    hap_write_exec_accepting = false;
+    return jobs;
+}
+
+static void hap_write_exec_task(void *param)
+{
+    hap_write_job_t *job;
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HAP Write Executor Started");
+    while (1) {
+        if (xQueueReceive(hap_write_exec_queue, &job, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        job->status = job->work(&job->write, job->priv);
+        job->done_cb(job);
+    }
+}
+
+/* The executor is started on the first deferred write, so that accessories which
+ * never defer do not pay for its stack.
+ */
+static int hap_write_exec_start(void)
+{
+    if (hap_write_exec_queue) {
+        return HAP_SUCCESS;
+    }
+    hap_write_exec_queue = xQueueCreate(HAP_WRITE_EXEC_QUEUE_LEN, sizeof(hap_write_job_t *));
+    if (!hap_write_exec_queue) {
+        return HAP_FAIL;
+    }
+    if (xTaskCreate(hap_write_exec_task, "hap-write-exec", hap_priv.cfg.task_stack_size,
+                NULL, hap_priv.cfg.task_priority, NULL) != pdPASS) {
+        vQueueDelete(hap_write_exec_queue);
+        hap_write_exec_queue = NULL;
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
+int hap_write_exec_submit(hap_write_job_t *job, void (*done_cb)(hap_write_job_t *job))
+{
+    if (hap_write_exec_start() != HAP_SUCCESS) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to start the write executor");
+        return HAP_FAIL;
+    }
+    job->done_cb = done_cb;
+    if (xQueueSend(hap_write_exec_queue, &job, 0) != pdTRUE) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Write executor queue full");
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
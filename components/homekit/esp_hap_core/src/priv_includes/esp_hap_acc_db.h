@@ -0,0 +1,56 @@
+ /*
+  * ESPRESSIF MIT License
+  *
+  * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+  *
+  * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+  * it is free of charge, to any person obtaining a copy of this software and associated
+  * documentation files (the "Software"), to deal in the Software without restriction, including
+  * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+  * to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all copies or
+  * substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+  * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+  * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+  * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+  *
+  */
+#ifndef _HAP_ACC_DB_H_
+#define _HAP_ACC_DB_H_
+#include <stdint.h>
+#include <json_generator.h>
+#include <esp_hap_char.h>
+#include <esp_hap_http_stream.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* JSON for the characteristic fields, shared with the characteristic reads, writes
+ * and notifications
+ */
+int hap_add_char_val_json(hap_char_format_t format, char *key,
+		hap_val_t *val, json_gen_str_t *jptr);
+int hap_add_char_type(__hap_char_t *hc, json_gen_str_t *jptr);
+int hap_add_char_meta(__hap_char_t *hc, json_gen_str_t *jptr);
+int hap_add_char_perms(__hap_char_t *hc, json_gen_str_t *jptr);
+int hap_add_char_ev(__hap_char_t *hc, json_gen_str_t *jptr, uint8_t session_index);
+
+/* Generate the attribute database for the controller afresh, into the stream */
+void hap_prepare_json_database(hap_http_stream_t *s, int session_index);
+/* Stream the cached attribute database, with its slots filled in for the controller.
+ * The cache is (re)built first, if required. Returns HAP_FAIL if it cannot be used,
+ * in which case hap_prepare_json_database() has to be used instead.
+ */
+int hap_acc_db_cache_send(hap_http_stream_t *s, int session_index);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _HAP_ACC_DB_H_ */
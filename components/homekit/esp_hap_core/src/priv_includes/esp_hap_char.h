@@ -81,6 +81,18 @@ typedef struct  {
     uint8_t *valid_vals;
     size_t valid_vals_cnt;
     bool update_called;
+
+    /* Set if the characteristic is in the pending notifications list */
+    bool notif_pending;
+    hap_char_t *next_pending;
+    /* Minimum interval between notifications, 0 for no rate limiting */
+    uint32_t min_notif_interval_ms;
+    /* Time (in msec) at which the last notification was picked up */
+    int64_t last_notif_time;
+    /* Bitmap of controllers whose notification is held back till their deferred
+     * write response goes out
+     */
+    uint16_t held_ctrls;
 } __hap_char_t;
 
 void hap_char_manage_notification(hap_char_t *hc, int index, bool ev);
@@ -91,7 +103,9 @@ void hap_disable_all_char_notif(int index);
 int hap_char_check_val_constraints(__hap_char_t *_hc, hap_val_t *val);
 int hap_event_queue_init();
 int hap_event_queue_deinit();
-hap_char_t * hap_get_pending_notif_char();
+int hap_get_pending_notif_chars(hap_char_t **char_arr, int max_chars);
+void hap_char_hold_notif(hap_char_t *hc, int index);
+int hap_get_held_notif_chars(int index, hap_char_t **char_arr, int max_chars);
 #ifdef __cplusplus
 }
 #endif
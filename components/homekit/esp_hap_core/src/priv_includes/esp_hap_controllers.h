@@ -26,6 +26,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #define HAP_MAX_CONTROLLERS 16
 #define HAP_CTRL_ID_LEN		64
@@ -49,6 +50,15 @@ typedef struct {
     uint8_t index;
 } hap_ctrl_data_t;
 
+/* Copy of a controller's details, taken under the controller directory lock, so that
+ * it stays consistent even if the controller gets removed while it is being used.
+ */
+typedef struct {
+	hap_ctrl_data_t *ctrl;	/* Slot of the controller, to be handed over to the session */
+	char id[HAP_CTRL_ID_LEN];
+	uint8_t ltpk[ED_KEY_LEN];
+} hap_ctrl_snapshot_t;
+
 int hap_controllers_init();
 bool is_accessory_paired();
 bool is_admin_paired();
@@ -56,6 +66,11 @@ hap_ctrl_data_t *hap_controller_get_empty_loc();
 int hap_controller_save(hap_ctrl_data_t *ctrl_data);
 void hap_controller_remove(hap_ctrl_data_t *ctrl_data);
 hap_ctrl_data_t *hap_get_controller(char *ctrl_id);
+/* For use outside the HTTP server task, where controllers get removed */
+int hap_get_controller_snapshot(const char *ctrl_id, hap_ctrl_snapshot_t *snap);
+/* Verify an Ed25519 signature made by the controller, using its cached decoded public key */
+int hap_controller_verify(const hap_ctrl_snapshot_t *ctrl, const uint8_t *sig,
+        const uint8_t *msg, size_t msg_len);
 void hap_erase_controller_info();
 
 #endif /* _HAP_CONTROLLERS_H_ */
@@ -0,0 +1,98 @@
+ /*
+  * ESPRESSIF MIT License
+  *
+  * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+  *
+  * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+  * it is free of charge, to any person obtaining a copy of this software and associated
+  * documentation files (the "Software"), to deal in the Software without restriction, including
+  * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+  * to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all copies or
+  * substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+  * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+  * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+  * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+  *
+  */
+#ifndef _HAP_CRYPTO_EXEC_H_
+#define _HAP_CRYPTO_EXEC_H_
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Pair Setup and Pair Verify stages, named by the request they answer */
+typedef enum {
+    HAP_CRYPTO_STAGE_SETUP_M1 = 0,  /* M1 -> M2 */
+    HAP_CRYPTO_STAGE_SETUP_M3,      /* M3 -> M4 */
+    HAP_CRYPTO_STAGE_SETUP_M5,      /* M5 -> M6 */
+    HAP_CRYPTO_STAGE_VERIFY_M1,     /* M1 -> M2, including Pair Resume */
+    HAP_CRYPTO_STAGE_VERIFY_M3,     /* M3 -> M4 */
+    HAP_CRYPTO_STAGE_MAX,
+} hap_crypto_stage_t;
+
+/* Latencies are from the request being received to the response being sent */
+typedef struct {
+    uint32_t count;
+    uint32_t last_ms;
+    uint32_t max_ms;
+    uint32_t avg_ms;
+    uint32_t max_wait_ms;   /* Longest time spent waiting for the executor */
+} hap_crypto_stage_stats_t;
+
+/* A Pair Setup or Pair Verify request handed over to the crypto executor */
+typedef struct hap_crypto_job {
+    int (*process)(void **ctx, uint8_t *buf, int inlen, int bufsize, int *outlen);
+    void *ctx;                  /* Context passed to, and possibly replaced by, process */
+    int ret;                    /* Value returned by process */
+    int inlen;
+    int outlen;
+    int bufsize;
+    int fd;
+    hap_crypto_stage_t stage;
+    bool attached;              /* For use by the owner of the job, see hap_crypto_exec_detach() */
+    bool abandoned;             /* Processed, but could not be handed back to the owner */
+    int64_t received_us;
+    int64_t started_us;
+    void (*done_cb)(struct hap_crypto_job *job);
+    uint8_t buf[];              /* Request on submission, response once processed */
+} hap_crypto_job_t;
+
+/* Returns false if handshakes are configured to run in the HTTP server task itself */
+bool hap_crypto_exec_enabled(void);
+/* Returns true if CONFIG_HAP_MAX_CONCURRENT_HANDSHAKES jobs are already in flight */
+bool hap_crypto_exec_full(void);
+/* Allocates a job with a buffer of bufsize bytes, for a request received on fd */
+hap_crypto_job_t *hap_crypto_job_create(int fd, int bufsize);
+/* Queue a job for the executor task, which calls done_cb once process returns.
+ * done_cb gets the ownership of the job back. Fails if the executor is full.
+ */
+int hap_crypto_exec_submit(hap_crypto_job_t *job, void (*done_cb)(hap_crypto_job_t *job));
+/* Record the latency of a submitted job whose response has been sent (or dropped) and free it.
+ * Must be called from the same task as hap_crypto_exec_submit().
+ */
+void hap_crypto_exec_complete(hap_crypto_job_t *job);
+/* For done_cb, if it cannot hand the job back to the submitting task. The job stops
+ * counting as in flight. Returns true if the job is still attached, in which case it
+ * gets freed by the owner on hap_crypto_exec_detach(). Else, the caller has to free it.
+ */
+bool hap_crypto_exec_abandon(hap_crypto_job_t *job);
+/* Clears job->attached. Returns true if the job had been abandoned meanwhile, in which
+ * case the caller has to free it, rather than wait for it to come back.
+ */
+bool hap_crypto_exec_detach(hap_crypto_job_t *job);
+void hap_crypto_exec_get_stats(hap_crypto_stage_t stage, hap_crypto_stage_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _HAP_CRYPTO_EXEC_H_ */
@@ -56,6 +56,8 @@ typedef struct {
     char setup_hash_str[SETUP_HASH_LEN * 2 + 1];
 	uint8_t ltska[ED_KEY_LEN];
 	uint8_t ltpka[ED_KEY_LEN];
+    /* ltska followed by ltpka, the secret key form that crypto_sign_ed25519_detached() takes */
+    uint8_t ltska_sk[2 * ED_KEY_LEN];
 	hap_cid_t cid;
 	hap_ctrl_data_t controllers[HAP_MAX_CONTROLLERS];
 	hap_secure_session_t *sessions[HAP_MAX_SESSIONS];
@@ -90,6 +92,7 @@ char *hap_get_acc_id();
 int hap_get_next_aid();
 int hap_acc_setup_init();
 void hap_erase_accessory_info();
+void hap_wipe_accessory_keys();
 void hap_increment_and_save_config_num();
 void hap_increment_and_save_state_num();
 #endif /* _HAP_DATABASE_H_ */
@@ -0,0 +1,63 @@
+ /*
+  * ESPRESSIF MIT License
+  *
+  * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+  *
+  * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+  * it is free of charge, to any person obtaining a copy of this software and associated
+  * documentation files (the "Software"), to deal in the Software without restriction, including
+  * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+  * to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all copies or
+  * substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+  * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+  * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+  * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+  *
+  */
+#ifndef _HAP_ED25519_H_
+#define _HAP_ED25519_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HAP_ED25519_PK_LEN      32
+#define HAP_ED25519_SIG_LEN     64
+
+/* An Ed25519 public key along with its decoded (and negated) curve point.
+ * Decoding the point needs a field exponentiation, which
+ * crypto_sign_ed25519_verify_detached() would otherwise do on every call.
+ * The point is opaque here, and is sized for libsodium's ge25519_p3.
+ */
+typedef struct {
+    uint64_t point[20];
+    uint8_t bytes[HAP_ED25519_PK_LEN];
+    bool valid;
+} hap_ed25519_pk_t;
+
+/* Validate and decode a public key. The checks are the ones libsodium applies
+ * to the key on each verification, so a key that fails here would never verify.
+ */
+int hap_ed25519_pk_load(hap_ed25519_pk_t *pk, const uint8_t *bytes);
+/* Forget a decoded public key */
+void hap_ed25519_pk_clear(hap_ed25519_pk_t *pk);
+/* Verify a detached signature against a decoded public key.
+ * Equivalent to crypto_sign_ed25519_verify_detached() with pk->bytes.
+ */
+int hap_ed25519_verify(const hap_ed25519_pk_t *pk, const uint8_t *sig,
+        const uint8_t *msg, size_t msg_len);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _HAP_ED25519_H_ */
@@ -0,0 +1,60 @@
+ /*
+  * ESPRESSIF MIT License
+  *
+  * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+  *
+  * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+  * it is free of charge, to any person obtaining a copy of this software and associated
+  * documentation files (the "Software"), to deal in the Software without restriction, including
+  * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+  * to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all copies or
+  * substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+  * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+  * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+  * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+  *
+  */
+#ifndef _HAP_HKDF_H_
+#define _HAP_HKDF_H_
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The constant salts used by Pair Setup and Pair Verify */
+typedef enum {
+    HAP_HKDF_SALT_CONTROL = 0,          /* "Control-Salt" */
+    HAP_HKDF_SALT_PAIR_VERIFY_ENCRYPT,  /* "Pair-Verify-Encrypt-Salt" */
+    HAP_HKDF_SALT_RESUME_SESSION_ID,    /* "Pair-Verify-ResumeSessionID-Salt" */
+    HAP_HKDF_SALT_PAIR_SETUP_ENCRYPT,   /* "Pair-Setup-Encrypt-Salt" */
+    HAP_HKDF_SALT_PAIR_SETUP_CTRL_SIGN, /* "Pair-Setup-Controller-Sign-Salt" */
+    HAP_HKDF_SALT_PAIR_SETUP_ACC_SIGN,  /* "Pair-Setup-Accessory-Sign-Salt" */
+    HAP_HKDF_SALT_MAX,
+} hap_hkdf_salt_t;
+
+/* Key the HMAC-SHA512 contexts for all the salts, so that HKDF does not have to
+ * derive the padded key states again on every call.
+ */
+int hap_hkdf_init(void);
+/* HKDF-SHA512 of ikm, with one of the constant salts */
+int hap_hkdf(hap_hkdf_salt_t salt, const uint8_t *ikm, int ikm_len,
+        const char *info, uint8_t *okm, int okm_len);
+/* Two HKDF-SHA512 outputs for the same salt and ikm, with different info.
+ * The extract step, and keying HMAC with its output, are done just once.
+ */
+int hap_hkdf2(hap_hkdf_salt_t salt, const uint8_t *ikm, int ikm_len,
+        const char *info1, uint8_t *okm1, int okm1_len,
+        const char *info2, uint8_t *okm2, int okm2_len);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _HAP_HKDF_H_ */
@@ -0,0 +1,66 @@
+ /*
+  * ESPRESSIF MIT License
+  *
+  * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+  *
+  * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+  * it is free of charge, to any person obtaining a copy of this software and associated
+  * documentation files (the "Software"), to deal in the Software without restriction, including
+  * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+  * to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all copies or
+  * substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+  * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+  * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+  * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+  *
+  */
+#ifndef _HAP_HTTP_STREAM_H_
+#define _HAP_HTTP_STREAM_H_
+#include <stdbool.h>
+#include <json_generator.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bytes of JSON staged before being copied into the frames */
+#define HAP_HTTP_STREAM_JSON_BUF_SIZE   128
+
+/* Chunked HTTP response written straight into the encrypted frames of a session */
+typedef struct {
+    int fd;
+    const char *status;     /* Can be changed till the stream has started */
+    bool started;
+    bool err;
+    char *buf;              /* Payload area of the current chunk */
+    int buf_size;           /* Payload bytes that fit in the current chunk */
+    int len;                /* Payload bytes in the current chunk */
+    char json_buf[HAP_HTTP_STREAM_JSON_BUF_SIZE];
+} hap_http_stream_t;
+
+/* Initialise a stream for the response on a corked session. Nothing is sent till
+ * the first data is added, so the status can still be changed.
+ */
+int hap_http_stream_init(hap_http_stream_t *s, int fd, const char *status);
+/* Add raw body data to the stream */
+void hap_http_stream_add(hap_http_stream_t *s, const char *data, int len);
+/* Start a JSON generator whose output goes to the stream */
+void hap_http_stream_json_start(hap_http_stream_t *s, json_gen_str_t *jstr);
+/* End the generator, pushing out whatever it has staged */
+void hap_http_stream_json_end(hap_http_stream_t *s, json_gen_str_t *jstr);
+/* Send the last chunk. Returns HAP_FAIL if anything in the stream failed to go out */
+int hap_http_stream_end(hap_http_stream_t *s);
+/* Print the body of the streamed responses */
+void hap_http_stream_debug_enable(bool enable);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _HAP_HTTP_STREAM_H_ */
@@ -34,4 +34,6 @@ int hap_ip_services_stop();
 int hap_mdns_announce(bool first);
 int hap_mdns_deannounce();
 void hap_http_send_notif();
+void hap_http_rebuild_acc_index();
+void hap_acc_db_cache_invalidate();
 #endif /* _HAP_IP_SERVICES_H_ */
@@ -0,0 +1,58 @@
+ /*
+  * ESPRESSIF MIT License
+  *
+  * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+  *
+  * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+  * it is free of charge, to any person obtaining a copy of this software and associated
+  * documentation files (the "Software"), to deal in the Software without restriction, including
+  * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+  * to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all copies or
+  * substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+  * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+  * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+  * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+  *
+  */
+#ifndef _HAP_KEYPAIR_POOL_H_
+#define _HAP_KEYPAIR_POOL_H_
+#include <stdint.h>
+#include <esp_hap_pair_common.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint8_t sk[CURVE_KEY_LEN];
+    uint8_t pk[CURVE_KEY_LEN];
+} hap_curve_keypair_t;
+
+typedef struct {
+    uint32_t hits;          /* Key pairs taken from the pool */
+    uint32_t misses;        /* Key pairs generated on demand since the pool was empty */
+    uint32_t generated;     /* Key pairs generated in the background */
+    uint32_t available;     /* Key pairs ready in the pool right now */
+} hap_keypair_pool_stats_t;
+
+/* Start the low priority task that keeps CONFIG_HAP_KEYPAIR_POOL_SIZE ephemeral
+ * Curve25519 key pairs ready. Does nothing if the pool size is 0.
+ */
+int hap_keypair_pool_start(void);
+/* Get a fresh key pair, from the pool if available, else generated right away.
+ * Every key pair is handed out just once.
+ */
+int hap_keypair_pool_get(hap_curve_keypair_t *kp);
+void hap_keypair_pool_get_stats(hap_keypair_pool_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _HAP_KEYPAIR_POOL_H_ */
@@ -25,7 +25,72 @@
 #define _HAP_NETWORK_IO_H_
 #include <stdint.h>
 #include <hap_platform_httpd.h>
+#include <esp_hap_pair_common.h>
+
+#define HAP_MAX_NW_FRAME_SIZE	1024 /* As per HAP Specifications */
+#define AUTH_TAG_LEN            16
+typedef struct {
+	uint8_t pkt_size[2];
+	uint8_t data[HAP_MAX_NW_FRAME_SIZE];
+	/* The Poly auth tag buffer will get used only if the data length is
+	 * greater than HAP_MAX_NW_FRAME_SIZE - 16.
+	 * Else, the auth tag would be included in the data buffer itself
+	 */
+	uint8_t poly_auth_tag[AUTH_TAG_LEN];
+} hap_encrypt_frame_t;
+
+/* Counters for the encrypted data received for a request */
+typedef struct {
+	uint32_t frames;	/* Encrypted frames received */
+	uint32_t wire_bytes;	/* Bytes on the wire, including length and authTag */
+	uint32_t direct_frames;	/* Frames decrypted straight into the caller's buffer */
+	uint32_t copies;	/* Copies out of the staging buffer */
+	uint32_t copied_bytes;	/* Bytes copied out of the staging buffer */
+} hap_rx_stats_t;
+
+typedef struct hap_decrypt_frame {
+	uint16_t pkt_size;	/* Plaintext staged in data, 0 if nothing is staged */
+	uint16_t bytes_read;
+	uint8_t data[HAP_MAX_NW_FRAME_SIZE + AUTH_TAG_LEN];
+	hap_secure_session_t *session;
+	hap_rx_stats_t stats;
+} hap_decrypt_frame_t;
+
+/* Counters for the encrypted data sent for a response */
+typedef struct {
+	uint32_t frames;	/* Encrypted frames sent */
+	uint32_t payload_bytes;	/* Plaintext bytes */
+	uint32_t wire_bytes;	/* Bytes on the wire, including length and authTag */
+	uint32_t send_calls;	/* sendmsg() calls made */
+} hap_tx_stats_t;
+
 int hap_httpd_send(httpd_handle_t hd, int sockfd, const char *buf, unsigned buf_len, int flags);
 int hap_httpd_recv(httpd_handle_t hd, int sockfd, char *buf, unsigned buf_len, int flags);
+/* Start combining all the data sent on a verified session into full
+ * encrypted frames, till hap_httpd_tx_flush() is called.
+ * Returns HAP_FAIL (and does nothing) if the session is not verified.
+ */
+int hap_httpd_tx_cork(int sockfd);
+/* Seal the partially filled frame, send out all pending frames and end
+ * write combining for the session.
+ */
+int hap_httpd_tx_flush(int sockfd);
+/* Get the plaintext area of the next frame of a corked session, so that data can be
+ * written directly into it. If less than min_len bytes are free in the current frame,
+ * it is sealed as is and a fresh one is used. Returns the bytes free, or HAP_FAIL if
+ * the session is not corked.
+ */
+int hap_httpd_tx_get_buf(int sockfd, int min_len, uint8_t **buf);
+/* Mark len bytes written to the area returned by hap_httpd_tx_get_buf() as sent.
+ * The frame is sealed once it is full.
+ */
+int hap_httpd_tx_put_buf(int sockfd, int len);
+/* Get the counters for the last flushed response */
+void hap_httpd_tx_get_last_stats(hap_tx_stats_t *stats);
+/* Mark the end of a request on the session, saving and resetting its receive counters */
+void hap_httpd_rx_request_done(int sockfd);
+/* Get the receive counters for the last completed request */
+void hap_httpd_rx_get_last_stats(hap_rx_stats_t *stats);
+void hap_decrypt_frame_release(hap_secure_session_t *session);
 
 #endif /* _HAP_NETWORK_IO_H_ */
@@ -31,6 +31,7 @@
 #define CURVE_KEY_LEN		32
 #define ED_SIGN_LEN		64
 #define NONCE_LEN		8
+#define SESSION_ID_LEN		8
 
 #define STATE_M0		0
 #define STATE_M1		1
@@ -52,6 +53,7 @@ typedef enum {
 	HAP_METHOD_ADD_PAIRING = 3,
 	HAP_METHOD_REMOVE_PAIRING = 4,
 	HAP_METHOD_LIST_PAIRINGS = 5,
+	HAP_METHOD_PAIR_RESUME = 6,
 } hap_pairing_methods_t;
 
 
@@ -80,6 +82,7 @@ typedef enum {
 	kTLVType_Permissions = 0x0b,
 	kTLVType_FragmentedData = 0x0c,
 	kTLVType_FragmentLast = 0x0d,
+	kTLVType_SessionID = 0x0e,
     kTLVType_Flags = 0x13,
     kTLVType_OwnershipProofToken = 0x1A,
     kTLVType_ProductData = 0x1C,
@@ -92,6 +95,8 @@ typedef struct {
 	int curlen;
 } hap_tlv_data_t;
 
+struct hap_decrypt_frame;
+
 typedef struct {
 	uint8_t state;
 	uint8_t encrypt_key[ENCRYPT_KEY_LEN];
@@ -107,6 +112,10 @@ typedef struct {
 	 * Need to make this generic later.
 	 */
 	int conn_identifier;
+	/* Receive side frame state, bound to this session on its first
+	 * encrypted read and released along with the session.
+	 */
+	struct hap_decrypt_frame *rx_frame;
 } hap_secure_session_t;
 
 void hap_tlv_data_init(hap_tlv_data_t *tlv_data, uint8_t *buf, int buf_size);
@@ -0,0 +1,57 @@
+ /*
+  * ESPRESSIF MIT License
+  *
+  * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+  *
+  * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+  * it is free of charge, to any person obtaining a copy of this software and associated
+  * documentation files (the "Software"), to deal in the Software without restriction, including
+  * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+  * to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all copies or
+  * substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+  * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+  * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+  * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+  *
+  */
+#ifndef _HAP_REQ_ARENA_H_
+#define _HAP_REQ_ARENA_H_
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Usage of the request arena for the last request */
+typedef struct {
+    uint32_t peak_bytes;    /* Maximum arena bytes in use at any point */
+    uint32_t heap_bytes;    /* Bytes that had to be allocated from the heap instead */
+    uint32_t allocs;        /* Number of allocations */
+} hap_req_arena_stats_t;
+
+/* Allocate zeroed memory that stays valid till hap_req_arena_reset().
+ * The memory comes from a static arena of CONFIG_HAP_REQ_ARENA_SIZE bytes, and from
+ * the heap only once that is used up. Must be called only from the HTTP server task.
+ */
+void *hap_req_arena_calloc(size_t count, size_t size);
+/* Release memory allocated by hap_req_arena_calloc() before the reset. Only the
+ * last arena allocation is actually reclaimed. Heap memory is released on reset.
+ */
+void hap_req_arena_free(void *ptr);
+/* Release everything allocated for the current request */
+void hap_req_arena_reset(void);
+/* Get the usage for the last request that was reset */
+void hap_req_arena_get_last_stats(hap_req_arena_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _HAP_REQ_ARENA_H_ */
@@ -0,0 +1,61 @@
+ /*
+  * ESPRESSIF MIT License
+  *
+  * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+  *
+  * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+  * it is free of charge, to any person obtaining a copy of this software and associated
+  * documentation files (the "Software"), to deal in the Software without restriction, including
+  * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+  * to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all copies or
+  * substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+  * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+  * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+  * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+  *
+  */
+#ifndef _HAP_WRITE_EXEC_H_
+#define _HAP_WRITE_EXEC_H_
+#include <stdint.h>
+#include <hap.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A characteristic write deferred with hap_write_defer() */
+typedef struct hap_write_job {
+    struct hap_write_job *next;
+    hap_write_data_t write;     /* Copy of the write data, with its own value and authData */
+    hap_status_t status;        /* Status returned by the work */
+    hap_status_t *req_status;   /* Status pointer of the write in the request */
+    hap_write_work_t work;
+    void *priv;
+    void (*done_cb)(struct hap_write_job *job);
+    uint32_t id;                /* For use by the owner of the job */
+    int index;                  /* For use by the owner of the job */
+} hap_write_job_t;
+
+/* Start accepting hap_write_defer() calls, before invoking the write callbacks of a request */
+void hap_write_exec_begin(void);
+/* Stop accepting hap_write_defer() calls, and get the list of jobs deferred since
+ * hap_write_exec_begin(). The jobs are owned by the caller.
+ */
+hap_write_job_t *hap_write_exec_end(void);
+/* Queue a job for the executor task, which calls done_cb once the work is done.
+ * done_cb gets the ownership of the job back.
+ */
+int hap_write_exec_submit(hap_write_job_t *job, void (*done_cb)(hap_write_job_t *job));
+void hap_write_job_free(hap_write_job_t *job);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _HAP_WRITE_EXEC_H_ */
@@ -44,6 +44,12 @@ static inline void mu_bn_ctx_free(mu_bn_ctx_t *ctx)
      return BN_CTX_free(ctx);
 }
 
+/* BN_CTX is only scratch space, there is nothing to carry over */
+static inline mu_bn_ctx_t *mu_bn_ctx_dup(mu_bn_ctx_t *ctx)
+{
+     return BN_CTX_new();
+}
+
 static inline unsigned int mu_bn_sizeof(mu_bn_t *bn)
 {
      return BN_num_bytes(bn);
@@ -146,6 +152,19 @@ static inline void mu_bn_ctx_free(mu_bn_ctx_t *ctx)
     mu_bn_free((mu_bn_t *)ctx);
 }
 
+/* The ctx holds the Montgomery constant cached by mbedtls_mpi_exp_mod() for
+ * the modulus it was first used with. Copying it lets a new handle skip that.
+ */
+static inline mu_bn_ctx_t *mu_bn_ctx_dup(mu_bn_ctx_t *ctx)
+{
+    mu_bn_t *bn = mu_bn_new();
+    if (bn && mbedtls_mpi_copy(bn, (mu_bn_t *)ctx) != 0) {
+        mu_bn_free(bn);
+        return NULL;
+    }
+    return (mu_bn_ctx_t *)bn;
+}
+
 static inline unsigned int mu_bn_sizeof(mu_bn_t *bn)
 {
     return mbedtls_mpi_size(bn);
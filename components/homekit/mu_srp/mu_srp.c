@@ -74,6 +74,59 @@ static const char N_3072[] = {
 };
 char g_3072[] = { 5 };
 
+/* Values which depend only on the group and are the same for every session.
+ * They are built once and shared (read only) by all the handles.
+ */
+static struct {
+	int ready;
+	mu_bn_t *n;
+	mu_bn_t *g;
+	/* k = H(N | PAD(g)) */
+	mu_bn_t *k;
+	/* Primed with the Montgomery constant for N. Each handle gets a copy */
+	mu_bn_ctx_t *ctx;
+} ng_3072;
+
+static mu_bn_t *calculate_padded_hash(int len_n, const char *a, int len_a, char *b, int len_b);
+
+int mu_srp_group_init(mu_ng_type_t ng)
+{
+	mu_bn_t *one, *tmp;
+
+	if (ng != MU_NG_3072)
+		return -1;
+	if (ng_3072.ready)
+		return 0;
+
+	ng_3072.n = mu_bn_new_from_bin(N_3072, sizeof(N_3072));
+	ng_3072.g = mu_bn_new_from_bin(g_3072, sizeof(g_3072));
+	ng_3072.ctx = mu_bn_ctx_new();
+	srp_print("k-->");
+	ng_3072.k = calculate_padded_hash(sizeof(N_3072), N_3072, sizeof(N_3072), g_3072, sizeof(g_3072));
+	if (!ng_3072.n || !ng_3072.g || !ng_3072.ctx || !ng_3072.k)
+		goto error;
+
+	/* A throw away g^1 makes the backend compute and cache the Montgomery
+	 * constant in ctx, so that no handle has to do it again.
+	 */
+	one = mu_bn_new_from_bin("\x01", 1);
+	tmp = mu_bn_new();
+	if (one && tmp)
+		mu_bn_a_exp_b_mod_c(tmp, ng_3072.g, one, ng_3072.n, ng_3072.ctx);
+	mu_bn_free(one);
+	mu_bn_free(tmp);
+
+	ng_3072.ready = 1;
+	return 0;
+ error:
+	mu_bn_free(ng_3072.n);
+	mu_bn_free(ng_3072.g);
+	mu_bn_free(ng_3072.k);
+	if (ng_3072.ctx)
+		mu_bn_ctx_free(ng_3072.ctx);
+	memset(&ng_3072, 0, sizeof(ng_3072));
+	return -1;
+}
 
 int mu_srp_init(mu_srp_handle_t *hd, mu_ng_type_t ng)
 {
@@ -83,23 +136,21 @@ int mu_srp_init(mu_srp_handle_t *hd, mu_ng_type_t ng)
 	memset(hd, 0, sizeof(*hd));
 	hd->allocated = 1;
 
-	hd->ctx = mu_bn_ctx_new();
-	if (! hd->ctx)
+	if (mu_srp_group_init(ng) < 0)
 		goto error;
-	if (ng != MU_NG_3072)
+
+	hd->ctx = mu_bn_ctx_dup(ng_3072.ctx);
+	if (! hd->ctx)
 		goto error;
 
-	hd->n = mu_bn_new_from_bin(N_3072, sizeof(N_3072));
+	/* N and g are shared by all the handles and must not be freed */
+	hd->n = ng_3072.n;
 	hd->bytes_n = N_3072;
 	hd->len_n = sizeof(N_3072);
-	if (! hd->n)
-		goto error;
 
-	hd->g = mu_bn_new_from_bin(g_3072, sizeof(g_3072));
+	hd->g = ng_3072.g;
 	hd->bytes_g = g_3072;
 	hd->len_g = sizeof(g_3072);
-	if (! hd->g)
-		goto error;
 	hd->type = ng;
 	return 0;
  error:
@@ -114,10 +165,6 @@ void mu_srp_free(mu_srp_handle_t *hd)
 
 	if (hd->ctx)
 		mu_bn_ctx_free(hd->ctx);
-	if (hd->n)
-		mu_bn_free(hd->n);
-	if (hd->g)
-		mu_bn_free(hd->g);
 	if (hd->s)
 		mu_bn_free(hd->s);
 	if (hd->bytes_s)
@@ -130,6 +177,8 @@ void mu_srp_free(mu_srp_handle_t *hd)
 		free(hd->bytes_B);
 	if (hd->b)
 		mu_bn_free(hd->b);
+	if (hd->gb)
+		mu_bn_free(hd->gb);
 	if (hd->A)
 		mu_bn_free(hd->A);
 	if (hd->bytes_A)
@@ -160,7 +209,7 @@ static mu_bn_t *calculate_x(char *bytes_salt, int salt_len, const char *username
 	return mu_bn_new_from_bin((char *)digest, sizeof(digest));
 }
 
-static mu_bn_t *calculate_padded_hash(mu_srp_handle_t *hd, const char *a, int len_a, char *b, int len_b)
+static mu_bn_t *calculate_padded_hash(int len_n, const char *a, int len_a, char *b, int len_b)
 {
 	unsigned char digest[SHA512HashSize];
 	SHA512Context ctx;
@@ -168,9 +217,9 @@ static mu_bn_t *calculate_padded_hash(mu_srp_handle_t *hd, const char *a, int le
 	char *s = NULL;
 
 	if (len_a > len_b) {
-		pad_len = hd->len_n - len_b;
+		pad_len = len_n - len_b;
 	} else {
-		pad_len = hd->len_n - len_a;
+		pad_len = len_n - len_a;
 	}
 
     if (pad_len) {
@@ -182,15 +231,15 @@ static mu_bn_t *calculate_padded_hash(mu_srp_handle_t *hd, const char *a, int le
 
 	SHA512Reset(&ctx);
 	/* PAD (a) */
-	if (s && (len_a != hd->len_n)) {
-		SHA512Input(&ctx, (unsigned char *)s, hd->len_n - len_a);
+	if (s && (len_a != len_n)) {
+		SHA512Input(&ctx, (unsigned char *)s, len_n - len_a);
 	}
 
 	SHA512Input(&ctx, (unsigned char *)a, len_a);
 
 	/* PAD (b) */
-	if (s && (len_b != hd->len_n)) {
-		SHA512Input(&ctx, (unsigned char *)s, hd->len_n - len_b);
+	if (s && (len_b != len_n)) {
+		SHA512Input(&ctx, (unsigned char *)s, len_n - len_b);
 	}
 
 	SHA512Input(&ctx, (unsigned char *)b, len_b);
@@ -205,60 +254,62 @@ static mu_bn_t *calculate_padded_hash(mu_srp_handle_t *hd, const char *a, int le
 	return mu_bn_new_from_bin((char *)digest, sizeof(digest));
 }
 
-/* k = SHA (N, PAD(g))
- *
- * https://tools.ietf.org/html/draft-ietf-tls-srp-08
- */
-static mu_bn_t *calculate_k(mu_srp_handle_t *hd)
-{
-	srp_print("k-->");
-	return calculate_padded_hash(hd, hd->bytes_n, hd->len_n, hd->bytes_g, hd->len_g);
-}
-
 static mu_bn_t *calculate_u(mu_srp_handle_t *hd, char *A, int len_A)
 {
 	srp_print("u-->");
-	return calculate_padded_hash(hd, A, len_A, hd->bytes_B, hd->len_B);
+	return calculate_padded_hash(hd->len_n, A, len_A, hd->bytes_B, hd->len_B);
 }
 
-int __mu_srp_srv_pubkey(mu_srp_handle_t *hd, char **bytes_B, int *len_B)
+int mu_srp_precompute_b(mu_srp_handle_t *hd)
 {
-	mu_bn_t *k = calculate_k(hd);
-	mu_bn_t *kv = NULL;
-	mu_bn_t *gb = NULL;
-	if (!k)
-		goto error;
+	if (hd->gb)
+		return 0;
 
 	hd->b = mu_bn_new();
-	if (!hd->b)
+	hd->gb = mu_bn_new();
+	if (!hd->b || !hd->gb)
 		goto error;
 	mu_bn_get_rand(hd->b, 256, -1, 0);
 	hex_dbg_bn("b", hd->b);
 
+	mu_bn_a_exp_b_mod_c(hd->gb, hd->g, hd->b, hd->n, hd->ctx);
+	return 0;
+ error:
+	if (hd->b) {
+		mu_bn_free(hd->b);
+		hd->b = NULL;
+	}
+	if (hd->gb) {
+		mu_bn_free(hd->gb);
+		hd->gb = NULL;
+	}
+	return -1;
+}
+
+int __mu_srp_srv_pubkey(mu_srp_handle_t *hd, char **bytes_B, int *len_B)
+{
+	mu_bn_t *kv = NULL;
+
+	/* g^b may already have been computed ahead of time */
+	if (mu_srp_precompute_b(hd) < 0)
+		goto error;
+
 	/* B = kv + g^b */
 	kv = mu_bn_new();
-	gb = mu_bn_new();
 	hd->B = mu_bn_new();
-	if (!kv || !gb || ! hd->B)
+	if (!kv || ! hd->B)
 		goto error;
-	mu_bn_a_mul_b_mod_c(kv, k, hd->v, hd->n, hd->ctx);
-	mu_bn_a_exp_b_mod_c(gb, hd->g, hd->b, hd->n, hd->ctx);
-	mu_bn_a_add_b_mod_c(hd->B, kv, gb, hd->n, hd->ctx);
+	mu_bn_a_mul_b_mod_c(kv, ng_3072.k, hd->v, hd->n, hd->ctx);
+	mu_bn_a_add_b_mod_c(hd->B, kv, hd->gb, hd->n, hd->ctx);
 	hd->bytes_B = mu_bn_to_bin(hd->B, len_B);
 	hd->len_B = *len_B;
 	*bytes_B = hd->bytes_B;
 
-	mu_bn_free(k);
 	mu_bn_free(kv);
-	mu_bn_free(gb);
 	return 0;
  error:
-	if (k)
-		mu_bn_free(k);
 	if (kv)
 		mu_bn_free(kv);
-	if (gb)
-		mu_bn_free(gb);
 	if (hd->B) {
 		mu_bn_free(hd->B);
 		hd->B = NULL;
@@ -267,6 +318,10 @@ int __mu_srp_srv_pubkey(mu_srp_handle_t *hd, char **bytes_B, int *len_B)
 		mu_bn_free(hd->b);
 		hd->b = NULL;
 	}
+	if (hd->gb) {
+		mu_bn_free(hd->gb);
+		hd->gb = NULL;
+	}
 	return -1;
 	
 }
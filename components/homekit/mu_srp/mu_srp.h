@@ -39,6 +39,8 @@ typedef struct mu_srp_handle {
 	int      len_B;
 	/* b */
 	mu_bn_t *b;
+	/* g^b */
+	mu_bn_t *gb;
 	/* A */
 	mu_bn_t *A;
 	char    *bytes_A;
@@ -47,6 +49,12 @@ typedef struct mu_srp_handle {
 	char *session_key;
 } mu_srp_handle_t;
 
+/* Build N, g, k and the Montgomery context for the group. These are shared by
+ * all the handles and built only once. mu_srp_init() does this implicitly, but
+ * it should be called once up front if handles get created from several tasks.
+ */
+int mu_srp_group_init(mu_ng_type_t ng);
+
 int mu_srp_init(mu_srp_handle_t *hd, mu_ng_type_t ng);
 
 void mu_srp_free(mu_srp_handle_t *hd);
@@ -73,6 +81,13 @@ int mu_srp_set_salt_verifier(mu_srp_handle_t *hd, const char *salt, int salt_len
  */
 int mu_srp_srv_pubkey_from_salt_verifier(mu_srp_handle_t *hd, char **bytes_B, int *len_B);
 
+/* Generate b and g^b, the expensive part of B, on an initialised handle.
+ * This does not need the salt or verifier, so it can be done ahead of time.
+ * If already done, mu_srp_srv_pubkey() and mu_srp_srv_pubkey_from_salt_verifier()
+ * use these values. Each handle must be used for only one session.
+ */
+int mu_srp_precompute_b(mu_srp_handle_t *hd);
+
 /* Returns bytes_key
  * *bytes_key MUST NOT BE FREED BY THE CALLER
  */
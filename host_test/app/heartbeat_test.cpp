@@ -0,0 +1,284 @@
+// 心跳 v1/v2 解析与统计：
+//   - 逐个检查 corpus/heartbeat 下的种子，ok-* 必须接受、bad-* 必须拒绝
+//   - 对种子做随机变异（翻转位、改字节、截断、加长、拼接），结果必须与按协议文档另写的参考解析一致
+//   - 序号、丢包、乱序、往返时间统计
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <strings.h>
+#include <vector>
+
+#include "check.h"
+#include "heartbeat.h"
+
+#define MUTATIONS_PER_SEED 20000
+#define MAX_PACKET 128 // 与心跳任务的接收缓冲区一致
+
+static const uint8_t kMac[6] = {0x22, 0x33, 0x4d, 0x06, 0x43, 0xed};
+
+// 参考解析：照 heartbeat.h 的协议说明逐字段写，不共用实现代码
+static bool reference_parse(const std::vector<uint8_t> &p, Heartbeat *out) {
+  auto le32 = [&](size_t off) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--)
+      v = v << 8 | p[off + i];
+    return v;
+  };
+  if (p.size() == 28 && p[0] == 'H' && p[1] == 'B' && p[2] == 'T' && p[3] == '2') {
+    if (p[4] != 2 || p[5] != 1)
+      return false;
+    memcpy(out->mac, &p[6], 6);
+    out->version = 2;
+    out->seq = le32(12);
+    out->timestamp_ms = le32(16);
+    out->echo_ms = le32(20);
+    out->hold_ms = le32(24);
+    return true;
+  }
+  static const char prefix[] = "HEARTBEAT|";
+  if (p.size() < 22 || memcmp(p.data(), prefix, 10) != 0)
+    return false;
+  for (int i = 0; i < 6; i++) {
+    char hex[3] = {(char)p[10 + 2 * i], (char)p[11 + 2 * i], 0};
+    if (!isxdigit((unsigned char)hex[0]) || !isxdigit((unsigned char)hex[1]))
+      return false;
+    out->mac[i] = (uint8_t)strtoul(hex, nullptr, 16);
+  }
+  out->version = 1;
+  out->seq = out->timestamp_ms = out->echo_ms = out->hold_ms = 0;
+  return true;
+}
+
+static bool same_beat(const Heartbeat &a, const Heartbeat &b) {
+  return !memcmp(a.mac, b.mac, 6) && a.version == b.version && a.seq == b.seq &&
+         a.timestamp_ms == b.timestamp_ms && a.echo_ms == b.echo_ms && a.hold_ms == b.hold_ms;
+}
+
+// 解析结果必须与参考解析一致；缓冲区按实际长度分配，越界读由 sanitizer 抓出
+static bool check_packet(const std::vector<uint8_t> &packet, const char *what) {
+  std::vector<uint8_t> exact(packet);
+  Heartbeat beat, expected;
+  bool ok = heartbeat_parse(exact.data(), exact.size(), &beat);
+  bool expect = reference_parse(packet, &expected);
+  CHECK(ok == expect, "%s (%zu bytes): parse %d, reference %d", what, packet.size(), ok, expect);
+  if (ok && expect)
+    CHECK(same_beat(beat, expected), "%s (%zu bytes): fields differ", what, packet.size());
+  return ok;
+}
+
+static std::vector<std::pair<std::string, std::vector<uint8_t>>> load_corpus(const char *dir) {
+  std::vector<std::pair<std::string, std::vector<uint8_t>>> seeds;
+  for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+    std::ifstream in(entry.path(), std::ios::binary);
+    seeds.emplace_back(entry.path().filename().string(),
+                       std::vector<uint8_t>(std::istreambuf_iterator<char>(in), {}));
+  }
+  std::sort(seeds.begin(), seeds.end());
+  return seeds;
+}
+
+static void test_corpus(const std::vector<std::pair<std::string, std::vector<uint8_t>>> &seeds) {
+  CHECK(!seeds.empty(), "empty corpus");
+  for (const auto &seed : seeds) {
+    bool ok = check_packet(seed.second, seed.first.c_str());
+    bool expect = seed.first.compare(0, 3, "ok-") == 0;
+    CHECK(ok == expect, "%s: %s", seed.first.c_str(), ok ? "accepted" : "rejected");
+  }
+}
+
+static void mutate(std::vector<uint8_t> &p, const std::vector<uint8_t> &other) {
+  int steps = 1 + rng() % 4;
+  while (steps--) {
+    switch (rng() % 6) {
+    case 0: // 翻转一位
+      if (!p.empty())
+        p[rng() % p.size()] ^= (uint8_t)(1 << (rng() % 8));
+      break;
+    case 1: // 改成随机字节或十六进制边界字符
+      if (!p.empty()) {
+        static const uint8_t edge[] = {0, '/', '0', '9', ':', '@', 'A', 'F', 'G', '`', 'a', 'f', 'g', 0xff};
+        p[rng() % p.size()] = rng() % 2 ? (uint8_t)rng() : edge[rng() % sizeof(edge)];
+      }
+      break;
+    case 2: // 截断
+      p.resize(p.empty() ? 0 : rng() % p.size());
+      break;
+    case 3: // 加长
+      p.resize(std::min<size_t>(p.size() + 1 + rng() % 8, MAX_PACKET), (uint8_t)rng());
+      break;
+    case 4: // 与另一个种子拼接
+      if (!other.empty()) {
+        size_t cut = rng() % (p.size() + 1);
+        size_t from = rng() % other.size();
+        p.resize(cut);
+        p.insert(p.end(), other.begin() + from, other.end());
+        if (p.size() > MAX_PACKET)
+          p.resize(MAX_PACKET);
+      }
+      break;
+    default: // 改成正好 22 或 28 字节，落到两种格式的长度判断上
+      p.resize(rng() % 2 ? 22 : HEARTBEAT_V2_SIZE, (uint8_t)rng());
+      break;
+    }
+  }
+}
+
+static void test_mutations(const std::vector<std::pair<std::string, std::vector<uint8_t>>> &seeds) {
+  HeartbeatStats stats;
+  uint32_t accepted = 0;
+  for (size_t i = 0; i < seeds.size(); i++) {
+    for (int n = 0; n < MUTATIONS_PER_SEED; n++) {
+      std::vector<uint8_t> p = seeds[i].second;
+      mutate(p, seeds[rng() % seeds.size()].second);
+      if (check_packet(p, seeds[i].first.c_str())) {
+        Heartbeat beat;
+        heartbeat_parse(p.data(), p.size(), &beat);
+        stats.on_heartbeat(beat, rng());
+        accepted++;
+      }
+    }
+  }
+  // 任意输入都不能让统计失去意义
+  CHECK(stats.received == accepted, "received %u, accepted %u", stats.received, accepted);
+  CHECK(stats.rtt_last_ms < 10000 && stats.rtt_avg_ms < 10000, "rtt %u/%u", stats.rtt_last_ms,
+        stats.rtt_avg_ms);
+  printf("mutations: %u of %zu accepted\n", accepted, seeds.size() * MUTATIONS_PER_SEED);
+}
+
+static void test_ack() {
+  Heartbeat beat = {};
+  memcpy(beat.mac, kMac, 6);
+  beat.version = 2;
+  beat.seq = 9;
+  beat.timestamp_ms = 555;
+  uint8_t ack[HEARTBEAT_V2_SIZE];
+  CHECK(heartbeat_build_ack(ack, beat, 777) == HEARTBEAT_V2_SIZE, "ack length");
+  CHECK(ack[5] == HEARTBEAT_TYPE_ACK, "ack type");
+  // 应答不是心跳，电脑发回来也不应被当成心跳
+  Heartbeat echo;
+  CHECK(!heartbeat_parse(ack, sizeof(ack), &echo), "ack parsed as a heartbeat");
+  ack[5] = HEARTBEAT_TYPE_BEAT;
+  CHECK(heartbeat_parse(ack, sizeof(ack), &echo) && echo.seq == 9 && echo.timestamp_ms == 777 &&
+            echo.echo_ms == 555 && echo.hold_ms == 0 && !memcmp(echo.mac, kMac, 6),
+        "ack fields");
+}
+
+static void test_stats() {
+  HeartbeatStats stats;
+  Heartbeat beat = {};
+  beat.version = 2;
+  // 第一个心跳只做同步；15 跳过 13、14；14 晚到；5000 跳变过大，重新同步
+  for (uint32_t seq : {10u, 11u, 12u, 15u, 14u, 16u, 5000u, 5001u}) {
+    beat.seq = seq;
+    stats.on_heartbeat(beat, 0);
+  }
+  CHECK(stats.received == 8 && stats.lost == 2 && stats.late == 1, "received %u lost %u late %u",
+        stats.received, stats.lost, stats.late);
+
+  // 序号回绕不算丢包
+  HeartbeatStats wrap;
+  for (uint32_t seq : {0xfffffffeu, 0xffffffffu, 0u, 1u}) {
+    beat.seq = seq;
+    wrap.on_heartbeat(beat, 0);
+  }
+  CHECK(wrap.lost == 0 && wrap.late == 0, "wrap: lost %u late %u", wrap.lost, wrap.late);
+
+  // rtt = now - echo - hold，平均值按 1/8 滑动
+  beat.seq = 2;
+  beat.echo_ms = 1000;
+  beat.hold_ms = 950;
+  wrap.on_heartbeat(beat, 2080);
+  CHECK(wrap.rtt_last_ms == 130 && wrap.rtt_min_ms == 130 && wrap.rtt_avg_ms == 130, "rtt %u/%u/%u",
+        wrap.rtt_last_ms, wrap.rtt_min_ms, wrap.rtt_avg_ms);
+  beat.seq = 3;
+  beat.echo_ms = 2000;
+  beat.hold_ms = 990;
+  wrap.on_heartbeat(beat, 3010);
+  CHECK(wrap.rtt_last_ms == 20 && wrap.rtt_min_ms == 20 && wrap.rtt_avg_ms == 130 - 14,
+        "rtt %u/%u/%u", wrap.rtt_last_ms, wrap.rtt_min_ms, wrap.rtt_avg_ms);
+  // echo 比 now 还新（时钟错乱）的样本丢弃
+  beat.seq = 4;
+  beat.echo_ms = 5000;
+  beat.hold_ms = 0;
+  wrap.on_heartbeat(beat, 4000);
+  CHECK(wrap.rtt_last_ms == 20, "bogus rtt kept: %u", wrap.rtt_last_ms);
+
+  // v1 只计数
+  HeartbeatStats v1;
+  beat.version = 1;
+  beat.echo_ms = 1;
+  v1.on_heartbeat(beat, 100);
+  CHECK(v1.received == 1 && v1.rtt_last_ms == 0, "v1 stats");
+}
+
+// 原先的做法：收到的文本与存好的 MAC 逐次 snprintf 后比较（缓冲区以 0 结尾）
+static bool old_text_match(const char *buf) {
+  if (strncmp(buf, "HEARTBEAT|", 10) != 0)
+    return false;
+  char mac_str[13];
+  snprintf(mac_str, sizeof(mac_str), "%02X%02X%02X%02X%02X%02X", kMac[0], kMac[1], kMac[2],
+           kMac[3], kMac[4], kMac[5]);
+  return strncasecmp(buf + 10, mac_str, 12) == 0;
+}
+
+template <typename F> static double bench_ns(F f) {
+  double best = 1e18;
+  volatile int sink = 0;
+  for (int run = 0; run < 50; run++) {
+    double start = now_us();
+    for (int i = 0; i < 10000; i++)
+      sink += f(i);
+    double ns = (now_us() - start) * 1000 / 10000;
+    if (ns < best)
+      best = ns;
+  }
+  return best;
+}
+
+static void bench() {
+  static const char v1[] = "HEARTBEAT|22334D0643ED";
+  uint8_t v2[HEARTBEAT_V2_SIZE];
+  Heartbeat beat = {};
+  memcpy(beat.mac, kMac, 6);
+  heartbeat_build_ack(v2, beat, 1000);
+  v2[5] = HEARTBEAT_TYPE_BEAT;
+  HeartbeatStats stats;
+
+  printf("old text + snprintf:  %6.1f ns/packet\n", bench_ns([&](int) { return (int)old_text_match(v1); }));
+  printf("v1 parse:             %6.1f ns/packet\n", bench_ns([&](int) {
+           Heartbeat b;
+           return (int)heartbeat_parse((const uint8_t *)v1, sizeof(v1) - 1, &b);
+         }));
+  printf("v2 parse:             %6.1f ns/packet\n", bench_ns([&](int) {
+           Heartbeat b;
+           return (int)heartbeat_parse(v2, sizeof(v2), &b);
+         }));
+  printf("v2 parse + stats:     %6.1f ns/packet\n", bench_ns([&](int i) {
+           Heartbeat b;
+           v2[12] = (uint8_t)i;
+           heartbeat_parse(v2, sizeof(v2), &b);
+           stats.on_heartbeat(b, 1000 + i);
+           return (int)b.seq;
+         }));
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("usage: %s <corpus dir> [--bench]\n", argv[0]);
+    return 2;
+  }
+  auto seeds = load_corpus(argv[1]);
+  test_corpus(seeds);
+  test_mutations(seeds);
+  test_ack();
+  test_stats();
+
+  if (check_bench(argc, argv))
+    bench();
+  return check_summary();
+}
@@ -0,0 +1,350 @@
+// 电脑在线状态机的状态转换、重发退避、故障和开机耗时直方图，用假时钟驱动：时间只在事件或 next_deadline() 之间跳跃，
+// 与 presence_run() 在设备上只在心跳到达或截止时间到期时醒来一致。
+#include <cstring>
+#include <vector>
+
+#include "check.h"
+#include "presence.h"
+
+#define NEVER PresenceMachine::kNoDeadline
+
+// 假时钟：按时间顺序投递心跳和截止时间，记录状态机要求的动作
+struct FakeClock {
+  PresenceMachine &machine;
+  uint64_t now_ms = 0;
+  uint64_t heartbeat_period_ms = 0; // 0 表示电脑没有心跳
+  uint64_t next_heartbeat_ms = NEVER;
+  int ticks = 0;                     // on_tick() 调用次数，即设备被唤醒的次数
+  std::vector<uint64_t> wol_ms;      // 每次要求重发 WOL 的时间
+  std::vector<uint64_t> shutdown_ms; // 每次要求重发关机指令的时间
+
+  explicit FakeClock(PresenceMachine &m) : machine(m) {}
+
+  // 电脑开始（period > 0）或停止（period = 0）发心跳
+  void heartbeats(uint64_t period_ms) {
+    heartbeat_period_ms = period_ms;
+    next_heartbeat_ms = period_ms ? now_ms + period_ms : NEVER;
+  }
+
+  // 投递 until_ms（含）之前最早的一个心跳或截止时间，没有则把时钟拨到 until_ms；
+  // 返回 1 表示状态变化，0 表示没有，-1 表示没有可投递的了
+  int step(uint64_t until_ms) {
+    uint64_t deadline = machine.next_deadline();
+    uint64_t next = deadline < next_heartbeat_ms ? deadline : next_heartbeat_ms;
+    if (next == NEVER || next > until_ms) {
+      if (until_ms != NEVER)
+        now_ms = until_ms;
+      return -1;
+    }
+    now_ms = next;
+    bool changed;
+    if (next == next_heartbeat_ms) {
+      next_heartbeat_ms += heartbeat_period_ms;
+      changed = machine.on_heartbeat(now_ms);
+    } else {
+      ticks++;
+      changed = machine.on_tick(now_ms);
+    }
+    uint8_t actions = machine.take_actions();
+    if (actions & PRESENCE_ACTION_SEND_WOL)
+      wol_ms.push_back(now_ms);
+    if (actions & PRESENCE_ACTION_SEND_SHUTDOWN)
+      shutdown_ms.push_back(now_ms);
+    return changed;
+  }
+
+  // 运行到 until_ms
+  void advance(uint64_t until_ms) {
+    while (step(until_ms) >= 0) {
+    }
+  }
+
+  // 运行到下一次状态变化，永远不会变化时返回 false
+  bool next_change() {
+    int result;
+    while ((result = step(NEVER)) == 0) {
+    }
+    return result > 0;
+  }
+};
+
+static PresenceMachine::Config config() {
+  PresenceMachine::Config c;
+  c.heartbeat_timeout_ms = 2000;
+  c.wake_timeout_ms = 30000;
+  c.shutdown_timeout_ms = 60000;
+  c.wake_retry_ms = 1000;
+  c.shutdown_retry_ms = 3000;
+  c.retry_max_ms = 8000;
+  return c;
+}
+
+// 离线时没有截止时间，状态机不会唤醒设备
+static void test_idle() {
+  PresenceMachine m(config());
+  FakeClock clock(m);
+  CHECK(m.state() == PresenceState::Offline && !m.switch_on() && !m.fault(), "initial state");
+  CHECK(m.next_deadline() == NEVER, "deadline while offline");
+  clock.advance(3600 * 1000);
+  CHECK(clock.ticks == 0, "woke %d times while offline", clock.ticks);
+}
+
+static void test_wake() {
+  PresenceMachine m(config());
+  FakeClock clock(m);
+  clock.now_ms = 1000;
+  CHECK(m.on_wake_requested(clock.now_ms), "wake request");
+  CHECK(m.state() == PresenceState::Waking && m.switch_on(), "waking shows on");
+
+  // 4.5 秒后电脑开始发心跳
+  clock.advance(5500);
+  clock.heartbeats(1000);
+  CHECK(clock.next_change() && m.state() == PresenceState::Online, "online after the heartbeat");
+  CHECK(clock.now_ms == 6500, "online at %llu", (unsigned long long)clock.now_ms);
+  uint32_t latency = 0;
+  CHECK(m.take_wake_latency(&latency) && latency == 5500, "wake latency %u", latency);
+  CHECK(!m.take_wake_latency(&latency), "wake latency taken twice");
+  CHECK(!m.fault(), "fault after a wake");
+}
+
+static void test_wake_timeout() {
+  PresenceMachine m(config());
+  FakeClock clock(m);
+  m.on_wake_requested(0);
+  CHECK(clock.next_change(), "wake never timed out");
+  CHECK(clock.now_ms == 30000, "timed out at %llu", (unsigned long long)clock.now_ms);
+  CHECK(m.state() == PresenceState::Offline && !m.switch_on() && m.fault(), "after wake timeout");
+  uint32_t latency = 0;
+  CHECK(!m.take_wake_latency(&latency), "latency for a failed wake");
+  CHECK(m.next_deadline() == NEVER, "deadline after wake timeout");
+}
+
+// Online 时心跳停止，heartbeat_timeout_ms 后离线
+static void test_heartbeat_timeout() {
+  PresenceMachine m(config());
+  FakeClock clock(m);
+  clock.heartbeats(1000);
+  CHECK(clock.next_change() && m.state() == PresenceState::Online, "online on a heartbeat");
+  CHECK(!m.fault(), "fault on an unrequested start");
+
+  clock.advance(20000);
+  CHECK(m.state() == PresenceState::Online && clock.ticks == 0,
+        "online with heartbeats: woke %d times", clock.ticks);
+  clock.heartbeats(0);
+  CHECK(clock.next_change() && m.state() == PresenceState::Offline, "offline without heartbeats");
+  // 最后一个心跳在 20000
+  CHECK(clock.now_ms == 22000, "offline at %llu", (unsigned long long)clock.now_ms);
+  CHECK(!m.fault(), "fault on an unrequested stop");
+}
+
+static void test_shutdown() {
+  PresenceMachine m(config());
+  FakeClock clock(m);
+  clock.heartbeats(1000);
+  clock.advance(10000);
+  CHECK(m.on_shutdown_requested(clock.now_ms), "shutdown request");
+  CHECK(m.state() == PresenceState::ShuttingDown && !m.switch_on(), "shutting down shows off");
+
+  // 电脑 5 秒后关机
+  clock.advance(15000);
+  clock.heartbeats(0);
+  CHECK(clock.next_change() && m.state() == PresenceState::Offline, "offline after shutdown");
+  CHECK(clock.now_ms == 17000, "offline at %llu", (unsigned long long)clock.now_ms);
+  CHECK(!m.fault(), "fault after a shutdown");
+}
+
+// 关机超时电脑仍有心跳：回到 Online 并置故障
+static void test_shutdown_failed() {
+  PresenceMachine m(config());
+  FakeClock clock(m);
+  clock.heartbeats(1000);
+  clock.advance(10000);
+  m.on_shutdown_requested(clock.now_ms);
+  CHECK(clock.next_change(), "shutdown never timed out");
+  CHECK(clock.now_ms == 70000, "shutdown timed out at %llu", (unsigned long long)clock.now_ms);
+  CHECK(m.state() == PresenceState::Online && m.switch_on() && m.fault(), "after failed shutdown");
+}
+
+// Waking 时取消：直接离线；若电脑其实已经开机，下一个心跳把状态拉回 Online
+static void test_cancel_wake() {
+  PresenceMachine m(config());
+  FakeClock clock(m);
+  m.on_wake_requested(0);
+  clock.advance(3000);
+  CHECK(m.on_shutdown_requested(clock.now_ms), "cancel wake");
+  CHECK(m.state() == PresenceState::Offline && !m.switch_on() && !m.fault(), "after cancel");
+  CHECK(m.next_deadline() == NEVER, "deadline after cancel");
+  size_t wol = clock.wol_ms.size();
+  clock.advance(60000);
+  CHECK(clock.wol_ms.size() == wol, "WOL resent after cancel");
+
+  clock.heartbeats(1000);
+  CHECK(clock.next_change() && m.state() == PresenceState::Online, "online after cancel");
+  uint32_t latency = 0;
+  CHECK(!m.take_wake_latency(&latency), "latency for a cancelled wake");
+}
+
+// ShuttingDown 时再开机：回到 Waking，心跳仍在则马上 Online
+static void test_wake_while_shutting_down() {
+  PresenceMachine m(config());
+  FakeClock clock(m);
+  clock.heartbeats(1000);
+  clock.advance(5000);
+  m.on_shutdown_requested(clock.now_ms);
+  clock.advance(6000);
+  CHECK(m.on_wake_requested(clock.now_ms) && m.state() == PresenceState::Waking, "wake while shutting down");
+  CHECK(clock.next_change() && m.state() == PresenceState::Online, "online again");
+  CHECK(clock.now_ms == 7000 && !m.fault(), "online at %llu", (unsigned long long)clock.now_ms);
+}
+
+// 相对请求时间的重发时刻，间隔从 *_retry_ms 开始翻倍，到 retry_max_ms 封顶
+static std::vector<uint64_t> relative(const std::vector<uint64_t> &times, uint64_t start_ms) {
+  std::vector<uint64_t> out;
+  for (uint64_t t : times)
+    out.push_back(t - start_ms);
+  return out;
+}
+
+static void test_wake_retry_schedule() {
+  PresenceMachine m(config());
+  FakeClock clock(m);
+  clock.now_ms = 500;
+  m.on_wake_requested(clock.now_ms);
+  clock.next_change();
+  // 间隔 1000、2000、4000、8000、8000，30 秒超时前共 5 次
+  std::vector<uint64_t> expected = {1000, 3000, 7000, 15000, 23000};
+  CHECK(relative(clock.wol_ms, 500) == expected, "WOL resent %zu times", clock.wol_ms.size());
+  CHECK(clock.shutdown_ms.empty(), "shutdown sent while waking");
+  // 每次唤醒要么重发要么超时
+  CHECK(clock.ticks == (int)expected.size() + 1, "woke %d times", clock.ticks);
+}
+
+static void test_shutdown_retry_schedule() {
+  PresenceMachine m(config());
+  FakeClock clock(m);
+  clock.heartbeats(1000);
+  clock.advance(1000);
+  m.on_shutdown_requested(clock.now_ms);
+  clock.next_change();
+  // 间隔 3000、6000、8000...，60 秒超时前共 8 次
+  std::vector<uint64_t> expected = {3000, 9000, 17000, 25000, 33000, 41000, 49000, 57000};
+  CHECK(relative(clock.shutdown_ms, 1000) == expected, "shutdown resent %zu times",
+        clock.shutdown_ms.size());
+  CHECK(clock.wol_ms.empty(), "WOL sent while shutting down");
+}
+
+// 重复开机请求重新计时，退避从头开始
+static void test_wake_repeated() {
+  PresenceMachine m(config());
+  FakeClock clock(m);
+  m.on_wake_requested(0);
+  clock.advance(20000);
+  CHECK(!m.on_wake_requested(clock.now_ms), "state changed on a repeated wake");
+  size_t before = clock.wol_ms.size();
+  CHECK(clock.next_change() && clock.now_ms == 50000, "timed out at %llu",
+        (unsigned long long)clock.now_ms);
+  std::vector<uint64_t> expected = {1000, 3000, 7000, 15000, 23000};
+  std::vector<uint64_t> after(clock.wol_ms.begin() + before, clock.wol_ms.end());
+  CHECK(relative(after, 20000) == expected, "WOL resent %zu times after the repeat", after.size());
+}
+
+// 故障保持到下一次请求，或电脑自行上线/离线
+static void test_fault_clearing() {
+  PresenceMachine m(config());
+  FakeClock clock(m);
+  m.on_wake_requested(0);
+  clock.next_change();
+  CHECK(m.fault(), "no fault after wake timeout");
+  clock.advance(40000);
+  CHECK(m.fault(), "fault cleared by time alone");
+  CHECK(m.on_wake_requested(clock.now_ms) && !m.fault(), "fault kept on a new wake");
+
+  clock.next_change();
+  CHECK(m.fault(), "no fault after the second wake timeout");
+  // 电脑最后还是开机了
+  clock.heartbeats(1000);
+  CHECK(clock.next_change() && m.state() == PresenceState::Online && !m.fault(),
+        "fault kept after a late start");
+
+  m.on_shutdown_requested(clock.now_ms);
+  clock.next_change();
+  CHECK(m.state() == PresenceState::Online && m.fault(), "no fault after failed shutdown");
+  // 仍然 Online，心跳不清故障
+  clock.advance(clock.now_ms + 10000);
+  CHECK(m.fault(), "fault cleared by a heartbeat");
+  CHECK(m.on_shutdown_requested(clock.now_ms) && !m.fault(), "fault kept on a new shutdown");
+
+  clock.next_change();
+  CHECK(m.fault(), "no fault after the second failed shutdown");
+  // 电脑最后还是关机了
+  clock.heartbeats(0);
+  CHECK(clock.next_change() && m.state() == PresenceState::Offline && !m.fault(),
+        "fault kept after a late stop");
+}
+
+static void test_take_actions() {
+  PresenceMachine m(config());
+  CHECK(m.take_actions() == PRESENCE_ACTION_NONE, "actions before any request");
+  // 请求本身不产生动作：第一个包由调用者发出
+  m.on_wake_requested(0);
+  CHECK(m.take_actions() == PRESENCE_ACTION_NONE, "action on the wake request");
+  m.on_tick(999);
+  CHECK(m.take_actions() == PRESENCE_ACTION_NONE, "WOL resent early");
+  m.on_tick(1000);
+  CHECK(m.take_actions() == PRESENCE_ACTION_SEND_WOL, "WOL not resent");
+  CHECK(m.take_actions() == PRESENCE_ACTION_NONE, "actions taken twice");
+
+  // 没取走的动作保留，直到被取走
+  m.on_tick(3000);
+  m.on_heartbeat(3500);
+  m.on_shutdown_requested(3500);
+  m.on_heartbeat(6000);
+  m.on_tick(6500);
+  CHECK(m.take_actions() == (PRESENCE_ACTION_SEND_WOL | PRESENCE_ACTION_SEND_SHUTDOWN),
+        "pending actions lost");
+  CHECK(m.take_actions() == PRESENCE_ACTION_NONE, "actions taken twice");
+}
+
+static void test_histogram() {
+  CHECK(WakeHistogram::bucket_limit_ms(0) == 1000 && WakeHistogram::bucket_limit_ms(6) == 64000 &&
+            WakeHistogram::bucket_limit_ms(WakeHistogram::kBuckets - 1) == UINT32_MAX,
+        "bucket limits");
+  struct {
+    uint32_t latency_ms;
+    int bucket;
+  } cases[] = {
+      {0, 0},      {999, 0},    {1000, 1},   {1999, 1},  {2000, 2},         {3999, 2},
+      {4000, 3},   {31999, 5},  {32000, 6},  {63999, 6}, {64000, 7},        {UINT32_MAX, 7},
+  };
+  for (const auto &c : cases) {
+    WakeHistogram h;
+    h.add(c.latency_ms);
+    int bucket = -1;
+    for (int i = 0; i < WakeHistogram::kBuckets; i++)
+      if (h.counts[i])
+        bucket = bucket < 0 ? i : -2;
+    CHECK(bucket == c.bucket, "%u ms went to bucket %d, not %d", c.latency_ms, bucket, c.bucket);
+  }
+  WakeHistogram h;
+  for (int i = 0; i < 5; i++)
+    h.add(1500);
+  CHECK(h.counts[1] == 5, "counts %u", h.counts[1]);
+}
+
+int main() {
+  test_idle();
+  test_wake();
+  test_wake_timeout();
+  test_heartbeat_timeout();
+  test_shutdown();
+  test_shutdown_failed();
+  test_cancel_wake();
+  test_wake_while_shutting_down();
+  test_wake_retry_schedule();
+  test_shutdown_retry_schedule();
+  test_wake_repeated();
+  test_fault_clearing();
+  test_take_actions();
+  test_histogram();
+  return check_summary();
+}
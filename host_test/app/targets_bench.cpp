@@ -0,0 +1,152 @@
+// 网桥模式心跳分发：64 台电脑、每台 2 Hz 心跳，按二进制 MAC 哈希查目标。
+// 先检查每个心跳都落到正确的目标，再与原先逐台 snprintf + strncasecmp 的做法对比耗时。
+#include <cstring>
+#include <strings.h>
+
+#include "check.h"
+#include "heartbeat.h"
+#include "targets.h"
+
+#define TARGETS TargetDirectory::kMaxTargets
+#define HEARTBEAT_HZ 2
+#define SIM_SECONDS 60
+
+static uint8_t macs[TARGETS][6];
+static TargetDirectory directory;
+
+struct Packet {
+  uint8_t buf[HEARTBEAT_V2_SIZE];
+  size_t len;
+  int target;
+};
+// SIM_SECONDS 秒内按到达顺序排列的全部心跳，一半电脑发 v1、一半发 v2
+static Packet packets[TARGETS * HEARTBEAT_HZ * SIM_SECONDS];
+static const int kPackets = sizeof(packets) / sizeof(packets[0]);
+
+static void build_packets() {
+  for (int i = 0; i < kPackets; i++) {
+    // 每轮 500 ms 内各台电脑依次到达
+    int target = i % TARGETS;
+    Packet &p = packets[i];
+    p.target = target;
+    if (target % 2) {
+      Heartbeat beat = {};
+      memcpy(beat.mac, macs[target], 6);
+      beat.seq = (uint32_t)(i / TARGETS);
+      beat.timestamp_ms = (uint32_t)(i / TARGETS) * (1000 / HEARTBEAT_HZ);
+      p.len = heartbeat_build_ack(p.buf, beat, beat.timestamp_ms);
+      p.buf[5] = HEARTBEAT_TYPE_BEAT;
+    } else {
+      // v1 正好 22 字节，不带结尾的 0
+      char text[32];
+      snprintf(text, sizeof(text), "HEARTBEAT|%02x%02X%02x%02X%02x%02X", macs[target][0],
+               macs[target][1], macs[target][2], macs[target][3], macs[target][4],
+               macs[target][5]);
+      p.len = strlen(text);
+      memcpy(p.buf, text, p.len);
+    }
+  }
+}
+
+// 原先的做法：每个包对每台电脑格式化一次 MAC 再比较字符串（只认 v1）
+static int naive_lookup(const uint8_t *buf, size_t len) {
+  if (len < 22 || strncmp((const char *)buf, "HEARTBEAT|", 10) != 0)
+    return TargetDirectory::kNotFound;
+  for (int i = 0; i < TARGETS; i++) {
+    char mac_str[13];
+    snprintf(mac_str, sizeof(mac_str), "%02X%02X%02X%02X%02X%02X", macs[i][0], macs[i][1],
+             macs[i][2], macs[i][3], macs[i][4], macs[i][5]);
+    if (strncasecmp((const char *)buf + 10, mac_str, 12) == 0)
+      return i;
+  }
+  return TargetDirectory::kNotFound;
+}
+
+// 心跳任务现在的做法：原地解析，再按二进制 MAC 查表
+static int hashed_lookup(const uint8_t *buf, size_t len) {
+  Heartbeat beat;
+  if (!heartbeat_parse(buf, len, &beat))
+    return TargetDirectory::kNotFound;
+  return directory.find(beat.mac);
+}
+
+static void test_directory() {
+  for (int i = 0; i < TARGETS; i++) {
+    for (int j = 0; j < 6; j++)
+      macs[i][j] = (uint8_t)rng();
+    // 同一厂商前缀，只有后三字节不同
+    macs[i][0] = 0x00;
+    macs[i][1] = 0x1a;
+    macs[i][2] = 0x2b;
+    CHECK(directory.add(macs[i]) == i, "add target %d", i);
+  }
+  CHECK(directory.size() == TARGETS, "size %d", directory.size());
+  CHECK(directory.add(macs[3]) == TargetDirectory::kNotFound, "duplicate accepted");
+
+  uint8_t unknown[6] = {0x00, 0x1a, 0x2b, 0xff, 0xff, 0xff};
+  CHECK(directory.find(unknown) == TargetDirectory::kNotFound, "unknown MAC found");
+
+  uint8_t mac[6];
+  CHECK(parse_mac_hex("001A2bFFfe01", mac) && mac[1] == 0x1a && mac[4] == 0xfe, "parse hex");
+  CHECK(!parse_mac_hex("00112233445", mac), "short MAC accepted");
+  CHECK(!parse_mac_hex("0011223344GG", mac), "non-hex MAC accepted");
+}
+
+static void test_dispatch() {
+  TargetMask mask;
+  int v1_ok = 0;
+  for (int i = 0; i < kPackets; i++) {
+    const Packet &p = packets[i];
+    int index = hashed_lookup(p.buf, p.len);
+    CHECK(index == p.target, "packet %d went to %d, not %d", i, index, p.target);
+    if (index >= 0)
+      mask.set(index);
+    if (p.len != HEARTBEAT_V2_SIZE)
+      v1_ok += naive_lookup(p.buf, p.len) == p.target;
+  }
+  CHECK(v1_ok == kPackets / 2, "naive lookup matched %d v1 packets", v1_ok);
+  for (int word = 0; word < TargetMask::kWords; word++)
+    CHECK(mask.take(word) == UINT32_MAX, "mask word %d", word);
+  CHECK(mask.take(0) == 0, "mask not cleared");
+}
+
+// 把 SIM_SECONDS 秒的全部心跳过一遍，取 20 次中最快的一次，返回每包纳秒数
+static double bench(int (*lookup)(const uint8_t *, size_t)) {
+  double best = 1e18;
+  volatile int sink = 0;
+  for (int run = 0; run < 20; run++) {
+    double start = now_us();
+    for (int i = 0; i < kPackets; i++)
+      sink += lookup(packets[i].buf, packets[i].len);
+    double ns = (now_us() - start) * 1000 / kPackets;
+    if (ns < best)
+      best = ns;
+  }
+  return best;
+}
+
+int main(int argc, char **argv) {
+  test_directory();
+  build_packets();
+  test_dispatch();
+
+  if (check_bench(argc, argv)) {
+    // naive 只认 v1，只拿 v1 包计时才公平
+    static Packet v1[kPackets / 2];
+    int n = 0;
+    for (int i = 0; i < kPackets; i++)
+      if (packets[i].len != HEARTBEAT_V2_SIZE)
+        v1[n++] = packets[i];
+    memcpy(packets, v1, sizeof(v1));
+    memcpy(packets + n, v1, sizeof(v1));
+    double naive = bench(naive_lookup);
+    double hashed = bench(hashed_lookup);
+    int rate = TARGETS * HEARTBEAT_HZ;
+    printf("%d targets at %d Hz (%d packets/s)\n", TARGETS, HEARTBEAT_HZ, rate);
+    printf("  snprintf + strncasecmp: %7.1f ns/packet, %6.1f us CPU per second\n", naive,
+           naive * rate / 1000);
+    printf("  parse + hash lookup:    %7.1f ns/packet, %6.1f us CPU per second\n", hashed,
+           hashed * rate / 1000);
+  }
+  return check_summary();
+}
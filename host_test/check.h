@@ -0,0 +1,69 @@
+/* Minimal check, timing and random data helpers shared by the host tests.
+ *
+ * The tests that have a benchmark run it only when started with --bench, which
+ * ctest does not pass, so that the gate stays fast.
+ */
+#ifndef _HOST_TEST_CHECK_H_
+#define _HOST_TEST_CHECK_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+static inline double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* xorshift32 with a fixed seed, so that the runs are reproducible */
+static uint32_t rng_state = 0x12345678;
+
+static inline uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static inline void rng_fill(uint8_t *buf, size_t len)
+{
+    while (len--) {
+        *buf++ = (uint8_t)rng();
+    }
+}
+
+/* True if --bench is among the arguments */
+static inline bool check_bench(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--bench")) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Prints the result and gives the exit status */
+static inline int check_summary(void)
+{
+    printf("%s: %d failures\n", failures ? "FAILED" : "PASSED", failures);
+    return failures ? 1 : 0;
+}
+
+#endif /* _HOST_TEST_CHECK_H_ */
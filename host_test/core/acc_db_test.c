@@ -0,0 +1,398 @@
+/* The attribute database of esp_hap_acc_db.c, streamed inline for a controller by
+ * hap_prepare_json_database() and from the cached template by
+ * hap_acc_db_cache_send(), on a fake corked session.
+ *
+ * The bridge has characteristics of every format, with and without values,
+ * constraints, valid values, descriptions and units, and each permission that
+ * changes what goes out, in hidden, primary and linked services. The service read
+ * routines give values that depend on the round, and some characteristics have
+ * notifications enabled for some controllers. For each controller, the template
+ * with its slots filled in must be byte-identical to the inline database, with the
+ * same reads done. After an accessory is added, the cache must be rebuilt.
+ */
+#include "esp_hap_acc_db.c"
+
+#include <stdlib.h>
+#include <esp_wifi.h>
+#include <esp_hap_database.h>
+#include <esp_hap_network_io.h>
+#include <sodium/utils.h>
+#include "check.h"
+#include "tx_capture.h"
+
+hap_priv_t hap_priv;
+
+static int next_aid = 2;
+static int reads;
+static int round_no;
+
+void *hap_platform_memory_malloc(size_t size)
+{
+    return malloc(size);
+}
+
+void *hap_platform_memory_calloc(size_t count, size_t size)
+{
+    return calloc(count, size);
+}
+
+void hap_platform_memory_free(void *ptr)
+{
+    free(ptr);
+}
+
+esp_err_t esp_wifi_get_mac(wifi_interface_t ifx, uint8_t mac[6])
+{
+    memset(mac, 0, 6);
+    return ESP_OK;
+}
+
+int hap_keystore_get(const char *name_space, const char *key, uint8_t *val, size_t *val_size)
+{
+    return HAP_FAIL;
+}
+
+int hap_keystore_set(const char *name_space, const char *key, const uint8_t *val, const size_t val_len)
+{
+    return HAP_SUCCESS;
+}
+
+int hap_get_next_aid()
+{
+    return next_aid++;
+}
+
+int hap_update_config_number()
+{
+    return HAP_SUCCESS;
+}
+
+void hap_http_rebuild_acc_index()
+{
+}
+
+/* Kept out of line, else GCC cannot tell that the length it gives back fits in dest */
+__attribute__((noipa))
+int esp_mfi_base64_encode(const char *src, int len, char *dest, int dest_len, int *out_len)
+{
+    if (!sodium_bin2base64(dest, dest_len, (const unsigned char *)src, len,
+                sodium_base64_VARIANT_ORIGINAL)) {
+        return -1;
+    }
+    *out_len = strlen(dest);
+    return 0;
+}
+
+/* Just enough of esp_hap_char.c for the accessories to be built and the database generated */
+static hap_char_t *test_char_create(const char *type_uuid, hap_char_format_t format, uint16_t perms)
+{
+    __hap_char_t *_hc = calloc(1, sizeof(__hap_char_t));
+    _hc->type_uuid = type_uuid;
+    _hc->format = format;
+    _hc->permission = perms;
+    return (hap_char_t *)_hc;
+}
+
+hap_char_t *hap_char_bool_create(char *type_uuid, uint16_t perms, bool val)
+{
+    hap_char_t *hc = test_char_create(type_uuid, HAP_CHAR_FORMAT_BOOL, perms);
+    ((__hap_char_t *)hc)->val.b = val;
+    return hc;
+}
+
+hap_char_t *hap_char_string_create(char *type_uuid, uint16_t perms, char *val)
+{
+    hap_char_t *hc = test_char_create(type_uuid, HAP_CHAR_FORMAT_STRING, perms);
+    ((__hap_char_t *)hc)->val.s = val ? strdup(val) : NULL;
+    return hc;
+}
+
+hap_char_t *hap_char_accessory_flags_create(uint32_t flags)
+{
+    return NULL;
+}
+
+hap_char_t *hap_char_product_data_create(hap_data_val_t *product_data)
+{
+    return NULL;
+}
+
+void hap_char_delete(hap_char_t *hc)
+{
+    __hap_char_t *_hc = (__hap_char_t *)hc;
+    if (_hc->format == HAP_CHAR_FORMAT_STRING) {
+        free(_hc->val.s);
+    }
+    free(_hc->valid_vals);
+    free(_hc->valid_vals_range);
+    free(hc);
+}
+
+hap_char_t *hap_char_get_next(hap_char_t *hc)
+{
+    return ((__hap_char_t *)hc)->next_char;
+}
+
+hap_serv_t *hap_char_get_parent(hap_char_t *hc)
+{
+    return ((__hap_char_t *)hc)->parent;
+}
+
+const hap_val_t *hap_char_get_val(hap_char_t *hc)
+{
+    return &((__hap_char_t *)hc)->val;
+}
+
+int hap_char_update_val(hap_char_t *hc, hap_val_t *val)
+{
+    __hap_char_t *_hc = (__hap_char_t *)hc;
+    if (_hc->format == HAP_CHAR_FORMAT_STRING) {
+        free(_hc->val.s);
+        _hc->val.s = val->s ? strdup(val->s) : NULL;
+    } else {
+        _hc->val = *val;
+    }
+    _hc->update_called = true;
+    return HAP_SUCCESS;
+}
+
+bool hap_char_is_ctrl_subscribed(hap_char_t *hc, int index)
+{
+    return ((__hap_char_t *)hc)->ev_ctrls & (1 << index);
+}
+
+void hap_char_set_owner_ctrl(hap_char_t *hc, int index)
+{
+    ((__hap_char_t *)hc)->owner_ctrl = 1 << index;
+}
+
+/* Values that depend on the round, with the strings and data long enough to span
+ * several chunks. Every third characteristic is left alone.
+ */
+static uint8_t data_buf[300];
+static char str_buf[200];
+
+static int test_read(hap_char_t *hc, hap_status_t *status_code, void *serv_priv, void *read_priv)
+{
+    __hap_char_t *_hc = (__hap_char_t *)hc;
+    hap_val_t val = {0};
+    reads++;
+    if ((_hc->iid + round_no) % 3 == 0) {
+        return HAP_SUCCESS;
+    }
+    switch (_hc->format) {
+        case HAP_CHAR_FORMAT_BOOL:
+            val.b = (_hc->iid + round_no) % 2;
+            break;
+        case HAP_CHAR_FORMAT_FLOAT:
+            val.f = (_hc->iid * 100 + round_no) / 8.0f;
+            break;
+        case HAP_CHAR_FORMAT_STRING:
+            if (round_no % 4 == 3) {
+                val.s = NULL;
+                break;
+            }
+            memset(str_buf, 'a' + round_no % 26, sizeof(str_buf) - 1);
+            str_buf[(_hc->iid * 37 + round_no * 11) % (sizeof(str_buf) - 1)] = '\0';
+            val.s = str_buf;
+            break;
+        case HAP_CHAR_FORMAT_DATA:
+        case HAP_CHAR_FORMAT_TLV8:
+            for (int i = 0; i < sizeof(data_buf); i++) {
+                data_buf[i] = i * 7 + round_no;
+            }
+            val.d.buf = round_no % 4 == 3 ? NULL : data_buf;
+            val.d.buflen = (_hc->iid * 41 + round_no * 13) % sizeof(data_buf) + 1;
+            break;
+        default:
+            val.i = _hc->iid * 1000 + round_no;
+            break;
+    }
+    hap_char_update_val(hc, &val);
+    *status_code = HAP_STATUS_SUCCESS;
+    return HAP_SUCCESS;
+}
+
+static void test_char_constrain(hap_char_t *hc, int min, int max, int step)
+{
+    __hap_char_t *_hc = (__hap_char_t *)hc;
+    _hc->constraint_flags = HAP_CHAR_MIN_FLAG | HAP_CHAR_MAX_FLAG | HAP_CHAR_STEP_FLAG;
+    if (_hc->format == HAP_CHAR_FORMAT_FLOAT) {
+        _hc->min.f = min;
+        _hc->max.f = max;
+        _hc->step.f = step / 10.0f;
+    } else {
+        _hc->min.i = min;
+        _hc->max.i = max;
+        _hc->step.i = step;
+    }
+}
+
+static hap_acc_t *test_acc_create(int n)
+{
+    char name[32], serial[32];
+    snprintf(name, sizeof(name), "Sensor %d", n);
+    snprintf(serial, sizeof(serial), "SN%06d", n);
+    hap_acc_cfg_t cfg = {
+        .name = name,
+        .manufacturer = "Espressif",
+        .model = "Launcher",
+        .serial_num = serial,
+        .fw_rev = "1.0.0",
+        .pv = "1.1.0",
+        .cid = HAP_CID_BRIDGE,
+    };
+    hap_acc_t *ha = hap_acc_create(&cfg);
+    hap_char_t *hc;
+
+    /* Numbers of every format, with constraints, valid values and units */
+    hap_serv_t *numbers = hap_serv_create("8A");
+    hc = test_char_create("11", HAP_CHAR_FORMAT_FLOAT, HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV);
+    test_char_constrain(hc, -50, 100, 1);
+    ((__hap_char_t *)hc)->unit = "celsius";
+    hap_serv_add_char(numbers, hc);
+    hc = test_char_create("8", HAP_CHAR_FORMAT_INT, HAP_CHAR_PERM_PR | HAP_CHAR_PERM_PW | HAP_CHAR_PERM_EV);
+    test_char_constrain(hc, 0, 100, 5);
+    ((__hap_char_t *)hc)->unit = "percentage";
+    hap_serv_add_char(numbers, hc);
+    hc = test_char_create("B0", HAP_CHAR_FORMAT_UINT8, HAP_CHAR_PERM_PR | HAP_CHAR_PERM_PW | HAP_CHAR_PERM_EV);
+    ((__hap_char_t *)hc)->valid_vals = calloc(3, 1);
+    ((__hap_char_t *)hc)->valid_vals[1] = 1;
+    ((__hap_char_t *)hc)->valid_vals[2] = 3;
+    ((__hap_char_t *)hc)->valid_vals_cnt = 3;
+    hap_serv_add_char(numbers, hc);
+    hc = test_char_create("D1", HAP_CHAR_FORMAT_UINT16, HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV);
+    ((__hap_char_t *)hc)->valid_vals_range = calloc(2, 1);
+    ((__hap_char_t *)hc)->valid_vals_range[1] = 4;
+    hap_serv_add_char(numbers, hc);
+    hap_serv_add_char(numbers, test_char_create("D2", HAP_CHAR_FORMAT_UINT32, HAP_CHAR_PERM_PR));
+    hap_serv_add_char(numbers, hap_char_bool_create("75", HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV | HAP_CHAR_PERM_HD, true));
+    hap_serv_set_read_cb(numbers, test_read);
+    if (n % 2) {
+        hap_serv_mark_primary(numbers);
+    }
+    hap_acc_add_serv(ha, numbers);
+
+    /* Strings and data, with the permissions for which no value or a fixed one goes out */
+    hap_serv_t *other = hap_serv_create("12345678-0000-1000-8000-0026BB765291");
+    hc = hap_char_string_create("23", HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV, "initial");
+    ((__hap_char_t *)hc)->constraint_flags = HAP_CHAR_MAXLEN_FLAG;
+    ((__hap_char_t *)hc)->max.i = 200;
+    ((__hap_char_t *)hc)->description = "A \"quoted\" description";
+    hap_serv_add_char(other, hc);
+    hc = test_char_create("220", HAP_CHAR_FORMAT_DATA, HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV);
+    ((__hap_char_t *)hc)->constraint_flags = HAP_CHAR_MAXDATALEN_FLAG;
+    ((__hap_char_t *)hc)->max.i = sizeof(data_buf);
+    hap_serv_add_char(other, hc);
+    hap_serv_add_char(other, test_char_create("221", HAP_CHAR_FORMAT_TLV8,
+                HAP_CHAR_PERM_PR | HAP_CHAR_PERM_PW | HAP_CHAR_PERM_WR));
+    hap_serv_add_char(other, test_char_create("222", HAP_CHAR_FORMAT_TLV8,
+                HAP_CHAR_PERM_PR | HAP_CHAR_PERM_SPECIAL_READ));
+    hap_serv_add_char(other, test_char_create("14", HAP_CHAR_FORMAT_BOOL,
+                HAP_CHAR_PERM_PW | HAP_CHAR_PERM_AA | HAP_CHAR_PERM_TW));
+    hap_serv_set_read_cb(other, test_read);
+    if (n % 3 == 1) {
+        hap_serv_mark_hidden(other);
+    }
+    hap_serv_link_serv(numbers, other);
+    hap_acc_add_serv(ha, other);
+
+    /* A service with no readable characteristics, and so nothing to read */
+    hap_serv_t *writes = hap_serv_create("CC");
+    hap_serv_add_char(writes, test_char_create("52", HAP_CHAR_FORMAT_UINT8, HAP_CHAR_PERM_PW));
+    hap_serv_link_serv(numbers, writes);
+    hap_acc_add_serv(ha, writes);
+    return ha;
+}
+
+/* Notifications enabled by some of the 16 controllers, on the characteristics that have them */
+static void test_subscribe(void)
+{
+    hap_acc_t *ha;
+    hap_serv_t *hs;
+    hap_char_t *hc;
+    for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
+        for (hs = hap_acc_get_first_serv(ha); hs; hs = hap_serv_get_next(hs)) {
+            for (hc = hap_serv_get_first_char(hs); hc; hc = hap_char_get_next(hc)) {
+                __hap_char_t *_hc = (__hap_char_t *)hc;
+                if (_hc->permission & HAP_CHAR_PERM_EV) {
+                    _hc->ev_ctrls = (_hc->iid * 0x9e37 + ((__hap_acc_t *)ha)->aid) & 0xffff;
+                }
+            }
+        }
+    }
+}
+
+static char inline_body[MAX_OUT], cached_body[MAX_OUT];
+
+/* Streams the database for a controller through one of the two, into body */
+static int db_send(const char *what, int session_index, bool cached, char *body)
+{
+    hap_http_stream_t s;
+    session_cork(MAX_FRAME);
+    CHECK(hap_http_stream_init(&s, TEST_FD, "200 OK") == HAP_SUCCESS, "%s: init", what);
+    if (cached) {
+        CHECK(hap_acc_db_cache_send(&s, session_index) == HAP_SUCCESS, "%s: cache send", what);
+    } else {
+        hap_prepare_json_database(&s, session_index);
+    }
+    CHECK(hap_http_stream_end(&s) == HAP_SUCCESS, "%s: end", what);
+    session_flush();
+    CHECK(!guard_hit, "%s: written past the frame", what);
+    return parse_response(what, "200 OK", body);
+}
+
+static void check_db(const char *tag)
+{
+    static const int sessions[] = {0, 3, 7, 15};
+    char what[64];
+
+    for (int i = 0; i < sizeof(sessions) / sizeof(sessions[0]); i++) {
+        round_no++;
+        snprintf(what, sizeof(what), "%s, controller %d, inline", tag, sessions[i]);
+        reads = 0;
+        int inline_len = db_send(what, sessions[i], false, inline_body);
+        int inline_reads = reads;
+
+        snprintf(what, sizeof(what), "%s, controller %d, cached", tag, sessions[i]);
+        reads = 0;
+        int cached_len = db_send(what, sessions[i], true, cached_body);
+        CHECK(reads == inline_reads, "%s: %d reads, %d inline", what, reads, inline_reads);
+        CHECK(cached_len == inline_len && !memcmp(cached_body, inline_body, inline_len),
+                "%s: %d bytes differ from the %d inline\n  inline: %.*s\n  cached: %.*s", what,
+                cached_len, inline_len, inline_len, inline_body, cached_len, cached_body);
+    }
+    /* Just a sanity check that the bodies are what they should be */
+    CHECK(strstr(inline_body, "\"ev\":true") && strstr(inline_body, "\"ev\":false") &&
+            strstr(inline_body, "\"value\":null") && strstr(inline_body, "\"value\":\"\"") &&
+            strstr(inline_body, "\"linked\":["), "%s: database incomplete", tag);
+}
+
+static void test_db(void)
+{
+    hap_add_accessory(test_acc_create(0));
+    for (int n = 1; n < 10; n++) {
+        hap_add_bridged_accessory(test_acc_create(n), 0);
+    }
+    test_subscribe();
+    check_db("10 accessories");
+
+    /* The template is reused as long as nothing changes */
+    char *tmpl = hap_acc_db_cache.tmpl;
+    check_db("10 accessories, again");
+    CHECK(hap_acc_db_cache.tmpl == tmpl, "cache rebuilt without a change");
+
+    /* Adding an accessory invalidates it */
+    uint32_t gen = hap_acc_db_cache.gen;
+    hap_add_bridged_accessory(test_acc_create(10), 0);
+    test_subscribe();
+    check_db("11 accessories");
+    CHECK(hap_acc_db_cache.gen != gen, "cache not rebuilt after an add");
+    hap_delete_all_accessories();
+}
+
+int main(int argc, char **argv)
+{
+    test_db();
+    return check_summary();
+}
@@ -0,0 +1,394 @@
+/* The (aid, iid) index of esp_hap_acc.c, on a bridge grown from 1 to 10 to 150
+ * accessories through hap_add_bridged_accessory(), the way an app adds them.
+ *
+ * At each size, every characteristic must resolve to the same object through the
+ * index and through the list walk it replaced, and ids that are not there must
+ * resolve to nothing through both. Adding an accessory with the config number
+ * updates on must leave the index invalid, with the lookups still right, till the
+ * HTTP server task rebuilds it. Removing one must drop it from the lookups.
+ *
+ * While the index is valid, a miss in it must not fall back to the list walk. A
+ * build during which the index is invalidated must be dropped.
+ */
+#include "esp_hap_acc.c"
+
+#include <stdlib.h>
+#include "check.h"
+
+#define MAX_ACCESSORIES 150
+#define MAX_CHARS       (MAX_ACCESSORIES * 10)
+
+hap_priv_t hap_priv;
+
+static int next_aid = 2;
+static int config_updates;
+static int cache_invalidates;
+/* Set to invalidate the index from within its build, as another task would */
+static bool invalidate_on_calloc;
+
+void *hap_platform_memory_calloc(size_t count, size_t size)
+{
+    if (invalidate_on_calloc) {
+        hap_acc_index_invalidate();
+    }
+    return calloc(count, size);
+}
+
+void hap_platform_memory_free(void *ptr)
+{
+    free(ptr);
+}
+
+esp_err_t esp_wifi_get_mac(wifi_interface_t ifx, uint8_t mac[6])
+{
+    memset(mac, 0, 6);
+    return ESP_OK;
+}
+
+int hap_keystore_get(const char *name_space, const char *key, uint8_t *val, size_t *val_size)
+{
+    return HAP_FAIL;
+}
+
+int hap_keystore_set(const char *name_space, const char *key, const uint8_t *val, const size_t val_len)
+{
+    return HAP_SUCCESS;
+}
+
+int hap_get_next_aid()
+{
+    return next_aid++;
+}
+
+int hap_update_config_number()
+{
+    config_updates++;
+    return HAP_SUCCESS;
+}
+
+void hap_acc_db_cache_invalidate()
+{
+    cache_invalidates++;
+}
+
+/* On the target this is queued to the HTTP server task, which builds the index */
+void hap_http_rebuild_acc_index()
+{
+    hap_acc_index_build();
+}
+
+/* Just enough of esp_hap_char.c for the accessories to be built and walked */
+static hap_char_t *test_char_create(const char *type_uuid, hap_char_format_t format)
+{
+    __hap_char_t *_hc = calloc(1, sizeof(__hap_char_t));
+    _hc->type_uuid = type_uuid;
+    _hc->format = format;
+    return (hap_char_t *)_hc;
+}
+
+hap_char_t *hap_char_bool_create(char *type_uuid, uint16_t perms, bool val)
+{
+    hap_char_t *hc = test_char_create(type_uuid, HAP_CHAR_FORMAT_BOOL);
+    ((__hap_char_t *)hc)->val.b = val;
+    return hc;
+}
+
+hap_char_t *hap_char_string_create(char *type_uuid, uint16_t perms, char *val)
+{
+    hap_char_t *hc = test_char_create(type_uuid, HAP_CHAR_FORMAT_STRING);
+    ((__hap_char_t *)hc)->val.s = val ? strdup(val) : NULL;
+    return hc;
+}
+
+hap_char_t *hap_char_accessory_flags_create(uint32_t flags)
+{
+    return NULL;
+}
+
+hap_char_t *hap_char_product_data_create(hap_data_val_t *product_data)
+{
+    return NULL;
+}
+
+void hap_char_delete(hap_char_t *hc)
+{
+    if (((__hap_char_t *)hc)->format == HAP_CHAR_FORMAT_STRING) {
+        free(((__hap_char_t *)hc)->val.s);
+    }
+    free(hc);
+}
+
+hap_char_t *hap_char_get_next(hap_char_t *hc)
+{
+    return ((__hap_char_t *)hc)->next_char;
+}
+
+hap_serv_t *hap_char_get_parent(hap_char_t *hc)
+{
+    return ((__hap_char_t *)hc)->parent;
+}
+
+const hap_val_t *hap_char_get_val(hap_char_t *hc)
+{
+    return &((__hap_char_t *)hc)->val;
+}
+
+int hap_char_update_val(hap_char_t *hc, hap_val_t *val)
+{
+    ((__hap_char_t *)hc)->val = *val;
+    return HAP_SUCCESS;
+}
+
+static hap_acc_t *test_acc_create(int n)
+{
+    char name[32], serial[32];
+    snprintf(name, sizeof(name), "Switch %d", n);
+    snprintf(serial, sizeof(serial), "SN%06d", n);
+    hap_acc_cfg_t cfg = {
+        .name = name,
+        .manufacturer = "Espressif",
+        .model = "Launcher",
+        .serial_num = serial,
+        .fw_rev = "1.0.0",
+        .pv = "1.1.0",
+        .cid = HAP_CID_BRIDGE,
+    };
+    hap_acc_t *ha = hap_acc_create(&cfg);
+    /* A switch with a name, like the ones the launcher bridges */
+    hap_serv_t *hs = hap_serv_create(HAP_SERV_UUID_SWITCH);
+    hap_serv_add_char(hs, hap_char_bool_create(HAP_CHAR_UUID_ON, HAP_CHAR_PERM_PR, false));
+    hap_serv_add_char(hs, hap_char_string_create(HAP_CHAR_UUID_NAME, HAP_CHAR_PERM_PR, name));
+    hap_acc_add_serv(ha, hs);
+    return ha;
+}
+
+/* Grows the bridge to count accessories, the first one being the bridge itself */
+static int accessories;
+
+static void bridge_grow(int count)
+{
+    if (!accessories) {
+        hap_add_accessory(test_acc_create(0));
+        hap_acc_index_build();
+        accessories = 1;
+    }
+    while (accessories < count) {
+        hap_add_bridged_accessory(test_acc_create(accessories), 0);
+        accessories++;
+    }
+}
+
+/* Every (aid, iid) of a characteristic on the bridge, in random order */
+static int32_t char_aids[MAX_CHARS], char_iids[MAX_CHARS];
+static hap_char_t *char_objs[MAX_CHARS];
+static int chars;
+
+static void collect_chars(void)
+{
+    hap_acc_t *ha;
+    hap_serv_t *hs;
+    hap_char_t *hc;
+    chars = 0;
+    for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
+        for (hs = hap_acc_get_first_serv(ha); hs; hs = hap_serv_get_next(hs)) {
+            for (hc = hap_serv_get_first_char(hs); hc; hc = hap_char_get_next(hc)) {
+                char_aids[chars] = ((__hap_acc_t *)ha)->aid;
+                char_iids[chars] = ((__hap_char_t *)hc)->iid;
+                char_objs[chars] = hc;
+                chars++;
+            }
+        }
+    }
+    for (int i = chars - 1; i > 0; i--) {
+        int j = rng() % (i + 1);
+        int32_t aid = char_aids[i], iid = char_iids[i];
+        hap_char_t *obj = char_objs[i];
+        char_aids[i] = char_aids[j];
+        char_iids[i] = char_iids[j];
+        char_objs[i] = char_objs[j];
+        char_aids[j] = aid;
+        char_iids[j] = iid;
+        char_objs[j] = obj;
+    }
+}
+
+/* The lookup as it was before the index */
+static hap_char_t *list_walk(int32_t aid, int32_t iid)
+{
+    hap_acc_t *ha;
+    for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
+        if (((__hap_acc_t *)ha)->aid == aid) {
+            return hap_acc_get_char_by_iid(ha, iid);
+        }
+    }
+    return NULL;
+}
+
+static void check_lookups(const char *what)
+{
+    hap_acc_t *ha;
+    hap_serv_t *hs;
+
+    collect_chars();
+    for (int i = 0; i < chars; i++) {
+        CHECK(hap_get_char_by_aid_iid(char_aids[i], char_iids[i]) == char_objs[i],
+                "%s: aid %d iid %d", what, (int)char_aids[i], (int)char_iids[i]);
+        CHECK(list_walk(char_aids[i], char_iids[i]) == char_objs[i],
+                "%s: list walk, aid %d iid %d", what, (int)char_aids[i], (int)char_iids[i]);
+    }
+    for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
+        __hap_acc_t *_ha = (__hap_acc_t *)ha;
+        CHECK(hap_acc_get_by_aid(_ha->aid) == ha, "%s: accessory %d", what, (int)_ha->aid);
+        /* Service iids, iid 0 and the next free iid are not characteristics */
+        for (hs = hap_acc_get_first_serv(ha); hs; hs = hap_serv_get_next(hs)) {
+            CHECK(!hap_get_char_by_aid_iid(_ha->aid, ((__hap_serv_t *)hs)->iid),
+                    "%s: service iid %d of aid %d found", what,
+                    (int)((__hap_serv_t *)hs)->iid, (int)_ha->aid);
+        }
+        CHECK(!hap_get_char_by_aid_iid(_ha->aid, 0), "%s: iid 0 of aid %d found", what,
+                (int)_ha->aid);
+        CHECK(!hap_get_char_by_aid_iid(_ha->aid, _ha->next_iid), "%s: iid %d of aid %d found",
+                what, (int)_ha->next_iid, (int)_ha->aid);
+    }
+    CHECK(!hap_acc_get_by_aid(next_aid), "%s: unused aid %d found", what, next_aid);
+    CHECK(!hap_get_char_by_aid_iid(next_aid, 1), "%s: char of unused aid %d found", what, next_aid);
+}
+
+static hap_char_t *index_lookup(int32_t aid, int32_t iid)
+{
+    return hap_get_char_by_aid_iid(aid, iid);
+}
+
+/* Every characteristic looked up once in random order, best of 20 rounds, in ns per lookup */
+static double bench_ns(hap_char_t *(*lookup)(int32_t, int32_t))
+{
+    double best = 1e18;
+    volatile uintptr_t sink = 0;
+    int rounds = 1 + 100000 / chars;
+    for (int run = 0; run < 20; run++) {
+        double start = now_us();
+        for (int r = 0; r < rounds; r++) {
+            for (int i = 0; i < chars; i++) {
+                sink += (uintptr_t)lookup(char_aids[i], char_iids[i]);
+            }
+        }
+        double ns = (now_us() - start) * 1000 / (rounds * chars);
+        if (ns < best) {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+static void bench(void)
+{
+    double indexed = bench_ns(index_lookup);
+    double walked = bench_ns(list_walk);
+    printf("%3d accessories, %4d chars: index %6.1f ns, list walk %8.1f ns\n",
+            accessories, chars, indexed, walked);
+}
+
+static void test_sizes(bool benchmark)
+{
+    static const int sizes[] = {1, 10, MAX_ACCESSORIES};
+    char what[32];
+
+    /* As with the config number updates disabled, the index is rebuilt on every add */
+    hap_priv.cfg.disable_config_num_update = true;
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bridge_grow(sizes[i]);
+        snprintf(what, sizeof(what), "%d accessories", sizes[i]);
+        CHECK(hap_acc_index_valid(), "%s: index not valid", what);
+        check_lookups(what);
+        hap_acc_index_invalidate();
+        snprintf(what, sizeof(what), "%d accessories, no index", sizes[i]);
+        check_lookups(what);
+        hap_acc_index_build();
+        if (benchmark) {
+            bench();
+        }
+    }
+    CHECK(config_updates == 0, "config number updated %d times", config_updates);
+}
+
+/* With the config number updates on, the index stays invalid till the HTTP server rebuilds it */
+static void test_config_number(void)
+{
+    hap_priv.cfg.disable_config_num_update = false;
+    int updates = config_updates, invalidates = cache_invalidates;
+
+    hap_acc_t *ha = test_acc_create(accessories);
+    hap_add_bridged_accessory(ha, 1000);
+    CHECK(config_updates == updates + 1, "config number not updated");
+    CHECK(cache_invalidates == invalidates + 1, "database cache not invalidated");
+    CHECK(!hap_acc_index_valid(), "index valid before the rebuild");
+    CHECK(hap_acc_get_by_aid(1000) == ha, "new accessory not found before the rebuild");
+    check_lookups("before the rebuild");
+    hap_http_rebuild_acc_index();
+    CHECK(hap_acc_index_valid(), "index not valid after the rebuild");
+    check_lookups("after the rebuild");
+
+    hap_remove_bridged_accessory(ha);
+    CHECK(config_updates == updates + 2, "config number not updated on remove");
+    CHECK(!hap_acc_index_valid(), "index valid after the remove");
+    CHECK(!hap_acc_get_by_aid(1000), "removed accessory found");
+    CHECK(!hap_get_char_by_aid_iid(1000, 1), "char of removed accessory found");
+    hap_http_rebuild_acc_index();
+    CHECK(!hap_acc_get_by_aid(1000), "removed accessory found after the rebuild");
+    check_lookups("after the remove");
+    hap_acc_delete(ha);
+
+    /* The primary accessory cannot be removed */
+    hap_remove_bridged_accessory(hap_get_first_acc());
+    CHECK(hap_acc_get_by_aid(1) == hap_get_first_acc(), "primary accessory removed");
+    hap_priv.cfg.disable_config_num_update = true;
+}
+
+/* An accessory put in the list behind the back of a valid index is not found
+ * through it, so nothing fell back to the list walk
+ */
+static void test_valid_miss(void)
+{
+    hap_acc_t *ha = test_acc_create(accessories);
+    ((__hap_acc_t *)ha)->aid = 2000;
+    hap_add_acc_to_list((__hap_acc_t *)hap_get_first_acc(), (__hap_acc_t *)ha);
+    CHECK(hap_acc_index_valid(), "valid miss: index not valid");
+    CHECK(!hap_acc_get_by_aid(2000), "valid miss: accessory found by a list walk");
+    CHECK(!hap_get_char_by_aid_iid(2000, 1), "valid miss: char found by a list walk");
+
+    hap_acc_index_invalidate();
+    CHECK(hap_acc_get_by_aid(2000) == ha, "invalid index: accessory not found by the list walk");
+    CHECK(hap_get_char_by_aid_iid(2000, 2), "invalid index: char not found by the list walk");
+
+    hap_remove_acc_from_list((__hap_acc_t *)hap_get_first_acc(), (__hap_acc_t *)ha);
+    hap_acc_delete(ha);
+    hap_acc_index_build();
+}
+
+/* A build during which the index is invalidated is dropped, leaving the lookups to the list walk */
+static void test_build_race(void)
+{
+    invalidate_on_calloc = true;
+    int ret = hap_acc_index_build();
+    invalidate_on_calloc = false;
+    CHECK(ret == HAP_FAIL, "build race: build not dropped");
+    CHECK(!hap_acc_index_valid(), "build race: index valid");
+    check_lookups("build race");
+    CHECK(hap_acc_index_build() == HAP_SUCCESS, "build race: rebuild failed");
+    CHECK(hap_acc_index_valid(), "build race: index not valid after the rebuild");
+    check_lookups("build race, rebuilt");
+}
+
+int main(int argc, char **argv)
+{
+    bool benchmark = check_bench(argc, argv);
+    if (benchmark) {
+        printf("aid/iid lookup, every characteristic once in random order\n");
+    }
+    test_sizes(benchmark);
+    test_config_number();
+    test_valid_miss();
+    test_build_race();
+    hap_delete_all_accessories();
+    return check_summary();
+}
@@ -0,0 +1,183 @@
+/* hap_hkdf() and hap_hkdf2(), with the pre-keyed salt contexts, checked against
+ * the RFC 6234 hkdf() they replaced. Built once per backend: the RFC 6234 SHA-512
+ * and, with CONFIG_HAP_HKDF_USE_LIBSODIUM, libsodium's HMAC-SHA512.
+ */
+#include "esp_hap_hkdf.c"
+
+#include <sodium/core.h>
+#include <hkdf-sha.h>
+#include "check.h"
+
+#ifdef CONFIG_HAP_HKDF_USE_LIBSODIUM
+#define BACKEND "libsodium"
+#else
+#define BACKEND "RFC 6234"
+#endif
+
+#define MAX_IKM_LEN 200
+#define MAX_OKM_LEN 300
+
+/* The info strings used by Pair Setup and Pair Verify, plus an empty one */
+static const char *infos[] = {
+    "Control-Read-Encryption-Key",
+    "Control-Write-Encryption-Key",
+    "Pair-Verify-Encrypt-Info",
+    "Pair-Verify-ResumeSessionID-Info",
+    "Pair-Setup-Encrypt-Info",
+    "Pair-Setup-Controller-Sign-Info",
+    "Pair-Setup-Accessory-Sign-Info",
+    "",
+};
+#define INFOS (sizeof(infos) / sizeof(infos[0]))
+
+static int reference_hkdf(hap_hkdf_salt_t salt, const uint8_t *ikm, int ikm_len,
+        const char *info, uint8_t *okm, int okm_len)
+{
+    const char *s = hap_hkdf_salts[salt];
+    return hkdf(SHA512, (const unsigned char *)s, strlen(s), ikm, ikm_len,
+            (const unsigned char *)info, strlen(info), okm, okm_len);
+}
+
+static void test_invalid(void)
+{
+    uint8_t ikm[32] = {0}, okm[32];
+
+    CHECK(hap_hkdf(HAP_HKDF_SALT_CONTROL, ikm, sizeof(ikm), "", okm, sizeof(okm)) == HAP_FAIL,
+            "accepted before hap_hkdf_init()");
+    CHECK(hap_hkdf_init() == HAP_SUCCESS, "hap_hkdf_init");
+    CHECK(hap_hkdf_init() == HAP_SUCCESS, "second hap_hkdf_init");
+    CHECK(hap_hkdf(HAP_HKDF_SALT_MAX, ikm, sizeof(ikm), "", okm, sizeof(okm)) == HAP_FAIL,
+            "accepted an invalid salt");
+    CHECK(hap_hkdf(HAP_HKDF_SALT_CONTROL, NULL, 0, "", okm, sizeof(okm)) == HAP_FAIL,
+            "accepted a NULL ikm");
+    CHECK(hap_hkdf(HAP_HKDF_SALT_CONTROL, ikm, sizeof(ikm), NULL, okm, sizeof(okm)) == HAP_FAIL,
+            "accepted a NULL info");
+    /* RFC 5869 limits the output to 255 hash lengths */
+    CHECK(hap_hkdf(HAP_HKDF_SALT_CONTROL, ikm, sizeof(ikm), "", okm, 255 * 64 + 1) == HAP_FAIL,
+            "accepted too long an output");
+    CHECK(hap_hkdf2(HAP_HKDF_SALT_CONTROL, ikm, sizeof(ikm), "", okm, sizeof(okm),
+                "", okm, 255 * 64 + 1) == HAP_FAIL, "accepted too long a second output");
+}
+
+/* Every salt and info, with ikm and okm lengths across the SHA-512 block and hash sizes */
+static void test_against_rfc6234(void)
+{
+    static uint8_t ikm[MAX_IKM_LEN], okm[MAX_OKM_LEN], ref[MAX_OKM_LEN];
+    int salt, it;
+
+    for (salt = 0; salt < HAP_HKDF_SALT_MAX; salt++) {
+        for (it = 0; it < 400; it++) {
+            int ikm_len = it < MAX_IKM_LEN ? it : (int)(rng() % MAX_IKM_LEN);
+            int okm_len = 1 + (it < MAX_IKM_LEN ? it : (int)(rng() % MAX_OKM_LEN));
+            const char *info = infos[rng() % INFOS];
+            rng_fill(ikm, ikm_len);
+
+            memset(okm, 0, sizeof(okm));
+            CHECK(reference_hkdf(salt, ikm, ikm_len, info, ref, okm_len) == shaSuccess,
+                    "RFC 6234 hkdf failed");
+            CHECK(hap_hkdf(salt, ikm, ikm_len, info, okm, okm_len) == HAP_SUCCESS &&
+                    !memcmp(okm, ref, okm_len), "salt %d, ikm %d, okm %d, info \"%s\"",
+                    salt, ikm_len, okm_len, info);
+            /* Nothing written past the requested length */
+            CHECK(okm_len == MAX_OKM_LEN || okm[okm_len] == 0, "okm overrun, len %d", okm_len);
+        }
+    }
+}
+
+/* Two outputs in one pass, as for the Control read and write keys */
+static void test_hkdf2(void)
+{
+    uint8_t ikm[32], read_key[32], write_key[32], ref_read[32], ref_write[32];
+    uint8_t long1[150], long2[70], ref1[150], ref2[70];
+    int it;
+
+    for (it = 0; it < 200; it++) {
+        rng_fill(ikm, sizeof(ikm));
+        CHECK(hap_hkdf2(HAP_HKDF_SALT_CONTROL, ikm, sizeof(ikm),
+                    "Control-Read-Encryption-Key", read_key, sizeof(read_key),
+                    "Control-Write-Encryption-Key", write_key, sizeof(write_key)) == HAP_SUCCESS,
+                "hap_hkdf2 failed");
+        reference_hkdf(HAP_HKDF_SALT_CONTROL, ikm, sizeof(ikm), "Control-Read-Encryption-Key",
+                ref_read, sizeof(ref_read));
+        reference_hkdf(HAP_HKDF_SALT_CONTROL, ikm, sizeof(ikm), "Control-Write-Encryption-Key",
+                ref_write, sizeof(ref_write));
+        CHECK(!memcmp(read_key, ref_read, 32) && !memcmp(write_key, ref_write, 32),
+                "Control keys differ from two hkdf() calls");
+
+        /* Different lengths, each spanning more than one hash block */
+        CHECK(hap_hkdf2(HAP_HKDF_SALT_PAIR_SETUP_ENCRYPT, ikm, sizeof(ikm),
+                    infos[it % INFOS], long1, sizeof(long1),
+                    infos[(it + 1) % INFOS], long2, sizeof(long2)) == HAP_SUCCESS,
+                "hap_hkdf2 failed");
+        reference_hkdf(HAP_HKDF_SALT_PAIR_SETUP_ENCRYPT, ikm, sizeof(ikm), infos[it % INFOS],
+                ref1, sizeof(ref1));
+        reference_hkdf(HAP_HKDF_SALT_PAIR_SETUP_ENCRYPT, ikm, sizeof(ikm),
+                infos[(it + 1) % INFOS], ref2, sizeof(ref2));
+        CHECK(!memcmp(long1, ref1, sizeof(ref1)) && !memcmp(long2, ref2, sizeof(ref2)),
+                "multi-block outputs differ, info %d", it % (int)INFOS);
+    }
+}
+
+static const char *bench_read = "Control-Read-Encryption-Key";
+static const char *bench_write = "Control-Write-Encryption-Key";
+static uint8_t bench_ikm[32] = {1}, bench_k1[32], bench_k2[32];
+
+static void bench_reference(void)
+{
+    reference_hkdf(HAP_HKDF_SALT_CONTROL, bench_ikm, 32, bench_read, bench_k1, 32);
+    reference_hkdf(HAP_HKDF_SALT_CONTROL, bench_ikm, 32, bench_write, bench_k2, 32);
+}
+
+static void bench_hap_hkdf(void)
+{
+    hap_hkdf(HAP_HKDF_SALT_CONTROL, bench_ikm, 32, bench_read, bench_k1, 32);
+    hap_hkdf(HAP_HKDF_SALT_CONTROL, bench_ikm, 32, bench_write, bench_k2, 32);
+}
+
+static void bench_hap_hkdf2(void)
+{
+    hap_hkdf2(HAP_HKDF_SALT_CONTROL, bench_ikm, 32, bench_read, bench_k1, 32,
+            bench_write, bench_k2, 32);
+}
+
+/* Best of 50 runs of 200 calls each, in microseconds per call */
+static double bench_us(void (*fn)(void))
+{
+    double best = 1e9;
+    int run, i;
+    for (run = 0; run < 50; run++) {
+        double start = now_us();
+        for (i = 0; i < 200; i++) {
+            fn();
+        }
+        double t = (now_us() - start) / 200;
+        if (t < best) {
+            best = t;
+        }
+    }
+    return best;
+}
+
+static void bench(void)
+{
+    printf("Control read + write keys, hap_hkdf backend: %s\n", BACKEND);
+    printf("  2 x RFC 6234 hkdf(): %6.2f us\n", bench_us(bench_reference));
+    printf("  2 x hap_hkdf():      %6.2f us\n", bench_us(bench_hap_hkdf));
+    printf("  hap_hkdf2():         %6.2f us\n", bench_us(bench_hap_hkdf2));
+}
+
+int main(int argc, char **argv)
+{
+    if (sodium_init() < 0) {
+        printf("sodium_init failed\n");
+        return 1;
+    }
+    test_invalid();
+    test_against_rfc6234();
+    test_hkdf2();
+
+    if (check_bench(argc, argv)) {
+        bench();
+    }
+    return check_summary();
+}
@@ -0,0 +1,187 @@
+/* The chunked response stream of esp_hap_http_stream.c, on a fake corked session
+ * whose frames are captured in plaintext.
+ *
+ * Random JSON documents, with strings long enough to span several chunks, are
+ * generated once into a single buffer and once through the stream, for several
+ * frame sizes. The chunked body must reassemble byte-identical to the buffer, no
+ * chunk may exceed a frame, and nothing may be written past the area that
+ * hap_httpd_tx_get_buf() hands out.
+ */
+#include "esp_hap_http_stream.c"
+
+#include <stdlib.h>
+#include "check.h"
+#include "tx_capture.h"
+
+hap_priv_t hap_priv;
+
+/* A random document: nested objects and arrays of every value type, with
+ * strings of up to 600 characters and long strings made of several parts.
+ */
+static void gen_string(char *buf, int max_len)
+{
+    int len = rng() % 4 ? rng() % 40 : rng() % max_len;
+    for (int i = 0; i < len; i++) {
+        buf[i] = 'a' + rng() % 26;
+    }
+    buf[len] = '\0';
+}
+
+static void gen_value(json_gen_str_t *jstr, const char *name, int depth)
+{
+    char str[601];
+    switch (rng() % (depth < 3 ? 8 : 6)) {
+        case 0:
+            name ? json_gen_obj_set_int(jstr, name, rng()) : json_gen_arr_set_int(jstr, rng());
+            break;
+        case 1:
+            name ? json_gen_obj_set_bool(jstr, name, rng() % 2) :
+                json_gen_arr_set_bool(jstr, rng() % 2);
+            break;
+        case 2:
+            name ? json_gen_obj_set_float(jstr, name, (rng() % 100000) / 7.0f) :
+                json_gen_arr_set_float(jstr, (rng() % 100000) / 7.0f);
+            break;
+        case 3:
+            gen_string(str, sizeof(str));
+            name ? json_gen_obj_set_string(jstr, name, str) : json_gen_arr_set_string(jstr, str);
+            break;
+        case 4:
+            name ? json_gen_obj_set_null(jstr, name) : json_gen_arr_set_null(jstr);
+            break;
+        case 5:
+            gen_string(str, sizeof(str));
+            name ? json_gen_obj_start_long_string(jstr, name, str) :
+                json_gen_arr_start_long_string(jstr, str);
+            for (int i = rng() % 4; i > 0; i--) {
+                gen_string(str, sizeof(str));
+                json_gen_add_to_long_string(jstr, str);
+            }
+            json_gen_end_long_string(jstr);
+            break;
+        case 6:
+            name ? json_gen_push_object(jstr, name) : json_gen_start_object(jstr);
+            for (int i = rng() % 6; i > 0; i--) {
+                char key[16];
+                snprintf(key, sizeof(key), "k%u", (unsigned)(rng() % 1000));
+                gen_value(jstr, key, depth + 1);
+            }
+            name ? json_gen_pop_object(jstr) : json_gen_end_object(jstr);
+            break;
+        default:
+            name ? json_gen_push_array(jstr, name) : json_gen_start_array(jstr);
+            for (int i = rng() % 6; i > 0; i--) {
+                gen_value(jstr, NULL, depth + 1);
+            }
+            name ? json_gen_pop_array(jstr) : json_gen_end_array(jstr);
+            break;
+    }
+}
+
+static void gen_doc(json_gen_str_t *jstr, uint32_t seed, int members)
+{
+    rng_state = seed;
+    json_gen_start_object(jstr);
+    for (int i = 0; i < members; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "m%d", i);
+        gen_value(jstr, key, 0);
+    }
+    json_gen_end_object(jstr);
+}
+
+static char expected[MAX_OUT], body[MAX_OUT];
+
+static void test_json(void)
+{
+    static const int frame_sizes[] = {6, 7, 16, 100, 133, 512, MAX_FRAME};
+    char what[64];
+
+    for (int f = 0; f < sizeof(frame_sizes) / sizeof(frame_sizes[0]); f++) {
+        for (uint32_t seed = 1; seed <= 40; seed++) {
+            int members = seed % 10 ? 1 + seed % 20 : 0;
+            snprintf(what, sizeof(what), "frames of %d, seed %u", frame_sizes[f], (unsigned)seed);
+
+            json_gen_str_t jstr;
+            json_gen_str_start(&jstr, expected, sizeof(expected), NULL, NULL);
+            gen_doc(&jstr, seed, members);
+            int expected_len = json_gen_str_end(&jstr) - 1;
+            CHECK(expected_len < sizeof(expected), "%s: document too long", what);
+
+            hap_http_stream_t s;
+            session_cork(frame_sizes[f]);
+            CHECK(hap_http_stream_init(&s, TEST_FD, "200 OK") == HAP_SUCCESS, "%s: init", what);
+            hap_http_stream_json_start(&s, &jstr);
+            gen_doc(&jstr, seed, members);
+            hap_http_stream_json_end(&s, &jstr);
+            CHECK(hap_http_stream_end(&s) == HAP_SUCCESS, "%s: end", what);
+            session_flush();
+
+            CHECK(!guard_hit, "%s: written past the frame", what);
+            int body_len = parse_response(what, "200 OK", body);
+            CHECK(body_len == expected_len && !memcmp(body, expected, expected_len),
+                    "%s: body of %d bytes differs from the %d generated", what, body_len,
+                    expected_len);
+        }
+    }
+}
+
+/* Raw data and generators mixed in one stream, the way the attribute database
+ * cache sends its template with the slots filled in
+ */
+static void test_mixed(void)
+{
+    static const char raw[] = "[\"raw data between the generators\"]";
+    int expected_len = 0;
+
+    for (uint32_t seed = 1; seed <= 5; seed++) {
+        json_gen_str_t jstr;
+        memcpy(expected + expected_len, raw, strlen(raw));
+        expected_len += strlen(raw);
+        json_gen_str_start(&jstr, expected + expected_len, sizeof(expected) - expected_len,
+                NULL, NULL);
+        gen_doc(&jstr, seed, seed * 3);
+        expected_len += json_gen_str_end(&jstr) - 1;
+    }
+
+    hap_http_stream_t s;
+    session_cork(100);
+    hap_http_stream_init(&s, TEST_FD, "207 Multi-Status");
+    for (uint32_t seed = 1; seed <= 5; seed++) {
+        json_gen_str_t jstr;
+        hap_http_stream_add(&s, raw, strlen(raw));
+        hap_http_stream_json_start(&s, &jstr);
+        gen_doc(&jstr, seed, seed * 3);
+        hap_http_stream_json_end(&s, &jstr);
+    }
+    CHECK(hap_http_stream_end(&s) == HAP_SUCCESS, "mixed: end");
+    session_flush();
+
+    CHECK(!guard_hit, "mixed: written past the frame");
+    int body_len = parse_response("mixed", "207 Multi-Status", body);
+    CHECK(body_len == expected_len && !memcmp(body, expected, expected_len),
+            "mixed: body of %d bytes differs from the %d generated", body_len, expected_len);
+}
+
+/* An empty body is just the last chunk, and the status can change till data is added */
+static void test_empty(void)
+{
+    hap_http_stream_t s;
+    session_cork(MAX_FRAME);
+    hap_http_stream_init(&s, TEST_FD, "207 Multi-Status");
+    s.status = "200 OK";
+    CHECK(hap_http_stream_end(&s) == HAP_SUCCESS, "empty: end");
+    session_flush();
+    CHECK(parse_response("empty", "200 OK", body) == 0, "empty: body not empty");
+
+    /* A session that is not corked cannot stream */
+    CHECK(hap_http_stream_init(&s, TEST_FD, "200 OK") == HAP_FAIL, "not corked: init");
+}
+
+int main(int argc, char **argv)
+{
+    test_json();
+    test_mixed();
+    test_empty();
+    return check_summary();
+}
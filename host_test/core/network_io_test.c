@@ -0,0 +1,289 @@
+/* The encrypted receive path of esp_hap_network_io.c, with eight verified
+ * sessions on socket pairs read interleaved through hap_httpd_recv(), the way
+ * the HTTP server task does when several controllers send at once.
+ *
+ * Each session must get back exactly what its controller sent, with read sizes
+ * that both split frames and take them whole. A single frame shared by all
+ * sessions, as before, is run through the same reads to show what it loses.
+ */
+#include "esp_hap_network_io.c"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sodium/core.h>
+#include "check.h"
+
+#define SESSIONS        HAP_MAX_SESSIONS
+#define REQUEST_LEN     16000   /* Plaintext per session per round */
+#define MAX_FD          1024
+
+hap_priv_t hap_priv;
+
+/* What the HTTP server would return for each socket */
+static hap_secure_session_t *fd_sessions[MAX_FD];
+static int closed_sessions;
+
+void *httpd_sess_get_ctx(httpd_handle_t handle, int sockfd)
+{
+    return (sockfd >= 0 && sockfd < MAX_FD) ? fd_sessions[sockfd] : NULL;
+}
+
+int hap_close_session(hap_secure_session_t *session)
+{
+    closed_sessions++;
+    return HAP_SUCCESS;
+}
+
+void *hap_platform_memory_calloc(size_t count, size_t size)
+{
+    return calloc(count, size);
+}
+
+void hap_platform_memory_free(void *ptr)
+{
+    free(ptr);
+}
+
+/* A controller, with its end of the socket pair and its own session for encrypting */
+typedef struct {
+    hap_secure_session_t session;
+    int fd;             /* Accessory end, read through hap_httpd_recv() */
+    int peer_fd;        /* Controller end */
+    hap_secure_session_t peer;
+    uint8_t sent[REQUEST_LEN];
+    uint8_t received[REQUEST_LEN];
+    int received_len;
+} test_session_t;
+
+static test_session_t sessions[SESSIONS + 1];
+
+static void session_open(test_session_t *s)
+{
+    int fds[2];
+    memset(s, 0, sizeof(*s));
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0 || fds[0] >= MAX_FD) {
+        printf("socketpair failed\n");
+        exit(1);
+    }
+    int buf_size = 4 * REQUEST_LEN;
+    setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+    s->fd = fds[0];
+    s->peer_fd = fds[1];
+    s->session.state = STATE_VERIFIED;
+    rng_fill(s->session.decrypt_key, sizeof(s->session.decrypt_key));
+    memcpy(s->peer.encrypt_key, s->session.decrypt_key, sizeof(s->peer.encrypt_key));
+    fd_sessions[s->fd] = &s->session;
+}
+
+static void session_close(test_session_t *s)
+{
+    hap_decrypt_frame_release(&s->session);
+    fd_sessions[s->fd] = NULL;
+    close(s->fd);
+    close(s->peer_fd);
+}
+
+/* The controller sends REQUEST_LEN bytes in frames of random sizes */
+static void session_send(test_session_t *s)
+{
+    static hap_encrypt_frame_t frame;
+    int off = 0;
+    rng_fill(s->sent, sizeof(s->sent));
+    s->received_len = 0;
+    while (off < REQUEST_LEN) {
+        int len = 1 + rng() % HAP_MAX_NW_FRAME_SIZE;
+        if (len > REQUEST_LEN - off) {
+            len = REQUEST_LEN - off;
+        }
+        hap_encrypt_data(&frame, &s->peer, s->sent + off, len);
+        if (write(s->peer_fd, &frame, 2 + len + AUTH_TAG_LEN) != 2 + len + AUTH_TAG_LEN) {
+            printf("write failed\n");
+            exit(1);
+        }
+        off += len;
+    }
+}
+
+/* Mostly small reads that split frames, sometimes ones that take a frame whole */
+static int read_size(void)
+{
+    return (rng() % 4) ? 1 + rng() % 300 : HAP_MAX_NW_FRAME_SIZE + AUTH_TAG_LEN + rng() % 100;
+}
+
+/* One read for a session, through hap_httpd_recv() or a frame shared by all sessions */
+static int session_read(test_session_t *s, hap_decrypt_frame_t *shared)
+{
+    int len = read_size();
+    if (len > REQUEST_LEN - s->received_len) {
+        len = REQUEST_LEN - s->received_len;
+    }
+    uint8_t *buf = s->received + s->received_len;
+    int ret = shared ?
+        hap_decrypt_data(shared, &s->session, buf, len, hap_httpd_raw_recv, &s->fd) :
+        hap_httpd_recv(NULL, s->fd, (char *)buf, len, 0);
+    if (ret > 0) {
+        s->received_len += ret;
+    }
+    return ret;
+}
+
+static int pending_bytes(test_session_t *s)
+{
+    int pending = 0;
+    ioctl(s->fd, FIONREAD, &pending);
+    return pending;
+}
+
+/* Round robin over the sessions, one read each, till every one has all its data */
+static void read_interleaved(test_session_t *list, int count)
+{
+    int done = 0;
+    while (done < count) {
+        done = 0;
+        for (int i = 0; i < count; i++) {
+            if (list[i].received_len == REQUEST_LEN) {
+                done++;
+            } else if (session_read(&list[i], NULL) <= 0) {
+                CHECK(0, "read failed on session %d", i);
+                return;
+            }
+        }
+    }
+}
+
+static void test_interleaved(void)
+{
+    for (int i = 0; i < SESSIONS; i++) {
+        session_open(&sessions[i]);
+    }
+    for (int round = 0; round < 20; round++) {
+        for (int i = 0; i < SESSIONS; i++) {
+            session_send(&sessions[i]);
+        }
+        read_interleaved(sessions, SESSIONS);
+        for (int i = 0; i < SESSIONS; i++) {
+            CHECK(!memcmp(sessions[i].received, sessions[i].sent, REQUEST_LEN),
+                    "round %d: session %d got different data", round, i);
+            CHECK(pending_bytes(&sessions[i]) == 0, "round %d: session %d left data", round, i);
+        }
+    }
+    CHECK(closed_sessions == 0, "%d sessions closed", closed_sessions);
+
+    /* Every session got a frame of its own from the pool */
+    for (int i = 0; i < SESSIONS; i++) {
+        hap_decrypt_frame_t *frame = sessions[i].session.rx_frame;
+        CHECK(frame >= hap_decrypt_frame_pool && frame < hap_decrypt_frame_pool + HAP_MAX_SESSIONS,
+                "session %d frame not from the pool", i);
+        CHECK(frame->session == &sessions[i].session, "session %d frame owner", i);
+    }
+    /* One more session than the pool holds falls back to the heap */
+    session_open(&sessions[SESSIONS]);
+    session_send(&sessions[SESSIONS]);
+    read_interleaved(sessions, SESSIONS + 1);
+    CHECK(!memcmp(sessions[SESSIONS].received, sessions[SESSIONS].sent, REQUEST_LEN),
+            "extra session got different data");
+    hap_decrypt_frame_t *extra = sessions[SESSIONS].session.rx_frame;
+    CHECK(extra && (extra < hap_decrypt_frame_pool || extra >= hap_decrypt_frame_pool + HAP_MAX_SESSIONS),
+            "extra session frame should come from the heap");
+
+    for (int i = 0; i <= SESSIONS; i++) {
+        session_close(&sessions[i]);
+    }
+    for (int i = 0; i < HAP_MAX_SESSIONS; i++) {
+        CHECK(hap_decrypt_frame_pool[i].session == NULL, "pool frame %d not released", i);
+    }
+}
+
+/* A wrong tag must close the session, not hand out data */
+static void test_tamper(void)
+{
+    static hap_encrypt_frame_t frame;
+    test_session_t *s = &sessions[0];
+    uint8_t buf[200];
+
+    session_open(s);
+    rng_fill(s->sent, 100);
+    hap_encrypt_data(&frame, &s->peer, s->sent, 100);
+    frame.data[5] ^= 1;
+    CHECK(write(s->peer_fd, &frame, 2 + 100 + AUTH_TAG_LEN) == 2 + 100 + AUTH_TAG_LEN,
+            "write");
+    closed_sessions = 0;
+    CHECK(hap_httpd_recv(NULL, s->fd, (char *)buf, sizeof(buf), 0) == HAP_FAIL,
+            "tampered frame accepted");
+    CHECK(closed_sessions == 1 && s->session.state == STATE_INVALID, "session not closed");
+    session_close(s);
+}
+
+/* The same reads with one frame for everyone: each switch of session drops
+ * whatever was left of the previous session's frame.
+ */
+static void test_shared_frame(void)
+{
+    static hap_decrypt_frame_t shared;
+    int lost = 0;
+
+    for (int i = 0; i < SESSIONS; i++) {
+        session_open(&sessions[i]);
+        session_send(&sessions[i]);
+    }
+    int active = SESSIONS;
+    while (active) {
+        active = 0;
+        for (int i = 0; i < SESSIONS; i++) {
+            test_session_t *s = &sessions[i];
+            bool staged = (shared.session == &s->session) && (shared.pkt_size != shared.bytes_read);
+            if (s->received_len < REQUEST_LEN && (staged || pending_bytes(s))) {
+                session_read(s, &shared);
+                active++;
+            }
+        }
+    }
+    for (int i = 0; i < SESSIONS; i++) {
+        lost += REQUEST_LEN - sessions[i].received_len;
+        session_close(&sessions[i]);
+    }
+    CHECK(lost > 0, "the shared frame lost nothing");
+    printf("one shared frame: %d of %d bytes lost\n", lost, SESSIONS * REQUEST_LEN);
+}
+
+/* Read throughput in MB/s, for count sessions read interleaved, over the best of 30 rounds */
+static double bench(int count)
+{
+    double best = 1e9;
+    for (int i = 0; i < count; i++) {
+        session_open(&sessions[i]);
+    }
+    for (int round = 0; round < 30; round++) {
+        for (int i = 0; i < count; i++) {
+            session_send(&sessions[i]);
+        }
+        double start = now_us();
+        read_interleaved(sessions, count);
+        double t = (now_us() - start) / count;
+        if (t < best) {
+            best = t;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        session_close(&sessions[i]);
+    }
+    return REQUEST_LEN / best;
+}
+
+int main(int argc, char **argv)
+{
+    if (sodium_init() < 0) {
+        printf("sodium_init failed\n");
+        return 1;
+    }
+    test_interleaved();
+    test_tamper();
+    test_shared_frame();
+
+    if (check_bench(argc, argv)) {
+        printf("1 session:              %6.1f MB/s\n", bench(1));
+        printf("%d sessions interleaved: %6.1f MB/s\n", SESSIONS, bench(SESSIONS));
+    }
+    return check_summary();
+}
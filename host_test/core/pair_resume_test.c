@@ -0,0 +1,513 @@
+/* Pair Verify and Pair Resume in esp_hap_pair_verify.c, driven by a controller
+ * written here from the spec, with a fake clock for the resume cache.
+ *
+ * Each Pair Verify must end with the session keys that the controller derives, and
+ * a session ID that the controller can resume with. A resume must do the same
+ * with a single round trip, and fall back to a full Pair Verify of the same M1 for
+ * an unknown, replayed, expired or forged session. The cache must evict the least
+ * recently used session when full, and drop the sessions of a controller that is
+ * removed or paired again.
+ */
+#include "esp_hap_pair_verify.c"
+
+#include <stdlib.h>
+#include <sodium/core.h>
+#include <sodium/randombytes.h>
+#include <esp_hap_ed25519.h>
+#include "check.h"
+
+#define BUF_SIZE        1024    /* As the HTTP request buffer */
+#define CONTROLLERS     (CONFIG_HAP_PAIR_RESUME_CACHE_SIZE + 1)
+#define READY_KEYPAIRS  64
+
+hap_priv_t hap_priv;
+
+/* The paired controllers, with their decoded keys, as in esp_hap_controllers.c */
+static hap_ctrl_data_t ctrl_slots[HAP_MAX_CONTROLLERS];
+static hap_ed25519_pk_t ctrl_pks[HAP_MAX_CONTROLLERS];
+static uint8_t acc_ltpk[ED_KEY_LEN];
+
+static int64_t fake_time_us = 1000000;
+static double accessory_us;     /* Time spent in hap_pair_verify_process() */
+
+/* Key pairs that the pool has ready. Once out of them, they are generated on demand. */
+static hap_curve_keypair_t ready_keypairs[READY_KEYPAIRS];
+static int ready_count;
+
+int64_t esp_timer_get_time(void)
+{
+    return fake_time_us;
+}
+
+int esp_mfi_get_random(uint8_t *buf, uint16_t len)
+{
+    randombytes_buf(buf, len);
+    return 0;
+}
+
+void *hap_platform_memory_calloc(size_t count, size_t size)
+{
+    return calloc(count, size);
+}
+
+void hap_platform_memory_free(void *ptr)
+{
+    free(ptr);
+}
+
+void hap_report_event(hap_event_t event, void *data, size_t data_size)
+{
+}
+
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd)
+{
+    return ESP_OK;
+}
+
+void hap_disable_all_char_notif(int index)
+{
+}
+
+void hap_decrypt_frame_release(hap_secure_session_t *session)
+{
+}
+
+static void keypair_generate(hap_curve_keypair_t *kp)
+{
+    randombytes_buf(kp->sk, sizeof(kp->sk));
+    crypto_scalarmult_curve25519_base(kp->pk, kp->sk);
+}
+
+int hap_keypair_pool_get(hap_curve_keypair_t *kp)
+{
+    if (ready_count) {
+        *kp = ready_keypairs[--ready_count];
+    } else {
+        keypair_generate(kp);
+    }
+    return HAP_SUCCESS;
+}
+
+int hap_get_controller_snapshot(const char *ctrl_id, hap_ctrl_snapshot_t *snap)
+{
+    for (int i = 0; i < HAP_MAX_CONTROLLERS; i++) {
+        if (ctrl_slots[i].valid && !strncmp(ctrl_slots[i].info.id, ctrl_id, HAP_CTRL_ID_LEN)) {
+            snap->ctrl = &ctrl_slots[i];
+            memcpy(snap->id, ctrl_slots[i].info.id, HAP_CTRL_ID_LEN);
+            memcpy(snap->ltpk, ctrl_slots[i].info.ltpk, ED_KEY_LEN);
+            return HAP_SUCCESS;
+        }
+    }
+    return HAP_FAIL;
+}
+
+int hap_controller_verify(const hap_ctrl_snapshot_t *ctrl, const uint8_t *sig,
+        const uint8_t *msg, size_t msg_len)
+{
+    hap_ed25519_pk_t *pk = &ctrl_pks[ctrl->ctrl - ctrl_slots];
+    if (!pk->valid || memcmp(pk->bytes, ctrl->ltpk, ED_KEY_LEN)) {
+        return HAP_FAIL;
+    }
+    return hap_ed25519_verify(pk, sig, msg, msg_len);
+}
+
+/* The controller side */
+typedef struct {
+    hap_ctrl_data_t *slot;
+    uint8_t ltsk[2 * ED_KEY_LEN];
+    uint8_t curve_sk[CURVE_KEY_LEN];
+    uint8_t curve_pk[CURVE_KEY_LEN];
+    uint8_t shared_secret[CURVE_KEY_LEN];
+    uint8_t session_id[SESSION_ID_LEN];
+    uint8_t read_key[ENCRYPT_KEY_LEN];
+    uint8_t write_key[ENCRYPT_KEY_LEN];
+} test_ctrl_t;
+
+static test_ctrl_t ctrls[CONTROLLERS];
+
+/* Pairs the controller, as Pair Setup or Add Pairing would, with a new long term key */
+static void ctrl_pair(test_ctrl_t *c, int index)
+{
+    hap_ctrl_data_t *slot = &ctrl_slots[index];
+    memset(slot, 0, sizeof(*slot));
+    snprintf(slot->info.id, sizeof(slot->info.id), "%08X-CONTROLLER-%d", 0xC0FFEE00 + index, index);
+    crypto_sign_ed25519_keypair(slot->info.ltpk, c->ltsk);
+    slot->valid = true;
+    slot->index = index;
+    hap_ed25519_pk_load(&ctrl_pks[index], slot->info.ltpk);
+    c->slot = slot;
+}
+
+static void ctrl_unpair(test_ctrl_t *c)
+{
+    hap_close_sessions_of_ctrl(c->slot);
+    c->slot->valid = false;
+    hap_ed25519_pk_clear(&ctrl_pks[c->slot - ctrl_slots]);
+}
+
+static void hkdf_sha512(const uint8_t *salt, int salt_len, const uint8_t *ikm, const char *info,
+        uint8_t *okm, int okm_len)
+{
+    hkdf(SHA512, salt, salt_len, ikm, CURVE_KEY_LEN, (const unsigned char *)info, strlen(info),
+            okm, okm_len);
+}
+
+static void nonce_init(uint8_t nonce[12], const char *name)
+{
+    memset(nonce, 0, 12);
+    memcpy(nonce + 4, name, 8);
+}
+
+/* The session keys and the ID to resume with, once the shared secret is known */
+static void ctrl_derive_session(test_ctrl_t *c)
+{
+    const char *salt = "Control-Salt";
+    hkdf_sha512((const uint8_t *)salt, strlen(salt), c->shared_secret, CONTROL_READ_INFO,
+            c->read_key, sizeof(c->read_key));
+    hkdf_sha512((const uint8_t *)salt, strlen(salt), c->shared_secret, CONTROL_WRITE_INFO,
+            c->write_key, sizeof(c->write_key));
+}
+
+/* Pair Resume keys, salted with the controller's public key and a session ID */
+static void ctrl_resume_key(test_ctrl_t *c, const uint8_t *session_id, const char *info,
+        uint8_t *key)
+{
+    uint8_t salt[CURVE_KEY_LEN + SESSION_ID_LEN];
+    memcpy(salt, c->curve_pk, CURVE_KEY_LEN);
+    memcpy(salt + CURVE_KEY_LEN, session_id, SESSION_ID_LEN);
+    hkdf_sha512(salt, sizeof(salt), c->shared_secret, info, key, CURVE_KEY_LEN);
+}
+
+/* M1, with a new Curve25519 key, and for a resume, the session ID and its authTag */
+static int ctrl_m1(test_ctrl_t *c, bool resume, uint8_t *buf)
+{
+    hap_tlv_data_t tlv_data;
+    uint8_t state = STATE_M1, method = HAP_METHOD_PAIR_RESUME;
+
+    randombytes_buf(c->curve_sk, sizeof(c->curve_sk));
+    crypto_scalarmult_curve25519_base(c->curve_pk, c->curve_sk);
+    hap_tlv_data_init(&tlv_data, buf, BUF_SIZE);
+    add_tlv(&tlv_data, kTLVType_State, 1, &state);
+    add_tlv(&tlv_data, kTLVType_PublicKey, CURVE_KEY_LEN, c->curve_pk);
+    if (resume) {
+        /* The message has no data, just the authTag */
+        uint8_t key[ENCRYPT_KEY_LEN], nonce[12], tag[POLY_AUTHTAG_LEN], empty[1];
+        unsigned long long tag_len;
+        ctrl_resume_key(c, c->session_id, PAIR_RESUME_REQUEST_INFO, key);
+        nonce_init(nonce, PR_NONCE1);
+        crypto_aead_chacha20poly1305_ietf_encrypt_detached(empty, tag, &tag_len, empty, 0,
+                NULL, 0, NULL, nonce, key);
+        add_tlv(&tlv_data, kTLVType_Method, 1, &method);
+        add_tlv(&tlv_data, kTLVType_SessionID, SESSION_ID_LEN, c->session_id);
+        add_tlv(&tlv_data, kTLVType_EncryptedData, POLY_AUTHTAG_LEN, tag);
+    }
+    return tlv_data.curlen;
+}
+
+/* Checks the accessory's M2 of a full Pair Verify, and builds M3 in its place */
+static int ctrl_m3(test_ctrl_t *c, uint8_t *buf, int len, bool forge)
+{
+    uint8_t acc_pk[CURVE_KEY_LEN], key[ENCRYPT_KEY_LEN], nonce[12];
+    uint8_t edata[BUF_SIZE], info[2 * CURVE_KEY_LEN + HAP_CTRL_ID_LEN], sig[ED_SIGN_LEN];
+    char acc_id[HAP_ACC_ID_LEN] = {0};
+    int edata_len, info_len = 0;
+    const char *salt = "Pair-Verify-Encrypt-Salt";
+
+    if ((get_value_from_tlv(buf, len, kTLVType_PublicKey, acc_pk, sizeof(acc_pk)) != CURVE_KEY_LEN) ||
+            ((edata_len = get_value_from_tlv(buf, len, kTLVType_EncryptedData, edata,
+                    sizeof(edata))) < POLY_AUTHTAG_LEN)) {
+        CHECK(0, "M2 without a public key and encrypted data");
+        return -1;
+    }
+    CHECK(crypto_scalarmult_curve25519(c->shared_secret, c->curve_sk, acc_pk) == 0, "X25519");
+    hkdf_sha512((const uint8_t *)salt, strlen(salt), c->shared_secret, PAIR_VERIFY_ENCRYPT_INFO,
+            key, sizeof(key));
+    nonce_init(nonce, PV_NONCE1);
+    edata_len -= POLY_AUTHTAG_LEN;
+    if (crypto_aead_chacha20poly1305_ietf_decrypt_detached(edata, NULL, edata, edata_len,
+                edata + edata_len, NULL, 0, nonce, key) != 0) {
+        CHECK(0, "M2 does not decrypt");
+        return -1;
+    }
+    /* The accessory signed its key, its ID and the controller's key */
+    get_value_from_tlv(edata, edata_len, kTLVType_Identifier, acc_id, sizeof(acc_id) - 1);
+    CHECK(!strcmp(acc_id, hap_priv.acc_id), "M2 accessory ID \"%s\"", acc_id);
+    CHECK(get_value_from_tlv(edata, edata_len, kTLVType_Signature, sig, sizeof(sig)) == ED_SIGN_LEN,
+            "M2 without a signature");
+    memcpy(info, acc_pk, CURVE_KEY_LEN);
+    memcpy(info + CURVE_KEY_LEN, acc_id, strlen(acc_id));
+    memcpy(info + CURVE_KEY_LEN + strlen(acc_id), c->curve_pk, CURVE_KEY_LEN);
+    CHECK(crypto_sign_ed25519_verify_detached(sig, info,
+                2 * CURVE_KEY_LEN + strlen(acc_id), acc_ltpk) == 0, "M2 signature");
+
+    /* The controller signs its key, its ID and the accessory's key */
+    memcpy(info, c->curve_pk, CURVE_KEY_LEN);
+    info_len += CURVE_KEY_LEN;
+    memcpy(info + info_len, c->slot->info.id, strlen(c->slot->info.id));
+    info_len += strlen(c->slot->info.id);
+    memcpy(info + info_len, acc_pk, CURVE_KEY_LEN);
+    info_len += CURVE_KEY_LEN;
+    crypto_sign_ed25519_detached(sig, NULL, info, info_len, c->ltsk);
+    if (forge) {
+        sig[10] ^= 1;
+    }
+
+    hap_tlv_data_t tlv_data;
+    uint8_t subtlv[4 + HAP_CTRL_ID_LEN + ED_SIGN_LEN + POLY_AUTHTAG_LEN];
+    hap_tlv_data_init(&tlv_data, subtlv, sizeof(subtlv));
+    add_tlv(&tlv_data, kTLVType_Identifier, strlen(c->slot->info.id), c->slot->info.id);
+    add_tlv(&tlv_data, kTLVType_Signature, sizeof(sig), sig);
+    int subtlv_len = tlv_data.curlen;
+    unsigned long long tag_len;
+    nonce_init(nonce, PV_NONCE2);
+    crypto_aead_chacha20poly1305_ietf_encrypt_detached(subtlv, subtlv + subtlv_len, &tag_len,
+            subtlv, subtlv_len, NULL, 0, NULL, nonce, key);
+
+    uint8_t state = STATE_M3;
+    hap_tlv_data_init(&tlv_data, buf, BUF_SIZE);
+    add_tlv(&tlv_data, kTLVType_State, 1, &state);
+    add_tlv(&tlv_data, kTLVType_EncryptedData, subtlv_len + POLY_AUTHTAG_LEN, subtlv);
+    return tlv_data.curlen;
+}
+
+/* Checks the accessory's M2 of a Pair Resume, and takes over the resumed session */
+static bool ctrl_resume_m2(test_ctrl_t *c, uint8_t *buf, int len)
+{
+    uint8_t session_id[SESSION_ID_LEN], tag[POLY_AUTHTAG_LEN], key[ENCRYPT_KEY_LEN], nonce[12];
+    uint8_t method = 0, empty[1];
+
+    get_value_from_tlv(buf, len, kTLVType_Method, &method, sizeof(method));
+    if ((method != HAP_METHOD_PAIR_RESUME) ||
+            (get_value_from_tlv(buf, len, kTLVType_SessionID, session_id,
+                    sizeof(session_id)) != SESSION_ID_LEN) ||
+            (get_value_from_tlv(buf, len, kTLVType_EncryptedData, tag,
+                    sizeof(tag)) != POLY_AUTHTAG_LEN)) {
+        CHECK(0, "Pair Resume M2 without method, session ID and authTag");
+        return false;
+    }
+    CHECK(memcmp(session_id, c->session_id, SESSION_ID_LEN), "resumed session kept its ID");
+    ctrl_resume_key(c, session_id, PAIR_RESUME_RESPONSE_INFO, key);
+    nonce_init(nonce, PR_NONCE2);
+    if (crypto_aead_chacha20poly1305_ietf_decrypt_detached(empty, NULL, empty, 0, tag, NULL, 0,
+                nonce, key) != 0) {
+        CHECK(0, "Pair Resume M2 authTag");
+        return false;
+    }
+    ctrl_resume_key(c, session_id, PAIR_RESUME_SHARED_SECRET_INFO, c->shared_secret);
+    memcpy(c->session_id, session_id, SESSION_ID_LEN);
+    return true;
+}
+
+typedef enum {
+    PV_FAILED,
+    PV_VERIFIED,    /* With a full Pair Verify */
+    PV_RESUMED,
+} pv_result_t;
+
+static int accessory_process(void **ctx, uint8_t *buf, int inlen)
+{
+    int outlen = 0;
+    double start = now_us();
+    int ret = hap_pair_verify_process(ctx, buf, inlen, BUF_SIZE, &outlen);
+    accessory_us += now_us() - start;
+    return ret == HAP_SUCCESS ? outlen : -1;
+}
+
+/* A whole Pair Verify, or Pair Resume, as the controller runs it */
+static pv_result_t pair_verify(test_ctrl_t *c, bool resume, bool forge)
+{
+    static uint8_t buf[BUF_SIZE];
+    pv_result_t result = PV_FAILED;
+    void *ctx = NULL;
+    int len, outlen;
+    uint8_t state = 0;
+
+    hap_pair_verify_context_init(&ctx, buf, BUF_SIZE, &outlen);
+    len = ctrl_m1(c, resume, buf);
+    if ((len = accessory_process(&ctx, buf, len)) < 0) {
+        goto done;
+    }
+    get_value_from_tlv(buf, len, kTLVType_State, &state, sizeof(state));
+    CHECK(state == STATE_M2, "M2 state %d", state);
+    if (get_tlv_length(buf, len, kTLVType_PublicKey) < 0) {
+        if (!ctrl_resume_m2(c, buf, len)) {
+            goto done;
+        }
+        result = PV_RESUMED;
+    } else {
+        if ((len = ctrl_m3(c, buf, len, forge)) < 0) {
+            goto done;
+        }
+        if ((len = accessory_process(&ctx, buf, len)) < 0) {
+            goto done;
+        }
+        get_value_from_tlv(buf, len, kTLVType_State, &state, sizeof(state));
+        CHECK(state == STATE_M4 && get_tlv_length(buf, len, kTLVType_Error) < 0,
+                "M4 state %d, or an error", state);
+        const char *salt = "Pair-Verify-ResumeSessionID-Salt";
+        hkdf_sha512((const uint8_t *)salt, strlen(salt), c->shared_secret,
+                RESUME_SESSION_ID_INFO, c->session_id, SESSION_ID_LEN);
+        result = PV_VERIFIED;
+    }
+
+    /* The context is now the session, with the keys the controller has */
+    ctrl_derive_session(c);
+    hap_secure_session_t *session = ctx;
+    CHECK(session->state == STATE_VERIFIED, "session state %d", session->state);
+    CHECK(session->ctrl == c->slot, "session of another controller");
+    CHECK(!memcmp(session->encrypt_key, c->read_key, ENCRYPT_KEY_LEN) &&
+            !memcmp(session->decrypt_key, c->write_key, ENCRYPT_KEY_LEN),
+            "session keys differ from the controller's");
+    hap_free_session(session);
+    return result;
+
+done:
+    if (hap_pair_verify_get_state(ctx) == STATE_VERIFIED) {
+        hap_free_session(ctx);
+    } else {
+        hap_pair_verify_context_deinit(ctx);
+    }
+    return result;
+}
+
+static void test_pair_verify(void)
+{
+    test_ctrl_t *c = &ctrls[0];
+
+    CHECK(pair_verify(c, false, false) == PV_VERIFIED, "Pair Verify");
+    CHECK(pair_verify(c, false, true) == PV_FAILED, "Pair Verify with a forged signature");
+
+    /* A controller that is not paired is turned away at M3 */
+    ctrl_unpair(c);
+    CHECK(pair_verify(c, false, false) == PV_FAILED, "Pair Verify of an unpaired controller");
+    ctrl_pair(c, 0);
+    CHECK(pair_verify(c, false, false) == PV_VERIFIED, "Pair Verify after pairing again");
+}
+
+static void test_resume(void)
+{
+    test_ctrl_t *c = &ctrls[0];
+    uint8_t old_session_id[SESSION_ID_LEN];
+
+    CHECK(pair_verify(c, false, false) == PV_VERIFIED, "Pair Verify");
+    CHECK(pair_verify(c, true, false) == PV_RESUMED, "Pair Resume");
+    memcpy(old_session_id, c->session_id, SESSION_ID_LEN);
+    CHECK(pair_verify(c, true, false) == PV_RESUMED, "Pair Resume of a resumed session");
+
+    /* Each session ID can be resumed only once */
+    memcpy(c->session_id, old_session_id, SESSION_ID_LEN);
+    CHECK(pair_verify(c, true, false) == PV_VERIFIED, "replayed session resumed");
+
+    /* A session ID that was never handed out */
+    randombytes_buf(c->session_id, SESSION_ID_LEN);
+    CHECK(pair_verify(c, true, false) == PV_VERIFIED, "unknown session resumed");
+
+    /* The right session ID, without the shared secret that goes with it */
+    CHECK(pair_verify(c, true, false) == PV_RESUMED, "Pair Resume");
+    c->shared_secret[0] ^= 1;
+    CHECK(pair_verify(c, true, false) == PV_VERIFIED, "session resumed without its secret");
+
+    /* Expiry, just after the timeout */
+    CHECK(pair_verify(c, true, false) == PV_RESUMED, "Pair Resume");
+    fake_time_us += CONFIG_HAP_PAIR_RESUME_TIMEOUT * 1000000LL;
+    CHECK(pair_verify(c, true, false) == PV_RESUMED, "Pair Resume at the timeout");
+    fake_time_us += CONFIG_HAP_PAIR_RESUME_TIMEOUT * 1000000LL + 1000;
+    CHECK(pair_verify(c, true, false) == PV_VERIFIED, "expired session resumed");
+}
+
+static void test_eviction(void)
+{
+    int i;
+
+    /* One more controller than the cache holds, each verified a second after the other */
+    for (i = 0; i < CONTROLLERS; i++) {
+        fake_time_us += 1000000;
+        CHECK(pair_verify(&ctrls[i], false, false) == PV_VERIFIED, "Pair Verify %d", i);
+    }
+    /* The first one got evicted by the last one */
+    CHECK(pair_verify(&ctrls[0], true, false) == PV_VERIFIED, "evicted session resumed");
+    /* And that evicted the second one, the least recently used now */
+    for (i = 2; i < CONTROLLERS; i++) {
+        fake_time_us += 1000000;
+        CHECK(pair_verify(&ctrls[i], true, false) == PV_RESUMED, "Pair Resume %d", i);
+    }
+    /* The second one's new session in turn evicts the first one's */
+    CHECK(pair_verify(&ctrls[1], true, false) == PV_VERIFIED, "evicted session resumed");
+    CHECK(pair_verify(&ctrls[0], true, false) == PV_VERIFIED, "evicted session resumed");
+}
+
+/* Removing a controller, or pairing it again with another key, ends its sessions */
+static void test_controller_removed(void)
+{
+    test_ctrl_t *c = &ctrls[1];
+    CHECK(pair_verify(c, true, false) == PV_RESUMED, "Pair Resume");
+    ctrl_unpair(c);
+    CHECK(pair_verify(c, true, false) == PV_FAILED, "removed controller resumed");
+    ctrl_pair(c, 1);
+    CHECK(pair_verify(c, true, false) == PV_VERIFIED, "session of the old key resumed");
+
+    /* Paired again without being removed, as Pair Setup can do */
+    CHECK(pair_verify(c, true, false) == PV_RESUMED, "Pair Resume");
+    ctrl_pair(c, 1);
+    CHECK(pair_verify(c, true, false) == PV_VERIFIED, "session of the old key resumed");
+}
+
+/* Accessory side microseconds per exchange, best of 20 runs of 50 */
+static double bench_us(bool resume, bool keypair_ready)
+{
+    test_ctrl_t *c = &ctrls[0];
+    double best = 1e9;
+    pair_verify(c, false, false);
+    for (int run = 0; run < 20; run++) {
+        if (keypair_ready) {
+            for (ready_count = 0; ready_count < 50; ready_count++) {
+                keypair_generate(&ready_keypairs[ready_count]);
+            }
+        }
+        accessory_us = 0;
+        for (int i = 0; i < 50; i++) {
+            pair_verify(c, resume, false);
+        }
+        if (accessory_us / 50 < best) {
+            best = accessory_us / 50;
+        }
+    }
+    ready_count = 0;
+    return best;
+}
+
+static void bench(void)
+{
+    double resume = bench_us(true, false);
+    double ready = bench_us(false, true);
+    double generated = bench_us(false, false);
+    printf("Accessory side time per exchange\n");
+    printf("  Pair Verify, key pair generated: %7.1f us\n", generated);
+    printf("  Pair Verify, key pair from pool: %7.1f us\n", ready);
+    printf("  Pair Resume:                     %7.1f us (%.1fx faster than from pool)\n",
+            resume, ready / resume);
+}
+
+int main(int argc, char **argv)
+{
+    if (sodium_init() < 0) {
+        printf("sodium_init failed\n");
+        return 1;
+    }
+    hap_hkdf_init();
+    strcpy(hap_priv.acc_id, "12:34:56:78:9A:BC");
+    crypto_sign_ed25519_keypair(acc_ltpk, hap_priv.ltska_sk);
+    for (int i = 0; i < CONTROLLERS; i++) {
+        ctrl_pair(&ctrls[i], i);
+    }
+
+    test_pair_verify();
+    test_resume();
+    test_eviction();
+    test_controller_removed();
+
+    if (check_bench(argc, argv)) {
+        bench();
+    }
+    return check_summary();
+}
@@ -0,0 +1,146 @@
+/* A fake corked session for the tests that stream responses. Its frames are
+ * captured in plaintext, and followed by a guard where the authTag would go, so
+ * that any write past the area that hap_httpd_tx_get_buf() hands out is caught.
+ * Include after check.h.
+ */
+#ifndef _HOST_TEST_TX_CAPTURE_H_
+#define _HOST_TEST_TX_CAPTURE_H_
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_FRAME   HAP_MAX_NW_FRAME_SIZE
+#define MAX_OUT     (1024 * 1024)
+#define GUARD_LEN   AUTH_TAG_LEN
+#define GUARD       0xa5
+#define TEST_FD     5
+
+/* One frame of frame_size plaintext bytes. Sealed frames are appended to out */
+static int frame_size;
+static uint8_t frame[MAX_FRAME + GUARD_LEN];
+static int cur_len;
+static bool corked;
+static char out[MAX_OUT];
+static int out_len;
+static bool guard_hit;
+
+static void frame_reset(void)
+{
+    cur_len = 0;
+    memset(frame, GUARD, sizeof(frame));
+}
+
+static void frame_seal(void)
+{
+    for (int i = frame_size; i < frame_size + GUARD_LEN; i++) {
+        if (frame[i] != GUARD) {
+            guard_hit = true;
+        }
+    }
+    if (out_len + cur_len <= MAX_OUT) {
+        memcpy(out + out_len, frame, cur_len);
+        out_len += cur_len;
+    }
+    frame_reset();
+}
+
+int hap_httpd_tx_get_buf(int sockfd, int min_len, uint8_t **buf)
+{
+    if (!corked || (sockfd != TEST_FD) || (min_len > frame_size)) {
+        return HAP_FAIL;
+    }
+    if ((frame_size - cur_len) < min_len) {
+        frame_seal();
+    }
+    *buf = &frame[cur_len];
+    return frame_size - cur_len;
+}
+
+int hap_httpd_tx_put_buf(int sockfd, int len)
+{
+    if (!corked || (sockfd != TEST_FD) || (len > frame_size - cur_len)) {
+        return HAP_FAIL;
+    }
+    cur_len += len;
+    if (cur_len == frame_size) {
+        frame_seal();
+    }
+    return HAP_SUCCESS;
+}
+
+int hap_httpd_send(httpd_handle_t hd, int sockfd, const char *buf, unsigned buf_len, int flags)
+{
+    if (!corked || (sockfd != TEST_FD)) {
+        return -1;
+    }
+    unsigned sent = 0;
+    while (sent < buf_len) {
+        int len = frame_size - cur_len;
+        if (len > (int)(buf_len - sent)) {
+            len = buf_len - sent;
+        }
+        memcpy(&frame[cur_len], buf + sent, len);
+        cur_len += len;
+        sent += len;
+        if (cur_len == frame_size) {
+            frame_seal();
+        }
+    }
+    return buf_len;
+}
+
+static void session_cork(int size)
+{
+    frame_size = size;
+    frame_reset();
+    out_len = 0;
+    guard_hit = false;
+    corked = true;
+}
+
+static void session_flush(void)
+{
+    if (cur_len) {
+        frame_seal();
+    }
+    corked = false;
+}
+
+/* Checks the response in out and reassembles its chunked body into body */
+static int parse_response(const char *what, const char *status, char *body)
+{
+    char hdr[128];
+    snprintf(hdr, sizeof(hdr), "HTTP/1.1 %s\r\n"
+            "Content-Type: application/hap+json\r\n"
+            "Transfer-Encoding: chunked\r\n\r\n", status);
+    int hdr_len = strlen(hdr);
+    if (out_len < hdr_len || memcmp(out, hdr, hdr_len)) {
+        CHECK(0, "%s: bad header", what);
+        return -1;
+    }
+    int off = hdr_len, body_len = 0;
+    while (1) {
+        char *end;
+        long len = strtol(out + off, &end, 16);
+        if (end == out + off || end + 2 > out + out_len || memcmp(end, "\r\n", 2)) {
+            CHECK(0, "%s: bad chunk header at %d", what, off);
+            return -1;
+        }
+        off = end + 2 - out;
+        if (!len) {
+            break;
+        }
+        CHECK(len + 5 <= frame_size, "%s: chunk of %ld bytes in frames of %d", what,
+                len, frame_size);
+        if (off + len + 2 > out_len || memcmp(out + off + len, "\r\n", 2)) {
+            CHECK(0, "%s: bad chunk end at %d", what, off);
+            return -1;
+        }
+        memcpy(body + body_len, out + off, len);
+        body_len += len;
+        off += len + 2;
+    }
+    CHECK(off + 2 == out_len && !memcmp(out + off, "\r\n", 2), "%s: bad last chunk", what);
+    return body_len;
+}
+
+#endif /* _HOST_TEST_TX_CAPTURE_H_ */
@@ -0,0 +1,9 @@
+/* Host stand-in for the ESP-IDF error codes */
+#ifndef _HOST_TEST_ESP_ERR_H_
+#define _HOST_TEST_ESP_ERR_H_
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+#endif /* _HOST_TEST_ESP_ERR_H_ */
@@ -0,0 +1,10 @@
+/* Host stand-in for the ESP-IDF event loop header, as far as hap.h needs it */
+#ifndef _HOST_TEST_ESP_EVENT_H_
+#define _HOST_TEST_ESP_EVENT_H_
+
+#include <esp_err.h>
+
+typedef const char *esp_event_base_t;
+#define ESP_EVENT_DECLARE_BASE(id) extern esp_event_base_t const id
+
+#endif /* _HOST_TEST_ESP_EVENT_H_ */
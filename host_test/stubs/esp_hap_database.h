@@ -0,0 +1,29 @@
+/* Host stand-in for priv_includes/esp_hap_database.h, which pulls in ESP-IDF.
+ * Only what the core sources built by the host tests use.
+ */
+#ifndef _HAP_DATABASE_H_
+#define _HAP_DATABASE_H_
+
+#include <hap.h>
+#include <esp_hap_pair_common.h>
+#include <esp_http_server.h>
+
+#define HAP_KEYSTORE_NAMESPACE_HAPMAIN  "hap_main"
+#define HAP_MAX_SESSIONS	8
+#define HAP_ACC_ID_LEN		18 /* AA:BB:CC:XX:YY:ZZ\0 */
+
+typedef struct {
+    hap_acc_cfg_t primary_acc;
+	char acc_id[HAP_ACC_ID_LEN];
+    /* ltska followed by ltpka, the secret key form that crypto_sign_ed25519_detached() takes */
+    uint8_t ltska_sk[2 * ED_KEY_LEN];
+	hap_cid_t cid;
+	hap_secure_session_t *sessions[HAP_MAX_SESSIONS];
+    hap_cfg_t cfg;
+    httpd_handle_t server;
+    bool disconnected_event_sent;
+} hap_priv_t;
+
+extern hap_priv_t hap_priv;
+int hap_get_next_aid();
+#endif /* _HAP_DATABASE_H_ */
@@ -0,0 +1,15 @@
+/* Host stand-in for the ESP-IDF HTTP server. The tests provide the functions. */
+#ifndef _HOST_TEST_ESP_HTTP_SERVER_H_
+#define _HOST_TEST_ESP_HTTP_SERVER_H_
+
+/* On the target, errno comes along with the lwIP socket headers */
+#include <errno.h>
+#include <esp_err.h>
+
+typedef void *httpd_handle_t;
+typedef struct httpd_req httpd_req_t;
+
+void *httpd_sess_get_ctx(httpd_handle_t handle, int sockfd);
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd);
+
+#endif /* _HOST_TEST_ESP_HTTP_SERVER_H_ */
@@ -0,0 +1,24 @@
+/* Host stand-in for priv_includes/esp_mfi_debug.h. The core's logging is
+ * compiled out, so that it does not skew the benchmarks.
+ */
+#ifndef _HOST_TEST_ESP_MFI_DEBUG_H_
+#define _HOST_TEST_ESP_MFI_DEBUG_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ESP_MFI_DEBUG_INFO      1
+#define ESP_MFI_DEBUG_WARN      2
+#define ESP_MFI_DEBUG_ERR       3
+
+#define ESP_MFI_DEBUG(l, fmt, ...)
+
+#define ESP_MFI_ASSERT(cond)                                                    \
+{                                                                               \
+    if (!(cond)) {                                                              \
+        printf("ESP_MFI assert file %s line %d\n", __FILE__, __LINE__);         \
+        abort();                                                                \
+    }                                                                           \
+}
+
+#endif /* _HOST_TEST_ESP_MFI_DEBUG_H_ */
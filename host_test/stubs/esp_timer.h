@@ -0,0 +1,11 @@
+/* Host stand-in for the ESP-IDF high resolution timer. The tests provide the
+ * function, usually as a fake clock.
+ */
+#ifndef _HOST_TEST_ESP_TIMER_H_
+#define _HOST_TEST_ESP_TIMER_H_
+
+#include <stdint.h>
+
+int64_t esp_timer_get_time(void);
+
+#endif /* _HOST_TEST_ESP_TIMER_H_ */
@@ -0,0 +1,15 @@
+/* Host stand-in for the ESP-IDF Wi-Fi driver header. The tests provide the functions. */
+#ifndef _HOST_TEST_ESP_WIFI_H_
+#define _HOST_TEST_ESP_WIFI_H_
+
+#include <stdint.h>
+#include <esp_event.h>
+
+typedef enum {
+    WIFI_IF_STA,
+    WIFI_IF_AP,
+} wifi_interface_t;
+
+esp_err_t esp_wifi_get_mac(wifi_interface_t ifx, uint8_t mac[6]);
+
+#endif /* _HOST_TEST_ESP_WIFI_H_ */
@@ -0,0 +1,13 @@
+/* Host stand-in for FreeRTOS, as far as the core sources built by the host tests
+ * use it. The tests are single threaded, so the critical sections are no-ops.
+ */
+#ifndef _HOST_TEST_FREERTOS_H_
+#define _HOST_TEST_FREERTOS_H_
+
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED    0
+
+#define portENTER_CRITICAL_SAFE(mux)    ((void)(mux))
+#define portEXIT_CRITICAL_SAFE(mux)     ((void)(mux))
+
+#endif /* _HOST_TEST_FREERTOS_H_ */
@@ -0,0 +1,7 @@
+/* Host stand-in for esp_hap_platform/include/hap_platform_httpd.h */
+#ifndef _HAP_PLATFORM_HTTPD_H_
+#define _HAP_PLATFORM_HTTPD_H_
+
+#include <esp_http_server.h>
+
+#endif /* _HAP_PLATFORM_HTTPD_H_ */
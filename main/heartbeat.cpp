@@ -0,0 +1,86 @@
+#include "heartbeat.h"
+
+#include <cstring>
+
+#include "targets.h"
+
+// 序号一次跳变超过该值视为电脑重启或换了进程，重新同步而不计丢包
+#define HEARTBEAT_SEQ_RESYNC_GAP 1024
+// 超过该值的往返时间视为无效（时钟异常或 echo 错配）
+#define HEARTBEAT_RTT_MAX_MS 10000
+
+static uint32_t get_le32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+}
+
+bool heartbeat_parse(const uint8_t *buf, size_t len, Heartbeat *out) {
+  if (len == HEARTBEAT_V2_SIZE && get_le32(buf) == HEARTBEAT_V2_MAGIC) {
+    if (buf[4] != HEARTBEAT_V2_VERSION || buf[5] != HEARTBEAT_TYPE_BEAT)
+      return false;
+    memcpy(out->mac, buf + 6, 6);
+    out->version = HEARTBEAT_V2_VERSION;
+    out->seq = get_le32(buf + 12);
+    out->timestamp_ms = get_le32(buf + 16);
+    out->echo_ms = get_le32(buf + 20);
+    out->hold_ms = get_le32(buf + 24);
+    return true;
+  }
+  // v1："HEARTBEAT|" + 12位十六进制，之后允许有其它内容
+  if (len >= 22 && memcmp(buf, "HEARTBEAT|", 10) == 0 &&
+      parse_mac_hex((const char *)buf + 10, out->mac)) {
+    out->version = 1;
+    out->seq = 0;
+    out->timestamp_ms = 0;
+    out->echo_ms = 0;
+    out->hold_ms = 0;
+    return true;
+  }
+  return false;
+}
+
+size_t heartbeat_build_ack(uint8_t *buf, const Heartbeat &beat, uint32_t now_ms) {
+  put_le32(buf, HEARTBEAT_V2_MAGIC);
+  buf[4] = HEARTBEAT_V2_VERSION;
+  buf[5] = HEARTBEAT_TYPE_ACK;
+  memcpy(buf + 6, beat.mac, 6);
+  put_le32(buf + 12, beat.seq);
+  put_le32(buf + 16, now_ms);
+  put_le32(buf + 20, beat.timestamp_ms);
+  put_le32(buf + 24, 0);
+  return HEARTBEAT_V2_SIZE;
+}
+
+void HeartbeatStats::on_heartbeat(const Heartbeat &beat, uint32_t now_ms) {
+  received++;
+  if (beat.version < 2)
+    return;
+
+  // 序号差按有符号处理，兼容回绕
+  int32_t gap = (int32_t)(beat.seq - next_seq_);
+  if (!synced_ || gap >= HEARTBEAT_SEQ_RESYNC_GAP || gap <= -HEARTBEAT_SEQ_RESYNC_GAP) {
+    synced_ = true;
+    next_seq_ = beat.seq + 1;
+  } else if (gap >= 0) {
+    lost += (uint32_t)gap;
+    next_seq_ = beat.seq + 1;
+  } else {
+    late++;
+  }
+
+  if (beat.echo_ms != 0) {
+    uint32_t rtt = now_ms - beat.echo_ms - beat.hold_ms;
+    if (rtt < HEARTBEAT_RTT_MAX_MS) {
+      rtt_last_ms = rtt;
+      if (rtt < rtt_min_ms)
+        rtt_min_ms = rtt;
+      rtt_avg_ms = rtt_avg_ms ? rtt_avg_ms + ((int32_t)(rtt - rtt_avg_ms) >> 3) : rtt;
+    }
+  }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// 心跳协议（UDP 40000 端口）
+//
+// v1 文本：  "HEARTBEAT|<12位十六进制MAC>"
+// v2 二进制：固定 28 字节，多字节字段均为小端
+//
+//   偏移  长度  字段
+//    0     4    magic        "HBT2"
+//    4     1    version      2
+//    5     1    type         1=心跳（电脑->ESP） 2=应答（ESP->电脑）
+//    6     6    mac          电脑 MAC
+//   12     4    seq          电脑每发一个心跳加 1
+//   16     4    timestamp_ms 发送方时钟
+//   20     4    echo_ms      最近收到的对端 timestamp_ms，没有则为 0
+//   24     4    hold_ms      收到该 timestamp_ms 到发出本包经过的时间
+//
+// ESP 收到 v2 心跳后回一个应答，timestamp_ms 为 ESP 时钟、echo_ms 为心跳的 timestamp_ms；
+// 电脑下一个心跳把应答的 timestamp_ms 放回 echo_ms，ESP 由此计算往返时间：
+//   rtt = now - echo_ms - hold_ms
+#define HEARTBEAT_V2_MAGIC 0x32544248u // "HBT2"
+#define HEARTBEAT_V2_VERSION 2
+#define HEARTBEAT_V2_SIZE 28
+
+enum HeartbeatType : uint8_t {
+  HEARTBEAT_TYPE_BEAT = 1,
+  HEARTBEAT_TYPE_ACK = 2,
+};
+
+struct Heartbeat {
+  uint8_t mac[6];
+  uint8_t version; // 1 或 2，v1 只有 mac 有效
+  uint32_t seq;
+  uint32_t timestamp_ms;
+  uint32_t echo_ms;
+  uint32_t hold_ms;
+};
+
+// 原地解析 v1/v2 心跳，不分配内存、不格式化字符串，格式不对返回 false
+bool heartbeat_parse(const uint8_t *buf, size_t len, Heartbeat *out);
+
+// 生成 v2 应答，buf 至少 HEARTBEAT_V2_SIZE 字节，返回写入长度
+size_t heartbeat_build_ack(uint8_t *buf, const Heartbeat &beat, uint32_t now_ms);
+
+// 单台电脑的心跳统计，只由心跳任务更新
+struct HeartbeatStats {
+  uint32_t received = 0;
+  uint32_t lost = 0;        // 序号跳过的心跳数
+  uint32_t late = 0;        // 乱序或重复的心跳数
+  uint32_t rtt_last_ms = 0; // 0 表示还没有测量
+  uint32_t rtt_min_ms = UINT32_MAX;
+  uint32_t rtt_avg_ms = 0; // 指数滑动平均（1/8）
+
+  void on_heartbeat(const Heartbeat &beat, uint32_t now_ms);
+
+private:
+  bool synced_ = false;
+  uint32_t next_seq_ = 0;
+};
@@ -2,10 +2,10 @@
 #include "esp_wifi.h"
 #include "lwip/inet.h"
 #include "lwip/sockets.h"
+#include <algorithm>
 #include <atomic>
 #include <cstring>
 #include <iostream>
-#include <sys/time.h>
 extern "C" {
 #include "app_wifi.h"
 #include "driver/gpio.h"
@@ -13,6 +13,7 @@ extern "C" {
 #include "esp_log.h"
 #include "esp_mac.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "hap.h"
@@ -25,6 +26,9 @@ extern "C" {
 #include "wifi_provisioning/manager.h"
 }
 #include "freertos/timers.h"
+#include "heartbeat.h"
+#include "presence.h"
+#include "targets.h"
 
 #define TAG "computer_hap" // 定义日志TAG
 
@@ -34,14 +38,55 @@ extern "C" {
 #define LAUNCHER_TASK_STACKSIZE 4 * 1024
 #define LAUNCHER_TASK_PRIORITY 1
 
-static std::atomic<uint64_t> last_heartbeat_time_ms{0};
-static std::atomic<bool> pc_online{false};
-
-// 获取当前时间戳（毫秒）
-static uint64_t get_time_ms() {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+// 每台目标电脑的状态
+struct LauncherTarget {
+  PresenceMachine presence;
+  hap_char_t *on_char = NULL;
+  hap_char_t *fault_char = NULL;
+  PresenceState logged_state = PresenceState::Offline;
+  bool reported_on = false;    // 已同步到HomeKit的开关值
+  bool reported_fault = false; // 已同步到HomeKit的故障值
+  WakeHistogram wake_histogram; // 只由状态机任务访问
+  std::atomic<uint64_t> last_heartbeat_ms{0};
+  std::atomic<uint32_t> last_ip{0}; // 最近一次心跳的源地址（网络字节序），0 表示未知
+  HeartbeatStats stats;             // 只由心跳任务访问
+};
+
+// 目标电脑目录（NVS中的targetMACs，旧固件只有targetMAC）
+static TargetDirectory g_targets;
+static LauncherTarget g_target_state[TargetDirectory::kMaxTargets];
+static_assert(TargetDirectory::kMaxTargets == APP_WIFI_MAX_TARGETS, "目标数量上限需与配网端一致");
+
+// 每个目标的待处理事件
+static TargetMask g_pending_heartbeat;
+static TargetMask g_pending_wake;
+static TargetMask g_pending_shutdown;
+
+// 状态机任务的通知位
+#define PRESENCE_EVT_HEARTBEAT (1UL << 0)
+#define PRESENCE_EVT_WAKE (1UL << 1)
+#define PRESENCE_EVT_SHUTDOWN (1UL << 2)
+static TaskHandle_t g_presence_task = NULL;
+
+// 获取当前时间戳（毫秒，单调时钟，不受SNTP校时影响）
+static uint64_t get_time_ms() { return (uint64_t)(esp_timer_get_time() / 1000); }
+
+// 通知状态机任务第index台电脑有事件发生
+static void presence_notify(int index, uint32_t event) {
+  switch (event) {
+  case PRESENCE_EVT_HEARTBEAT:
+    g_pending_heartbeat.set(index);
+    break;
+  case PRESENCE_EVT_WAKE:
+    g_pending_wake.set(index);
+    break;
+  case PRESENCE_EVT_SHUTDOWN:
+    g_pending_shutdown.set(index);
+    break;
+  }
+  if (g_presence_task) {
+    xTaskNotify(g_presence_task, event, eSetBits);
+  }
 }
 
 // LED 闪烁函数
@@ -62,76 +107,112 @@ static int launcher_identify(hap_acc_t *ha) {
   return HAP_SUCCESS;
 }
 
-// Switch状态变量
-static hap_char_t *switch_on_char = NULL;
+#define WOL_PORT 9
+#define WOL_BURST 3 // 用户开机时连续发送的魔术包数量，之后由状态机按退避间隔重发
+#define LAUNCHER_UDP_PORT 40000 // 心跳、关机指令共用端口
+// 超过该时间没有心跳，记录的地址可能已失效（DHCP换了地址），关机指令改用广播
+#define LAST_IP_MAX_AGE_MS 10000
 
-// 全局保存NVS targetMAC
-static uint8_t g_target_mac[6] = {0};
-static bool g_target_mac_valid = false;
-
-// WOL后等待心跳保护期（单位ms）
-#define WOL_WAIT_HEARTBEAT_MS 30000
-static uint64_t wol_sent_time_ms = 0;
+// 发送一个UDP包，ip为网络字节序
+static bool send_udp(const void *data, size_t len, uint32_t ip, uint16_t port) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    return false;
+  }
+  int broadcast = 1;
+  setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(broadcast));
+  struct sockaddr_in addr = {{0}}; // 修正初始化
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = ip;
+  int ret = sendto(sock, data, len, 0, (struct sockaddr *)&addr, sizeof(addr));
+  close(sock);
+  return ret >= 0;
+}
 
-// 发送WOL魔术包
-static void send_wol_from_nvs(void *arg) {
-  uint8_t mac[6];
-  nvs_handle_t nvs_handle;
-  esp_err_t err = nvs_open("prov", NVS_READONLY, &nvs_handle);
-  if (err != ESP_OK) {
-    blink_led(8);
-    return;
+// STA所在子网的定向广播地址（网络字节序），未获取到IP时返回受限广播地址
+static uint32_t subnet_broadcast_addr(void) {
+  esp_netif_ip_info_t ip_info;
+  esp_netif_t *netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+  if (netif && esp_netif_get_ip_info(netif, &ip_info) == ESP_OK && ip_info.ip.addr != 0) {
+    return ip_info.ip.addr | ~ip_info.netmask.addr;
   }
-  size_t len = 6;
-  err = nvs_get_blob(nvs_handle, "targetMAC", mac, &len);
-  nvs_close(nvs_handle);
-  if (err != ESP_OK || len != 6) {
-    blink_led(1);
-    return;
+  return htonl(INADDR_BROADCAST);
+}
+
+// 第index台电脑最近的单播地址，心跳过期或未知时返回0
+static uint32_t target_unicast_addr(int index) {
+  LauncherTarget &target = g_target_state[index];
+  uint64_t last = target.last_heartbeat_ms;
+  if (last == 0 || get_time_ms() - last > LAST_IP_MAX_AGE_MS) {
+    return 0;
   }
+  return target.last_ip;
+}
+
+// 发送copies个WOL魔术包：子网定向广播，另外发给最近已知的单播地址
+static bool send_wol_packets(int index, int copies) {
+  const uint8_t *mac = g_targets.mac(index);
   uint8_t packet[102];
   memset(packet, 0xFF, 6);
   for (int i = 1; i <= 16; ++i) {
     memcpy(&packet[i * 6], mac, 6);
   }
-  struct sockaddr_in addr = {{0}}; // 修正初始化
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(9);
-  addr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
-  int sock = socket(AF_INET, SOCK_DGRAM, 0);
-  if (sock < 0) {
-    blink_led(4);
-    return;
+  uint32_t broadcast_ip = subnet_broadcast_addr();
+  // 电脑休眠后不回应ARP，单播不一定能发出，只作为补充
+  uint32_t ip = g_target_state[index].last_ip;
+  bool sent = false;
+  for (int i = 0; i < copies; i++) {
+    sent |= send_udp(packet, sizeof(packet), broadcast_ip, WOL_PORT);
+    if (ip != 0) {
+      sent |= send_udp(packet, sizeof(packet), ip, WOL_PORT);
+    }
   }
-  int broadcast = 1;
-  setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(broadcast));
-  int ret = sendto(sock, packet, sizeof(packet), 0, (struct sockaddr *)&addr, sizeof(addr));
-  close(sock);
-  if (ret < 0) {
+  return sent;
+}
+
+// 用户开机：连发一组魔术包并闪灯提示
+static void send_wol(int index) {
+  if (!send_wol_packets(index, WOL_BURST)) {
     blink_led(4);
   } else {
     blink_led(2);
   }
 }
 
-// 发送关机指令
-static void send_shutdown_cmd_from_nvs(void) {
-  if (!g_target_mac_valid)
-    return;
+// 发送关机指令：优先单播到电脑最近的地址（广播在繁忙的Wi-Fi上以最低速率发送，容易丢失），
+// 地址未知时退回广播
+static void send_shutdown_cmd(int index) {
+  const uint8_t *mac = g_targets.mac(index);
   char msg[64];
-  snprintf(msg, sizeof(msg), "SHUTDOWN_ESP|%02X%02X%02X%02X%02X%02X", g_target_mac[0],
-           g_target_mac[1], g_target_mac[2], g_target_mac[3], g_target_mac[4], g_target_mac[5]);
-  int sock = socket(AF_INET, SOCK_DGRAM, 0);
-  if (sock < 0)
-    return;
-  int broadcast = 1;
-  setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(broadcast));
-  struct sockaddr_in addr = {{0}}; // 修正初始化
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(40000);
-  addr.sin_addr.s_addr = inet_addr("255.255.255.255");
-  sendto(sock, msg, strlen(msg), 0, (struct sockaddr *)&addr, sizeof(addr));
-  close(sock);
+  snprintf(msg, sizeof(msg), "SHUTDOWN_ESP|%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2],
+           mac[3], mac[4], mac[5]);
+  uint32_t ip = target_unicast_addr(index);
+  if (ip == 0) {
+    ip = htonl(INADDR_BROADCAST);
+  }
+  send_udp(msg, strlen(msg), ip, LAUNCHER_UDP_PORT);
+}
+
+// Switch写操作，在HAP写执行任务中运行（发UDP、闪LED都会阻塞，不能占用HomeKit服务任务）
+// priv 为目标序号
+static hap_status_t launcher_switch_work(hap_write_data_t *write, void *priv) {
+  int index = (int)(intptr_t)priv;
+  if (index >= g_targets.size()) {
+    blink_led(1); // 未配置目标MAC
+    return HAP_STATUS_SUCCESS;
+  }
+  bool new_state = write->val.b;
+  if (new_state) {
+    send_wol(index);
+    ESP_LOGI(TAG, "Switch ON: trigger action (WOL), target %d", index);
+    presence_notify(index, PRESENCE_EVT_WAKE);
+  } else {
+    send_shutdown_cmd(index);
+    ESP_LOGI(TAG, "Switch OFF: trigger shutdown command, target %d", index);
+    presence_notify(index, PRESENCE_EVT_SHUTDOWN);
+  }
+  return HAP_STATUS_SUCCESS;
 }
 
 // Switch写回调
@@ -141,16 +222,10 @@ static int launcher_switch_write(hap_write_data_t write_data[], int count, void
     hap_write_data_t *write = &write_data[i];
     const char *uuid = hap_char_get_type_uuid(write->hc);
     if (!strcmp(uuid, HAP_CHAR_UUID_ON)) {
-      bool new_state = write->val.b;
-      if (new_state) {
-        send_wol_from_nvs(NULL);
-        ESP_LOGI(TAG, "Switch ON: trigger action (WOL)");
-        wol_sent_time_ms = get_time_ms(); // 记录WOL发送时间
-      } else {
-        send_shutdown_cmd_from_nvs();
-        ESP_LOGI(TAG, "Switch OFF: trigger shutdown command");
+      // 交给写执行任务完成，完成后再回复控制器；失败时直接在当前任务执行
+      if (hap_write_defer(write, launcher_switch_work, serv_priv) != HAP_SUCCESS) {
+        *(write->status) = launcher_switch_work(write, serv_priv);
       }
-      *(write->status) = HAP_STATUS_SUCCESS;
     } else {
       *(write->status) = HAP_STATUS_RES_ABSENT;
     }
@@ -158,6 +233,18 @@ static int launcher_switch_write(hap_write_data_t write_data[], int count, void
   return HAP_SUCCESS;
 }
 
+// 为第index台电脑创建 Switch 服务（用 Switch 服务模拟按钮）
+static hap_serv_t *launcher_switch_create(int index) {
+  hap_serv_t *service = hap_serv_switch_create(false);
+  g_target_state[index].on_char = hap_serv_get_char_by_uuid(service, HAP_CHAR_UUID_ON);
+  // 开机/关机失败时置1，下一次操作或电脑自行上线/离线时清除
+  g_target_state[index].fault_char = hap_char_status_fault_create(0);
+  hap_serv_add_char(service, g_target_state[index].fault_char);
+  hap_serv_set_priv(service, (void *)(intptr_t)index);
+  hap_serv_set_write_cb(service, launcher_switch_write);
+  return service;
+}
+
 // HomeKit事件回调（可选，调试用）
 static void launcher_hap_event_handler(void *arg, esp_event_base_t event_base, int32_t event,
                                        void *data) {
@@ -201,7 +288,12 @@ static void button_short_press_cb(void *arg) {
     tap_timer = xTimerCreate("tap_timer", pdMS_TO_TICKS(DOUBLE_TAP_INTERVAL), pdFALSE, &tap_count,
                              [](TimerHandle_t xTimer) {
                                ESP_LOGI(TAG, "Single tap detected, sending WOL");
-                               send_wol_from_nvs(NULL);
+                               if (g_targets.size() > 0) {
+                                 send_wol(0);
+                                 presence_notify(0, PRESENCE_EVT_WAKE);
+                               } else {
+                                 blink_led(1);
+                               }
                                int *tap_count_ptr = (int *)pvTimerGetTimerID(xTimer);
                                if (tap_count_ptr)
                                  *tap_count_ptr = 0;
@@ -215,7 +307,10 @@ static void button_short_press_cb(void *arg) {
     xTimerStart(tap_timer, 0);
   } else if (tap_count == 2) {
     ESP_LOGI(TAG, "Double tap detected, sending shutdown command");
-    send_shutdown_cmd_from_nvs();
+    if (g_targets.size() > 0) {
+      send_shutdown_cmd(0);
+      presence_notify(0, PRESENCE_EVT_SHUTDOWN);
+    }
     tap_count = 0;
   }
 }
@@ -226,33 +321,91 @@ static void button_long_press_cb(void *arg) {
   esp_restart();
 }
 
-void loop() {
-  static bool last_pc_online = false;
-  uint64_t now = get_time_ms();
-  bool online = false;
-  // 判断是否处于WOL保护期
-  bool in_wol_wait = (wol_sent_time_ms > 0) && (now - wol_sent_time_ms < WOL_WAIT_HEARTBEAT_MS);
-  if (last_heartbeat_time_ms > 0 && now - last_heartbeat_time_ms < 2000) {
-    online = true;
-  } else if (in_wol_wait) {
-    online = true; // 保护期内强制保持开
-  }
-  // 如果收到心跳，退出保护期
-  if (last_heartbeat_time_ms > 0 && now - last_heartbeat_time_ms < 2000 && in_wol_wait) {
-    wol_sent_time_ms = 0;
+// 取走待处理事件位图，对置位的每个目标调用 handler
+template <typename Handler> static void presence_take(TargetMask &mask, Handler handler) {
+  for (int w = 0; w < TargetMask::kWords; w++) {
+    uint32_t bits = mask.take(w);
+    while (bits) {
+      int index = w * 32 + __builtin_ctz(bits);
+      bits &= bits - 1;
+      handler(g_target_state[index]);
+    }
   }
-  // 状态变化时同步HomeKit开关
-  if (online != last_pc_online) {
-    last_pc_online = online;
-    if (switch_on_char) {
-      hap_val_t val = {.b = online};
-      hap_char_update_val(switch_on_char, &val);
+}
+
+static_assert(WakeHistogram::kBuckets == 8, "开机耗时日志按8个桶输出");
+
+// 电脑在线状态机任务：只在收到心跳/开关机事件或到达截止时间时唤醒，状态变化立即同步HomeKit开关
+static void presence_run(void) {
+  int count = g_targets.size();
+  while (1) {
+    TickType_t wait = portMAX_DELAY;
+    uint64_t deadline = PresenceMachine::kNoDeadline;
+    for (int i = 0; i < count; i++) {
+      deadline = std::min(deadline, g_target_state[i].presence.next_deadline());
+    }
+    if (deadline != PresenceMachine::kNoDeadline) {
+      uint64_t now = get_time_ms();
+      // 多等一个tick，避免因取整提前醒来
+      wait = deadline > now ? pdMS_TO_TICKS(deadline - now) + 1 : 0;
+    }
+    uint32_t events = 0;
+    xTaskNotifyWait(0, UINT32_MAX, &events, wait);
+
+    // 先取心跳时间再取当前时间，保证心跳时间不晚于now
+    presence_take(g_pending_heartbeat,
+                  [](LauncherTarget &t) { t.presence.on_heartbeat(t.last_heartbeat_ms); });
+    uint64_t now = get_time_ms();
+    presence_take(g_pending_wake, [now](LauncherTarget &t) { t.presence.on_wake_requested(now); });
+    presence_take(g_pending_shutdown,
+                  [now](LauncherTarget &t) { t.presence.on_shutdown_requested(now); });
+    for (int i = 0; i < count; i++) {
+      LauncherTarget &t = g_target_state[i];
+      t.presence.on_tick(now);
+      // 按状态机要求重发（不闪灯，避免阻塞本任务）
+      uint8_t actions = t.presence.take_actions();
+      if (actions & PRESENCE_ACTION_SEND_WOL) {
+        ESP_LOGI(TAG, "PC %d no heartbeat yet, resending WOL", i);
+        send_wol_packets(i, 1);
+      }
+      if (actions & PRESENCE_ACTION_SEND_SHUTDOWN) {
+        ESP_LOGI(TAG, "PC %d still alive, resending shutdown command", i);
+        send_shutdown_cmd(i);
+      }
+      if (t.presence.state() != t.logged_state) {
+        t.logged_state = t.presence.state();
+        ESP_LOGI(TAG, "PC %d state: %s%s", i, presence_state_name(t.logged_state),
+                 t.presence.fault() ? " (fault)" : "");
+      }
+      uint32_t latency_ms;
+      if (t.presence.take_wake_latency(&latency_ms)) {
+        t.wake_histogram.add(latency_ms);
+        const uint32_t *c = t.wake_histogram.counts;
+        ESP_LOGI(TAG, "PC %d first heartbeat %u ms after WOL, histogram <1s:%u <2s:%u <4s:%u "
+                      "<8s:%u <16s:%u <32s:%u <64s:%u more:%u",
+                 i, (unsigned)latency_ms, (unsigned)c[0], (unsigned)c[1], (unsigned)c[2],
+                 (unsigned)c[3], (unsigned)c[4], (unsigned)c[5], (unsigned)c[6], (unsigned)c[7]);
+      }
+      // 状态变化时同步HomeKit开关
+      if (t.presence.switch_on() != t.reported_on) {
+        t.reported_on = t.presence.switch_on();
+        if (t.on_char) {
+          hap_val_t val = {.b = t.reported_on};
+          hap_char_update_val(t.on_char, &val);
+        }
+      }
+      if (t.presence.fault() != t.reported_fault) {
+        t.reported_fault = t.presence.fault();
+        if (t.fault_char) {
+          hap_val_t val = {.u = t.reported_fault ? 1u : 0u};
+          hap_char_update_val(t.fault_char, &val);
+        }
+      }
     }
   }
-  vTaskDelay(100 / portTICK_PERIOD_MS);
 }
 
-// UDP 监听任务，监听40000端口，收到HEARTBEAT|MAC包时刷新心跳
+// UDP 监听任务，监听40000端口，收到v1文本或v2二进制心跳时刷新心跳，v2心跳回复应答用于测量往返时间
 static void udp_heartbeat_task(void *arg) {
   int sock = socket(AF_INET, SOCK_DGRAM, 0);
   if (sock < 0) {
@@ -261,35 +414,45 @@ static void udp_heartbeat_task(void *arg) {
   }
   struct sockaddr_in addr = {{0}}; // 修正初始化
   addr.sin_family = AF_INET;
-  addr.sin_port = htons(40000);
+  addr.sin_port = htons(LAUNCHER_UDP_PORT);
   addr.sin_addr.s_addr = htonl(INADDR_ANY);
   if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
     close(sock);
     vTaskDelete(NULL);
     return;
   }
-  char buf[128];
+  uint8_t buf[128];
   while (1) {
     struct sockaddr_in src_addr;
     socklen_t addrlen = sizeof(src_addr);
-    int len = recvfrom(sock, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&src_addr, &addrlen);
-    if (len > 0) {
-      buf[len] = '\0';
-      // 查找HEARTBEAT|前缀
-      if (strncmp(buf, "HEARTBEAT|", 10) == 0 && g_target_mac_valid) {
-        // 取出心跳包中的MAC字符串
-        const char *mac_str = buf + 10;
-        // 格式化NVS MAC为大写无冒号字符串
-        char nvs_mac_str[13];
-        snprintf(nvs_mac_str, sizeof(nvs_mac_str), "%02X%02X%02X%02X%02X%02X", g_target_mac[0],
-                 g_target_mac[1], g_target_mac[2], g_target_mac[3], g_target_mac[4],
-                 g_target_mac[5]);
-        // 比较
-        if (strncasecmp(mac_str, nvs_mac_str, 12) == 0) {
-          last_heartbeat_time_ms = get_time_ms();
-          pc_online = true;
-        }
-      }
+    int len = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&src_addr, &addrlen);
+    Heartbeat beat;
+    if (len <= 0 || !heartbeat_parse(buf, len, &beat)) {
+      continue;
+    }
+    // 按二进制MAC查目标
+    int index = g_targets.find(beat.mac);
+    if (index == TargetDirectory::kNotFound) {
+      continue;
+    }
+    LauncherTarget &target = g_target_state[index];
+    uint64_t now = get_time_ms();
+    target.last_ip = src_addr.sin_addr.s_addr;
+    target.last_heartbeat_ms = now;
+    presence_notify(index, PRESENCE_EVT_HEARTBEAT);
+
+    if (beat.version >= HEARTBEAT_V2_VERSION) {
+      size_t ack_len = heartbeat_build_ack(buf, beat, (uint32_t)now);
+      sendto(sock, buf, ack_len, 0, (struct sockaddr *)&src_addr, addrlen);
+    }
+    HeartbeatStats &stats = target.stats;
+    uint32_t lost = stats.lost;
+    stats.on_heartbeat(beat, (uint32_t)now);
+    if (stats.lost != lost || stats.received % 60 == 0) {
+      ESP_LOGD(TAG, "PC %d heartbeat: received %u lost %u late %u rtt %u/%u/%u ms", index,
+               (unsigned)stats.received, (unsigned)stats.lost, (unsigned)stats.late,
+               (unsigned)stats.rtt_last_ms, (unsigned)stats.rtt_avg_ms,
+               (unsigned)(stats.rtt_min_ms == UINT32_MAX ? 0 : stats.rtt_min_ms));
     }
   }
   // never reached
@@ -297,6 +460,31 @@ static void udp_heartbeat_task(void *arg) {
   vTaskDelete(NULL);
 }
 
+// 从NVS加载目标电脑MAC：targetMACs保存多台（网桥模式），兼容旧固件的单个targetMAC
+static void load_targets_from_nvs(void) {
+  nvs_handle_t nvs_handle;
+  if (nvs_open("prov", NVS_READONLY, &nvs_handle) != ESP_OK) {
+    return;
+  }
+  static uint8_t macs[TargetDirectory::kMaxTargets][6];
+  size_t len = sizeof(macs);
+  esp_err_t err = nvs_get_blob(nvs_handle, "targetMACs", macs, &len);
+  if (err != ESP_OK || len == 0 || len % 6 != 0) {
+    len = 6;
+    err = nvs_get_blob(nvs_handle, "targetMAC", macs[0], &len);
+    if (err != ESP_OK || len != 6) {
+      len = 0;
+    }
+  }
+  nvs_close(nvs_handle);
+  for (size_t i = 0; i < len / 6; i++) {
+    if (g_targets.add(macs[i]) == TargetDirectory::kNotFound) {
+      ESP_LOGW(TAG, "Duplicate target MAC ignored: %d", (int)i);
+    }
+  }
+  ESP_LOGI(TAG, "Loaded %d target PC(s)", g_targets.size());
+}
+
 static void setup(void *p) {
   uint8_t mac[6];
   esp_read_mac(mac, ESP_MAC_WIFI_STA);
@@ -308,17 +496,12 @@ static void setup(void *p) {
   }
   ESP_ERROR_CHECK(ret);
 
-  // 读取NVS targetMAC到全局变量
-  nvs_handle_t nvs_handle;
-  size_t mac_len = 6;
-  esp_err_t err = nvs_open("prov", NVS_READONLY, &nvs_handle);
-  if (err == ESP_OK) {
-    err = nvs_get_blob(nvs_handle, "targetMAC", g_target_mac, &mac_len);
-    nvs_close(nvs_handle);
-    if (err == ESP_OK && mac_len == 6) {
-      g_target_mac_valid = true;
-    }
-  }
+  // 本任务在初始化完成后运行状态机，需在注册回调、启动心跳任务前记录句柄
+  g_presence_task = xTaskGetCurrentTaskHandle();
+
+  // 读取NVS中的目标电脑MAC
+  load_targets_from_nvs();
+  bool bridge = g_targets.size() > 1;
 
   // 初始化 LED GPIO
   gpio_reset_pin((gpio_num_t)LED_GPIO);
@@ -369,18 +552,34 @@ static void setup(void *p) {
   cfg.hw_rev = NULL;
   cfg.pv = (char *)acc_pv;
   cfg.identify_routine = launcher_identify;
-  cfg.cid = HAP_CID_SWITCH;
+  cfg.cid = bridge ? HAP_CID_BRIDGE : HAP_CID_SWITCH;
   hap_acc_t *accessory = hap_acc_create(&cfg);
 
   hap_acc_add_product_data(accessory, (uint8_t *)"ESP32HAP", 8);
 
-  // 用 Switch 服务模拟按钮
-  hap_serv_t *switch_service = hap_serv_switch_create(false);
-  switch_on_char = hap_serv_get_char_by_uuid(switch_service, HAP_CHAR_UUID_ON);
-  hap_serv_set_write_cb(switch_service, launcher_switch_write);
-  hap_acc_add_serv(accessory, switch_service);
+  // 单台电脑时 Switch 直接挂在主配件上（与旧固件一致，已有配对不受影响）
+  if (!bridge) {
+    hap_acc_add_serv(accessory, launcher_switch_create(0));
+  }
   hap_acc_add_wifi_transport_service(accessory, 0);
   hap_add_accessory(accessory);
+
+  // 网桥模式：每台电脑一个桥接配件，AID由MAC固定，重启后不变
+  for (int i = 0; bridge && i < g_targets.size(); i++) {
+    const uint8_t *target_mac = g_targets.mac(i);
+    char target_serial[13];
+    snprintf(target_serial, sizeof(target_serial), "%02X%02X%02X%02X%02X%02X", target_mac[0],
+             target_mac[1], target_mac[2], target_mac[3], target_mac[4], target_mac[5]);
+    char target_name[32];
+    snprintf(target_name, sizeof(target_name), "电脑 %s", target_serial + 6);
+    hap_acc_cfg_t bridged_cfg = cfg;
+    bridged_cfg.name = target_name;
+    bridged_cfg.serial_num = target_serial;
+    bridged_cfg.cid = HAP_CID_SWITCH;
+    hap_acc_t *bridged = hap_acc_create(&bridged_cfg);
+    hap_acc_add_serv(bridged, launcher_switch_create(i));
+    hap_add_bridged_accessory(bridged, hap_get_unique_aid(target_serial));
+  }
   char setup_code[9];
   get_setup_code(setup_code);
   char formatted_code[12];
@@ -404,10 +603,8 @@ static void setup(void *p) {
   app_wifi_start(portMAX_DELAY);
   gpio_set_level((gpio_num_t)LED_GPIO, 1); // 关闭LED
 
-  // 主循环，处理长按事件
-  while (1) {
-    loop();
-  }
+  // 主循环，运行电脑在线状态机
+  presence_run();
 }
 
 extern "C" void app_main() {
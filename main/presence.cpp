@@ -0,0 +1,146 @@
+#include "presence.h"
+
+#include <algorithm>
+
+const char *presence_state_name(PresenceState state) {
+  switch (state) {
+  case PresenceState::Offline:
+    return "Offline";
+  case PresenceState::Waking:
+    return "Waking";
+  case PresenceState::Online:
+    return "Online";
+  case PresenceState::ShuttingDown:
+    return "ShuttingDown";
+  }
+  return "?";
+}
+
+bool PresenceMachine::enter(PresenceState state, uint64_t now_ms) {
+  // 故障由失败路径在 enter() 之后重新设置
+  fault_ = false;
+  switch (state) {
+  case PresenceState::Waking:
+    state_deadline_ms_ = now_ms + config_.wake_timeout_ms;
+    retry_interval_ms_ = config_.wake_retry_ms;
+    retry_at_ms_ = now_ms + retry_interval_ms_;
+    wake_started_ms_ = now_ms;
+    break;
+  case PresenceState::ShuttingDown:
+    state_deadline_ms_ = now_ms + config_.shutdown_timeout_ms;
+    retry_interval_ms_ = config_.shutdown_retry_ms;
+    retry_at_ms_ = now_ms + retry_interval_ms_;
+    break;
+  default:
+    state_deadline_ms_ = kNoDeadline;
+    retry_at_ms_ = kNoDeadline;
+    break;
+  }
+  if (state == state_)
+    return false;
+  state_ = state;
+  return true;
+}
+
+bool PresenceMachine::retry_due(uint64_t now_ms) {
+  if (now_ms < retry_at_ms_)
+    return false;
+  retry_interval_ms_ = std::min(retry_interval_ms_ * 2, config_.retry_max_ms);
+  retry_at_ms_ = now_ms + retry_interval_ms_;
+  return true;
+}
+
+bool PresenceMachine::on_heartbeat(uint64_t now_ms) {
+  has_heartbeat_ = true;
+  last_heartbeat_ms_ = now_ms;
+  switch (state_) {
+  case PresenceState::Waking:
+    wake_latency_ms_ = (uint32_t)(now_ms - wake_started_ms_);
+    has_wake_latency_ = true;
+    return enter(PresenceState::Online, now_ms);
+  case PresenceState::Offline:
+    return enter(PresenceState::Online, now_ms);
+  default:
+    // Online 只需刷新心跳时间；ShuttingDown 期间的心跳说明电脑还没关
+    return false;
+  }
+}
+
+bool PresenceMachine::on_wake_requested(uint64_t now_ms) {
+  switch (state_) {
+  case PresenceState::Offline:
+  case PresenceState::ShuttingDown:
+    return enter(PresenceState::Waking, now_ms);
+  case PresenceState::Waking:
+    // 再次开机，重新计时
+    enter(PresenceState::Waking, now_ms);
+    return false;
+  default:
+    return false;
+  }
+}
+
+bool PresenceMachine::on_shutdown_requested(uint64_t now_ms) {
+  switch (state_) {
+  case PresenceState::Online:
+    return enter(PresenceState::ShuttingDown, now_ms);
+  case PresenceState::Waking:
+    // 还没收到过心跳，直接视为离线；若电脑仍然开机，下一个心跳会把状态拉回 Online
+    return enter(PresenceState::Offline, now_ms);
+  default:
+    return false;
+  }
+}
+
+bool PresenceMachine::on_tick(uint64_t now_ms) {
+  switch (state_) {
+  case PresenceState::Online:
+    if (!heartbeat_fresh(now_ms))
+      return enter(PresenceState::Offline, now_ms);
+    return false;
+  case PresenceState::Waking:
+    if (now_ms >= state_deadline_ms_) {
+      enter(PresenceState::Offline, now_ms);
+      fault_ = true; // 开机失败
+      return true;
+    }
+    if (retry_due(now_ms))
+      actions_ |= PRESENCE_ACTION_SEND_WOL;
+    return false;
+  case PresenceState::ShuttingDown:
+    if (!heartbeat_fresh(now_ms))
+      return enter(PresenceState::Offline, now_ms);
+    if (now_ms >= state_deadline_ms_) {
+      enter(PresenceState::Online, now_ms);
+      fault_ = true; // 关机失败
+      return true;
+    }
+    if (retry_due(now_ms))
+      actions_ |= PRESENCE_ACTION_SEND_SHUTDOWN;
+    return false;
+  default:
+    return false;
+  }
+}
+
+uint64_t PresenceMachine::next_deadline() const {
+  uint64_t heartbeat_deadline =
+      has_heartbeat_ ? last_heartbeat_ms_ + config_.heartbeat_timeout_ms : kNoDeadline;
+  switch (state_) {
+  case PresenceState::Online:
+    return heartbeat_deadline;
+  case PresenceState::Waking:
+    return std::min(state_deadline_ms_, retry_at_ms_);
+  case PresenceState::ShuttingDown:
+    return std::min({heartbeat_deadline, state_deadline_ms_, retry_at_ms_});
+  default:
+    return kNoDeadline;
+  }
+}
+
+void WakeHistogram::add(uint32_t latency_ms) {
+  int bucket = 0;
+  while (bucket < kBuckets - 1 && latency_ms >= bucket_limit_ms(bucket))
+    bucket++;
+  counts[bucket]++;
+}
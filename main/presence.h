@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+
+// 电脑在线状态机（不依赖 FreeRTOS/ESP-IDF，时间由调用者传入，便于在主机上用假时钟测试）
+//
+//   Offline --开机(WOL)--> Waking --心跳--> Online --关机--> ShuttingDown --心跳超时--> Offline
+//
+// Waking 期间按退避间隔重发 WOL，超时未收到心跳回到 Offline 并置故障；
+// ShuttingDown 期间心跳仍在则按退避间隔重发关机指令，超时仍有心跳说明关机失败，回到 Online 并置故障。
+enum class PresenceState : uint8_t { Offline, Waking, Online, ShuttingDown };
+
+const char *presence_state_name(PresenceState state);
+
+// 状态机要求调用者执行的动作，由 take_actions() 取走
+enum PresenceAction : uint8_t {
+  PRESENCE_ACTION_NONE = 0,
+  PRESENCE_ACTION_SEND_WOL = 1 << 0,
+  PRESENCE_ACTION_SEND_SHUTDOWN = 1 << 1,
+};
+
+class PresenceMachine {
+public:
+  static constexpr uint64_t kNoDeadline = UINT64_MAX;
+
+  struct Config {
+    uint32_t heartbeat_timeout_ms = 2000; // 超过该时间无心跳视为离线
+    uint32_t wake_timeout_ms = 30000;     // WOL 后等待第一个心跳的时间
+    uint32_t shutdown_timeout_ms = 60000; // 关机指令后等待心跳消失的时间
+    uint32_t wake_retry_ms = 1000;        // 第一次重发 WOL 的间隔，之后每次翻倍
+    uint32_t shutdown_retry_ms = 3000;    // 第一次重发关机指令的间隔，之后每次翻倍
+    uint32_t retry_max_ms = 8000;         // 重发间隔上限
+  };
+
+  PresenceMachine() = default;
+  explicit PresenceMachine(const Config &config) : config_(config) {}
+
+  // 以下事件函数返回 true 表示状态发生了变化
+  // 调用者在请求开机/关机时已发出第一个包，状态机只负责之后的重发
+  bool on_heartbeat(uint64_t now_ms);
+  bool on_wake_requested(uint64_t now_ms);
+  bool on_shutdown_requested(uint64_t now_ms);
+  // 到达（或越过）截止时间时调用
+  bool on_tick(uint64_t now_ms);
+
+  // 下一个需要调用 on_tick() 的时间，kNoDeadline 表示只需等待事件
+  uint64_t next_deadline() const;
+  PresenceState state() const { return state_; }
+  // HomeKit 开关应显示的值
+  bool switch_on() const {
+    return state_ == PresenceState::Online || state_ == PresenceState::Waking;
+  }
+  // 最近一次开机或关机失败，直到下一次请求或电脑自行上线/离线
+  bool fault() const { return fault_; }
+  // 取走待执行的动作（PresenceAction 位组合）
+  uint8_t take_actions() {
+    uint8_t actions = actions_;
+    actions_ = PRESENCE_ACTION_NONE;
+    return actions;
+  }
+  // 取走最近一次开机到第一个心跳的耗时，没有新样本时返回 false
+  bool take_wake_latency(uint32_t *latency_ms) {
+    if (!has_wake_latency_)
+      return false;
+    has_wake_latency_ = false;
+    *latency_ms = wake_latency_ms_;
+    return true;
+  }
+
+private:
+  bool heartbeat_fresh(uint64_t now_ms) const {
+    return has_heartbeat_ && now_ms < last_heartbeat_ms_ + config_.heartbeat_timeout_ms;
+  }
+  bool enter(PresenceState state, uint64_t now_ms);
+  bool retry_due(uint64_t now_ms);
+
+  Config config_;
+  PresenceState state_ = PresenceState::Offline;
+  bool has_heartbeat_ = false;
+  bool fault_ = false;
+  bool has_wake_latency_ = false;
+  uint8_t actions_ = PRESENCE_ACTION_NONE;
+  uint64_t last_heartbeat_ms_ = 0;
+  uint64_t state_deadline_ms_ = kNoDeadline; // Waking/ShuttingDown 的超时
+  uint64_t retry_at_ms_ = kNoDeadline;       // 下一次重发时间
+  uint32_t retry_interval_ms_ = 0;
+  uint64_t wake_started_ms_ = 0;
+  uint32_t wake_latency_ms_ = 0;
+};
+
+// 开机耗时直方图（开机指令到第一个心跳），桶上限依次为 1,2,4,...,64 秒，最后一个桶为更长
+struct WakeHistogram {
+  static constexpr int kBuckets = 8;
+  uint32_t counts[kBuckets] = {};
+
+  void add(uint32_t latency_ms);
+  // 第 bucket 个桶的上限（毫秒），最后一个桶返回 UINT32_MAX
+  static uint32_t bucket_limit_ms(int bucket) {
+    return bucket < kBuckets - 1 ? 1000u << bucket : UINT32_MAX;
+  }
+};
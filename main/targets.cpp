@@ -0,0 +1,61 @@
+#include "targets.h"
+
+#include <cstring>
+
+uint32_t TargetDirectory::hash(const uint8_t mac[6]) {
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < 6; i++) {
+    h ^= mac[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+int TargetDirectory::add(const uint8_t mac[6]) {
+  if (count_ >= kMaxTargets || find(mac) != kNotFound)
+    return kNotFound;
+  uint32_t slot = hash(mac) & (kBuckets - 1);
+  while (buckets_[slot])
+    slot = (slot + 1) & (kBuckets - 1);
+  memcpy(macs_[count_], mac, 6);
+  buckets_[slot] = (int8_t)(count_ + 1);
+  return count_++;
+}
+
+int TargetDirectory::find(const uint8_t mac[6]) const {
+  // 装载率不超过1/2，必然存在空槽，探测一定会终止
+  uint32_t slot = hash(mac) & (kBuckets - 1);
+  while (buckets_[slot]) {
+    int index = buckets_[slot] - 1;
+    if (memcmp(macs_[index], mac, 6) == 0)
+      return index;
+    slot = (slot + 1) & (kBuckets - 1);
+  }
+  return kNotFound;
+}
+
+void TargetDirectory::clear() {
+  memset(buckets_, 0, sizeof(buckets_));
+  count_ = 0;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c |= 0x20; // 转小写
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+bool parse_mac_hex(const char *str, uint8_t mac[6]) {
+  for (int i = 0; i < 6; i++) {
+    int hi = hex_value(str[2 * i]);
+    int lo = hi < 0 ? -1 : hex_value(str[2 * i + 1]);
+    if (lo < 0)
+      return false;
+    mac[i] = (uint8_t)(hi << 4 | lo);
+  }
+  return true;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// 目标电脑目录：按二进制 MAC 做开放寻址哈希，O(1) 查找目标序号。
+// 启动时从 NVS 建表，之后只读，心跳任务可以无锁查询。
+class TargetDirectory {
+public:
+  static constexpr int kMaxTargets = 64;
+  static constexpr int kNotFound = -1;
+
+  // 添加目标，返回序号；目录已满或 MAC 重复时返回 kNotFound
+  int add(const uint8_t mac[6]);
+  int find(const uint8_t mac[6]) const;
+  void clear();
+
+  int size() const { return count_; }
+  const uint8_t *mac(int index) const { return macs_[index]; }
+
+private:
+  static constexpr int kBuckets = 2 * kMaxTargets; // 必须是2的幂
+  static uint32_t hash(const uint8_t mac[6]);
+
+  uint8_t macs_[kMaxTargets][6] = {};
+  int8_t buckets_[kBuckets] = {}; // 目标序号 + 1，0 表示空槽
+  int count_ = 0;
+};
+
+// 每个目标一位的待处理事件位图，多个任务可同时置位，状态机任务一次取走
+class TargetMask {
+public:
+  void set(int index) {
+    words_[index / 32].fetch_or(1UL << (index % 32), std::memory_order_release);
+  }
+  // 取走第 word 个32位字并清零
+  uint32_t take(int word) { return words_[word].exchange(0, std::memory_order_acquire); }
+
+  static constexpr int kWords = (TargetDirectory::kMaxTargets + 31) / 32;
+
+private:
+  std::atomic<uint32_t> words_[kWords] = {};
+};
+
+// 解析12位十六进制 MAC（不区分大小写、无分隔符），成功返回 true
+bool parse_mac_hex(const char *str, uint8_t mac[6]);